@@ -31,6 +31,11 @@ private:
 	mutable Mutex queue_mutex;
 	Condition queue_sync;
 	std::list<T> frame_queue;	// FIFOにしないといけないのでstd::listを使う, std::queueでもいいかも
+	/**
+	 * キューが一杯で破棄したフレーム数
+	 * queue_mutexで保護する
+	 */
+	uint64_t dropped_frames = 0;
 	/**
 	 * コピーコンストラクタ
 	 * (コピー禁止)
@@ -116,6 +121,7 @@ public:
 					FramePool<T>::recycle_frame(*iter);
 					iter = frame_queue.erase(iter);
 				}
+				dropped_frames += cnt;
 				LOGW("dropped frame data(%d)", cnt);
 			}
 		}
@@ -146,11 +152,14 @@ public:
 					FramePool<T>::recycle_frame(*iter);
 					iter = frame_queue.erase(iter);
 				}
+				dropped_frames += cnt;
 				LOGW("%d frame(s) dropped", cnt);
 			}
 			if ((frame_queue.size() < FramePool<T>::get_max_frame_num())) {
 				frame_queue.push_back(frame);
 				frame = nullptr;	// 正常にキューに追加できた
+			} else {
+				dropped_frames++;
 			}
 			queue_sync.signal();
 		}
@@ -235,6 +244,16 @@ public:
 		RETURN(result, size_t);
 	}
 
+	/**
+	 * キューが一杯で破棄したフレーム数を取得する
+	 * v4l2機器側(ドライバー)で破棄されたフレームは含まない
+	 * @return
+	 */
+	uint64_t get_dropped_frames() const {
+		AutoMutex lock(queue_mutex);
+		return dropped_frames;
+	}
+
 	/**
 	 * フレームキューの待機(wait_frame)を解除する
 	 */
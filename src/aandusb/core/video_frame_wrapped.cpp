@@ -21,6 +21,7 @@
 #endif
 
 #include <cstring>
+#include <utility>
 
 #include "utilbase.h"
 // core
@@ -30,6 +31,66 @@
 
 namespace serenegiant::core {
 
+/**
+ * 映像データを隙間なく詰めたときの各プレーンの1行分のバイト数と行数を取得する
+ * プラナー/セミプラナー形式以外は1プレーンとして扱う
+ * @param frame_type
+ * @param width
+ * @param height
+ * @param row_bytes 各プレーンの1行分のバイト数
+ * @param rows 各プレーンの行数
+ * @return プレーン数
+ */
+static int get_plane_layout(
+	const raw_frame_t &frame_type,
+	const uint32_t &width, const uint32_t &height,
+	uint32_t row_bytes[MAX_WRAPPED_PLANES], uint32_t rows[MAX_WRAPPED_PLANES]) {
+
+	int result = 1;
+	row_bytes[0] = width;
+	rows[0] = height;
+	switch (frame_type) {
+	case RAW_FRAME_UNCOMPRESSED_NV21:	// y->vu
+	case RAW_FRAME_UNCOMPRESSED_NV12:	// y->uv
+		row_bytes[1] = width;
+		rows[1] = height / 2;
+		result = 2;
+		break;
+	case RAW_FRAME_UNCOMPRESSED_422sp:	// y->uv
+		row_bytes[1] = width;
+		rows[1] = height;
+		result = 2;
+		break;
+	case RAW_FRAME_UNCOMPRESSED_444sp:	// y->uv
+		row_bytes[1] = width * 2;
+		rows[1] = height;
+		result = 2;
+		break;
+	case RAW_FRAME_UNCOMPRESSED_I420:	// y->u->v
+	case RAW_FRAME_UNCOMPRESSED_YV12:	// y->v->u
+		row_bytes[1] = row_bytes[2] = width / 2;
+		rows[1] = rows[2] = height / 2;
+		result = 3;
+		break;
+	case RAW_FRAME_UNCOMPRESSED_422p:	// y->u->v
+		row_bytes[1] = row_bytes[2] = width / 2;
+		rows[1] = rows[2] = height;
+		result = 3;
+		break;
+	case RAW_FRAME_UNCOMPRESSED_444p:	// y->u->v
+		row_bytes[1] = row_bytes[2] = width;
+		rows[1] = rows[2] = height;
+		result = 3;
+		break;
+	default:
+		// インターリーブ形式
+		row_bytes[0] = get_pixel_bytes(frame_type).frame_bytes(width, 1);
+		break;
+	}
+
+	return result;
+}
+
 /**
  * コンストラクタ
  * @param buffer
@@ -43,6 +104,8 @@ WrappedVideoFrame::WrappedVideoFrame(
 	const uint32_t &width, const uint32_t &height,
 	const raw_frame_t &frame_type)
 :	buffer(buffer), buffer_bytes(buffer_bytes),
+	num_planes(1), planes{buffer}, plane_bytes{buffer_bytes},
+	plane_row_bytes{}, plane_steps{},
 	// IFrame実装用
 	_actual_bytes(0),
 	_presentation_time_us(0), _received_sys_time_us(0),
@@ -85,11 +148,12 @@ WrappedVideoFrame &WrappedVideoFrame::operator=(const WrappedVideoFrame &src) {
 		_flags = _src->_flags;
 		_option = _src->_option;
 		const size_t bytes = resize(_src->_actual_bytes);
-		memcpy(frame(), _src->frame(), bytes);
+		_src->copy_planes(frame(), bytes);
 		_frame_type = _src->_frame_type;
 		_width = _src->_width;
 		_height = _src->_height;
-		_step = _src->_step;
+		// 隙間なく詰めてコピーするので詰め物を含まない1行分のバイト数にする
+		_step = _src->_pixelBytes.frame_bytes(_src->_width, 1);
 		_pixelBytes = _src->_pixelBytes;
 		_pts = _src->_pts;
 		_stc = _src->_stc;
@@ -117,7 +181,7 @@ int WrappedVideoFrame::copy_to(IVideoFrame &dst) const {
 	} else {
 		result = dst.resize(*this, _frame_type);
 		if (!result) {
-			memcpy(dst.frame(), frame(), dst.actual_bytes());
+			copy_planes(dst.frame(), dst.actual_bytes());
 		}
 		dst.set_attribute(*this);
 	}
@@ -133,7 +197,37 @@ int WrappedVideoFrame::copy_to(IVideoFrame &dst) const {
 int WrappedVideoFrame::get_image(VideoImage_t &image) {
 	ENTER();
 	// ここのassignはvideo_image.h/video_image.cpp
-	RETURN(core::assign(image, frame_type(), width(), height(), frame(), actual_bytes()), int);
+	const int result = core::assign(image, frame_type(), width(), height(), frame(), actual_bytes());
+	if (!result && (num_planes > 1)) {
+		// 連続したメモリーにあるとしたときのポインタを各プレーンのポインタへ付け替える
+		const std::pair<uint8_t **, uint32_t *> targets[] = {
+			{ &image.ptr_u, &image.stride_u }, { &image.ptr_v, &image.stride_v } };
+		for (const auto &target: targets) {
+			auto ptr = target.first;
+			if (!*ptr) continue;
+			size_t offset = *ptr - buffer;
+			for (int i = 0; i < num_planes; i++) {
+				if ((offset < plane_bytes[i]) || (i == num_planes - 1)) {
+					*ptr = planes[i] + offset;
+					if (plane_steps[i]) {
+						// 行末に詰め物があるときは詰め物を含めた1行分のバイト数にする
+						*target.second = plane_steps[i];
+					}
+					break;
+				}
+				offset -= plane_bytes[i];
+			}
+		}
+	}
+	if (!result && plane_steps[0]) {
+		if (image.ptr_u || image.ptr_v) {
+			image.stride_y = plane_steps[0];
+		} else if (image.pixel_stride) {
+			// インターリーブ形式のstrideはピクセル数
+			image.stride = plane_steps[0] / image.pixel_stride;
+		}
+	}
+	RETURN(result, int);
 };
 
 /**
@@ -148,12 +242,18 @@ int WrappedVideoFrame::get_image(VideoImage_t &image) {
  */
 void WrappedVideoFrame::assign(uint8_t *buf, const size_t &size,
 	const uint32_t &width, const uint32_t &height,
-	const raw_frame_t &frame_type) {
+	const raw_frame_t &frame_type,
+	const uint32_t &step) {
 
 	ENTER();
 
 	buffer = buf;
 	buffer_bytes = size;
+	num_planes = 1;
+	planes[0] = buf;
+	plane_bytes[0] = size;
+	memset(plane_row_bytes, 0, sizeof(plane_row_bytes));
+	memset(plane_steps, 0, sizeof(plane_steps));
 
 	if (LIKELY(width && height && frame_type)) {
 		_actual_bytes = size;
@@ -162,6 +262,35 @@ void WrappedVideoFrame::assign(uint8_t *buf, const size_t &size,
 		_frame_type = frame_type;
 		_step = get_pixel_bytes(frame_type).frame_bytes(width, 1);
 		_pixelBytes = get_pixel_bytes(frame_type);
+		uint32_t row_bytes[MAX_WRAPPED_PLANES], rows[MAX_WRAPPED_PLANES];
+		const int n = get_plane_layout(frame_type, width, height, row_bytes, rows);
+		if (step > row_bytes[0]) {
+			// 行末に詰め物があるとき
+			// 色差プレーンは輝度プレーンと同じ比率の詰め物を含めて輝度プレーンの直後に続いている
+			size_t offset = 0;
+			size_t required = 0;
+			for (int i = 0; i < n; i++) {
+				planes[i] = buf + offset;
+				plane_row_bytes[i] = row_bytes[i];
+				plane_steps[i] = (uint32_t)(((uint64_t)step * row_bytes[i]) / row_bytes[0]);
+				plane_bytes[i] = (size_t)row_bytes[i] * rows[i];
+				// 最終行の詰め物は無くてもいい
+				required = offset + (size_t)plane_steps[i] * (rows[i] - 1) + row_bytes[i];
+				offset += (size_t)plane_steps[i] * rows[i];
+			}
+			if (LIKELY(required <= size)) {
+				num_planes = n;
+				_actual_bytes = _pixelBytes.frame_bytes(width, height);
+				_step = (uint32_t)(((uint64_t)_step * step) / row_bytes[0]);
+			} else {
+				LOGW("insufficient buffer size,required=%" FMT_SIZE_T ",size=%" FMT_SIZE_T, required, size);
+				planes[0] = buf;
+				plane_bytes[0] = size;
+				memset(plane_row_bytes, 0, sizeof(plane_row_bytes));
+				memset(plane_steps, 0, sizeof(plane_steps));
+				_actual_bytes = 0;
+			}
+		}
 	} else {
 		_actual_bytes = 0;
 	}
@@ -169,6 +298,102 @@ void WrappedVideoFrame::assign(uint8_t *buf, const size_t &size,
 	EXIT();
 }
 
+/**
+ * @brief プレーン毎に別々のメモリーにある外部メモリーへ割り当て直す
+ *        各プレーンは隙間なく詰まっていること(1行分のバイト数==横幅x1ピクセルあたりのバイト数)
+ *        先頭プレーンは輝度(y), 残りのプレーンは色差を等分して保持しているものとする
+ *
+ * @param bufs 各プレーンの先頭ポインタ, 連続したメモリーにあるときと同じ順
+ * @param nums プレーン数[1, MAX_WRAPPED_PLANES]
+ * @param width
+ * @param height
+ * @param frame_type
+ */
+void WrappedVideoFrame::assign(
+	uint8_t *const *bufs, const int &nums,
+	const uint32_t &width, const uint32_t &height,
+	const raw_frame_t &frame_type,
+	const uint32_t *steps) {
+
+	ENTER();
+
+	const int n = MIN(MAX(nums, 1), MAX_WRAPPED_PLANES);
+	const size_t total = get_pixel_bytes(frame_type).frame_bytes(width, height);
+	if (n > 1) {
+		assign(bufs[0], total, width, height, frame_type);
+		num_planes = n;
+		planes[0] = bufs[0];
+		plane_bytes[0] = MIN((size_t)width * height, total);
+		for (int i = 1; i < n; i++) {
+			planes[i] = bufs[i];
+			plane_bytes[i] = (total - plane_bytes[0]) / (n - 1);
+		}
+		uint32_t row_bytes[MAX_WRAPPED_PLANES], rows[MAX_WRAPPED_PLANES];
+		if (steps && (get_plane_layout(frame_type, width, height, row_bytes, rows) == n)) {
+			// v4l2のマルチプレーン(NV12M/YUV420M等)はプレーン毎にbytesperlineが決まっている
+			for (int i = 0; i < n; i++) {
+				if (steps[i] > row_bytes[i]) {
+					plane_row_bytes[i] = row_bytes[i];
+					plane_steps[i] = steps[i];
+				}
+			}
+			if (plane_steps[0]) {
+				_step = (uint32_t)(((uint64_t)_step * plane_steps[0]) / row_bytes[0]);
+			}
+		}
+	} else {
+		// 1プレーンだけのときは連続したメモリーにあるときと同じ
+		const size_t size = steps && steps[0] ? MAX(total, (size_t)steps[0] * height) : total;
+		assign(bufs[0], size, width, height, frame_type, steps ? steps[0] : 0);
+	}
+
+	EXIT();
+}
+
+/**
+ * プレーン毎に別々のメモリーにある映像データを連続したメモリーへコピーする
+ * @param dst
+ * @param bytes コピーする最大バイト数
+ */
+/*private*/
+void WrappedVideoFrame::copy_planes(uint8_t *dst, const size_t &bytes) const {
+	ENTER();
+
+	size_t remain = bytes;
+	for (int i = 0; (i < num_planes) && remain; i++) {
+		const size_t n = MIN(plane_bytes[i], remain);
+		if (plane_steps[i]) {
+			// 行末に詰め物があるときは1行ずつ詰めてコピーする
+			const uint8_t *src = planes[i];
+			for (size_t copied = 0; copied < n; ) {
+				const size_t w = MIN((size_t)plane_row_bytes[i], n - copied);
+				memcpy(dst + copied, src, w);
+				copied += w;
+				src += plane_steps[i];
+			}
+		} else {
+			memcpy(dst, planes[i], n);
+		}
+		dst += n;
+		remain -= n;
+	}
+
+	EXIT();
+}
+
+/**
+ * 行末に詰め物があるかどうかを取得
+ * @return
+ */
+bool WrappedVideoFrame::is_padded() const {
+	for (int i = 0; i < num_planes; i++) {
+		if (plane_steps[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
 //--------------------------------------------------------------------------------
 // IFrameの純粋仮想関数の実装
 /**
@@ -305,6 +530,7 @@ uint32_t WrappedVideoFrame::height() const {
 
 /**
  * 映像データ1行(横幅x1)分のバイト数を取得
+ * 行末に詰め物があるときは詰め物を含めたバイト数
  * @return
  */
 uint32_t WrappedVideoFrame::step() const {
@@ -424,6 +650,14 @@ int WrappedVideoFrame::resize(const uint32_t &new_width, const uint32_t &new_hei
 			_pixelBytes = new_pixel_bytes;
 			// FIXME I420とかだと正しくない
 			_step = new_pixel_bytes.frame_bytes(new_width, 1);
+			if (is_padded()) {
+				// 行末の詰め物の情報は映像サイズが変わると使えないので連続したメモリーとして扱う
+				num_planes = 1;
+				planes[0] = buffer;
+				plane_bytes[0] = buffer_bytes;
+				memset(plane_row_bytes, 0, sizeof(plane_row_bytes));
+				memset(plane_steps, 0, sizeof(plane_steps));
+			}
 		} else {
 			result = USB_ERROR_NO_MEM;
 		}
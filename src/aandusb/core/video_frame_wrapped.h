@@ -20,6 +20,11 @@
 
 namespace serenegiant::core {
 
+/**
+ * WrappedVideoFrameでラップできる最大プレーン数
+ */
+#define MAX_WRAPPED_PLANES (3)
+
 /**
  * @brief 外部のメモリーをラップするためのIVideoFrame実装
  * 
@@ -28,6 +33,29 @@ class WrappedVideoFrame : public virtual IVideoFrame {
 private:
 	uint8_t *buffer;
 	size_t buffer_bytes;
+	/**
+	 * プレーン数, 映像データが連続したメモリーにあるときは1
+	 * 2以上ならプレーン毎に別々のメモリーにある(v4l2のマルチプレーン等)
+	 */
+	int num_planes;
+	/**
+	 * 各プレーンの先頭ポインタ, planes[0] == buffer
+	 */
+	uint8_t *planes[MAX_WRAPPED_PLANES];
+	/**
+	 * 各プレーンのデータバイト数(隙間なく詰めたときのバイト数)
+	 */
+	size_t plane_bytes[MAX_WRAPPED_PLANES];
+	/**
+	 * 各プレーンを隙間なく詰めたときの1行分のバイト数
+	 * 行末に詰め物が無いときは0
+	 */
+	uint32_t plane_row_bytes[MAX_WRAPPED_PLANES];
+	/**
+	 * 各プレーンの実際の1行分のバイト数(v4l2のbytesperline)
+	 * 行末に詰め物が無いときは0
+	 */
+	uint32_t plane_steps[MAX_WRAPPED_PLANES];
 	// IFrame実装用
 	size_t _actual_bytes;
 	nsecs_t _presentation_time_us;
@@ -66,6 +94,13 @@ private:
 	size_t _packet_id;
 	/** ペイロード中のマイクロフレームの数 */
 	int _frame_num_in_payload;
+
+	/**
+	 * プレーン毎に別々のメモリーにある映像データを連続したメモリーへコピーする
+	 * @param dst
+	 * @param bytes コピーする最大バイト数
+	 */
+	void copy_planes(uint8_t *dst, const size_t &bytes) const;
 protected:
 public:
 	/**
@@ -109,17 +144,54 @@ public:
 
 	/**
 	 * @brief 別の外部メモリーへ割り当て直す
+	 *        stepを指定したときは行末の詰め物を含めた1行分のバイト数として扱い、
+	 *        プラナー/セミプラナー形式の色差プレーンは輝度プレーンと同じ比率の詰め物を含めて
+	 *        輝度プレーンの直後に続いているものとする(v4l2のシングルプレーンと同じ)
+	 *        行末に詰め物があってもactual_bytesは隙間なく詰めたときのバイト数になる
 	 * 
 	 * @param buf 
 	 * @param size 
 	 * @param width
 	 * @param height
 	 * @param frame_type
+	 * @param step 先頭プレーンの1行分のバイト数(v4l2のbytesperline), 0なら隙間なく詰まっている
 	 */
 	void assign(
 		uint8_t *buf, const size_t &size,
 		const uint32_t &width, const uint32_t &height,
-		const raw_frame_t &frame_type);
+		const raw_frame_t &frame_type,
+		const uint32_t &step = 0);
+	/**
+	 * @brief プレーン毎に別々のメモリーにある外部メモリーへ割り当て直す
+	 *        先頭プレーンは輝度(y), 残りのプレーンは色差を等分して保持しているものとする
+	 *
+	 * @param bufs 各プレーンの先頭ポインタ, 連続したメモリーにあるときと同じ順
+	 * @param nums プレーン数[1, MAX_WRAPPED_PLANES]
+	 * @param width
+	 * @param height
+	 * @param frame_type
+	 * @param steps 各プレーンの1行分のバイト数(v4l2のbytesperline)の配列,
+	 *              nullptrまたは0なら隙間なく詰まっている(1行分のバイト数==横幅x1ピクセルあたりのバイト数)
+	 */
+	void assign(
+		uint8_t *const *bufs, const int &nums,
+		const uint32_t &width, const uint32_t &height,
+		const raw_frame_t &frame_type,
+		const uint32_t *steps = nullptr);
+	/**
+	 * @brief プレーン数を取得
+	 *
+	 * @return int 2以上ならプレーン毎に別々のメモリーにある
+	 */
+	inline int get_num_planes() const { return num_planes; };
+	/**
+	 * @brief 行末に詰め物があるかどうかを取得
+	 *        詰め物があるときはframe()から隙間なく詰まっているものとして読み込んではいけない
+	 *
+	 * @return true
+	 * @return false
+	 */
+	bool is_padded() const;
 	//--------------------------------------------------------------------------------
 	// IFrameの純粋仮想関数の実装
 	/**
@@ -211,6 +283,8 @@ public:
 	uint32_t height() const override;
 	/**
 	 * 映像データ1行(横幅x1)分のバイト数を取得
+	 * 行末に詰め物があるときは詰め物を含めたバイト数
+	 * (プラナー/セミプラナー形式は詰め物を含めた輝度プレーンの1行分のバイト数x1ピクセルあたりのバイト数)
 	 * @return
 	 */
 	uint32_t step() const override;
@@ -188,6 +188,16 @@ void VideoGLRenderer::release_renderer(const bool &release_hw_buffer) {
 #endif
 }
 
+/*private*/
+void VideoGLRenderer::release_textures() {
+	SAFE_DELETE(yuvtexture);
+	SAFE_DELETE(uvtexture);
+#if defined(__ANDROID__)
+	SAFE_DELETE(wrapped);
+	SAFE_DELETE(hwBuffer);
+#endif
+}
+
 //--------------------------------------------------------------------------------
 #include "gl/texture_vsh.h"
 #include "gl/yuv2_fsh.h"
@@ -400,6 +410,52 @@ static gl::GLRenderer *createGLRenderer(
 	RET(result);
 }
 
+/**
+ * 行末に詰め物があるかどうかを取得
+ * @param frame
+ * @return
+ */
+static bool is_padded(const IVideoFrame &frame) {
+	return frame.step() > get_pixel_bytes(frame.frame_type()).frame_bytes(frame.width(), 1);
+}
+
+/**
+ * 行末に詰め物があるときの1行分のバイト数を取得する
+ * GLTexture::assignTextureへ引き渡す用
+ * @param frame
+ * @return 行末に詰め物があればIVideoFrame::step, なければ0
+ */
+static GLint get_stride(const IVideoFrame &frame) {
+	return is_padded(frame) ? (GLint)frame.step() : 0;
+}
+
+/**
+ * 行末に詰め物があってもCPUで詰め直さずにテクスチャへ書き込めるフレームタイプかどうか
+ * インターリーブ形式とyとuv/vuを別々のテクスチャへ書き込むセミプラナー形式(NV12/NV21)は
+ * 1行分のバイト数を指定してテクスチャへ書き込める
+ * @param frame_type
+ * @return
+ */
+static bool is_stride_supported(const raw_frame_t &frame_type) {
+	switch (frame_type) {
+	case RAW_FRAME_UNCOMPRESSED_YUYV:
+	case RAW_FRAME_UNCOMPRESSED_UYVY:
+	case RAW_FRAME_UNCOMPRESSED_NV21:
+	case RAW_FRAME_UNCOMPRESSED_NV12:
+	case RAW_FRAME_UNCOMPRESSED_RGBX:
+	case RAW_FRAME_UNCOMPRESSED_XRGB:
+	case RAW_FRAME_UNCOMPRESSED_RGB565:
+	case RAW_FRAME_UNCOMPRESSED_RGB:
+	case RAW_FRAME_UNCOMPRESSED_BGR:
+	case RAW_FRAME_UNCOMPRESSED_GRAY8:
+	case RAW_FRAME_UNCOMPRESSED_BGRX:
+	case RAW_FRAME_UNCOMPRESSED_XBGR:
+		return true;
+	default:
+		return false;
+	}
+}
+
 /**
  * 描画処理
  * イベントループから定期的に呼び出される
@@ -420,12 +476,22 @@ int VideoGLRenderer::draw_frame(IVideoFrame &frame)
 		LOGD("frame size and/or type changed! size:%dx%d=>%dx%d,tyep:%08x=>%08x",
 			preview_width, preview_height, frame.width(), frame.height(),
 			preview_frame_type, frame.frame_type());
+		// MJPEGはデコード後のフレームタイプが映像サイズで変わることがあるのでGLRendererも作り直す
+		const bool reuse_renderer = renderer
+			&& (preview_frame_type == frame.frame_type())
+			&& (preview_frame_type != RAW_FRAME_MJPEG);
 		preview_width =(int)frame.width();
 		preview_height = (int)frame.height();
 		preview_frame_type = frame.frame_type();
-		mjpeg_decoded_frame_type = RAW_FRAME_UNKNOWN;
-		mjpeg_decode_target = MJPEG_DECODE_TARGET;
-		release_renderer();
+		if (reuse_renderer) {
+			// 映像サイズだけが変わったときはシェーダーを再利用して
+			// 画面を消去せずに前の映像を表示したまま新しい映像へ切り替える
+			release_textures();
+		} else {
+			mjpeg_decoded_frame_type = RAW_FRAME_UNKNOWN;
+			mjpeg_decode_target = MJPEG_DECODE_TARGET;
+			release_renderer();
+		}
 		raw_frame_bytes = get_pixel_bytes(preview_frame_type)
 			.frame_bytes(preview_width, preview_height);
 		LOGD("raw_frame_bytes %" FMT_SIZE_T "=>%" FMT_SIZE_T,
@@ -484,6 +550,15 @@ int VideoGLRenderer::on_draw_uncompressed(IVideoFrame &frame) {
 	ENTER();
 
 	int result = USB_ERROR_NOT_SUPPORTED;
+	if (UNLIKELY(is_padded(frame) && !is_stride_supported(frame.frame_type()))) {
+		// 行末に詰め物があって1行分のバイト数を指定してテクスチャへ書き込めないときは
+		// 隙間なく詰めてから描画する
+		result = frame.copy_to(work);
+		if (LIKELY(!result)) {
+			result = on_draw_uncompressed(work);
+		}
+		RETURN(result, int);
+	}
 	switch (frame.frame_type()) {
 	case RAW_FRAME_UNCOMPRESSED_YUYV:
 		result = on_draw_yuyv(frame);	// YUV2,インターリーブ
@@ -902,7 +977,7 @@ int VideoGLRenderer::on_draw_yuyv(IVideoFrame &frame_yuyv) {
     if (LIKELY(frame_yuyv.actual_bytes() == raw_frame_bytes)) {	// 実フレームサイズの比較を追加
         // yuyvフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
         // 元データの2ピクセルがテクスチャの1テクセルに対応するのでテクスチャの横幅を1/2にする
-        yuvtexture->assignTexture(frame_yuyv.frame());
+        yuvtexture->assignTexture(frame_yuyv.frame(), get_stride(frame_yuyv));
         result = renderer->draw(yuvtexture, yuvtexture->getTexMatrix(), mvp_matrix);			// ピクセルフォーマットの変換をしながらを描画
     } else {
         MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -951,7 +1026,7 @@ int VideoGLRenderer::on_draw_uyvy(IVideoFrame &frame_uyvy) {
 	if (LIKELY(frame_uyvy.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 		// uyvyフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
 		// 元データの2ピクセルがテクスチャの1テクセルに対応するのでテクスチャの横幅を1/2にする
-		yuvtexture->assignTexture(frame_uyvy.frame());
+		yuvtexture->assignTexture(frame_uyvy.frame(), get_stride(frame_uyvy));
 		result = renderer->draw(yuvtexture, yuvtexture->getTexMatrix(), mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1202,7 +1277,7 @@ int VideoGLRenderer::on_draw_yuv420p(IVideoFrame &frame_yuv) {
 	MEAS_TIME_START
 	if (LIKELY(frame_yuv.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // YUV420pフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_yuv.frame());
+		assign_yuv420p(frame_yuv, false);
 		result = renderer->draw(yuvtexture, yuvtexture->getTexMatrix(), mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1250,7 +1325,7 @@ int VideoGLRenderer::on_draw_yuv420p_yv12(IVideoFrame &frame_yuv) {
 	MEAS_TIME_START
 	if (LIKELY(frame_yuv.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // YV12フレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_yuv.frame());
+		assign_yuv420p(frame_yuv, true);
 		result = renderer->draw(yuvtexture, yuvtexture->getTexMatrix(), mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1262,6 +1337,37 @@ int VideoGLRenderer::on_draw_yuv420p_yv12(IVideoFrame &frame_yuv) {
 	RETURN(result, int);
 }
 
+/**
+ * YUV420p(I420/YV12)のフレームデータをyuvtextureへ書き込む
+ * y/u/vが連続したメモリーにあれば1回で書き込み,
+ * マルチプレーン等で別々のメモリーにあるときは連続したメモリーのときと同じ配置になるように
+ * プレーン毎にテクスチャの行範囲を指定して書き込む(CPUで1つのバッファーへ詰め直さない)
+ * @param frame_yuv
+ * @param yv12 true: y->v->u(YV12), false: y->u->v(I420)
+ */
+/*private*/
+void VideoGLRenderer::assign_yuv420p(IVideoFrame &frame_yuv, const bool &yv12) {
+	ENTER();
+
+	VideoImage_t image{};
+	frame_yuv.get_image(image);
+	const size_t y_bytes = preview_width * preview_height;
+	// 連続したメモリーにあるときのプレーンの並び順
+	const uint8_t *first = yv12 ? image.ptr_v : image.ptr_u;
+	const uint8_t *second = yv12 ? image.ptr_u : image.ptr_v;
+	if ((first == image.ptr_y + y_bytes) && (second == first + y_bytes / 4)) {
+		yuvtexture->assignTexture(frame_yuv.frame());
+	} else {
+		// 色差プレーンは1/4サイズなのでテクスチャの1行(横幅分)に2行ずつ入る
+		const GLint rows = (GLint)preview_height / 4;
+		yuvtexture->assignTexture(image.ptr_y, 0, (GLint)preview_height);
+		yuvtexture->assignTexture(first, (GLint)preview_height, rows);
+		yuvtexture->assignTexture(second, (GLint)preview_height + rows, rows);
+	}
+
+	EXIT();
+}
+
 /**
  * on_drawの下請け
  * preview_frame_type == RAW_FRAME_UNCOMPRESSED_NV21(YUV420sp)の時
@@ -1307,8 +1413,11 @@ int VideoGLRenderer::on_draw_yuv420sp_nv21(IVideoFrame &frame_yuv) {
 	MEAS_TIME_START
 	if (LIKELY(frame_yuv.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // YUV420pフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_yuv.frame());
-		uvtexture->assignTexture(&frame_yuv[preview_width * preview_height]);
+		// マルチプレーンのときはyとvuが別々のメモリーにあるのでget_imageでvuプレーンの位置を取得する
+		VideoImage_t image{};
+		frame_yuv.get_image(image);
+		yuvtexture->assignTexture(image.ptr_y, (GLint)image.stride_y);
+		uvtexture->assignTexture(image.ptr_v, (GLint)image.stride_v);
 		result = renderer->draw(yuvtexture, uvtexture, nullptr, mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1365,8 +1474,11 @@ int VideoGLRenderer::on_draw_yuv420sp_nv12(IVideoFrame &frame_yuv) {
 	MEAS_TIME_START
 	if (LIKELY(frame_yuv.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // YUV420pフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_yuv.frame());
-		uvtexture->assignTexture(&frame_yuv[preview_width * preview_height]);
+		// マルチプレーンのときはyとuvが別々のメモリーにあるのでget_imageでuvプレーンの位置を取得する
+		VideoImage_t image{};
+		frame_yuv.get_image(image);
+		yuvtexture->assignTexture(image.ptr_y, (GLint)image.stride_y);
+		uvtexture->assignTexture(image.ptr_u, (GLint)image.stride_u);
 		result = renderer->draw(yuvtexture, uvtexture, nullptr, mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1405,7 +1517,7 @@ int VideoGLRenderer::on_draw_rgbx(IVideoFrame &frame_rgbx) {
 	MEAS_TIME_START
 	if (LIKELY(frame_rgbx.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // RGBXフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_rgbx.frame());
+		yuvtexture->assignTexture(frame_rgbx.frame(), get_stride(frame_rgbx));
 		result = renderer->draw(yuvtexture, nullptr, nullptr, mvp_matrix);
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1444,7 +1556,7 @@ int VideoGLRenderer::on_draw_xrgb(IVideoFrame &frame_xrgb) {
 	MEAS_TIME_START
 	if (LIKELY(frame_xrgb.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // RGBXフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_xrgb.frame());
+		yuvtexture->assignTexture(frame_xrgb.frame(), get_stride(frame_xrgb));
 		result = renderer->draw(yuvtexture, nullptr, mvp_matrix);
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1516,7 +1628,7 @@ int VideoGLRenderer::on_draw_rgb565(IVideoFrame &frame_rgb565) {
 	MEAS_TIME_START
 	if (LIKELY(frame_rgb565.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // RGB565フレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_rgb565.frame());
+		yuvtexture->assignTexture(frame_rgb565.frame(), get_stride(frame_rgb565));
 		result = renderer->draw(yuvtexture, nullptr, mvp_matrix);
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1563,7 +1675,7 @@ int VideoGLRenderer::on_draw_rgb(IVideoFrame &frame_rgb) {
 	MEAS_TIME_START
 	if (LIKELY(frame_rgb.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // RGBフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_rgb.frame());
+		yuvtexture->assignTexture(frame_rgb.frame(), get_stride(frame_rgb));
 		result = renderer->draw(yuvtexture, nullptr, mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1610,7 +1722,7 @@ int VideoGLRenderer::on_draw_bgr(IVideoFrame &frame_bgr) {
 	MEAS_TIME_START
 	if (LIKELY(frame_bgr.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // RGBフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_bgr.frame());
+		yuvtexture->assignTexture(frame_bgr.frame(), get_stride(frame_bgr));
 		result = renderer->draw(yuvtexture, nullptr, mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1656,7 +1768,7 @@ int VideoGLRenderer::on_draw_gray8(IVideoFrame &frame_gray8) {
 	MEAS_TIME_START
 	if (LIKELY(frame_gray8.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // YUV420pフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_gray8.frame());
+		yuvtexture->assignTexture(frame_gray8.frame(), get_stride(frame_gray8));
 		result = renderer->draw(yuvtexture, nullptr, mvp_matrix);            // ピクセルフォーマットの変換をしながらを描画
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1701,7 +1813,7 @@ int VideoGLRenderer::on_draw_bgrx(IVideoFrame &frame_bgrx) {
 	MEAS_TIME_START
 	if (LIKELY(frame_bgrx.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // RGBXフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_bgrx.frame());
+		yuvtexture->assignTexture(frame_bgrx.frame(), get_stride(frame_bgrx));
 		result = renderer->draw(yuvtexture, nullptr, mvp_matrix);
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
@@ -1746,7 +1858,7 @@ int VideoGLRenderer::on_draw_xbgr(IVideoFrame &frame_xrgb) {
 	MEAS_TIME_START
 	if (LIKELY(frame_xrgb.actual_bytes() == raw_frame_bytes)) {    // 実フレームサイズの比較を追加
 // RGBXフレームデータをテクスチャにセットしてシェーダーを使ってレンダリング
-		yuvtexture->assignTexture(frame_xrgb.frame());
+		yuvtexture->assignTexture(frame_xrgb.frame(), get_stride(frame_xrgb));
 		result = renderer->draw(yuvtexture, nullptr, mvp_matrix);
 	} else {
 		MARK("Unexpected frame bytes: actual_bytes=%" FMT_SIZE_T ",frame_bytes=%" FMT_SIZE_T,
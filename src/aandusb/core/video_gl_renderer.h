@@ -66,6 +66,11 @@ private:
 #endif
 
 	void release_renderer(const bool &release_hw_buffer = true);
+	/**
+	 * 映像サイズに依存するテクスチャ等だけを破棄してGLRenderer(シェーダー)は再利用する
+	 * フレームタイプが変わらずに映像サイズだけが変わったときに使う
+	 */
+	void release_textures();
 	/**
 	 * 映像の描画処理
 	 * @param frame
@@ -163,6 +168,13 @@ private:
 	 * @return 0: 描画成功, それ以外: エラー
 	 */
 	int on_draw_yuv420p_yv12(IVideoFrame &frame_yuv);
+	/**
+	 * YUV420p(I420/YV12)のフレームデータをyuvtextureへ書き込む
+	 * y/u/vが別々のメモリーにあるときはプレーン毎に書き込む
+	 * @param frame_yuv
+	 * @param yv12 true: y->v->u(YV12), false: y->u->v(I420)
+	 */
+	void assign_yuv420p(IVideoFrame &frame_yuv, const bool &yv12);
 	/**
 	 * on_drawの下請け
 	 * preview_frame_type == RAW_FRAME_UNCOMPRESSED_NV21(YUV420sp)の時
@@ -0,0 +1,1193 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4L2DecoderPipeline"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+	// #define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "utilbase.h"
+
+#include "times.h"
+#include "charutils.h"
+
+// v4l2
+#include "v4l2/pipeline_v4l2_decoder.h"
+
+namespace serenegiant::v4l2::pipeline {
+
+/**
+ * OUTPUTキュー(圧縮映像)のバッファー数
+ */
+#define OUTPUT_BUFFER_NUMS (4)
+/**
+ * CAPTUREキュー(デコード済み映像)のバッファー数
+ * 実際にはこれとV4L2_CID_MIN_BUFFERS_FOR_CAPTUREの大きい方へmax_lend_numsを加えた数を確保する
+ */
+#define CAPTURE_BUFFER_NUMS (4)
+/**
+ * 貸し出し中以外にデコーダー側に残しておくCAPTUREキューのバッファー数の最小値
+ */
+#define MIN_QUEUED_BUFFERS (2)
+/**
+ * デコード完了待ちの最大時間[ミリ秒]
+ */
+#define DECODE_TIMEOUT_MS (100)
+/**
+ * 貸し出したバッファーの返却待ちの最大時間[ナノ秒]
+ */
+#define MAX_WAIT_LENT_BUFFERS_NS (1000000000LL)
+/**
+ * find_decoderで調べる/dev/videoNの数
+ */
+#define MAX_VIDEO_DEVICES (64)
+
+/**
+ * コンストラクタ
+ * @param device_name デコーダーのデバイスファイル名, 空なら映像のフォーマットに対応しているものを探す
+ * @param decoded_format デコード後のピクセルフォーマット要求値
+ * @param max_lend_nums 下流のパイプラインが同時に保持できるバッファーの最大数
+ */
+/*public*/
+V4L2DecoderPipeline::V4L2DecoderPipeline(
+	std::string device_name,
+	const uint32_t &decoded_format,
+	const uint32_t &max_lend_nums)
+:	IPipeline(),
+	device_name(std::move(device_name)),
+	decoded_format(decoded_format),
+	max_lend_nums(max_lend_nums),
+	m_fd(0), decoder_name(),
+	coded_format(0), export_dmabuf(false),
+	out_type(V4L2_BUF_TYPE_VIDEO_OUTPUT), cap_type(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+	current_coded(0), coded_width(0), coded_height(0),
+	failed_coded(0), failed_width(0), failed_height(0),
+	decoded_width(0), decoded_height(0), decoded_frame_type(core::RAW_FRAME_UNKNOWN),
+	out_buffers(), free_outputs(),
+	cap_buffers(), cap_frames(), orphan_frames(), cap_bytesused(), cap_streaming(false),
+	lent_nums(0),
+	converter(), work(DEFAULT_FRAME_SZ),
+	sw_frame_type(core::RAW_FRAME_UNKNOWN),
+	hw_frames(0), sw_frames(0)
+{
+	ENTER();
+
+	set_state(sere_pipeline::PIPELINE_STATE_INITIALIZED);
+
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4L2DecoderPipeline::~V4L2DecoderPipeline() {
+	ENTER();
+
+	set_state(sere_pipeline::PIPELINE_STATE_RELEASING);
+	set_running(false);
+	decoder_lock.lock();
+	{
+		close_decoder_locked();
+	}
+	decoder_lock.unlock();
+
+	EXIT();
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * 映像のフレームタイプからデコーダーへ渡すv4l2ピクセルフォーマットを取得する
+ * @param frame_type
+ * @return 圧縮フォーマットでなければ0
+ */
+/*private,static*/
+uint32_t V4L2DecoderPipeline::get_coded_format(const core::raw_frame_t &frame_type) {
+	switch (frame_type) {
+	case core::RAW_FRAME_MJPEG:			return V4L2_PIX_FMT_MJPEG;
+	case core::RAW_FRAME_H264:
+	case core::RAW_FRAME_FRAME_H264:	return V4L2_PIX_FMT_H264;
+	case core::RAW_FRAME_VP8:
+	case core::RAW_FRAME_FRAME_VP8:		return V4L2_PIX_FMT_VP8;
+	case core::RAW_FRAME_H265:			return V4L2_PIX_FMT_HEVC;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * 指定した圧縮フォーマットをデコードできるmem2memデコーダーかどうかを確認する
+ * @param fd
+ * @param out_type
+ * @param coded
+ * @return
+ */
+/*private,static*/
+bool V4L2DecoderPipeline::is_decoder(int fd, const uint32_t &out_type, const uint32_t &coded) {
+	ENTER();
+
+	for (uint32_t i = 0; ; i++) {
+		struct v4l2_fmtdesc desc {
+			.index = i,
+			.type = out_type,
+		};
+		if (xioctl(fd, VIDIOC_ENUM_FMT, &desc) == -1) {
+			break;
+		}
+		if (desc.pixelformat == coded) {
+			RETURN(true, bool);
+		}
+	}
+
+	RETURN(false, bool);
+}
+
+/**
+ * mem2memデバイスのOUTPUTキューのv4l2_buf_typeを取得する
+ * @param fd
+ * @return mem2memデバイスでなければ0
+ */
+static uint32_t get_m2m_output_type(int fd) {
+	struct v4l2_capability cap{};
+	if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
+		return 0;
+	}
+	const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+		? cap.device_caps : cap.capabilities;
+	if (caps & V4L2_CAP_VIDEO_M2M_MPLANE) {
+		return V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	} else if (caps & V4L2_CAP_VIDEO_M2M) {
+		return V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	}
+	return 0;
+}
+
+/**
+ * /dev/videoNを順に調べて指定した圧縮フォーマットをデコードできるmem2memデコーダーを探す
+ * @param coded
+ * @return 見つからなければ空文字列
+ */
+/*private,static*/
+std::string V4L2DecoderPipeline::find_decoder(const uint32_t &coded) {
+	ENTER();
+
+	std::string result;
+	for (int i = 0; i < MAX_VIDEO_DEVICES; i++) {
+		const auto name = format("/dev/video%d", i);
+		int fd = ::open(name.c_str(), O_RDWR | O_NONBLOCK, 0);
+		if (fd < 0) {
+			continue;
+		}
+		const auto type = get_m2m_output_type(fd);
+		if (type && is_decoder(fd, type, coded)) {
+			result = name;
+		}
+		::close(fd);
+		if (!result.empty()) {
+			LOGD("found decoder %s for %s", result.c_str(), V4L2_PIX_FMT_to_string(coded).c_str());
+			break;
+		}
+	}
+
+	RET(result);
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * パイプライン処理を開始
+ * IPipelineの純粋仮想関数
+ * デコーダーは最初の圧縮映像を受け取ったときにオープンする
+ * @return
+ */
+/*public*/
+int V4L2DecoderPipeline::start() {
+	ENTER();
+
+	if (!set_running(true)) {
+		set_state(sere_pipeline::PIPELINE_STATE_RUNNING);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * パイプライン処理を停止
+ * IPipelineの純粋仮想関数
+ * @return
+ */
+/*public*/
+int V4L2DecoderPipeline::stop() {
+	ENTER();
+
+	if (set_running(false)) {
+		set_state(sere_pipeline::PIPELINE_STATE_STOPPING);
+		decoder_lock.lock();
+		{
+			close_decoder_locked();
+			failed_coded = 0;
+			sw_frame_type = core::RAW_FRAME_UNKNOWN;
+		}
+		decoder_lock.unlock();
+		set_state(sere_pipeline::PIPELINE_STATE_INITIALIZED);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 新しいフレームを受け取る処理
+ * IPipelineの純粋仮想関数
+ * @param frame
+ * @return
+ */
+/*public*/
+int V4L2DecoderPipeline::queue_frame(core::BaseVideoFrame *frame) {
+	if (UNLIKELY(!is_running() || !frame)) {
+		return core::USB_SUCCESS;
+	}
+
+	const uint32_t coded = coded_format ? coded_format : get_coded_format(frame->frame_type());
+	if (!coded) {
+		// 圧縮されていない映像はそのまま次のパイプラインへ渡す
+		return chain_frame(frame);
+	}
+	int result = decode_hw(*frame, coded);
+	if (result == core::USB_ERROR_NOT_SUPPORTED) {
+		result = decode_sw(*frame);
+	}
+
+	return result;
+}
+
+/**
+ * 映像のフレームタイプに関係なく指定した圧縮フォーマットとしてデコーダーへ渡すように設定する
+ * 開始前のみ変更可能
+ * @param coded 圧縮フォーマット, 0なら映像のフレームタイプから決める
+ * @return
+ */
+/*public*/
+int V4L2DecoderPipeline::set_coded_format(const uint32_t &coded) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(decoder_lock);
+	if (!is_running()) {
+		coded_format = coded;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", get_state());
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * デコードした映像のバッファーをVIDIOC_EXPBUFでdma-bufとしてエクスポートするかどうかを設定する
+ * 開始前のみ変更可能
+ * @param enable
+ * @return
+ */
+/*public*/
+int V4L2DecoderPipeline::set_export_dmabuf(const bool &enable) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(decoder_lock);
+	if (!is_running()) {
+		export_dmabuf = enable;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", get_state());
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * デコーダーで映像をデコードしているかどうか
+ * @return
+ */
+/*public*/
+bool V4L2DecoderPipeline::is_hw_decoding() const {
+	AutoMutex lock(decoder_lock);
+	return (m_fd > 0) && cap_streaming;
+}
+
+/**
+ * 現在オープンしているデコーダーのデバイスファイル名を取得
+ * @return オープンしていなければ空文字列
+ */
+/*public*/
+std::string V4L2DecoderPipeline::get_decoder_name() const {
+	AutoMutex lock(decoder_lock);
+	return decoder_name;
+}
+
+/**
+ * 次のパイプラインへ渡したV4L2BufferFrameのdma-bufのファイルディスクリプタを取得する
+ * @param frame
+ * @return set_export_dmabufが無効・このパイプラインのフレームでなければ負
+ */
+/*public*/
+int V4L2DecoderPipeline::get_dmabuf_fd(const V4L2BufferFrame &frame) const {
+	ENTER();
+
+	int result = core::USB_ERROR_NOT_FOUND;
+
+	AutoMutex lock(decoder_lock);
+	const auto index = frame.index();
+	if ((index < cap_frames.size()) && (cap_frames[index].get() == &frame)
+		&& (cap_buffers[index].fd > 0)) {
+
+		result = cap_buffers[index].fd;
+	}
+
+	RETURN(result, int);
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * 映像をデコーダーでデコードして次のパイプラインへ渡す
+ * @param frame
+ * @param coded
+ * @return core::USB_ERROR_NOT_SUPPORTEDならCPUでデコードすること
+ */
+/*private*/
+int V4L2DecoderPipeline::decode_hw(core::BaseVideoFrame &frame, const uint32_t &coded) {
+	ENTER();
+
+	int result;
+	std::vector<decoded_buffer_t> decoded;
+	decoder_lock.lock();
+	{
+		result = prepare_decoder_locked(coded, frame.width(), frame.height(), frame.size());
+		if (LIKELY(!result)) {
+			result = queue_output_locked(frame);
+		}
+		if (LIKELY(!result)) {
+			result = dequeue_capture_locked(decoded);
+		}
+		if (UNLIKELY(result && (result != core::USB_ERROR_NOT_SUPPORTED)
+			&& (result != core::USB_ERROR_TIMEOUT))) {
+			// デコーダーがエラーになったときは同じ映像の間はCPUでデコードする
+			LOGW("decoder error,err=%d, fallback to cpu", result);
+			// 取り出したが下流へ渡していないバッファーは貸し出し中ではない
+			for (const auto &item: decoded) {
+				item.frame->set_lent(false);
+			}
+			decoded.clear();
+			close_decoder_locked();
+			failed_coded = coded;
+			failed_width = frame.width();
+			failed_height = frame.height();
+			result = core::USB_ERROR_NOT_SUPPORTED;
+		}
+	}
+	decoder_lock.unlock();
+
+	// 下流でV4L2BufferFrameを開放するとrelease_bufferでdecoder_lockを取るのでロックの外で渡す
+	for (const auto &item: decoded) {
+		lend_frame(item);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像をCPUでデコードして次のパイプラインへ渡す
+ * MJPEG以外はそのまま次のパイプラインへ渡す
+ * @param frame
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::decode_sw(core::BaseVideoFrame &frame) {
+	ENTER();
+
+	if (frame.frame_type() != core::RAW_FRAME_MJPEG) {
+		// H264/VP8等はCPUでデコードしないので下流(GLRendererPipeline等)に任せる
+		RETURN(chain_frame(&frame), int);
+	}
+	if (sw_frame_type == core::RAW_FRAME_UNKNOWN) {
+		sw_frame_type = V4L2_PIX_FMT_to_raw_frame(decoded_format);
+	}
+	int result = converter.copy_to(frame, work, sw_frame_type);
+	if (result == core::USB_ERROR_NOT_SUPPORTED) {
+		// 要求したピクセルフォーマットへ直接展開できないときはMJPEGのサブサンプリングのまま展開する
+		sw_frame_type = converter.get_mjpeg_decode_type(frame);
+		LOGD("fallback to 0x%08x", sw_frame_type);
+		result = converter.copy_to(frame, work, sw_frame_type);
+	}
+	if (LIKELY(!result)) {
+		sw_frames++;
+		result = chain_frame(&work);
+	} else {
+		LOGW("failed to decode mjpeg,err=%d", result);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 必要であればデコーダーをオープン・再設定する
+ * @param coded
+ * @param width
+ * @param height
+ * @param bytes
+ * @return core::USB_ERROR_NOT_SUPPORTEDならデコーダーを使えない
+ */
+/*private*/
+int V4L2DecoderPipeline::prepare_decoder_locked(
+	const uint32_t &coded,
+	const uint32_t &width, const uint32_t &height, const size_t &bytes) {
+
+	ENTER();
+
+	if ((m_fd > 0) && (coded == current_coded)
+		&& (width == coded_width) && (height == coded_height)) {
+		RETURN(core::USB_SUCCESS, int);
+	}
+	if ((coded == failed_coded) && (width == failed_width) && (height == failed_height)) {
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	close_decoder_locked();
+	const int result = open_decoder_locked(coded, width, height, bytes);
+	if (UNLIKELY(result)) {
+		LOGW("decoder not available for %s(%ux%u),err=%d, fallback to cpu",
+			V4L2_PIX_FMT_to_string(coded).c_str(), width, height, result);
+		close_decoder_locked();
+		failed_coded = coded;
+		failed_width = width;
+		failed_height = height;
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	failed_coded = 0;
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * デコーダーをオープンしてOUTPUT/CAPTUREキューを初期化・ストリーミング開始する
+ * @param coded
+ * @param width
+ * @param height
+ * @param bytes
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::open_decoder_locked(
+	const uint32_t &coded,
+	const uint32_t &width, const uint32_t &height, const size_t &bytes) {
+
+	ENTER();
+
+	const auto name = device_name.empty() ? find_decoder(coded) : device_name;
+	if (name.empty()) {
+		RETURN(core::USB_ERROR_NOT_FOUND, int);
+	}
+	int fd = ::open(name.c_str(), O_RDWR | O_NONBLOCK, 0);
+	if (fd < 0) {
+		const int result = -errno;
+		LOGE("Cannot open '%s',errno=%d", name.c_str(), -result);
+		RETURN(result, int);
+	}
+	m_fd = fd;
+	decoder_name = name;
+	out_type = get_m2m_output_type(m_fd);
+	if (!out_type || !is_decoder(m_fd, out_type, coded)) {
+		LOGE("%s can't decode %s", name.c_str(), V4L2_PIX_FMT_to_string(coded).c_str());
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	cap_type = (out_type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	// 圧縮映像は映像毎にサイズが変わるので余裕を持たせる
+	const auto sizeimage = (uint32_t)std::max<size_t>(bytes * 2, (size_t)width * height * 3 / 2);
+	struct v4l2_format fmt { .type = out_type };
+	if (is_mplane()) {
+		fmt.fmt.pix_mp.width = width;
+		fmt.fmt.pix_mp.height = height;
+		fmt.fmt.pix_mp.pixelformat = coded;
+		fmt.fmt.pix_mp.num_planes = 1;
+		fmt.fmt.pix_mp.plane_fmt[0].sizeimage = sizeimage;
+	} else {
+		fmt.fmt.pix.width = width;
+		fmt.fmt.pix.height = height;
+		fmt.fmt.pix.pixelformat = coded;
+		fmt.fmt.pix.sizeimage = sizeimage;
+	}
+	if (xioctl(m_fd, VIDIOC_S_FMT, &fmt) == -1) {
+		const int result = -errno;
+		LOGE("VIDIOC_S_FMT(OUTPUT),errno=%d", -result);
+		RETURN(result, int);
+	}
+	// デコード後のピクセルフォーマットを要求する, 実際のフォーマットは解像度変更イベント後に確定する
+	fmt = { .type = cap_type };
+	if (is_mplane()) {
+		fmt.fmt.pix_mp.width = width;
+		fmt.fmt.pix_mp.height = height;
+		fmt.fmt.pix_mp.pixelformat = decoded_format;
+	} else {
+		fmt.fmt.pix.width = width;
+		fmt.fmt.pix.height = height;
+		fmt.fmt.pix.pixelformat = decoded_format;
+	}
+	if (xioctl(m_fd, VIDIOC_S_FMT, &fmt) == -1) {
+		LOGW("VIDIOC_S_FMT(CAPTURE),errno=%d", errno);
+	}
+
+	struct v4l2_event_subscription sub {
+		.type = V4L2_EVENT_SOURCE_CHANGE,
+	};
+	if (xioctl(m_fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1) {
+		LOGW("V4L2_EVENT_SOURCE_CHANGE not supported,errno=%d", errno);
+	}
+
+	struct v4l2_requestbuffers req {
+		.count = OUTPUT_BUFFER_NUMS,
+		.type = out_type,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	if ((xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) || !req.count) {
+		const int result = errno ? -errno : core::USB_ERROR_NO_MEM;
+		LOGE("VIDIOC_REQBUFS(OUTPUT),err=%d", result);
+		RETURN(result, int);
+	}
+	int result = init_buffers_locked(out_type, req.count, out_buffers, false);
+	if (UNLIKELY(result)) {
+		RETURN(result, int);
+	}
+	free_outputs.clear();
+	for (uint32_t i = 0; i < out_buffers.size(); i++) {
+		free_outputs.push_back(i);
+	}
+	auto type = (enum v4l2_buf_type)out_type;
+	if (xioctl(m_fd, VIDIOC_STREAMON, &type) == -1) {
+		result = -errno;
+		LOGE("VIDIOC_STREAMON(OUTPUT),errno=%d", -result);
+		RETURN(result, int);
+	}
+	result = setup_capture_locked();
+	if (LIKELY(!result)) {
+		current_coded = coded;
+		coded_width = width;
+		coded_height = height;
+		LOGI("decoder %s opened,%s(%ux%u)->%s(%ux%u)",
+			name.c_str(), V4L2_PIX_FMT_to_string(coded).c_str(), width, height,
+			V4L2_PIX_FMT_to_string(raw_frame_to_V4L2_PIX_FMT(decoded_frame_type)).c_str(),
+			decoded_width, decoded_height);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * ストリーミングを終了してデコーダーを閉じる
+ */
+/*private*/
+void V4L2DecoderPipeline::close_decoder_locked() {
+	ENTER();
+
+	if (m_fd > 0) {
+		auto type = (enum v4l2_buf_type)cap_type;
+		if (cap_streaming && (xioctl(m_fd, VIDIOC_STREAMOFF, &type) == -1)) {
+			LOGE("VIDIOC_STREAMOFF(CAPTURE),errno=%d", errno);
+		}
+		cap_streaming = false;
+		type = (enum v4l2_buf_type)out_type;
+		if (!out_buffers.empty() && (xioctl(m_fd, VIDIOC_STREAMOFF, &type) == -1)) {
+			LOGE("VIDIOC_STREAMOFF(OUTPUT),errno=%d", errno);
+		}
+		if (wait_lent_buffers_locked()) {
+			// 下流が保持しているバッファーはrelease_capture_lockedでmunmapせずに最後の参照が開放されるまで保持する
+			LOGW("lent buffers are not returned,defer release");
+		}
+		release_capture_locked();
+		release_buffers_locked(out_type, out_buffers);
+		::close(m_fd);
+		m_fd = 0;
+	}
+	cap_frames.clear();
+	cap_bytesused.clear();
+	free_outputs.clear();
+	decoder_name.clear();
+	current_coded = 0;
+	lent_nums = 0;
+
+	EXIT();
+}
+
+/**
+ * CAPTUREキューを(再)初期化してストリーミング開始する
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::setup_capture_locked() {
+	ENTER();
+
+	auto type = (enum v4l2_buf_type)cap_type;
+	if (cap_streaming) {
+		if (xioctl(m_fd, VIDIOC_STREAMOFF, &type) == -1) {
+			LOGE("VIDIOC_STREAMOFF(CAPTURE),errno=%d", errno);
+		}
+		cap_streaming = false;
+	}
+	// 下流が保持しているバッファーはmunmapできないので返却を待つ
+	if (wait_lent_buffers_locked()) {
+		// 返却されなかったバッファーはrelease_capture_lockedでmunmapせずに最後の参照が開放されるまで保持する
+		LOGW("lent buffers are not returned,defer release");
+	}
+	release_capture_locked();
+	cap_bytesused.clear();
+
+	struct v4l2_format fmt { .type = cap_type };
+	if (xioctl(m_fd, VIDIOC_G_FMT, &fmt) == -1) {
+		const int result = -errno;
+		LOGE("VIDIOC_G_FMT(CAPTURE),errno=%d", -result);
+		RETURN(result, int);
+	}
+	auto pixel_format = is_mplane() ? fmt.fmt.pix_mp.pixelformat : fmt.fmt.pix.pixelformat;
+	if (pixel_format != decoded_format) {
+		// 解像度変更イベントでデコーダーのデフォルトへ戻ったときは要求値を再設定してみる
+		if (is_mplane()) {
+			fmt.fmt.pix_mp.pixelformat = decoded_format;
+		} else {
+			fmt.fmt.pix.pixelformat = decoded_format;
+		}
+		if ((xioctl(m_fd, VIDIOC_S_FMT, &fmt) == -1)
+			|| (xioctl(m_fd, VIDIOC_G_FMT, &fmt) == -1)) {
+			LOGD("decoder does not support %s", V4L2_PIX_FMT_to_string(decoded_format).c_str());
+		}
+		pixel_format = is_mplane() ? fmt.fmt.pix_mp.pixelformat : fmt.fmt.pix.pixelformat;
+	}
+	decoded_frame_type = V4L2_PIX_FMT_to_raw_frame(pixel_format);
+	if (UNLIKELY((decoded_frame_type == core::RAW_FRAME_UNKNOWN)
+		|| (is_mplane() && (fmt.fmt.pix_mp.num_planes != 1)))) {
+		// 各プレーンが別バッファー(NV12M等)だとV4L2BufferFrameで渡せない
+		LOGE("unsupported decoded format %s", V4L2_PIX_FMT_to_string(pixel_format).c_str());
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	decoded_width = is_mplane() ? fmt.fmt.pix_mp.width : fmt.fmt.pix.width;
+	decoded_height = is_mplane() ? fmt.fmt.pix_mp.height : fmt.fmt.pix.height;
+
+	uint32_t count = CAPTURE_BUFFER_NUMS;
+	struct v4l2_control ctrl { .id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE };
+	if (xioctl(m_fd, VIDIOC_G_CTRL, &ctrl) != -1) {
+		// 参照フレームを保持するデコーダーは最小バッファー数が決まっている
+		count = std::max(count, (uint32_t)ctrl.value);
+	}
+	struct v4l2_requestbuffers req {
+		.count = count + max_lend_nums,
+		.type = cap_type,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	if ((xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) || !req.count) {
+		const int result = errno ? -errno : core::USB_ERROR_NO_MEM;
+		LOGE("VIDIOC_REQBUFS(CAPTURE),err=%d", result);
+		RETURN(result, int);
+	}
+	int result = init_buffers_locked(cap_type, req.count, cap_buffers, export_dmabuf);
+	if (UNLIKELY(result)) {
+		RETURN(result, int);
+	}
+	cap_bytesused.assign(cap_buffers.size(), 0);
+	for (uint32_t i = 0; i < cap_buffers.size(); i++) {
+		cap_frames.push_back(std::make_unique<V4L2BufferFrame>(i,
+			[this](V4L2BufferFrame &frame) { release_buffer(frame); }));
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf {
+			.index = i,
+			.type = cap_type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (is_mplane()) {
+			buf.m.planes = planes;
+			buf.length = 1;
+		}
+		if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_QBUF(CAPTURE),errno=%d", -result);
+			RETURN(result, int);
+		}
+	}
+	if (xioctl(m_fd, VIDIOC_STREAMON, &type) == -1) {
+		result = -errno;
+		LOGE("VIDIOC_STREAMON(CAPTURE),errno=%d", -result);
+		RETURN(result, int);
+	}
+	cap_streaming = true;
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * VIDIOC_REQBUFSで確保したバッファーをmmapする
+ * @param type
+ * @param count
+ * @param buffers
+ * @param exported VIDIOC_EXPBUFでdma-bufとしてエクスポートするかどうか
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::init_buffers_locked(const uint32_t &type, const uint32_t &count,
+	std::vector<buffer_t> &buffers, const bool &exported) {
+
+	ENTER();
+
+	const bool mplane = (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		|| (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	for (uint32_t i = 0; i < count; i++) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf {
+			.index = i,
+			.type = type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (mplane) {
+			buf.m.planes = planes;
+			buf.length = VIDEO_MAX_PLANES;
+		}
+		if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+			const int result = -errno;
+			LOGE("VIDIOC_QUERYBUF,errno=%d", -result);
+			RETURN(result, int);
+		}
+		buffer_t buffer{};
+		buffer.length = mplane ? planes[0].length : buf.length;
+		buffer.offset = mplane ? planes[0].m.mem_offset : buf.m.offset;
+		buffer.num_planes = 1;
+		buffer.start = mmap(nullptr, buffer.length,
+			PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, (off_t)buffer.offset);
+		if (buffer.start == MAP_FAILED) {
+			const int result = -errno;
+			LOGE("mmap,errno=%d", -result);
+			RETURN(result, int);
+		}
+		if (exported) {
+			struct v4l2_exportbuffer expbuf {
+				.type = type,
+				.index = i,
+				.plane = 0,
+				.flags = O_CLOEXEC | O_RDONLY,
+			};
+			if (xioctl(m_fd, VIDIOC_EXPBUF, &expbuf) != -1) {
+				buffer.fd = expbuf.fd;
+				buffer.dmabuf_sync = true;
+			} else {
+				LOGW("VIDIOC_EXPBUF,errno=%d", errno);
+			}
+		}
+		buffer.planes[0] = {
+			.fd = buffer.fd,
+			.start = buffer.start,
+			.offset = buffer.offset,
+			.length = buffer.length,
+		};
+		buffers.push_back(buffer);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * バッファーを開放してVIDIOC_REQBUFS(count=0)する
+ * @param type
+ * @param buffers
+ */
+/*private*/
+void V4L2DecoderPipeline::release_buffers_locked(const uint32_t &type, std::vector<buffer_t> &buffers) {
+	ENTER();
+
+	for (auto &buffer: buffers) {
+		if (buffer.start != MAP_FAILED) {
+			munmap(buffer.start, buffer.length);
+		}
+		if (buffer.fd > 0) {
+			::close(buffer.fd);
+		}
+	}
+	buffers.clear();
+	if (m_fd > 0) {
+		struct v4l2_requestbuffers req {
+			.count = 0,
+			.type = type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		xioctl(m_fd, VIDIOC_REQBUFS, &req);
+	}
+
+	EXIT();
+}
+
+/**
+ * CAPTUREキューのバッファーと貸し出し用のフレームを開放する
+ * 下流がまだ参照しているフレームはmunmapせずに最後の参照が開放されるまで保持する
+ */
+/*private*/
+void V4L2DecoderPipeline::release_capture_locked() {
+	ENTER();
+
+	// 返却済みの古い貸し出し用フレームを破棄する
+	orphan_frames.erase(std::remove_if(orphan_frames.begin(), orphan_frames.end(),
+		[](const V4L2BufferFrameUp &frame) { return !frame->is_lent(); }), orphan_frames.end());
+	// munmapするとデコーダー側のバッファーも開放されて下流が開放済みのメモリーへアクセスしてしまうので
+	// 下流がまだ参照しているフレームはmmap領域とdma-bufを引き取らせて最後の参照が開放されるまで保持する
+	for (auto &frame: cap_frames) {
+		if (frame && frame->is_lent()) {
+			const auto ix = frame->index();
+			if (ix < cap_buffers.size()) {
+				auto &buffer = cap_buffers[ix];
+				frame->orphan(buffer.start, buffer.length, buffer.fd);
+				buffer.start = MAP_FAILED;
+				buffer.fd = 0;
+			} else {
+				frame->orphan(MAP_FAILED, 0, 0);
+			}
+			orphan_frames.push_back(std::move(frame));
+		}
+	}
+	cap_frames.clear();
+	release_buffers_locked(cap_type, cap_buffers);
+
+	EXIT();
+}
+
+/**
+ * デコード済みの(空いた)OUTPUTキューのバッファーを取り出す
+ */
+/*private*/
+void V4L2DecoderPipeline::reclaim_outputs_locked() {
+	ENTER();
+
+	for ( ; ; ) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf {
+			.type = out_type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (is_mplane()) {
+			buf.m.planes = planes;
+			buf.length = VIDEO_MAX_PLANES;
+		}
+		if (xioctl(m_fd, VIDIOC_DQBUF, &buf) == -1) {
+			break;
+		}
+		if (LIKELY(buf.index < out_buffers.size())) {
+			free_outputs.push_back(buf.index);
+		}
+	}
+
+	EXIT();
+}
+
+/**
+ * 圧縮映像をOUTPUTキューへ入れる
+ * @param frame
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::queue_output_locked(const core::BaseVideoFrame &frame) {
+	ENTER();
+
+	reclaim_outputs_locked();
+	if (free_outputs.empty()) {
+		// デコーダーが圧縮映像を処理し終わるのを待つ
+		struct pollfd fds { .fd = m_fd, .events = POLLOUT };
+		if (poll(&fds, 1, DECODE_TIMEOUT_MS) > 0) {
+			reclaim_outputs_locked();
+		}
+		if (free_outputs.empty()) {
+			LOGW("decoder is busy, drop frame");
+			RETURN(core::USB_ERROR_TIMEOUT, int);
+		}
+	}
+	const auto index = free_outputs.back();
+	auto &buffer = out_buffers[index];
+	const size_t bytes = frame.size();
+	if (UNLIKELY(bytes > buffer.length)) {
+		LOGW("frame too large for decoder,bytes=%" FMT_SIZE_T ",length=%" FMT_SIZE_T, bytes, buffer.length);
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	memcpy(buffer.start, frame.frame(), bytes);
+
+	struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+	struct v4l2_buffer buf {
+		.index = index,
+		.type = out_type,
+		.bytesused = (uint32_t)bytes,
+		.field = V4L2_FIELD_NONE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	// デコーダーはOUTPUTのタイムスタンプをCAPTUREへコピーするのでPTSを渡す
+	const nsecs_t pts_us = frame.presentation_time_us();
+	buf.timestamp.tv_sec = (time_t)(pts_us / 1000000);
+	buf.timestamp.tv_usec = (suseconds_t)(pts_us % 1000000);
+	if (is_mplane()) {
+		planes[0].bytesused = (uint32_t)bytes;
+		planes[0].length = (uint32_t)buffer.length;
+		buf.m.planes = planes;
+		buf.length = 1;
+	}
+	if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+		const int result = -errno;
+		LOGE("VIDIOC_QBUF(OUTPUT),errno=%d", -result);
+		RETURN(result, int);
+	}
+	free_outputs.pop_back();
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * デコードした映像をCAPTUREキューから取り出す
+ * 取り出せるものが無いときはデコードが終わるまで待機する
+ * @param decoded 取り出したバッファーのスナップショット
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::dequeue_capture_locked(std::vector<decoded_buffer_t> &decoded) {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+	const nsecs_t deadline = systemTime() + ms2ns(DECODE_TIMEOUT_MS);
+	for ( ; ; ) {
+		// 準備できているデコード済み映像を全て取り出す
+		for ( ; cap_streaming ; ) {
+			struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+			struct v4l2_buffer buf {
+				.type = cap_type,
+				.memory = V4L2_MEMORY_MMAP,
+			};
+			if (is_mplane()) {
+				buf.m.planes = planes;
+				buf.length = VIDEO_MAX_PLANES;
+			}
+			if (xioctl(m_fd, VIDIOC_DQBUF, &buf) == -1) {
+				// EAGAINなら取り出し終わった, EPIPEならV4L2_BUF_FLAG_LASTの後
+				break;
+			}
+			const uint32_t bytes = is_mplane() ? planes[0].bytesused : buf.bytesused;
+			if (UNLIKELY((buf.index >= cap_buffers.size())
+				|| (buf.flags & V4L2_BUF_FLAG_ERROR) || !bytes)) {
+				// デコードに失敗した・空のバッファーはすぐにデコーダーへ戻す
+				if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+					LOGE("VIDIOC_QBUF(CAPTURE),errno=%d", errno);
+				}
+				continue;
+			}
+			update_buffer_info(cap_buffers[buf.index], buf);
+			cap_bytesused[buf.index] = bytes;
+			decoded.push_back(decoded_buffer_t {
+				.index = buf.index,
+				.frame = cap_frames[buf.index].get(),
+				.buffer = cap_buffers[buf.index],
+				.bytesused = bytes,
+				.width = decoded_width,
+				.height = decoded_height,
+				.frame_type = decoded_frame_type,
+			});
+			lent_nums++;
+			cap_frames[buf.index]->set_lent(true);
+		}
+		if (!decoded.empty()) {
+			break;
+		}
+		const auto remain_ms = (int)ns2ms(deadline - systemTime());
+		if (remain_ms <= 0) {
+			// 参照フレームの並べ替え等ですぐに出てこないときは次の映像で取り出す
+			break;
+		}
+		struct pollfd fds { .fd = m_fd, .events = POLLIN | POLLOUT | POLLPRI };
+		const int r = poll(&fds, 1, remain_ms);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			result = -errno;
+			LOGE("poll,errno=%d", -result);
+			break;
+		} else if (!r) {
+			break;
+		}
+		if (fds.revents & POLLPRI) {
+			result = handle_events_locked();
+			if (UNLIKELY(result)) {
+				break;
+			}
+		}
+		if ((fds.revents & POLLOUT) && !(fds.revents & POLLIN)) {
+			// 圧縮映像は処理されたがデコード済み映像がまだ無い
+			reclaim_outputs_locked();
+			if (free_outputs.size() == out_buffers.size()) {
+				break;
+			}
+		}
+		if (fds.revents & POLLERR) {
+			result = core::USB_ERROR_IO;
+			LOGE("decoder error");
+			break;
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * デコーダーからのイベントを処理する
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::handle_events_locked() {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+	for ( ; ; ) {
+		struct v4l2_event event{};
+		if (xioctl(m_fd, VIDIOC_DQEVENT, &event) == -1) {
+			break;
+		}
+		if ((event.type == V4L2_EVENT_SOURCE_CHANGE)
+			&& (event.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION)) {
+			// 映像ヘッダーを解析して解像度が確定した・変わったのでCAPTUREキューを作り直す
+			LOGD("source changed");
+			result = setup_capture_locked();
+			if (UNLIKELY(result)) {
+				break;
+			}
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * デコードした映像をコピーせずに次のパイプラインへ渡す
+ * decoder_lockを保持せずに呼び出す
+ * @param decoded dequeue_capture_lockedで取得したスナップショット
+ * @return
+ */
+/*private*/
+int V4L2DecoderPipeline::lend_frame(const decoded_buffer_t &decoded) {
+	ENTER();
+
+	// 別スレッドの#stopでcap_frames等がクリアされても貸し出し中のフレームは
+	// orphan_framesに残るのでスナップショットのポインタは最後の参照を開放するまで有効
+	auto &frame = *decoded.frame;
+	const auto &buffer = decoded.buffer;
+	bool lendable;
+	decoder_lock.lock();
+	{
+		// 下流がこのバッファーを保持してもデコーダー側に
+		// MIN_QUEUED_BUFFERS個以上のバッファーが残るときだけ貸し出しを許可する
+		lendable = (lent_nums <= max_lend_nums)
+			&& (cap_buffers.size() >= lent_nums + MIN_QUEUED_BUFFERS);
+	}
+	decoder_lock.unlock();
+	int result = frame.assign(
+		static_cast<uint8_t *>(buffer.start), buffer.length, decoded.bytesused,
+		decoded.width, decoded.height, decoded.frame_type,
+		lendable);
+	if (LIKELY(!result)) {
+		set_frame_attribute(frame, buffer);
+		hw_frames++;
+		result = chain_frame(&frame);
+	} else {
+		LOGW("failed to assign buffer,index=%d,err=%d", decoded.index, result);
+	}
+	// 自分の参照を開放する, 下流が参照を保持していなければここでVIDIOC_QBUFされる
+	frame.release();
+
+	RETURN(result, int);
+}
+
+/**
+ * 貸し出したバッファーの最後の参照が開放されたときの処理
+ * 任意のスレッドから呼ばれる
+ * @param frame
+ */
+/*private*/
+void V4L2DecoderPipeline::release_buffer(V4L2BufferFrame &frame) {
+	ENTER();
+
+	AutoMutex lock(decoder_lock);
+	frame.set_lent(false);
+	if (frame.is_orphan()) {
+		// CAPTUREキューは開放済みなので遅延していたmunmapとdma-bufのクローズだけを行う
+		// 同じインデックスのバッファーは作り直した別のバッファーなのでVIDIOC_QBUFしてはだめ
+		frame.release_orphan();
+		lend_sync.broadcast();
+		EXIT();
+	}
+	// ストリーム停止後はVIDIOC_STREAMOFFでデコーダー側のキューがクリアされているので返却しない
+	if (cap_streaming && (frame.index() < cap_buffers.size())) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf {
+			.index = frame.index(),
+			.type = cap_type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (is_mplane()) {
+			buf.m.planes = planes;
+			buf.length = 1;
+		}
+		if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+			LOGE("VIDIOC_QBUF(CAPTURE),errno=%d", errno);
+		}
+	}
+	if (LIKELY(lent_nums > 0)) {
+		lent_nums--;
+	}
+	lend_sync.broadcast();
+
+	EXIT();
+}
+
+/**
+ * 貸し出したバッファーが全て返却されるまで待機する
+ * @return 0: 全て返却された, 0以外: タイムアウト
+ */
+/*private*/
+int V4L2DecoderPipeline::wait_lent_buffers_locked() {
+	ENTER();
+
+	const nsecs_t deadline = systemTime() + MAX_WAIT_LENT_BUFFERS_NS;
+	for (auto &frame: cap_frames) {
+		for ( ; frame->is_lent() ; ) {
+			const nsecs_t remain = deadline - systemTime();
+			if (remain <= 0) {
+				LOGW("timeout waiting lent buffer,index=%d,ref_count=%d",
+					frame->index(), frame->ref_count());
+				RETURN(core::USB_ERROR_TIMEOUT, int);
+			}
+			lend_sync.waitRelative(decoder_lock, remain);
+		}
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+}	// namespace serenegiant::v4l2::pipeline
@@ -0,0 +1,371 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_PIPELINE_V4L2_DECODER_H
+#define AANDUSB_PIPELINE_V4L2_DECODER_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+// common
+#include "mutex.h"
+#include "condition.h"
+// core
+#include "core/video_converter.h"
+#include "core/video_frame_base.h"
+// pipeline
+#include "pipeline/pipeline_base.h"
+// v4l2
+#include "v4l2/v4l2.h"
+#include "v4l2/v4l2_buffer_frame.h"
+
+namespace sere_pipeline = serenegiant::pipeline;
+
+namespace serenegiant::v4l2::pipeline {
+
+/**
+ * 下流のパイプラインへ同時に貸し出すことができるデコード済みバッファー数のデフォルト値
+ */
+#define DEFAULT_DECODER_MAX_LEND_NUMS (2)
+
+/**
+ * 前のパイプラインから受け取った圧縮映像(MJPEG/H264/VP8等)を
+ * v4l2のmem2memデコーダー(stateful decoder, OUTPUT/CAPTUREキュー)でデコードして
+ * 次のパイプラインへ渡すためのパイプライン
+ * デコードした映像はCAPTUREキューのバッファーをコピーせずにV4L2BufferFrameとして貸し出す
+ * (set_export_dmabufを有効にするとVIDIOC_EXPBUFでエクスポートしたdma-bufも取得できる)
+ * デコーダーが無い・対応していない・オープンできないときは
+ * MJPEGならVideoConverter(libjpeg-turbo)でデコードし、それ以外はそのまま次のパイプラインへ渡す
+ * 圧縮されていない映像はそのまま次のパイプラインへ渡す
+ * デコードは#queue_frameを呼び出したスレッド上で行う
+ */
+class V4L2DecoderPipeline : virtual public sere_pipeline::IPipeline {
+private:
+	/**
+	 * CAPTUREキューから取り出したデコード済み映像のスナップショット
+	 * decoder_lockの外で下流へ貸し出すときに別スレッドの#stop等で
+	 * cap_frames/cap_buffers/cap_bytesusedが変更されても影響を受けないように
+	 * decoder_lockを保持している間に取得しておく
+	 * (貸し出し中のV4L2BufferFrameはCAPTUREキューを開放してもorphan_framesに残る)
+	 */
+	typedef struct decoded_buffer {
+		uint32_t index;
+		V4L2BufferFrame *frame;
+		buffer_t buffer;
+		uint32_t bytesused;
+		uint32_t width, height;
+		core::raw_frame_t frame_type;
+	} decoded_buffer_t;
+	/**
+	 * デコーダーのデバイスファイル名, 空なら映像のフォーマットに対応しているものを探す
+	 */
+	const std::string device_name;
+	/**
+	 * デコード後のピクセルフォーマット要求値
+	 */
+	const uint32_t decoded_format;
+	/**
+	 * 下流のパイプラインが同時に保持できるバッファーの最大数
+	 */
+	const uint32_t max_lend_nums;
+	mutable Mutex decoder_lock;
+	/**
+	 * 貸し出したバッファーの返却待ち用
+	 */
+	Condition lend_sync;
+	/**
+	 * デコーダーのファイルディスクリプタ
+	 */
+	int m_fd;
+	/**
+	 * 現在オープンしているデコーダーのデバイスファイル名
+	 */
+	std::string decoder_name;
+	/**
+	 * 強制的にデコーダーへ渡すときの圧縮フォーマット, 0なら映像のフレームタイプから決める
+	 */
+	uint32_t coded_format;
+	/**
+	 * CAPTUREキューのバッファーをVIDIOC_EXPBUFでdma-bufとしてエクスポートするかどうか
+	 */
+	bool export_dmabuf;
+	/**
+	 * OUTPUT/CAPTUREキューのv4l2_buf_type(マルチプレーン対応のデコーダーならV4L2_BUF_TYPE_xxx_MPLANE)
+	 */
+	uint32_t out_type, cap_type;
+	/**
+	 * デコーダーへ設定した圧縮フォーマットと映像サイズ, current_codedが0ならデコーダー未設定
+	 */
+	uint32_t current_coded;
+	uint32_t coded_width, coded_height;
+	/**
+	 * デコーダーを使えなかった圧縮フォーマットと映像サイズ
+	 * 同じ映像でフレーム毎にデコーダーのオープンを試みないようにするため
+	 */
+	uint32_t failed_coded;
+	uint32_t failed_width, failed_height;
+	/**
+	 * デコード後の映像サイズとフレームタイプ
+	 */
+	uint32_t decoded_width, decoded_height;
+	core::raw_frame_t decoded_frame_type;
+	/**
+	 * OUTPUTキューのバッファー
+	 */
+	std::vector<buffer_t> out_buffers;
+	/**
+	 * デコーダーから返却された(空いている)OUTPUTキューのバッファーのインデックス
+	 */
+	std::vector<uint32_t> free_outputs;
+	/**
+	 * CAPTUREキューのバッファー
+	 */
+	std::vector<buffer_t> cap_buffers;
+	/**
+	 * CAPTUREキューのバッファーを下流へ貸し出すためのV4L2BufferFrame
+	 */
+	std::vector<V4L2BufferFrameUp> cap_frames;
+	/**
+	 * CAPTUREキューを開放したときにまだ下流が参照していた貸し出し用のフレーム
+	 * mmap領域とdma-bufは最後の参照が開放されたときにrelease_bufferで開放する
+	 * decoder_lockで保護する
+	 */
+	std::vector<V4L2BufferFrameUp> orphan_frames;
+	/**
+	 * CAPTUREキューの各バッファーのデコード済み映像のバイト数
+	 */
+	std::vector<uint32_t> cap_bytesused;
+	/**
+	 * CAPTUREキューをストリーミング中かどうか
+	 */
+	bool cap_streaming;
+	/**
+	 * 下流へ貸し出し中のバッファー数
+	 */
+	uint32_t lent_nums;
+	/**
+	 * CPUでデコードするとき用
+	 */
+	core::VideoConverter converter;
+	core::BaseVideoFrame work;
+	/**
+	 * CPUでデコードするときのフレームタイプ
+	 */
+	core::raw_frame_t sw_frame_type;
+	/**
+	 * デコーダー/CPUでデコードしたフレーム数
+	 */
+	std::atomic<uint64_t> hw_frames;
+	std::atomic<uint64_t> sw_frames;
+
+	/**
+	 * 映像のフレームタイプからデコーダーへ渡すv4l2ピクセルフォーマットを取得する
+	 * @param frame_type
+	 * @return 圧縮フォーマットでなければ0
+	 */
+	static uint32_t get_coded_format(const core::raw_frame_t &frame_type);
+	/**
+	 * 指定した圧縮フォーマットをデコードできるmem2memデコーダーかどうかを確認する
+	 * @param fd
+	 * @param out_type
+	 * @param coded
+	 * @return
+	 */
+	static bool is_decoder(int fd, const uint32_t &out_type, const uint32_t &coded);
+	/**
+	 * /dev/videoNを順に調べて指定した圧縮フォーマットをデコードできるmem2memデコーダーを探す
+	 * @param coded
+	 * @return 見つからなければ空文字列
+	 */
+	static std::string find_decoder(const uint32_t &coded);
+
+	/**
+	 * 映像をデコーダーでデコードして次のパイプラインへ渡す
+	 * @param frame
+	 * @param coded
+	 * @return core::USB_ERROR_NOT_SUPPORTEDならCPUでデコードすること
+	 */
+	int decode_hw(core::BaseVideoFrame &frame, const uint32_t &coded);
+	/**
+	 * 映像をCPUでデコードして次のパイプラインへ渡す
+	 * MJPEG以外はそのまま次のパイプラインへ渡す
+	 * @param frame
+	 * @return
+	 */
+	int decode_sw(core::BaseVideoFrame &frame);
+	/**
+	 * 必要であればデコーダーをオープン・再設定する
+	 * @param coded
+	 * @param width
+	 * @param height
+	 * @param bytes
+	 * @return core::USB_ERROR_NOT_SUPPORTEDならデコーダーを使えない
+	 */
+	int prepare_decoder_locked(
+		const uint32_t &coded,
+		const uint32_t &width, const uint32_t &height, const size_t &bytes);
+	/**
+	 * デコーダーをオープンしてOUTPUT/CAPTUREキューを初期化・ストリーミング開始する
+	 * @param coded
+	 * @param width
+	 * @param height
+	 * @param bytes
+	 * @return
+	 */
+	int open_decoder_locked(
+		const uint32_t &coded,
+		const uint32_t &width, const uint32_t &height, const size_t &bytes);
+	/**
+	 * ストリーミングを終了してデコーダーを閉じる
+	 */
+	void close_decoder_locked();
+	/**
+	 * CAPTUREキューを(再)初期化してストリーミング開始する
+	 * 最初と解像度変更イベント(V4L2_EVENT_SOURCE_CHANGE)を受け取ったときに呼ぶ
+	 * @return
+	 */
+	int setup_capture_locked();
+	/**
+	 * VIDIOC_REQBUFSで確保したバッファーをmmapする
+	 * @param type
+	 * @param count
+	 * @param buffers
+	 * @param exported VIDIOC_EXPBUFでdma-bufとしてエクスポートするかどうか
+	 * @return
+	 */
+	int init_buffers_locked(const uint32_t &type, const uint32_t &count,
+		std::vector<buffer_t> &buffers, const bool &exported);
+	/**
+	 * バッファーを開放してVIDIOC_REQBUFS(count=0)する
+	 * @param type
+	 * @param buffers
+	 */
+	void release_buffers_locked(const uint32_t &type, std::vector<buffer_t> &buffers);
+	/**
+	 * CAPTUREキューのバッファーと貸し出し用のフレームを開放する
+	 * 下流がまだ参照しているフレームはmunmapせずに最後の参照が開放されるまで保持する
+	 */
+	void release_capture_locked();
+	/**
+	 * デコード済みの(空いた)OUTPUTキューのバッファーを取り出す
+	 */
+	void reclaim_outputs_locked();
+	/**
+	 * 圧縮映像をOUTPUTキューへ入れる
+	 * @param frame
+	 * @return
+	 */
+	int queue_output_locked(const core::BaseVideoFrame &frame);
+	/**
+	 * デコードした映像をCAPTUREキューから取り出す
+	 * 取り出せるものが無いときはデコードが終わるまで待機する
+	 * @param decoded 取り出したバッファーのスナップショット
+	 * @return
+	 */
+	int dequeue_capture_locked(std::vector<decoded_buffer_t> &decoded);
+	/**
+	 * デコーダーからのイベントを処理する
+	 * @return
+	 */
+	int handle_events_locked();
+	/**
+	 * デコードした映像をコピーせずに次のパイプラインへ渡す
+	 * decoder_lockを保持せずに呼び出す
+	 * @param decoded dequeue_capture_lockedで取得したスナップショット
+	 * @return
+	 */
+	int lend_frame(const decoded_buffer_t &decoded);
+	/**
+	 * 貸し出したバッファーの最後の参照が開放されたときの処理
+	 * 任意のスレッドから呼ばれる
+	 * @param frame
+	 */
+	void release_buffer(V4L2BufferFrame &frame);
+	/**
+	 * 貸し出したバッファーが全て返却されるまで待機する
+	 * @return 0: 全て返却された, 0以外: タイムアウト
+	 */
+	int wait_lent_buffers_locked();
+	inline bool is_mplane() const {
+		return cap_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	}
+public:
+	/**
+	 * コンストラクタ
+	 * @param device_name デコーダーのデバイスファイル名, 空なら映像のフォーマットに対応しているものを探す
+	 * @param decoded_format デコード後のピクセルフォーマット要求値,
+	 *                       デコーダーが対応していなければデコーダーのデフォルトを使う
+	 * @param max_lend_nums 下流のパイプラインが同時に保持できるバッファーの最大数
+	 */
+	explicit V4L2DecoderPipeline(
+		std::string device_name = "",
+		const uint32_t &decoded_format = V4L2_PIX_FMT_NV12,
+		const uint32_t &max_lend_nums = DEFAULT_DECODER_MAX_LEND_NUMS);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4L2DecoderPipeline();
+
+	// IPipelineの純粋仮想関数
+	virtual int start() override;
+	virtual int stop() override;
+	virtual int queue_frame(core::BaseVideoFrame *frame) override;
+
+	/**
+	 * 映像のフレームタイプに関係なく指定した圧縮フォーマットとしてデコーダーへ渡すように設定する
+	 * v4l2_pix_formatにしか無い圧縮フォーマット(vicodecのV4L2_PIX_FMT_FWHT等)を使うとき用
+	 * 開始前のみ変更可能
+	 * @param coded 圧縮フォーマット, 0なら映像のフレームタイプから決める
+	 * @return
+	 */
+	int set_coded_format(const uint32_t &coded);
+	/**
+	 * デコードした映像のバッファーをVIDIOC_EXPBUFでdma-bufとしてエクスポートするかどうかを設定する
+	 * 開始前のみ変更可能
+	 * @param enable
+	 * @return
+	 */
+	int set_export_dmabuf(const bool &enable);
+	/**
+	 * デコーダーで映像をデコードしているかどうか
+	 * @return
+	 */
+	bool is_hw_decoding() const;
+	/**
+	 * 現在オープンしているデコーダーのデバイスファイル名を取得
+	 * @return オープンしていなければ空文字列
+	 */
+	std::string get_decoder_name() const;
+	/**
+	 * 次のパイプラインへ渡したV4L2BufferFrameのdma-bufのファイルディスクリプタを取得する
+	 * 次のパイプラインの#queue_frame内またはV4L2BufferFrame::retainで保持している間だけ有効
+	 * @param frame
+	 * @return set_export_dmabufが無効・このパイプラインのフレームでなければ負
+	 */
+	int get_dmabuf_fd(const V4L2BufferFrame &frame) const;
+	/**
+	 * デコーダーでデコードしたフレーム数を取得
+	 * @return
+	 */
+	inline uint64_t get_hw_frames() const { return hw_frames.load(); };
+	/**
+	 * CPUでデコードしたフレーム数を取得
+	 * @return
+	 */
+	inline uint64_t get_sw_frames() const { return sw_frames.load(); };
+};
+
+typedef std::unique_ptr<V4L2DecoderPipeline> V4L2DecoderPipelineUp;
+typedef std::shared_ptr<V4L2DecoderPipeline> V4L2DecoderPipelineSp;
+
+}	// namespace serenegiant::v4l2::pipeline
+
+#endif //AANDUSB_PIPELINE_V4L2_DECODER_H
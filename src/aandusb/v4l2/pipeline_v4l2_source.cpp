@@ -65,6 +65,14 @@ namespace serenegiant::v4l2::pipeline {
  * 映像データ最大待ち時間
  */
 #define MAX_WAIT_FRAME_US (100000L)
+/**
+ * バッファーを下流へ貸し出すときに最低限v4l2機器側へ残しておくバッファー数
+ */
+#define MIN_QUEUED_BUFFERS (2)
+/**
+ * 貸し出したバッファーの返却を待つ最大時間
+ */
+#define MAX_WAIT_LENT_BUFFERS_NS (1000000000LL)
 
 #if MEAS_TIME
 #define MEAS_TIME_INIT static nsecs_t _meas_time_ = 0;\
@@ -108,7 +116,13 @@ V4L2SourcePipeline::V4L2SourcePipeline(std::string device_name)
 	stream_width(DEFAULT_PREVIEW_WIDTH), stream_height(DEFAULT_PREVIEW_HEIGHT), image_bytes(0),
 	stream_frame_type(core::RAW_FRAME_UNKNOWN), stream_fps(0.0f),
 	m_buffers(nullptr), m_buffersNums(0),
-	v4l2_thread()
+	v4l2_thread(),
+	lending(false), max_lend_nums(DEFAULT_MAX_LEND_NUMS), lent_nums(0),
+	last_sequence(-1), dropped_frames(0),
+	lend_frames(), orphan_frames(),
+	userptr(false), userptr_pool(), userptr_frames(),
+	reactor(), reactor_frame(),
+	cap_cache(), caps()
 {
 	ENTER();
 	EXIT();
@@ -147,7 +161,13 @@ int V4L2SourcePipeline::open() {
 				result = core::USB_SUCCESS;
 				m_fd = fd;
 				m_state = STATE_OPEN;
-				update_ctrl_all_locked(fd, supported);
+				caps = cap_cache ? cap_cache->get(fd) : nullptr;
+				if (caps) {
+					// キャッシュがあればVIDIOC_QUERYCTRLで列挙しない
+					supported = caps->ctrls;
+				} else {
+					update_ctrl_all_locked(fd, supported);
+				}
 			} else {
 				// ::openの返り値が負(-1)の時はオープンできていない
 				result = -errno;
@@ -178,6 +198,7 @@ int V4L2SourcePipeline::close() {
 	v4l2_lock.lock();
 	{
 		supported.clear();
+		caps.reset();
 		// v4l2機器をクローズ
 		if (m_fd) {
 			result = ::close(m_fd);
@@ -216,9 +237,18 @@ int V4L2SourcePipeline::start() {
 		bool b = set_running(true);
 		if (!b) {
 			set_state(sere_pipeline::PIPELINE_STATE_STARTING);
-			LOGD("映像取得用のワーカースレッドを開始");
-			// 実際のイベントハンドラで初期化したthread型一時オブジェクトをムーブ代入
-			v4l2_thread = std::thread([this] { v4l2_thread_func(); });
+			if (reactor) {
+				LOGD("V4l2Reactorへ登録");
+				result = reactor->attach(this);
+				if (UNLIKELY(result)) {
+					set_running(false);
+					set_state(sere_pipeline::PIPELINE_STATE_INITIALIZED);
+				}
+			} else {
+				LOGD("映像取得用のワーカースレッドを開始");
+				// 実際のイベントハンドラで初期化したthread型一時オブジェクトをムーブ代入
+				v4l2_thread = std::thread([this] { v4l2_thread_func(); });
+			}
 		}
 	} else {
 		LOGD("Illegal state: not opened");
@@ -247,23 +277,10 @@ std::string V4L2SourcePipeline::get_supported_size() const {
 	std::vector<FormatInfoSp> formats;
 
 	AutoMutex lock(v4l2_lock);
-	if (m_state > STATE_CLOSE) {
-		int r = 0;
-		for (int i = 0 ; r != -1; i++) {
-			struct v4l2_fmtdesc fmt {
-				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			};
-			fmt.index = i;
-			r = xioctl(m_fd, VIDIOC_ENUM_FMT, &fmt);
-			if (r != -1) {
-				LOGV("%i)%s(%s)", fmt.index,
-					V4L2_PIX_FMT_to_string(fmt.pixelformat).c_str(),
-					fmt.description);
-				auto format = std::make_shared<format_info_t>(i, fmt.pixelformat);
-				get_supported_frame_size(m_fd, format);
-				formats.push_back(format);
-			}
-		}
+	if (caps) {
+		formats = caps->formats;
+	} else if (m_state > STATE_CLOSE) {
+		get_supported_formats(m_fd, formats);
 	}
 	// jsonへの出力
 	char buf[128];
@@ -344,41 +361,43 @@ int V4L2SourcePipeline::find_stream(
 			capture_format.fmt.pix.pixelformat, V4L2_PIX_FMT_to_string(capture_format.fmt.pix.pixelformat).c_str(),
 			capture_format.fmt.pix.field);
 
-		int r = 0;
-		for (int i = 0 ; result && (r != -1); i++) {
-			struct v4l2_fmtdesc fmt {
-				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			};
-			fmt.index = i;
-			r = xioctl(m_fd, VIDIOC_ENUM_FMT, &fmt);
-			if (r != -1) {
-				const auto pxl_fmt = fmt.pixelformat;
-				LOGD("%i)0x%08x=%s(%s)", fmt.index,
-					pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str(),
-					fmt.description);
-				if (!_pixel_format || (_pixel_format == pxl_fmt)) {
-					// ピクセルフォーマットが一致したとき
-					pixel_format = pxl_fmt;	// 最後に一致したピクセルフォーマットをセット
-					LOGD("found pixel format, try find video size");
-					result = find_frame_size(m_fd, pxl_fmt, width, height, min_fps, max_fps);
-					// XXX VIDIOC_ENUM_FRAMESIZESが常にエラーを返してfind_frame_sizeで判断できないV4L2機器があるので
-					//     デフォルトのキャプチャーフォーマットと一致すればOKとする
-					if (result && (capture_format.fmt.pix.pixelformat == pxl_fmt)
-						&& (capture_format.fmt.pix.width == width) && (capture_format.fmt.pix.height == height)) {
-						result = 0;
-					}
+		std::vector<FormatInfoSp> formats;
+		if (caps) {
+			formats = caps->formats;
+		} else {
+			// 解像度・フレームレートはピクセルフォーマットが一致したときだけfind_frame_sizeで確認する
+			get_supported_formats(m_fd, formats, false);
+		}
+		for (auto itr = formats.begin(); result && (itr != formats.end()); itr++) {
+			const auto &format = *itr;
+			const auto pxl_fmt = format->pixel_format;
+			LOGD("%i)0x%08x=%s", format->index,
+				pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str());
+			if (!_pixel_format || (_pixel_format == pxl_fmt)) {
+				// ピクセルフォーマットが一致したとき
+				pixel_format = pxl_fmt;	// 最後に一致したピクセルフォーマットをセット
+				LOGD("found pixel format, try find video size");
+				// キャッシュに離散値の解像度が無いときはv4l2機器へ問い合わせる
+				result = !format->frames.empty()
+					? find_frame_size(format->frames, width, height, min_fps, max_fps)
+					: find_frame_size(m_fd, pxl_fmt, width, height, min_fps, max_fps);
+				// XXX VIDIOC_ENUM_FRAMESIZESが常にエラーを返してfind_frame_sizeで判断できないV4L2機器があるので
+				//     デフォルトのキャプチャーフォーマットと一致すればOKとする
+				if (result && (capture_format.fmt.pix.pixelformat == pxl_fmt)
+					&& (capture_format.fmt.pix.width == width) && (capture_format.fmt.pix.height == height)) {
+					result = 0;
 				}
-				if (!result) {
-					if (!request_pixel_format) {
-						request_pixel_format = pxl_fmt;
-					}
-					if (!stream_pixel_format) {
-						stream_pixel_format = pxl_fmt;
-					}
-					LOGD("%i)0x%08x=%s(%s),sz(%dx%d)", fmt.index,
-						pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str(),
-						fmt.description, width, height);
+			}
+			if (!result) {
+				if (!request_pixel_format) {
+					request_pixel_format = pxl_fmt;
 				}
+				if (!stream_pixel_format) {
+					stream_pixel_format = pxl_fmt;
+				}
+				LOGD("%i)0x%08x=%s,sz(%dx%d)", format->index,
+					pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str(),
+					width, height);
 			}
 		}
 
@@ -410,11 +429,109 @@ int V4L2SourcePipeline::resize(
 		request_height = height;
 		request_pixel_format = format;
 		request_resize = true;
+		if (reactor) {
+			// V4l2Reactorのワーカースレッドを起こして解像度変更させる
+			reactor->wakeup();
+		}
 	}
 
 	RETURN(core::USB_SUCCESS, int);
 }
 
+/**
+ * 映像受け取りバッファーをコピーせずに下流へ貸し出すかどうかを設定
+ * 映像取得開始前(ストリーム停止中)のみ変更可能
+ * @param enable
+ * @param max_lend_nums 下流のパイプラインが同時に保持できるバッファーの最大数
+ * @return
+ */
+/*public*/
+int V4L2SourcePipeline::set_lending(const bool &enable, const uint32_t &_max_lend_nums) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(v4l2_lock);
+	if (!is_running() && (m_state <= STATE_OPEN)) {
+		lending = enable;
+		max_lend_nums = _max_lend_nums;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * V4L2_MEMORY_USERPTRでフレームプールから取得したフレームのバッファーへ直接映像を受け取るかどうかを設定
+ * 映像取得開始前(ストリーム停止中)のみ変更可能
+ * @param enable
+ * @return
+ */
+/*public*/
+int V4L2SourcePipeline::set_userptr(const bool &enable) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(v4l2_lock);
+	if (!is_running() && (m_state <= STATE_OPEN)) {
+		userptr = enable;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 専用ワーカースレッドの代わりにV4l2Reactorのワーカースレッド上で映像取得するように設定する
+ * 映像取得開始前(ストリーム停止中)のみ変更可能
+ * @param reactor nullptrなら専用ワーカースレッドを使う
+ * @return
+ */
+/*public*/
+int V4L2SourcePipeline::set_reactor(V4l2ReactorSp _reactor) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(v4l2_lock);
+	if (!is_running() && (m_state <= STATE_OPEN)) {
+		reactor = std::move(_reactor);
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 対応ピクセルフォーマット・解像度・フレームレート・コントロール機能のキャッシュを設定する
+ * オープン前のみ変更可能
+ * @param cache nullptrならキャッシュを使わない
+ * @return
+ */
+/*public*/
+int V4L2SourcePipeline::set_cap_cache(V4l2CapCacheSp cache) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(v4l2_lock);
+	if (m_state == STATE_CLOSE) {
+		cap_cache = std::move(cache);
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already opened,state=%d", m_state);
+	}
+
+	RETURN(result, int);
+}
+
 /**
  * IPipelineの純粋仮想関数
  * @param frame
@@ -454,6 +571,36 @@ void V4L2SourcePipeline::v4l2_thread_func() {
 	if (!is_running()) return;
 
 	LOGD("映像処理スレッド開始");
+	result = internal_start_stream();
+
+	LOGD("映像取得ループ,is_running=%d,result=%d", is_running(), result);
+	for ( ; is_running() && !result; ) {
+		result = handle_request();
+		// 映像取得ループへ
+		if (!result) {
+			v4l2_loop();
+		}
+	}	// for ( ; is_running() && !result; )
+
+	MARK("映像取得ループ終了");
+
+	// 終了処理
+	internal_finish_stream();
+
+	EXIT();
+}
+
+/**
+ * 映像取得開始時の処理
+ * on_startを呼び出した後に解像度・ピクセルフォーマットをセットして映像ストリームを開始する
+ * @return
+ */
+/*private*/
+int V4L2SourcePipeline::internal_start_stream() {
+	ENTER();
+
+	int result;
+
 	set_state(sere_pipeline::PIPELINE_STATE_RUNNING);
 	on_start();
 	v4l2_lock.lock();
@@ -467,29 +614,24 @@ void V4L2SourcePipeline::v4l2_thread_func() {
 	}
 	v4l2_lock.unlock();
 
-	LOGD("映像取得ループ,is_running=%d,result=%d", is_running(), result);
-	for ( ; is_running() && !result; ) {
-		v4l2_lock.lock();
-		{
-			if (request_resize) {
-				request_resize = false;
-				// 解像度変更処理
-				result = handle_resize(request_width, request_height, request_pixel_format);
-			}
-		}
-		v4l2_lock.unlock();
-		// 映像取得ループへ
-		if (!result) {
-			v4l2_loop();
-		}
-	}	// for ( ; is_running() && !result; )
+	RETURN(result, int);
+}
 
-	MARK("映像取得ループ終了");
+/**
+ * 映像取得終了時の処理
+ * 映像ストリームを終了して貸し出したバッファーの返却を待った後にon_stopを呼び出す
+ */
+/*private*/
+void V4L2SourcePipeline::internal_finish_stream() {
+	ENTER();
 
-	// 終了処理
 	v4l2_lock.lock();
 	{
 		stop_stream_locked();
+		if (wait_lent_buffers_locked()) {
+			// 下流が保持しているバッファーはrelease_mmap_lockedでmunmapせずに最後の参照が開放されるまで保持する
+			LOGW("lent buffers are not returned,defer release");
+		}
 		release_mmap_locked();
 	}
 	v4l2_lock.unlock();
@@ -499,6 +641,29 @@ void V4L2SourcePipeline::v4l2_thread_func() {
 	EXIT();
 }
 
+/**
+ * 解像度変更要求があれば処理する
+ * @return
+ */
+/*private*/
+int V4L2SourcePipeline::handle_request() {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+
+	v4l2_lock.lock();
+	{
+		if (request_resize) {
+			request_resize = false;
+			// 解像度変更処理
+			result = handle_resize(request_width, request_height, request_pixel_format);
+		}
+	}
+	v4l2_lock.unlock();
+
+	RETURN(result, int);
+}
+
 /**
  * 映像取得ループ
  * @return
@@ -507,6 +672,15 @@ void V4L2SourcePipeline::v4l2_thread_func() {
 int V4L2SourcePipeline::v4l2_loop() {
 	ENTER();
 
+	if (lending || !userptr_frames.empty()) {
+		// 実行中＆解像度・ピクセルフォーマット変更要求が無ければ映像取得して下流へ貸し出す
+		// V4L2_MEMORY_USERPTRのときは映像を受け取ったフレームをそのまま下流へ渡す
+		for ( ; is_running() && !request_resize; ) {
+			wait_frame(nullptr);
+		}
+		RETURN(core::USB_SUCCESS, int);
+	}
+
 	uvc::VideoFrame frame;
 	frame.resize(stream_width, stream_height, stream_frame_type);
 	frame.resize(image_bytes);
@@ -514,11 +688,8 @@ int V4L2SourcePipeline::v4l2_loop() {
 	// 実行中＆解像度・ピクセルフォーマット変更要求が無ければ映像取得する
 	for ( ; is_running() && !request_resize; ) {
 		// 映像フレームを待機
-		int result = wait_frame(frame.frame(), image_bytes);
+		int result = wait_frame(&frame);
 		if (result > 0) {
-			// mjpegとかだと受信データサイズは固定では無いので
-			// 実際のデータバイト数に合うようにリサイズする
-			frame.resize(result);
 			queue_frame(&frame);
 		}
 	} // for ( ; is_running(); )
@@ -538,7 +709,10 @@ int V4L2SourcePipeline::internal_stop() {
 	bool b = set_running(false);
 	if (LIKELY(b)) {
 		set_state(sere_pipeline::PIPELINE_STATE_STOPPING);
-		if (v4l2_thread.joinable()) {
+		if (reactor) {
+			LOGD("V4l2Reactorから登録解除");
+			reactor->detach(this);
+		} else if (v4l2_thread.joinable()) {
 			LOGD("join:v4l2_thread");
 			v4l2_thread.join();
 		}
@@ -564,6 +738,28 @@ int V4L2SourcePipeline::start_stream_locked() {
 		// 予めすべてのバッファをキューに入れておく
 		enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		for (uint32_t i = 0; i < m_buffersNums; ++i) {
+			if (!userptr_frames.empty()) {
+				// V4L2_MEMORY_USERPTRのときはフレームプールから取得したフレームのバッファーをキューに入れる
+				auto frame = userptr_frames[i] ? userptr_frames[i] : userptr_pool->obtain_frame();
+				userptr_frames[i] = nullptr;
+				if (UNLIKELY(!frame
+					|| frame->resize(stream_width, stream_height, stream_frame_type)
+					|| (frame->resize(image_bytes), frame->size() < image_bytes))) {
+
+					LOGE("failed to obtain frame for USERPTR,index=%d", i);
+					if (frame) {
+						userptr_pool->return_frame(frame);
+					}
+					result = core::USB_ERROR_NO_MEM;
+					goto ret;
+				}
+				result = queue_userptr_locked(i, frame);
+				if (UNLIKELY(result)) {
+					userptr_pool->return_frame(frame);
+					goto ret;
+				}
+				continue;
+			}
 			struct v4l2_buffer buf {
 				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 				.memory = V4L2_MEMORY_MMAP,
@@ -582,6 +778,10 @@ int V4L2SourcePipeline::start_stream_locked() {
 			goto ret;
 		}
 		// success
+		lent_nums = 0;
+		last_sequence = -1;
+		dropped_frames = 0;
+		m_state = STATE_STREAM;
 		result = core::USB_SUCCESS;
 	} else {
 		LOGD("invalid state: state=%d", m_state);
@@ -611,6 +811,50 @@ int V4L2SourcePipeline::stop_stream_locked() {
 	RETURN(core::USB_SUCCESS, int);
 }
 
+/**
+ * キャッシュの内容が実際のv4l2機器と一致しなかったときに
+ * v4l2機器から取得し直してキャッシュを更新する
+ */
+/*private*/
+void V4L2SourcePipeline::refresh_caps_locked() {
+	ENTER();
+
+	if (cap_cache && m_fd) {
+		caps = cap_cache->refresh(m_fd, caps);
+		supported = caps->ctrls;
+	}
+
+	EXIT();
+}
+
+/**
+ * キャッシュから読み込んだコントロール機能の設定でエラーになったときに
+ * VIDIOC_QUERYCTRLで照合して一致しなければキャッシュを更新する
+ * @param ctrl_id
+ */
+/*private*/
+void V4L2SourcePipeline::validate_ctrl_locked(const uint32_t &ctrl_id) {
+	ENTER();
+
+	if (caps && caps->from_cache) {
+		const auto cached = supported.find(ctrl_id) != supported.end()
+			? supported[ctrl_id] : nullptr;
+		struct v4l2_queryctrl query {
+			.id = ctrl_id,
+		};
+		const int r = xioctl(m_fd, VIDIOC_QUERYCTRL, &query);
+		if (!cached || (r == -1) || (query.flags & V4L2_CTRL_FLAG_DISABLED)
+			|| (query.type != cached->type)
+			|| (query.minimum != cached->minimum) || (query.maximum != cached->maximum)) {
+
+			LOGW("ctrl 0x%08x does not match the cache", ctrl_id);
+			refresh_caps_locked();
+		}
+	}
+
+	EXIT();
+}
+
 /**
  * 解像度とピクセルフォーマットをセットして映像データ受け取り用バッファーを初期化する
  * @param width
@@ -683,6 +927,14 @@ int V4L2SourcePipeline::init_v4l2_locked(
 		LOGE("VIDIOC_S_FMT,errno=%d", errno);
 		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
 	}
+	if (caps && !caps->validated) {
+		// キャッシュから読み込んだときは実際にネゴシエーションした結果と照合する
+		if (V4l2CapCache::validate(*caps, fmt.fmt.pix.pixelformat, fmt.fmt.pix.width, fmt.fmt.pix.height)) {
+			caps->validated = true;
+		} else {
+			refresh_caps_locked();
+		}
+	}
 
 	// Buggy driver paranoia.
 	uint32_t min = fmt.fmt.pix.width * 2;
@@ -696,7 +948,7 @@ int V4L2SourcePipeline::init_v4l2_locked(
 
 	// 画像データ読み込み用のメモリマップを初期化
 	LOGD("call init_mmap_locked");
-	result = init_mmap_locked();
+	result = userptr ? init_userptr_locked(fmt.fmt.pix.sizeimage) : init_mmap_locked();
 	if (!result) {
 		stream_width = fmt.fmt.pix.width;
 		stream_height = fmt.fmt.pix.height;
@@ -719,6 +971,33 @@ int V4L2SourcePipeline::release_mmap_locked() {
 
 	ENTER();
 
+	// 返却済みの古い貸し出し用フレームを破棄する
+	orphan_frames.erase(std::remove_if(orphan_frames.begin(), orphan_frames.end(),
+		[](const V4L2BufferFrameUp &frame) { return !frame->is_lent(); }), orphan_frames.end());
+	// 下流がまだ参照しているフレームはmunmapせずに最後の参照が開放されるまで保持する
+	// (munmapするとv4l2機器側のバッファーも開放されて下流が開放済みのメモリーへアクセスしてしまう)
+	for (auto &frame: lend_frames) {
+		if (frame && frame->is_lent()) {
+			const auto ix = frame->index();
+			if (m_buffers && (ix < m_buffersNums)) {
+				frame->orphan(m_buffers[ix].start, m_buffers[ix].length, 0);
+				m_buffers[ix].start = MAP_FAILED;
+			} else {
+				frame->orphan(MAP_FAILED, 0, 0);
+			}
+			orphan_frames.push_back(std::move(frame));
+		}
+	}
+	lend_frames.clear();
+	if (userptr_pool) {
+		// VIDIOC_STREAMOFF後はv4l2機器側のキューがクリアされているのでフレームプールへ戻す
+		for (auto frame: userptr_frames) {
+			if (frame) {
+				userptr_pool->return_frame(frame);
+			}
+		}
+	}
+	userptr_frames.clear();
 	if (m_buffersNums && m_buffers) {
 		for (uint32_t i = 0; i < m_buffersNums; ++i) {
 			if (m_buffers[i].start != MAP_FAILED) {
@@ -747,13 +1026,15 @@ int V4L2SourcePipeline::init_mmap_locked() {
 	ENTER();
 
 	int result = core::USB_SUCCESS;
+	// 貸し出し時は下流が保持する分だけバッファーを増やしてv4l2機器側のバッファーが枯渇しないようにする
+	const uint32_t buffer_nums = lending ? BUFFER_NUMS + max_lend_nums : BUFFER_NUMS;
 	struct v4l2_requestbuffers req {
-		.count = BUFFER_NUMS,
+		.count = buffer_nums,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 		.memory = V4L2_MEMORY_MMAP,
 	};
 
-	LOGD("VIDIOC_REQBUFS");
+	LOGD("VIDIOC_REQBUFS:%d", buffer_nums);
 	if (xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) {
 		result = -errno;
 		if (EINVAL == errno) {
@@ -778,6 +1059,9 @@ int V4L2SourcePipeline::init_mmap_locked() {
 	}
 	for (uint32_t i = 0; i < req.count; i++) {
 		m_buffers[i].start = MAP_FAILED;
+		m_buffers[i].dmabuf_sync = false;
+		m_buffers[i].udmabuf_sync_for_cpu = m_buffers[i].udmabuf_sync_for_device = 0;
+		m_buffers[i].exposure_ts = 0;
 	}
 	m_buffersNums = req.count;
 
@@ -805,17 +1089,127 @@ int V4L2SourcePipeline::init_mmap_locked() {
 			LOGE("mmap,err=%d", result);
 			break;
 		}
+		if (lending) {
+			lend_frames.push_back(std::make_unique<V4L2BufferFrame>(i,
+				[this](V4L2BufferFrame &frame) { release_buffer(frame); }));
+		}
 	}
 
 err:
 	if (result) {
 		LOGD("something error occurred, release buffers,result=%d", result);
+		lend_frames.clear();
 		SAFE_DELETE_ARRAY(m_buffers)
 		m_buffersNums = 0;
 	}
 	RETURN(result, int);
 }
 
+/**
+ * V4L2_MEMORY_USERPTRで映像を受け取るための初期化
+ * v4l2機器がV4L2_MEMORY_USERPTRに対応していなければinit_mmap_lockedへフォールバックする
+ * init_device_lockedの下請け
+ * @param sizeimage
+ * @return
+ */
+/*private*/
+int V4L2SourcePipeline::init_userptr_locked(const size_t &sizeimage) {
+	ENTER();
+
+	struct v4l2_requestbuffers req {
+		.count = BUFFER_NUMS,
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_USERPTR,
+	};
+
+	LOGD("VIDIOC_REQBUFS(USERPTR):%d", BUFFER_NUMS);
+	if (xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) {
+		const int result = -errno;
+		if (EINVAL == errno) {
+			LOGW("%s does not support USERPTR, fallback to mmap", device_name.c_str());
+			RETURN(init_mmap_locked(), int);
+		}
+		LOGE("VIDIOC_REQBUFS,err=%d", result);
+		RETURN(result, int);
+	}
+	if (req.count < BUFFER_NUMS) {
+		LOGE("Insufficient buffer memory on %s", device_name.c_str());
+		RETURN(core::USB_ERROR_NO_MEM, int);
+	}
+	// 映像データはフレームのバッファーへ直接受け取るのでm_buffersはタイムスタンプ等の保持にだけ使う
+	m_buffers = new buffer_t[req.count];
+	if (UNLIKELY(!m_buffers)) {
+		LOGE("Out of memory");
+		RETURN(core::USB_ERROR_NO_MEM, int);
+	}
+	for (uint32_t i = 0; i < req.count; i++) {
+		m_buffers[i].start = MAP_FAILED;
+		m_buffers[i].length = 0;
+		m_buffers[i].dmabuf_sync = false;
+		m_buffers[i].udmabuf_sync_for_cpu = m_buffers[i].udmabuf_sync_for_device = 0;
+		m_buffers[i].exposure_ts = 0;
+	}
+	m_buffersNums = req.count;
+	if (!userptr_pool) {
+		userptr_pool = std::make_unique<V4L2UserptrFramePool>(req.count + 1,
+			[this](core::BaseVideoFrame *frame) { return requeue_userptr(frame); });
+	}
+	// 解像度・ピクセルフォーマットが変わるとバッファーサイズも変わるので作り直す
+	userptr_pool->init_pool(req.count, sizeimage);
+	userptr_frames.assign(req.count, nullptr);
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * フレームのバッファーを映像受け取りバッファーとして指定したインデックスでキューに入れる(VIDIOC_QBUF)
+ * @param index
+ * @param frame
+ * @return
+ */
+/*private*/
+int V4L2SourcePipeline::queue_userptr_locked(const uint32_t &index, core::BaseVideoFrame *frame) {
+	ENTER();
+
+	struct v4l2_buffer buf {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_USERPTR,
+	};
+	buf.index = index;
+	buf.m.userptr = (unsigned long)frame->raw_frame();
+	buf.length = (uint32_t)frame->size();
+	if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+		const int result = -errno;
+		LOGE("VIDIOC_QBUF(USERPTR): errno=%d", -result);
+		RETURN(result, int);
+	}
+	userptr_frames[index] = frame;
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 下流から戻ってきたフレームを空いているインデックスでv4l2機器へ再キューする
+ * @param frame
+ * @return true: 再キューした, false: 再キューしなかったのでフレームプールへ戻す
+ */
+/*private*/
+bool V4L2SourcePipeline::requeue_userptr(core::BaseVideoFrame *frame) {
+	ENTER();
+
+	AutoMutex lock(v4l2_lock);
+	// ストリーム停止後はVIDIOC_STREAMOFFでv4l2機器側のキューがクリアされているので再キューしない
+	if ((m_state == STATE_STREAM) && (frame->size() >= image_bytes)) {
+		for (uint32_t i = 0; i < userptr_frames.size(); i++) {
+			if (!userptr_frames[i]) {
+				RETURN(!queue_userptr_locked(i, frame), bool);
+			}
+		}
+	}
+
+	RETURN(false, bool);
+}
+
 /**
  * @brief 対応しているピクセルフォーマット一覧を取得する
  * 
@@ -825,7 +1219,13 @@ std::vector<uint32_t> V4L2SourcePipeline::get_supported_pixel_formats_locked(con
 	ENTER();
 
 	std::vector<uint32_t> result;
-	if (m_state > STATE_CLOSE) {
+	if (caps) {
+		for (const auto &format: caps->formats) {
+			if (preffered.empty() || (find(preffered.begin(), preffered.end(), format->pixel_format) != preffered.end())) {
+				result.push_back(format->pixel_format);
+			}
+		}
+	} else if (m_state > STATE_CLOSE) {
 		int r = 0;
 		for (int i = 0 ; (r != -1); i++) {
 			struct v4l2_fmtdesc fmt {
@@ -870,6 +1270,10 @@ int V4L2SourcePipeline::handle_resize(
 		const uint32_t cur_width = stream_width ? stream_width : width;
 		const uint32_t cur_height = stream_height ? stream_height : height;
 		const uint32_t cur_pixel_format = stream_pixel_format ? stream_pixel_format : pixel_format;
+		if (wait_lent_buffers_locked()) {
+			// 下流が保持しているバッファーはrelease_mmap_lockedでmunmapせずに最後の参照が開放されるまで保持する
+			LOGW("lent buffers are not returned,defer release");
+		}
 		result = release_mmap_locked();	// state == STATE_OPEN
 		if (LIKELY(!result)) {
 			// 解像度・ピクセルフォーマットをセット
@@ -901,12 +1305,11 @@ int V4L2SourcePipeline::handle_resize(
 /**
  * 映像データを取得する
  * 映像データがないときはブロックする
- * @param dst
- * @param capacity
+ * @param frame 映像データのコピー先, nullptrまたは映像データの貸し出し中は貸し出し用フレームを使う
  * @return 負:エラー 0以上:読み込んだデータバイト数
  */
 /*private*/
-int V4L2SourcePipeline::wait_frame(uint8_t *dst, const size_t &capacity) {
+int V4L2SourcePipeline::wait_frame(core::BaseVideoFrame *frame) {
 
 	ENTER();
 
@@ -931,7 +1334,15 @@ int V4L2SourcePipeline::wait_frame(uint8_t *dst, const size_t &capacity) {
 		// 映像データの準備ができたかタイムアウトした時
 		if (FD_ISSET(m_fd, &fds)) {
 			// 映像データを読み込み
-			result = read_frame(dst, capacity);
+			if (!userptr_frames.empty()) {
+				result = read_userptr_frame();
+			} else {
+				result = lending || !frame ? lend_frame() : read_frame(*frame);
+			}
+			if (result == -EAGAIN) {
+				// 映像データが準備出来てない
+				result = 0;
+			}
 		} else {
 			// EAGAIN(タイムアウト)
 			result = 0;
@@ -942,13 +1353,13 @@ int V4L2SourcePipeline::wait_frame(uint8_t *dst, const size_t &capacity) {
 }
 
 /**
- * 映像データを指定したバッファにコピーする
- * @param dst
- * @param capacity
- * @return 負:エラー, 0以上:読み込んだ映像データのバイト数
+ * 映像データを指定したフレームにコピーする
+ * タイムスタンプ・シーケンス番号・v4l2_buffer.flagsもフレームへセットする
+ * @param frame
+ * @return 負:エラー(-EAGAINなら映像データが準備出来てない), 0以上:読み込んだ映像データのバイト数
  */
 /*private*/
-int V4L2SourcePipeline::read_frame(uint8_t *dst, const size_t &capacity) {
+int V4L2SourcePipeline::read_frame(core::BaseVideoFrame &frame) {
 	ENTER();
 
 	struct v4l2_buffer buf{
@@ -960,9 +1371,16 @@ int V4L2SourcePipeline::read_frame(uint8_t *dst, const size_t &capacity) {
 	int result = xioctl(m_fd, VIDIOC_DQBUF, &buf);
 	if (result >= 0) {
 		// バッファを取得できた時
+		dropped_frames += count_sequence_gap(last_sequence, buf.sequence);
 		if (buf.index < m_buffersNums) {
-			if (LIKELY(dst && (capacity >= buf.bytesused))) {
-				memcpy(dst, m_buffers[buf.index].start, buf.bytesused);
+			auto &buffer = m_buffers[buf.index];
+			update_buffer_info(buffer, buf);
+			// mjpegとかだと受信データサイズは固定では無いので
+			// 実際のデータバイト数に合うようにリサイズする
+			frame.resize(buf.bytesused);
+			if (LIKELY(frame.raw_bytes() >= buf.bytesused)) {
+				memcpy(frame.frame(), buffer.start, buf.bytesused);
+				set_frame_attribute(frame, buffer);
 				// コピーしたサイズを返す
 				result = (int)buf.bytesused;
 			} else {
@@ -979,7 +1397,131 @@ int V4L2SourcePipeline::read_frame(uint8_t *dst, const size_t &capacity) {
 		switch (errno) {
 		case EAGAIN:
 			// 映像データが準備出来てない
+			break;
+		case EIO:
+			/* Could ignore EIO, see spec. */
+			/* fall through */
+		default:
+			LOGE("VIDIOC_DQBUF: errno=%d", -result);
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像データの入ったバッファーをコピーせずにV4L2BufferFrameとして下流へ渡す
+ * @return 負:エラー(-EAGAINなら映像データが準備出来てない), 0以上:映像データのバイト数
+ */
+/*private*/
+int V4L2SourcePipeline::lend_frame() {
+	ENTER();
+
+	struct v4l2_buffer buf{
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+
+	// 映像の入ったバッファを取得
+	int result = xioctl(m_fd, VIDIOC_DQBUF, &buf);
+	if (result >= 0) {
+		// バッファを取得できた時
+		dropped_frames += count_sequence_gap(last_sequence, buf.sequence);
+		if (LIKELY(buf.index < lend_frames.size())) {
+			bool lendable;
+			v4l2_lock.lock();
+			{
+				lent_nums++;
+				lend_frames[buf.index]->set_lent(true);
+				// 下流がこのバッファーを保持してもv4l2機器側に
+				// MIN_QUEUED_BUFFERS個以上のバッファーが残るときだけ貸し出しを許可する
+				lendable = (lent_nums <= max_lend_nums)
+					&& (m_buffersNums >= lent_nums + MIN_QUEUED_BUFFERS);
+			}
+			v4l2_lock.unlock();
+			auto &frame = *lend_frames[buf.index];
+			auto &buffer = m_buffers[buf.index];
+			update_buffer_info(buffer, buf);
+			result = frame.assign(
+				static_cast<uint8_t *>(buffer.start), buffer.length, buf.bytesused,
+				stream_width, stream_height, stream_frame_type,
+				lendable);
+			if (LIKELY(!result)) {
+				set_frame_attribute(frame, buffer);
+				queue_frame(&frame);
+				result = (int)buf.bytesused;
+			} else {
+				LOGW("failed to assign buffer,index=%d,err=%d", buf.index, result);
+			}
+			// 自分の参照を開放する, 下流が参照を保持していなければここでVIDIOC_QBUFされる
+			frame.release();
+		} else if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_QBUF: errno=%d", -result);
+		}
+	} else {
+		result = -errno;
+		switch (errno) {
+		case EAGAIN:
+			// 映像データが準備出来てない
+			break;
+		case EIO:
+			/* Could ignore EIO, see spec. */
+			/* fall through */
+		default:
+			LOGE("VIDIOC_DQBUF: errno=%d", -result);
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * V4L2_MEMORY_USERPTRで映像データを受け取ったフレームをコピーせずに下流へ渡す
+ * @return 負:エラー(-EAGAINなら映像データが準備出来てない), 0以上:映像データのバイト数
+ */
+/*private*/
+int V4L2SourcePipeline::read_userptr_frame() {
+	ENTER();
+
+	struct v4l2_buffer buf{
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_USERPTR,
+	};
+
+	// 映像の入ったバッファを取得
+	int result = xioctl(m_fd, VIDIOC_DQBUF, &buf);
+	if (result >= 0) {
+		// バッファを取得できた時
+		dropped_frames += count_sequence_gap(last_sequence, buf.sequence);
+		core::BaseVideoFrame *frame = nullptr;
+		v4l2_lock.lock();
+		{
+			if (LIKELY(buf.index < userptr_frames.size())) {
+				frame = userptr_frames[buf.index];
+				userptr_frames[buf.index] = nullptr;
+			}
+		}
+		v4l2_lock.unlock();
+		if (LIKELY(frame)) {
+			auto &buffer = m_buffers[buf.index];
+			update_buffer_info(buffer, buf);
+			// 実際のデータバイト数をセットする, バッファーより小さいので再確保はされない
+			frame->resize(buf.bytesused);
+			set_frame_attribute(*frame, buffer);
+			queue_frame(frame);
+			result = (int)buf.bytesused;
+			// フレームプールへ返却するとv4l2機器へ再キューされる
+			userptr_pool->recycle_frame(frame);
+		} else {
+			LOGW("unexpected buffer index,%d", buf.index);
 			result = 0;
+		}
+	} else {
+		result = -errno;
+		switch (errno) {
+		case EAGAIN:
+			// 映像データが準備出来てない
 			break;
 		case EIO:
 			/* Could ignore EIO, see spec. */
@@ -992,6 +1534,148 @@ int V4L2SourcePipeline::read_frame(uint8_t *dst, const size_t &capacity) {
 	RETURN(result, int);
 }
 
+/**
+ * 貸し出したバッファーの最後の参照が開放されたときの処理
+ * 任意のスレッドから呼ばれる
+ * @param frame
+ */
+/*private*/
+void V4L2SourcePipeline::release_buffer(V4L2BufferFrame &frame) {
+	ENTER();
+
+	AutoMutex lock(v4l2_lock);
+	frame.set_lent(false);
+	if (frame.is_orphan()) {
+		// 映像受け取りバッファーは開放済みなので遅延していたmunmapだけを行う
+		// 同じインデックスのバッファーは作り直した別のバッファーなのでVIDIOC_QBUFしてはだめ
+		frame.release_orphan();
+		lend_sync.broadcast();
+		EXIT();
+	}
+	// ストリーム停止後はVIDIOC_STREAMOFFでv4l2機器側のキューがクリアされているので返却しない
+	if ((m_state == STATE_STREAM) && (frame.index() < m_buffersNums)) {
+		struct v4l2_buffer buf{
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		buf.index = frame.index();
+		if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+			LOGE("VIDIOC_QBUF: errno=%d", errno);
+		}
+	}
+	if (LIKELY(lent_nums > 0)) {
+		lent_nums--;
+	}
+	lend_sync.broadcast();
+
+	EXIT();
+}
+
+/**
+ * 貸し出したバッファーが全て返却されるまで待機する
+ * @return 0: 全て返却された, 0以外: タイムアウト
+ */
+/*private*/
+int V4L2SourcePipeline::wait_lent_buffers_locked() {
+	ENTER();
+
+	const nsecs_t deadline = systemTime() + MAX_WAIT_LENT_BUFFERS_NS;
+	for (auto &frame: lend_frames) {
+		for ( ; frame->is_lent() ; ) {
+			const nsecs_t remain = deadline - systemTime();
+			if (remain <= 0) {
+				LOGW("timeout waiting lent buffer,index=%d,ref_count=%d",
+					frame->index(), frame->ref_count());
+				RETURN(core::USB_ERROR_TIMEOUT, int);
+			}
+			lend_sync.waitRelative(v4l2_lock, remain);
+		}
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * V4l2Reactorへ登録されたときの処理
+ * IV4l2ReactorClientの純粋仮想関数を実装
+ * @return
+ */
+/*private*/
+int V4L2SourcePipeline::on_reactor_attach() {
+	ENTER();
+
+	LOGD("V4l2Reactor上で映像取得開始");
+	int result = internal_start_stream();
+
+	RETURN(result, int);
+}
+
+/**
+ * v4l2機器が読み込み可能になったときの処理
+ * エッジトリガーで監視しているのでVIDIOC_DQBUFがEAGAINを返すまで映像データを取り出す
+ * IV4l2ReactorClientの純粋仮想関数を実装
+ * @return
+ */
+/*private*/
+int V4L2SourcePipeline::on_reactor_ready() {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+	const bool use_userptr = !userptr_frames.empty();
+	if (!lending && !use_userptr) {
+		reactor_frame.resize(stream_width, stream_height, stream_frame_type);
+	}
+	// EIOが続いたときに抜けられなくなるのを防ぐため取り出す回数を制限する
+	const uint32_t max_nums = m_buffersNums * 2 + 1;
+	for (uint32_t i = 0; i < max_nums; i++) {
+		const int r = use_userptr ? read_userptr_frame()
+			: (lending ? lend_frame() : read_frame(reactor_frame));
+		if (r == -EAGAIN) {
+			break;
+		} else if (UNLIKELY((r < 0) && (r != -EIO))) {
+			result = r;
+			break;
+		} else if (!lending && !use_userptr && (r > 0)) {
+			queue_frame(&reactor_frame);
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * V4l2Reactor::wakeupが呼ばれたときの処理
+ * IV4l2ReactorClientの純粋仮想関数を実装
+ * @return
+ */
+/*private*/
+int V4L2SourcePipeline::on_reactor_wakeup() {
+	ENTER();
+
+	int result = handle_request();
+
+	RETURN(result, int);
+}
+
+/**
+ * V4l2Reactorから登録解除されたときの処理
+ * IV4l2ReactorClientの純粋仮想関数を実装
+ * @param error
+ */
+/*private*/
+void V4L2SourcePipeline::on_reactor_detach(const bool &error) {
+	ENTER();
+
+	LOGD("V4l2Reactor上での映像取得終了,error=%d", error);
+	internal_finish_stream();
+	if (error) {
+		set_state(sere_pipeline::PIPELINE_STATE_INITIALIZED);
+	}
+
+	EXIT();
+}
+
 /**
  * ctrl_idで指定したコントロール機能に対応しているかどうかを取得
  * v4l2機器をオープンしているときのみ有効。closeしているときは常にfalseを返す
@@ -1047,6 +1731,8 @@ int V4L2SourcePipeline::get_ctrl(
 		result = xioctl(m_fd, VIDIOC_G_CTRL, &ctrl);
 		if (!result) {
 			values.current = ctrl.value;
+		} else if (errno == EINVAL) {
+			validate_ctrl_locked(ctrl_id);
 		}
 	}
 
@@ -1075,6 +1761,8 @@ int V4L2SourcePipeline::get_ctrl_value(const uint32_t &ctrl_id, int32_t &value)
 		result = xioctl(m_fd, VIDIOC_G_CTRL, &ctrl);
 		if (!result) {
 			value = ctrl.value;
+		} else if (errno == EINVAL) {
+			validate_ctrl_locked(ctrl_id);
 		}
 	}
 
@@ -1104,6 +1792,8 @@ int V4L2SourcePipeline::set_ctrl_value(const uint32_t &ctrl_id, const int32_t &v
 		if (result && (errno == ERANGE)) {
 			// ドライバー側で値をクランプしたときは正常終了とする
 			result = core::USB_SUCCESS;
+		} else if (result && (errno == EINVAL)) {
+			validate_ctrl_locked(ctrl_id);
 		}
 	}
 
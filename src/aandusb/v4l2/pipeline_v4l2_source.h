@@ -9,6 +9,7 @@
 #define AANDUSB_PIPELINE_V4L2_SOURCE_H
 
 #include <stddef.h>
+#include <atomic>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -24,6 +25,10 @@
 #include "pipeline/pipeline_base.h"
 // v4l2
 #include "v4l2/v4l2.h"
+#include "v4l2/v4l2_cap_cache.h"
+#include "v4l2/v4l2_buffer_frame.h"
+#include "v4l2/v4l2_reactor.h"
+#include "v4l2/v4l2_userptr_frame_pool.h"
 
 namespace usb = serenegiant::usb;
 namespace uvc = serenegiant::usb::uvc;
@@ -31,11 +36,16 @@ namespace sere_pipeline = serenegiant::pipeline;
 
 namespace serenegiant::v4l2::pipeline {
 
+/**
+ * 下流のパイプラインへ同時に貸し出すことができるバッファー数のデフォルト値
+ */
+#define DEFAULT_MAX_LEND_NUMS (2)
+
 /**
  * v4l2からの映像をソースとして使うためのパイプライン(始点)
  * FIXME V4l2SourceBaseを使うように変更する
  */
-class V4L2SourcePipeline : virtual public sere_pipeline::IPipeline {
+class V4L2SourcePipeline : virtual public sere_pipeline::IPipeline, public IV4l2ReactorClient {
 private:
 	const std::string device_name;
 	mutable Mutex v4l2_lock;
@@ -96,11 +106,99 @@ private:
 	 * 対応しているコントロール機能のv4l2_queryctrl構造体マップ
 	 */
 	std::unordered_map<uint32_t, QueryCtrlSp> supported;
+	/**
+	 * 映像受け取りバッファーをコピーせずに下流へ貸し出すかどうか
+	 */
+	bool lending;
+	/**
+	 * 下流のパイプラインが同時に保持できるバッファーの最大数
+	 */
+	uint32_t max_lend_nums;
+	/**
+	 * v4l2機器から取り出したままでまだ返却(VIDIOC_QBUF)していないバッファー数
+	 * v4l2_lockで保護する
+	 */
+	uint32_t lent_nums;
+	/**
+	 * 前回VIDIOC_DQBUFしたときのv4l2_buffer.sequence, 負なら映像ストリーム開始後まだ取得していない
+	 */
+	int64_t last_sequence;
+	/**
+	 * v4l2_buffer.sequenceの欠番から求めたドライバー側で破棄されたフレーム数
+	 */
+	std::atomic<uint64_t> dropped_frames;
+	/**
+	 * 貸し出し用のフレーム, m_buffersと同じインデックスでアクセスする
+	 */
+	std::vector<V4L2BufferFrameUp> lend_frames;
+	/**
+	 * 映像受け取りバッファーを開放したときにまだ下流が参照していた貸し出し用のフレーム
+	 * mmap領域は最後の参照が開放されたときにrelease_bufferでmunmapする
+	 * v4l2_lockで保護する
+	 */
+	std::vector<V4L2BufferFrameUp> orphan_frames;
+	/**
+	 * V4L2_MEMORY_USERPTRでFramePoolから取得したフレームのバッファーへ直接映像を受け取るかどうか
+	 */
+	bool userptr;
+	/**
+	 * V4L2_MEMORY_USERPTRで映像受け取りバッファーとして使うフレームのフレームプール
+	 */
+	V4L2UserptrFramePoolUp userptr_pool;
+	/**
+	 * v4l2機器へキューに入れているフレーム, m_buffersと同じインデックスでアクセスする
+	 * v4l2機器から取り出して下流へ渡している間はnullptr
+	 * v4l2_lockで保護する
+	 */
+	std::vector<core::BaseVideoFrame *> userptr_frames;
+	/**
+	 * 貸し出したバッファーの返却待ち用
+	 */
+	Condition lend_sync;
+	/**
+	 * 映像取得を任せるV4l2Reactor
+	 * nullptrでなければ専用ワーカースレッドの代わりにV4l2Reactorのワーカースレッド上で映像取得する
+	 */
+	V4l2ReactorSp reactor;
+	/**
+	 * 対応ピクセルフォーマット・解像度・フレームレート・コントロール機能のキャッシュ
+	 * nullptrならキャッシュを使わずに毎回v4l2機器から取得する
+	 */
+	V4l2CapCacheSp cap_cache;
+	/**
+	 * オープン中のv4l2機器の対応ピクセルフォーマット・解像度・フレームレート・コントロール機能
+	 * cap_cacheを使わないときはnullptr
+	 * v4l2_lockで保護する
+	 */
+	DeviceCapsSp caps;
+	/**
+	 * V4l2Reactor上で映像データを受け取るためのフレーム(貸し出ししないとき)
+	 */
+	core::BaseVideoFrame reactor_frame;
 
 	/**
 	 * 映像取得スレッドの実行関数
 	 */
 	void v4l2_thread_func();
+	/**
+	 * 映像取得開始時の処理
+	 * on_startを呼び出した後に解像度・ピクセルフォーマットをセットして映像ストリームを開始する
+	 * ワーカースレッド上で呼ばれる
+	 * @return
+	 */
+	int internal_start_stream();
+	/**
+	 * 映像取得終了時の処理
+	 * 映像ストリームを終了して貸し出したバッファーの返却を待った後にon_stopを呼び出す
+	 * ワーカースレッド上で呼ばれる
+	 */
+	void internal_finish_stream();
+	/**
+	 * 解像度変更要求があれば処理する
+	 * ワーカースレッド上で呼ばれる
+	 * @return
+	 */
+	int handle_request();
 	/**
 	 * 映像取得ループ
 	 * ワーカースレッド上で呼ばれる
@@ -125,6 +223,19 @@ private:
 	 * @return
 	 */
 	int stop_stream_locked();
+	/**
+	 * キャッシュの内容が実際のv4l2機器と一致しなかったときに
+	 * v4l2機器から取得し直してキャッシュを更新する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 */
+	void refresh_caps_locked();
+	/**
+	 * キャッシュから読み込んだコントロール機能の設定でエラーになったときに
+	 * VIDIOC_QUERYCTRLで照合して一致しなければキャッシュを更新する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param ctrl_id
+	 */
+	void validate_ctrl_locked(const uint32_t &ctrl_id);
 	/**
 	 * v4l2からの映像取得の準備
 	 * ワーカースレッド上で呼ばれる
@@ -148,6 +259,30 @@ private:
 	 * init_device_lockedの下請け
 	 */
 	int init_mmap_locked(void);
+	/**
+	 * V4L2_MEMORY_USERPTRで映像を受け取るための初期化
+	 * フレームプールをsizeimage以上のバッファーを持つフレームで初期化する
+	 * ワーカースレッド上で呼ばれる
+	 * init_device_lockedの下請け
+	 * @param sizeimage
+	 * @return
+	 */
+	int init_userptr_locked(const size_t &sizeimage);
+	/**
+	 * フレームのバッファーを映像受け取りバッファーとして指定したインデックスでキューに入れる(VIDIOC_QBUF)
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param index
+	 * @param frame
+	 * @return
+	 */
+	int queue_userptr_locked(const uint32_t &index, core::BaseVideoFrame *frame);
+	/**
+	 * 下流から戻ってきたフレームを空いているインデックスでv4l2機器へ再キューする
+	 * V4L2UserptrFramePool::recycle_frameから呼ばれる
+	 * @param frame
+	 * @return true: 再キューした, false: 再キューしなかったのでフレームプールへ戻す
+	 */
+	bool requeue_userptr(core::BaseVideoFrame *frame);
 	/**
 	 * @brief 対応するピクセルフォーマット一覧を取得する
 	 *        v4l2_lockをロックした状態で呼び出すこと
@@ -171,19 +306,52 @@ private:
 	 * 映像データを取得する
 	 * 映像データがないときはMAX_WAIT_FRAME_USで指定した時間待機する
 	 * ワーカースレッド上で呼ばれる
-	 * @param dst
-	 * @param capacity
+	 * @param frame 映像データのコピー先, nullptrまたは映像データの貸し出し中は貸し出し用フレームを使う
 	 * @return 負:エラー 0以上:読み込んだデータバイト数
 	 */
-	int wait_frame(uint8_t *dst, const size_t &capacity);
+	int wait_frame(core::BaseVideoFrame *frame);
+	/**
+	 * 映像データを指定したフレームにコピーする
+	 * タイムスタンプ・シーケンス番号・v4l2_buffer.flagsもフレームへセットする
+	 * ワーカースレッド上で呼ばれる
+	 * @param frame
+	 * @return 負:エラー(-EAGAINなら映像データが準備出来てない), 0以上:読み込んだ映像データのバイト数
+	 */
+	int read_frame(core::BaseVideoFrame &frame);
+	/**
+	 * 映像データの入ったバッファーをコピーせずにV4L2BufferFrameとして下流へ渡す
+	 * 下流がV4L2BufferFrame::retainで参照を保持した場合は
+	 * 最後の参照が開放されるまでVIDIOC_QBUFしない
+	 * ワーカースレッド上で呼ばれる
+	 * @return 負:エラー(-EAGAINなら映像データが準備出来てない), 0以上:映像データのバイト数
+	 */
+	int lend_frame();
 	/**
-	 * 映像データを指定したバッファにコピーする
+	 * V4L2_MEMORY_USERPTRで映像データを受け取ったフレームをコピーせずに下流へ渡す
+	 * 下流から戻った後にフレームプールへ返却するとv4l2機器へ再キューされる
 	 * ワーカースレッド上で呼ばれる
-	 * @param dst
-	 * @param capacity
-	 * @return 負:エラー, 0以上:読み込んだ映像データのバイト数
+	 * @return 負:エラー(-EAGAINなら映像データが準備出来てない), 0以上:映像データのバイト数
+	 */
+	int read_userptr_frame();
+	/**
+	 * 貸し出したバッファーの最後の参照が開放されたときの処理
+	 * 任意のスレッドから呼ばれる
+	 * @param frame
+	 */
+	void release_buffer(V4L2BufferFrame &frame);
+	/**
+	 * 貸し出したバッファーが全て返却されるまで待機する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @return 0: 全て返却された, 0以外: タイムアウト
 	 */
-	int read_frame(uint8_t *dst, const size_t &capacity);
+	int wait_lent_buffers_locked();
+	//--------------------------------------------------------------------------------
+	// IV4l2ReactorClientの純粋仮想関数を実装
+	int on_reactor_attach() override;
+	inline int get_reactor_fd() const override { return m_fd; };
+	int on_reactor_ready() override;
+	int on_reactor_wakeup() override;
+	void on_reactor_detach(const bool &error) override;
 protected:
 	/**
 	 * 映像取得開始時の処理
@@ -280,6 +448,61 @@ public:
 	 * @return
 	 */
 	int resize(const uint32_t &width, const uint32_t &height, const uint32_t &pixel_format = 0);
+	/**
+	 * 映像受け取りバッファーをコピーせずに下流へ貸し出すかどうかを設定
+	 * 映像取得開始前(ストリーム停止中)のみ変更可能
+	 * 貸し出しを有効にするとVIDIOC_REQBUFSで要求するバッファー数をmax_lend_nums個増やして
+	 * 下流がバッファーを保持していてもv4l2機器側のバッファーが枯渇しないようにする
+	 * @param enable
+	 * @param max_lend_nums 下流のパイプラインが同時に保持できるバッファーの最大数
+	 * @return
+	 */
+	int set_lending(const bool &enable, const uint32_t &max_lend_nums = DEFAULT_MAX_LEND_NUMS);
+	/**
+	 * 映像受け取りバッファーを下流へ貸し出す設定かどうかを取得
+	 * @return
+	 */
+	inline bool is_lending() const { return lending; };
+	/**
+	 * V4L2_MEMORY_USERPTRでフレームプールから取得したフレームのバッファーへ直接映像を受け取るかどうかを設定
+	 * 有効にするとv4l2機器から取り出したフレームをコピーせずにそのまま下流へ渡す
+	 * 下流はqueue_frameから戻った後にフレームを保持してはいけない(保持する場合はコピーすること)
+	 * v4l2機器がV4L2_MEMORY_USERPTRに対応していないときはmmapへフォールバックする
+	 * 貸し出し(set_lending)より優先する
+	 * 映像取得開始前(ストリーム停止中)のみ変更可能
+	 * @param enable
+	 * @return
+	 */
+	int set_userptr(const bool &enable);
+	/**
+	 * V4L2_MEMORY_USERPTRで映像を受け取る設定かどうかを取得
+	 * @return
+	 */
+	inline bool is_userptr() const { return userptr; };
+	/**
+	 * ドライバー側で破棄されたフレーム数を取得
+	 * 下流のFrameQueueで破棄されたフレームは含まない
+	 * 映像ストリーム開始時にクリアされる
+	 * @return
+	 */
+	inline uint64_t get_dropped_frames() const { return dropped_frames.load(); };
+	/**
+	 * 専用ワーカースレッドの代わりにV4l2Reactorのワーカースレッド上で映像取得するように設定する
+	 * 複数のv4l2機器で同じV4l2Reactorを共有するとスレッド数を減らすことができる
+	 * V4l2Reactorは呼び出し元でstartしておくこと
+	 * 映像取得開始前(ストリーム停止中)のみ変更可能
+	 * @param reactor nullptrなら専用ワーカースレッドを使う
+	 * @return
+	 */
+	int set_reactor(V4l2ReactorSp reactor);
+	/**
+	 * 対応ピクセルフォーマット・解像度・フレームレート・コントロール機能のキャッシュを設定する
+	 * 2回目以降のオープン時はVIDIOC_ENUM_xxx/VIDIOC_QUERYCTRLでの列挙の代わりにキャッシュを使う
+	 * オープン前のみ変更可能
+	 * @param cache nullptrならキャッシュを使わない
+	 * @return
+	 */
+	int set_cap_cache(V4l2CapCacheSp cache);
 	/**
 	 * IPipelineの純粋仮想関数
 	 * @param frame
@@ -21,7 +21,11 @@
 	#undef NDEBUG
 #endif
 
+#include <cinttypes>
+
+#include <unistd.h>
 #include <sys/ioctl.h>
+#include <linux/dma-buf.h>
 
 #include "utilbase.h"
 #include "charutils.h"
@@ -56,13 +60,16 @@ core::raw_frame_t V4L2_PIX_FMT_to_raw_frame(const uint32_t &v4l2_pix_fmt) {
 	case V4L2_PIX_FMT_UYVY:			return core::RAW_FRAME_UNCOMPRESSED_UYVY;
 	case V4L2_PIX_FMT_GREY:			return core::RAW_FRAME_UNCOMPRESSED_GRAY8;
 //									return core::RAW_FRAME_UNCOMPRESSED_BY8;
-	case V4L2_PIX_FMT_NV21:			return core::RAW_FRAME_UNCOMPRESSED_NV21;
-	case V4L2_PIX_FMT_YVU420:		return core::RAW_FRAME_UNCOMPRESSED_YV12;
-//									return core::RAW_FRAME_UNCOMPRESSED_I420;
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_NV21M:		return core::RAW_FRAME_UNCOMPRESSED_NV21;
+	case V4L2_PIX_FMT_YVU420:
+	case V4L2_PIX_FMT_YVU420M:		return core::RAW_FRAME_UNCOMPRESSED_YV12;
+	case V4L2_PIX_FMT_YUV420M:		return core::RAW_FRAME_UNCOMPRESSED_I420;
 	case V4L2_PIX_FMT_Y16:			return core::RAW_FRAME_UNCOMPRESSED_Y16;
 //									return core::RAW_FRAME_UNCOMPRESSED_RGBP;
 	case V4L2_PIX_FMT_M420:			return core::RAW_FRAME_UNCOMPRESSED_M420;
-	case V4L2_PIX_FMT_NV12:			return core::RAW_FRAME_UNCOMPRESSED_NV12;
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV12M:		return core::RAW_FRAME_UNCOMPRESSED_NV12;
 //									return core::RAW_FRAME_UNCOMPRESSED_YCbCr;
 	case V4L2_PIX_FMT_RGB565:		return core::RAW_FRAME_UNCOMPRESSED_RGB565;
 	case V4L2_PIX_FMT_RGB24:		return core::RAW_FRAME_UNCOMPRESSED_RGB;
@@ -167,6 +174,175 @@ int xioctl(int fd, int request, void *arg) {
 	RETURN(r, int);
 }
 
+/**
+ * v4l2機器が映像取得に使うバッファータイプを取得する
+ * シングルプレーンに対応していればV4L2_BUF_TYPE_VIDEO_CAPTURE,
+ * マルチプレーンのみに対応していればV4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+ * @param fd v4l2機器のファイルディスクリプタ
+ * @return 映像取得できないv4l2機器なら0
+ */
+uint32_t get_capture_buf_type(int fd) {
+	ENTER();
+
+	struct v4l2_capability cap{};
+	if (UNLIKELY(xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1)) {
+		LOGE("VIDIOC_QUERYCAP,errno=%d", errno);
+		RETURN(0, uint32_t);
+	}
+	// 複数の機能を持つ機器はdevice_capsでこのデバイスファイルの機能を確認する
+	const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+		? cap.device_caps : cap.capabilities;
+	uint32_t result = 0;
+	if (caps & V4L2_CAP_VIDEO_CAPTURE) {
+		result = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	} else if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+		result = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	}
+
+	RETURN(result, uint32_t);
+}
+
+/**
+ * VIDIOC_DQBUFで取得したv4l2_bufferのタイムスタンプ・シーケンス番号・フラグをbuffer_tへセットする
+ * マルチプレーンのときは各プレーンのdata_offsetもセットする
+ * @param buffer
+ * @param buf
+ */
+void update_buffer_info(buffer_t &buffer, const struct v4l2_buffer &buf) {
+	buffer.timestamp = s2ns(buf.timestamp.tv_sec) + us2ns(buf.timestamp.tv_usec);
+	buffer.sequence = buf.sequence;
+	buffer.flags = buf.flags;
+	if (V4L2_TYPE_IS_MULTIPLANAR(buf.type) && buf.m.planes) {
+		const uint32_t n = MIN(buf.length, (uint32_t)MAX_BUFFER_PLANES);
+		for (uint32_t i = 0; i < n; i++) {
+			buffer.planes[i].data_offset = buf.m.planes[i].data_offset;
+		}
+	}
+}
+
+/**
+ * 前回のシーケンス番号からの欠番数(ドライバー側で破棄されたフレーム数)を取得する
+ * @param last_sequence 前回のシーケンス番号, 負なら初回, 今回のシーケンス番号で更新する
+ * @param sequence 今回のシーケンス番号
+ * @return
+ */
+uint32_t count_sequence_gap(int64_t &last_sequence, const uint32_t &sequence) {
+	uint32_t result = 0;
+	if (last_sequence >= 0) {
+		// uint32_tで計算するのでシーケンス番号が一周しても大丈夫
+		const uint32_t diff = sequence - (uint32_t)last_sequence;
+		// 巻き戻ったとき(ストリーム再開等)は欠番として扱わない
+		if ((diff > 1) && (diff < 0x80000000u)) {
+			result = diff - 1;
+		}
+	}
+	last_sequence = sequence;
+	return result;
+}
+
+/**
+ * buffer_tのタイムスタンプ・シーケンス番号・フラグをフレームへセットする
+ * UVCメタデータから露光開始時刻がわかっているときはそれを、
+ * タイムスタンプも無いときは呼び出し時のシステム時刻をPTSとする
+ * @param frame
+ * @param buffer
+ */
+void set_frame_attribute(core::BaseFrame &frame, const buffer_t &buffer) {
+	const nsecs_t pts = buffer.exposure_ts ? buffer.exposure_ts
+		: (buffer.timestamp ? buffer.timestamp : systemTime());
+	frame.update_presentationtime_us(buffer.sequence, ns2us(pts));
+	frame.flags(buffer.flags);
+}
+
+/**
+ * buffer_tのUVCペイロードヘッダー情報(pts/stc/sof)をフレームへセットする
+ * @param frame
+ * @param buffer
+ */
+void set_frame_header_info(core::IVideoFrame &frame, const buffer_t &buffer) {
+	frame.set_header_info(buffer.pts, buffer.stc, buffer.sof);
+}
+
+/**
+ * buffer_tの各プレーンのdma-bufへDMA_BUF_IOCTL_SYNCを発行する
+ * begin_cpu_access/end_cpu_accessの下請け
+ * @param buffer
+ * @param flags
+ * @return
+ */
+static int sync_dmabuf(const buffer_t &buffer, const uint64_t &flags) {
+	ENTER();
+
+	int result = 0;
+	if (buffer.dmabuf_sync) {
+		struct dma_buf_sync sync {
+			.flags = flags,
+		};
+		const uint32_t num_planes = buffer.num_planes ? buffer.num_planes : 1;
+		for (uint32_t i = 0; i < num_planes; i++) {
+			const int fd = buffer.num_planes ? buffer.planes[i].fd : buffer.fd;
+			if ((fd > 0) && (xioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) == -1)) {
+				result = -errno;
+				LOGW("DMA_BUF_IOCTL_SYNC:fd=%d,flags=0x%" PRIx64 ",errno=%d", fd, flags, -result);
+			}
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * u-dma-bufのsysfs属性sync_for_cpu/sync_for_deviceへbuffer_tのoffset/lengthの範囲の
+ * 同期要求(デバイスからの読み込み方向)を書き込む
+ * begin_cpu_access/end_cpu_accessの下請け
+ * @param buffer
+ * @param fd sync_for_cpuまたはsync_for_deviceのファイルディスクリプタ
+ * @return
+ */
+static int sync_udmabuf(const buffer_t &buffer, const int &fd) {
+	ENTER();
+
+	int result = 0;
+	if ((fd > 0) && buffer.length) {
+		// bit63-32:オフセット, bit31-4:サイズ(16バイト単位), bit3-2:方向(2=DMA_FROM_DEVICE), bit0:同期する
+		const uint64_t size = (buffer.length + 0x0f) & ~(uint64_t)0x0f;
+		const uint64_t cmd = ((uint64_t)buffer.offset << 32)
+			| (size & 0xfffffff0) | (2 << 2) | 1;
+		char str[32];
+		const int len = snprintf(str, sizeof(str), "0x%016" PRIx64, cmd);
+		if (pwrite(fd, str, len, 0) != len) {
+			result = -errno;
+			LOGW("udmabuf sync:fd=%d,cmd=%s,errno=%d", fd, str, -result);
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * mmapしたdma-bufの映像データをCPUから読み込む前に呼び出してキャッシュを同期する
+ * @param buffer
+ * @return 0: 成功, 0以外: -errno
+ */
+int begin_cpu_access(const buffer_t &buffer) {
+	if (buffer.udmabuf_sync_for_cpu > 0) {
+		return sync_udmabuf(buffer, buffer.udmabuf_sync_for_cpu);
+	}
+	return sync_dmabuf(buffer, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+}
+
+/**
+ * begin_cpu_accessの後でCPUからの読み込みが終わったときに呼び出す
+ * @param buffer
+ * @return 0: 成功, 0以外: -errno
+ */
+int end_cpu_access(const buffer_t &buffer) {
+	if (buffer.udmabuf_sync_for_device > 0) {
+		return sync_udmabuf(buffer, buffer.udmabuf_sync_for_device);
+	}
+	return sync_dmabuf(buffer, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
 /**
  * コントロール機能をIDを文字列に変換
  * @param id
@@ -785,6 +961,110 @@ void get_supported_frame_size(int fd, FormatInfoSp &format) {
 	EXIT();
 }
 
+/**
+ * 対応するピクセルフォーマットを全て取得する
+ * @param fd
+ * @param formats 取得したピクセルフォーマットを追加するstd::vector<FormatInfoSp>
+ * @param with_frames 各ピクセルフォーマットの解像度・フレームレートも取得するかどうか
+ * @return 取得したピクセルフォーマットの数
+ */
+int get_supported_formats(int fd, std::vector<FormatInfoSp> &formats, const bool &with_frames) {
+	ENTER();
+
+	int result = 0;
+	int r = 0;
+	// マルチプレーンのみに対応している機器はV4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANEで列挙する
+	const uint32_t buf_type = get_capture_buf_type(fd);
+	for (int i = 0 ; buf_type && (r != -1); i++) {
+		struct v4l2_fmtdesc fmt {
+			.type = buf_type,
+		};
+		fmt.index = i;
+		r = xioctl(fd, VIDIOC_ENUM_FMT, &fmt);
+		if (r != -1) {
+			LOGV("%i)%s(%s)", fmt.index,
+				V4L2_PIX_FMT_to_string(fmt.pixelformat).c_str(),
+				fmt.description);
+			auto format = std::make_shared<format_info_t>(i, fmt.pixelformat);
+			if (with_frames) {
+				get_supported_frame_size(fd, format);
+			}
+			formats.push_back(format);
+			result++;
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * v4l2_frmivalenumが指定したフレームレートに対応しているかどうかを確認
+ * ::find_fpsの下請け
+ * @param fmt
+ * @param min_fps
+ * @param max_fps
+ * @return 0: 対応している, 0以外: 対応していない
+ */
+int match_fps(const struct v4l2_frmivalenum &fmt, const float &min_fps, const float &max_fps) {
+	int result = core::USB_ERROR_NOT_SUPPORTED;
+
+	switch (fmt.type) {
+	case V4L2_FRMIVAL_TYPE_DISCRETE:
+		{
+			const float fps = (float)fmt.discrete.numerator / (float)fmt.discrete.denominator;
+			result = (fps >= min_fps) && (fps < max_fps);
+#if defined(USE_LOGD)
+			if (!result) {
+				LOGD("found DISCRETE%i:fmt=%s,sz(%dx%d),fps=%d/%d",
+					fmt.index,
+					V4L2_PIX_FMT_to_string(fmt.pixel_format).c_str(),
+					fmt.width, fmt.height,
+					fmt.discrete.numerator, fmt.discrete.denominator);
+			}
+#endif
+		}
+		break;
+	case V4L2_FRMIVAL_TYPE_CONTINUOUS:
+		{
+			const float min = (float)fmt.stepwise.min.numerator / (float)fmt.stepwise.min.denominator;
+			const float max = (float)fmt.stepwise.max.numerator / (float)fmt.stepwise.max.denominator;
+			result = ((min >= min_fps) && (min < max_fps))
+				|| ((max >= min_fps) && (max < max_fps));
+#if defined(USE_LOGD)
+			if (!result) {
+				LOGD("found STEPWISE%i:fmt=%s,sz(%dx%d),fps=%d/%d-%d/%d",
+					fmt.index,
+					V4L2_PIX_FMT_to_string(fmt.pixel_format).c_str(),
+					fmt.width, fmt.height,
+					fmt.stepwise.min.numerator, fmt.stepwise.min.denominator,
+					fmt.stepwise.max.numerator, fmt.stepwise.max.denominator);
+			}
+#endif
+		}
+		break;
+	case V4L2_FRMIVAL_TYPE_STEPWISE:
+		{
+			const float min = (float)fmt.stepwise.min.numerator / (float)fmt.stepwise.min.denominator;
+			const float max = (float)fmt.stepwise.max.numerator / (float)fmt.stepwise.max.denominator;
+			result = ((min >= min_fps) && (min < max_fps))
+				|| ((max >= min_fps) && (max < max_fps));
+#if defined(USE_LOGD)
+			if (!result) {
+				LOGD("found STEPWISE%i:fmt=%s,sz(%dx%d),fps=%d/%d-%d/%d((%d/%d)", fmt.index,
+					V4L2_PIX_FMT_to_string(fmt.pixel_format).c_str(),
+					fmt.width, fmt.height,
+					fmt.stepwise.min.numerator, fmt.stepwise.min.denominator,
+					fmt.stepwise.max.numerator, fmt.stepwise.max.denominator,
+					fmt.stepwise.step.numerator, fmt.stepwise.step.denominator);
+			}
+#endif
+		}
+		break;
+	}
+
+	return result;
+}
+
 /**
  * 指定したピクセルフォーマット・解像度・フレームレートに対応しているかどうかを確認
  * ::find_stream, ::find_frameの下請け
@@ -815,59 +1095,7 @@ int find_fps(int fd,
 		fmt.index = i;
 		r = xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &fmt);
 		if (r != -1) {
-			switch (fmt.type) {
-			case V4L2_FRMIVAL_TYPE_DISCRETE:
-				{
-					const float fps = (float)fmt.discrete.numerator / (float)fmt.discrete.denominator;
-					result = (fps >= min_fps) && (fps < max_fps);
-#if defined(USE_LOGD)
-					if (!result) {
-						LOGD("found DISCRETE%i:fmt=%s,sz(%dx%d),fps=%d/%d",
-							fmt.index,
-							V4L2_PIX_FMT_to_string(fmt.pixel_format).c_str(),
-							fmt.width, fmt.height,
-							fmt.discrete.numerator, fmt.discrete.denominator);
-					}
-#endif
-				}
-				break;
-			case V4L2_FRMIVAL_TYPE_CONTINUOUS:
-				{
-					const float min = (float)fmt.stepwise.min.numerator / (float)fmt.stepwise.min.denominator;
-					const float max = (float)fmt.stepwise.max.numerator / (float)fmt.stepwise.max.denominator;
-					result = ((min >= min_fps) && (min < max_fps))
-						|| ((max >= min_fps) && (max < max_fps));
-#if defined(USE_LOGD)
-					if (!result) {
-						LOGD("found STEPWISE%i:fmt=%s,sz(%dx%d),fps=%d/%d-%d/%d",
-							fmt.index,
-							V4L2_PIX_FMT_to_string(fmt.pixel_format).c_str(),
-							fmt.width, fmt.height,
-							fmt.stepwise.min.numerator, fmt.stepwise.min.denominator,
-							fmt.stepwise.max.numerator, fmt.stepwise.max.denominator);
-					}
-#endif
-				}
-				break;
-			case V4L2_FRMIVAL_TYPE_STEPWISE:
-				{
-					const float min = (float)fmt.stepwise.min.numerator / (float)fmt.stepwise.min.denominator;
-					const float max = (float)fmt.stepwise.max.numerator / (float)fmt.stepwise.max.denominator;
-					result = ((min >= min_fps) && (min < max_fps))
-						|| ((max >= min_fps) && (max < max_fps));
-#if defined(USE_LOGD)
-					if (!result) {
-						LOGD("found STEPWISE%i:fmt=%s,sz(%dx%d),fps=%d/%d-%d/%d((%d/%d)", fmt.index,
-							V4L2_PIX_FMT_to_string(fmt.pixel_format).c_str(),
-							fmt.width, fmt.height,
-							fmt.stepwise.min.numerator, fmt.stepwise.min.denominator,
-							fmt.stepwise.max.numerator, fmt.stepwise.max.denominator,
-							fmt.stepwise.step.numerator, fmt.stepwise.step.denominator);
-					}
-#endif
-				}
-				break;
-			}
+			result = match_fps(fmt, min_fps, max_fps);
 		} else if (i == 0) {
 			// なぜかフレームレートを取得できないときがあるのでその場合は見つかったことにする
 			LOGD("not found, r=%d,errno=%d", r, errno);
@@ -947,6 +1175,40 @@ int find_frame_size(int fd,
 	RETURN(result, int);
 }
 
+/**
+ * 取得済みの解像度・フレームレート一覧から
+ * 指定した解像度・フレームレートに対応しているかどうかを確認
+ * @param frames
+ * @param width
+ * @param height
+ * @param min_fps
+ * @param max_fps
+ * @return 0: 対応している, 0以外: 対応していない
+ */
+int find_frame_size(const std::vector<FrameInfoSp> &frames,
+	const uint32_t &width, const uint32_t &height,
+	const float &min_fps, const float &max_fps) {
+
+	ENTER();
+
+	int result = core::USB_ERROR_NOT_SUPPORTED;
+	for (const auto &frame: frames) {
+		if ((frame->width != width) || (frame->height != height)) continue;
+		if (frame->frame_rates.empty()) {
+			// find_fpsと同様にフレームレートを取得できなかったときは見つかったことにする
+			result = core::USB_SUCCESS;
+		} else {
+			for (const auto &fps: frame->frame_rates) {
+				result = match_fps(*fps, min_fps, max_fps);
+				if (!result) break;
+			}
+		}
+		if (!result) break;
+	}
+
+	RETURN(result, int);
+}
+
 /**
  * 指定したピクセルフォーマットのフレームサイズ設定の数を取得する
  * @param fd
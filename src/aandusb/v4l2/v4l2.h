@@ -18,6 +18,7 @@
 
 // common
 #include "json_helper.h"
+#include "times.h"
 // uvc
 #include "uvc/aanduvc.h"
 
@@ -41,11 +42,98 @@ typedef enum _state {
 	STATE_STREAM,		// カメラ映像取得中
 } state_t;
 
+/**
+ * マルチプレーン(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)のときに扱う最大プレーン数
+ * (NV12M/NV21Mは2プレーン, YUV420M/YVU420Mは3プレーン)
+ */
+#define MAX_BUFFER_PLANES (3)
+
+/**
+ * 映像受け取りバッファーの1プレーン分の情報
+ */
+typedef struct _plane {
+	/**
+	 * VIDIOC_EXPBUFでエクスポートしたdma-bufのファイルディスクリプタ, エクスポートしていなければ0
+	 */
+	int fd;
+	/**
+	 * mmapしたプレーンの先頭ポインタ, mmapできなければMAP_FAILED
+	 */
+	void *start;
+	/**
+	 * fdの先頭からの位置
+	 */
+	size_t offset;
+	/**
+	 * プレーンのバッファーサイズ
+	 */
+	size_t length;
+	/**
+	 * 1行分のバイト数(v4l2_plane_pix_format.bytesperline)
+	 * 行末に詰め物があるときは横幅x1ピクセルあたりのバイト数より大きい, 0なら隙間なく詰まっている
+	 */
+	uint32_t bytesperline;
+	/**
+	 * 最後にVIDIOC_DQBUFしたときのプレーンの先頭から映像データまでのバイト数(v4l2_plane.data_offset)
+	 * シングルプレーンなら常に0
+	 */
+	uint32_t data_offset;
+} plane_t;
+
 typedef struct _buffer {
+	/**
+	 * fd/start/offset/lengthは先頭プレーンの値
+	 */
 	int fd;
 	void *start;
 	size_t offset;
 	size_t length;
+	/**
+	 * プレーン数, シングルプレーン(V4L2_BUF_TYPE_VIDEO_CAPTURE)なら1
+	 */
+	uint32_t num_planes;
+	/**
+	 * fd(マルチプレーンなら各plane_t::fd)がdma-bufで
+	 * CPUからアクセスするときにDMA_BUF_IOCTL_SYNCでキャッシュを同期する必要があるかどうか
+	 * (VIDIOC_EXPBUFでエクスポートしたものか呼び出し元が確保したdma-buf)
+	 */
+	bool dmabuf_sync;
+	/**
+	 * u-dma-buf(udmabuf)のsysfs属性sync_for_cpu/sync_for_deviceのファイルディスクリプタ
+	 * udmabufを使うときだけセットされる, それ以外は0
+	 * CPUからアクセスするときにoffset/lengthの範囲のキャッシュを同期するために使う
+	 */
+	int udmabuf_sync_for_cpu;
+	int udmabuf_sync_for_device;
+	/**
+	 * 各プレーンの情報, planes[0]は先頭プレーン(fd/start/offset/lengthと同じ)
+	 */
+	plane_t planes[MAX_BUFFER_PLANES];
+	/**
+	 * 最後にVIDIOC_DQBUFしたときのv4l2_buffer.timestamp[ナノ秒]
+	 */
+	nsecs_t timestamp;
+	/**
+	 * 最後にVIDIOC_DQBUFしたときのv4l2_buffer.sequence
+	 */
+	uint32_t sequence;
+	/**
+	 * 最後にVIDIOC_DQBUFしたときのv4l2_buffer.flags
+	 * V4L2_BUF_FLAG_TIMESTAMP_MASK/V4L2_BUF_FLAG_TSTAMP_SRC_MASKでタイムスタンプの種類と取得タイミングがわかる
+	 */
+	uint32_t flags;
+	/**
+	 * UVCメタデータノードから取得したペイロードヘッダーのdwPresentationTime/SCR
+	 * メタデータを使わないか対応するメタデータが無いときは0
+	 */
+	uint32_t pts;
+	uint32_t stc;
+	uint32_t sof;
+	/**
+	 * ptsをホスト側のCLOCK_MONOTONICへ変換した露光開始時刻[ナノ秒]
+	 * 不明なときは0
+	 */
+	nsecs_t exposure_ts;
 } buffer_t;
 
 typedef std::shared_ptr<struct v4l2_queryctrl> QueryCtrlSp;
@@ -99,6 +187,64 @@ uint32_t raw_frame_to_V4L2_PIX_FMT(const core::raw_frame_t &frame_type);
  * @return
  */
 int xioctl(int fd, int request, void *arg);
+/**
+ * v4l2機器が映像取得に使うバッファータイプを取得する
+ * シングルプレーンに対応していればV4L2_BUF_TYPE_VIDEO_CAPTURE,
+ * マルチプレーンのみに対応していればV4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+ * @param fd v4l2機器のファイルディスクリプタ
+ * @return 映像取得できないv4l2機器なら0
+ */
+uint32_t get_capture_buf_type(int fd);
+
+/**
+ * VIDIOC_DQBUFで取得したv4l2_bufferのタイムスタンプ・シーケンス番号・フラグをbuffer_tへセットする
+ * マルチプレーンのときは各プレーンのdata_offsetもセットする
+ * @param buffer
+ * @param buf
+ */
+void update_buffer_info(buffer_t &buffer, const struct v4l2_buffer &buf);
+/**
+ * 前回のシーケンス番号からの欠番数(ドライバー側で破棄されたフレーム数)を取得する
+ * @param last_sequence 前回のシーケンス番号, 負なら初回, 今回のシーケンス番号で更新する
+ * @param sequence 今回のシーケンス番号
+ * @return
+ */
+uint32_t count_sequence_gap(int64_t &last_sequence, const uint32_t &sequence);
+/**
+ * buffer_tのタイムスタンプ・シーケンス番号・フラグをフレームへセットする
+ * UVCメタデータから露光開始時刻がわかっているときはそれを、
+ * タイムスタンプも無いときは呼び出し時のシステム時刻をPTSとする
+ * @param frame
+ * @param buffer
+ */
+void set_frame_attribute(core::BaseFrame &frame, const buffer_t &buffer);
+/**
+ * buffer_tのUVCペイロードヘッダー情報(pts/stc/sof)をフレームへセットする
+ * @param frame
+ * @param buffer
+ */
+void set_frame_header_info(core::IVideoFrame &frame, const buffer_t &buffer);
+
+/**
+ * mmapしたdma-bufの映像データをCPUから読み込む前に呼び出してキャッシュを同期する
+ * (DMA_BUF_IOCTL_SYNC, DMA_BUF_SYNC_START|DMA_BUF_SYNC_READ)
+ * udmabufならsysfsのsync_for_cpuへ書き込んでoffset/lengthの範囲を同期する
+ * キャッシュ有効でmmapしたままCPUから高速に読み込めるようにするため
+ * EGLImage等でGPUからだけアクセスするときは呼び出さなくて良い
+ * dma-bufでもudmabufでもなければ何もしない
+ * @param buffer
+ * @return 0: 成功, 0以外: -errno
+ */
+int begin_cpu_access(const buffer_t &buffer);
+/**
+ * begin_cpu_accessの後でCPUからの読み込みが終わったときに呼び出す
+ * (DMA_BUF_IOCTL_SYNC, DMA_BUF_SYNC_END|DMA_BUF_SYNC_READ)
+ * udmabufならsysfsのsync_for_deviceへ書き込んで所有権をデバイスへ戻す
+ * dma-bufでもudmabufでもなければ何もしない
+ * @param buffer
+ * @return 0: 成功, 0以外: -errno
+ */
+int end_cpu_access(const buffer_t &buffer);
 
 /**
  * コントロール機能をIDを文字列に変換
@@ -170,6 +316,25 @@ void get_supported_fps(int fd, const FrameInfoSp &frame);
  */
 void get_supported_frame_size(int fd, FormatInfoSp &format);
 
+/**
+ * 対応するピクセルフォーマットを全て取得する
+ * @param fd
+ * @param formats 取得したピクセルフォーマットを追加するstd::vector<FormatInfoSp>
+ * @param with_frames 各ピクセルフォーマットの解像度・フレームレートも取得するかどうか
+ * @return 取得したピクセルフォーマットの数
+ */
+int get_supported_formats(int fd, std::vector<FormatInfoSp> &formats, const bool &with_frames = true);
+
+/**
+ * v4l2_frmivalenumが指定したフレームレートに対応しているかどうかを確認
+ * ::find_fpsの下請け
+ * @param fmt
+ * @param min_fps
+ * @param max_fps
+ * @return 0: 対応している, 0以外: 対応していない
+ */
+int match_fps(const struct v4l2_frmivalenum &fmt, const float &min_fps, const float &max_fps);
+
 /**
  * 指定したピクセルフォーマット・解像度・フレームレートに対応しているかどうかを確認
  * ::find_stream, ::find_frameの下請け
@@ -202,6 +367,21 @@ int find_frame_size(int fd,
 	const uint32_t &width, const uint32_t &height,
 	const float &min_fps, const float &max_fps);
 
+/**
+ * 取得済みの解像度・フレームレート一覧から
+ * 指定した解像度・フレームレートに対応しているかどうかを確認
+ * get_supported_frame_sizeと同様に離散値の解像度のみ対応
+ * @param frames
+ * @param width
+ * @param height
+ * @param min_fps
+ * @param max_fps
+ * @return 0: 対応している, 0以外: 対応していない
+ */
+int find_frame_size(const std::vector<FrameInfoSp> &frames,
+	const uint32_t &width, const uint32_t &height,
+	const float &min_fps, const float &max_fps);
+
 /**
  * 指定したピクセルフォーマットのフレームサイズ設定の数を取得する
  * @param fd
@@ -0,0 +1,498 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2AnalysisSource"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "utilbase.h"
+#include "charutils.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_analysis_source.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * 解析用映像ノードを探すときに調べる/dev/videoNの最大数
+ */
+#define MAX_VIDEO_DEVICES (64)
+
+/**
+ * 解析用映像のピクセルフォーマット, 前にあるものを優先する
+ * 輝度成分を直接読めるものだけ
+ */
+static const uint32_t ANALYSIS_PIXEL_FORMATS[] {
+	V4L2_PIX_FMT_GREY,
+	V4L2_PIX_FMT_NV12,
+	V4L2_PIX_FMT_NV21,
+	V4L2_PIX_FMT_YUV420,
+	V4L2_PIX_FMT_YVU420,
+	V4L2_PIX_FMT_YUYV,
+	V4L2_PIX_FMT_UYVY,
+};
+
+/**
+ * 指定した映像サイズに対応していないときに試す映像サイズ, 前にあるものを優先する
+ */
+static const uint32_t ANALYSIS_FALLBACK_SIZES[][2] {
+	{ 320, 240 },
+	{ 320, 180 },
+	{ 424, 240 },
+	{ 640, 360 },
+	{ 640, 480 },
+	{ 160, 120 },
+};
+
+/**
+ * コンストラクタ
+ * @param device_name 解析用映像を受け取るv4l2機器名
+ */
+/*public*/
+V4l2AnalysisSource::V4l2AnalysisSource(std::string device_name)
+:	source(std::make_unique<V4l2Source>(std::move(device_name), true)),
+	on_analysis(),
+	motion_threshold(DEFAULT_MOTION_THRESHOLD),
+	stream_width(0), stream_height(0),
+	prev_luma(), history(), history_head(0), history_count(0),
+	analyzed_frames(0)
+{
+	ENTER();
+
+	source->set_on_frame_ready([this](const uint8_t *image, const size_t &bytes, const buffer_t &buffer) {
+		return on_frame(image, bytes, buffer);
+	});
+
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2AnalysisSource::~V4l2AnalysisSource() noexcept {
+	ENTER();
+
+	stop();
+
+	EXIT();
+}
+
+/**
+ * 映像ノードと同じ機器の別の映像取得ノードを探す
+ * @param video_device 表示用映像を受け取る映像ノードのデバイスファイル名
+ * @return 見つからなければ空文字列
+ */
+/*public,static*/
+std::string V4l2AnalysisSource::find_capture_device(const std::string &video_device) {
+	ENTER();
+
+	std::string result;
+	struct v4l2_capability video_cap{};
+	int fd = ::open(video_device.c_str(), O_RDWR | O_NONBLOCK, 0);
+	if (fd < 0) {
+		LOGW("Cannot open '%s',errno=%d", video_device.c_str(), errno);
+		RET(result);
+	}
+	const bool ok = xioctl(fd, VIDIOC_QUERYCAP, &video_cap) != -1;
+	::close(fd);
+	if (UNLIKELY(!ok)) {
+		RET(result);
+	}
+	for (int i = 0; i < MAX_VIDEO_DEVICES; i++) {
+		const auto name = format("/dev/video%d", i);
+		if (name == video_device) {
+			continue;
+		}
+		fd = ::open(name.c_str(), O_RDWR | O_NONBLOCK, 0);
+		if (fd < 0) {
+			continue;
+		}
+		struct v4l2_capability cap{};
+		if (xioctl(fd, VIDIOC_QUERYCAP, &cap) != -1) {
+			const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+				? cap.device_caps : cap.capabilities;
+			// UVC機器のメタデータノードは映像取得ノードではないので除外される
+			if ((caps & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE))
+				&& !strncmp((const char *)cap.bus_info, (const char *)video_cap.bus_info, sizeof(cap.bus_info))) {
+				result = name;
+			}
+		}
+		::close(fd);
+		if (!result.empty()) {
+			LOGD("found %s for %s", result.c_str(), video_device.c_str());
+			break;
+		}
+	}
+
+	RET(result);
+}
+
+/**
+ * 解析用v4l2機器をオープンして映像取得を開始する
+ * 指定した映像サイズに対応していなければ対応している小さい映像サイズを探す
+ * @param width
+ * @param height
+ * @return 0: 成功, 0以外: エラー
+ */
+/*public*/
+int V4l2AnalysisSource::start(const uint32_t &width, const uint32_t &height) {
+	ENTER();
+
+	if (UNLIKELY(source->is_running())) {
+		LOGW("Illegal state: already started");
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+	int result = source->open();
+	if (UNLIKELY(result)) {
+		LOGW("failed to open analysis device,err=%d", result);
+		RETURN(result, int);
+	}
+
+	// 指定した映像サイズを優先して輝度成分を直接読めるピクセルフォーマットを探す
+	std::vector<std::pair<uint32_t, uint32_t>> sizes;
+	sizes.emplace_back(width, height);
+	for (const auto &sz : ANALYSIS_FALLBACK_SIZES) {
+		if ((sz[0] != width) || (sz[1] != height)) {
+			sizes.emplace_back(sz[0], sz[1]);
+		}
+	}
+	uint32_t w = 0, h = 0, pixel_format = 0;
+	for (const auto &sz : sizes) {
+		for (const auto &fmt : ANALYSIS_PIXEL_FORMATS) {
+			if (!source->find_stream(sz.first, sz.second, fmt)) {
+				w = sz.first;
+				h = sz.second;
+				pixel_format = fmt;
+				break;
+			}
+		}
+		if (pixel_format) break;
+	}
+	if (UNLIKELY(!pixel_format)) {
+		// MJPEG等の圧縮フォーマットは輝度成分を直接読めないので対応しない
+		LOGW("no supported stream for analysis");
+		source->close();
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	result = source->resize(w, h, pixel_format);
+	if (UNLIKELY(result)) {
+		LOGW("failed to resize analysis stream,err=%d", result);
+		source->close();
+		RETURN(result, int);
+	}
+
+	analysis_lock.lock();
+	{
+		stream_width = w;
+		stream_height = h;
+		history_head = history_count = 0;
+	}
+	analysis_lock.unlock();
+	// 動き検出用の前フレームはワーカースレッド上でしか触らないので映像取得開始前にクリアする
+	prev_luma.clear();
+	analyzed_frames = 0;
+
+	result = source->start();
+	if (UNLIKELY(result)) {
+		LOGW("failed to start analysis stream,err=%d", result);
+		source->close();
+	} else {
+		LOGI("analysis stream(%ux%u,0x%08x)", w, h, pixel_format);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像取得を停止して解析用v4l2機器を閉じる
+ * ワーカースレッドが終了するのを待つのでanalysis_lockをロックしていない状態で呼び出すこと
+ * @return
+ */
+/*public*/
+int V4l2AnalysisSource::stop() {
+	ENTER();
+
+	source->stop();
+	const int result = source->close();
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像取得中かどうか
+ * @return
+ */
+/*public*/
+bool V4l2AnalysisSource::is_running() const {
+	return source->is_running();
+}
+
+/**
+ * 解析用v4l2機器名を変更する
+ * 再接続時にデバイスファイル名が変わったときに使う, 映像取得中は変更できない
+ * @param device_name
+ * @return
+ */
+/*public*/
+int V4l2AnalysisSource::set_device_name(const std::string &device_name) {
+	return source->set_device_name(device_name);
+}
+
+/**
+ * 解析結果を受け取るコールバックをセット
+ * @param callback
+ * @return
+ */
+/*public*/
+V4l2AnalysisSource &V4l2AnalysisSource::set_on_analysis(OnAnalysisFunc callback) {
+	AutoMutex lock(analysis_lock);
+	on_analysis = std::move(callback);
+	return *this;
+}
+
+/**
+ * 動き検出で動いたとみなす輝度差を設定
+ * @param threshold [1,255]
+ * @return
+ */
+/*public*/
+V4l2AnalysisSource &V4l2AnalysisSource::set_motion_threshold(const int &threshold) {
+	AutoMutex lock(analysis_lock);
+	motion_threshold = threshold < 1 ? 1 : (threshold > 255 ? 255 : threshold);
+	return *this;
+}
+
+/**
+ * 最新の解析結果を取得
+ * @param result
+ * @return 0: 成功, 0以外: 解析結果がない
+ */
+/*public*/
+int V4l2AnalysisSource::get_latest(analysis_result_t &result) const {
+	AutoMutex lock(analysis_lock);
+	if (!history_count) {
+		return core::USB_ERROR_NOT_FOUND;
+	}
+	result = history[(history_head + ANALYSIS_HISTORY_NUMS - 1) % ANALYSIS_HISTORY_NUMS];
+	return core::USB_SUCCESS;
+}
+
+/**
+ * 指定したタイムスタンプに最も近い解析結果を取得
+ * 表示用映像のフレームに対応する解析結果を探すときに使う
+ * @param timestamp 表示用映像のv4l2_buffer.timestamp[ナノ秒]
+ * @param result
+ * @param tolerance_ns タイムスタンプの差の最大値[ナノ秒]
+ * @return 0: 成功, 0以外: 許容範囲内の解析結果がない
+ */
+/*public*/
+int V4l2AnalysisSource::find(const nsecs_t &timestamp, analysis_result_t &result,
+	const nsecs_t &tolerance_ns) const {
+
+	AutoMutex lock(analysis_lock);
+	int found = -1;
+	nsecs_t min_diff = tolerance_ns;
+	for (uint32_t i = 0; i < history_count; i++) {
+		const auto ix = (history_head + ANALYSIS_HISTORY_NUMS - 1 - i) % ANALYSIS_HISTORY_NUMS;
+		const auto diff = std::abs(history[ix].timestamp - timestamp);
+		if (diff <= min_diff) {
+			min_diff = diff;
+			found = (int)ix;
+		}
+	}
+	if (found < 0) {
+		return core::USB_ERROR_NOT_FOUND;
+	}
+	result = history[found];
+	return core::USB_SUCCESS;
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * 解析用V4l2Sourceからのフレームを受け取ったときの処理
+ * 解析用V4l2Sourceのワーカースレッド上で呼ばれる
+ * @param image
+ * @param bytes
+ * @param buffer
+ * @return
+ */
+/*private*/
+int V4l2AnalysisSource::on_frame(const uint8_t *image, const size_t &bytes, const buffer_t &buffer) {
+	ENTER();
+
+	// マルチプレーンのときも輝度成分は先頭プレーンにある
+	const uint8_t *luma = buffer.num_planes > 1
+		? (const uint8_t *)buffer.planes[0].start + buffer.planes[0].data_offset
+		: image;
+	if (UNLIKELY(!luma || (luma == MAP_FAILED))) {
+		RETURN(0, int);
+	}
+	int pixel_step;
+	switch (source->get_pixel_format()) {
+	case V4L2_PIX_FMT_YUYV:
+		pixel_step = 2;
+		break;
+	case V4L2_PIX_FMT_UYVY:
+		luma++;
+		pixel_step = 2;
+		break;
+	case V4L2_PIX_FMT_GREY:
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV21M:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+	case V4L2_PIX_FMT_YUV420M:
+	case V4L2_PIX_FMT_YVU420M:
+		pixel_step = 1;
+		break;
+	default:
+		LOGW("unsupported pixel format,0x%08x", source->get_pixel_format());
+		RETURN(0, int);
+	}
+
+	analysis_result_t result{};
+	analysis_lock.lock();
+	{
+		result.width = stream_width;
+		result.height = stream_height;
+	}
+	analysis_lock.unlock();
+	// 行末に詰め物があるときはbytesperlineを使う
+	const int row_bytes = buffer.planes[0].bytesperline
+		? (int)buffer.planes[0].bytesperline : (int)result.width * pixel_step;
+	if (UNLIKELY(!result.width || !result.height
+		|| ((buffer.num_planes <= 1) && (bytes < (size_t)row_bytes * (result.height - 1) + result.width * pixel_step)))) {
+		LOGW("unexpected frame size,bytes=%zu", bytes);
+		RETURN(0, int);
+	}
+	// 表示用映像とはv4l2_buffer.timestampで突き合わせるので露光開始時刻は使わない
+	result.timestamp = buffer.timestamp;
+	result.sequence = buffer.sequence;
+
+	const bool cpu_access = !begin_cpu_access(buffer);
+	analyze(luma, pixel_step, row_bytes, result);
+	if (cpu_access) {
+		end_cpu_access(buffer);
+	}
+	analyzed_frames++;
+
+	OnAnalysisFunc callback;
+	analysis_lock.lock();
+	{
+		history[history_head] = result;
+		history_head = (history_head + 1) % ANALYSIS_HISTORY_NUMS;
+		if (history_count < ANALYSIS_HISTORY_NUMS) {
+			history_count++;
+		}
+		callback = on_analysis;
+	}
+	analysis_lock.unlock();
+	if (callback) {
+		callback(result);
+	}
+
+	RETURN((int)bytes, int);
+}
+
+/**
+ * 輝度成分を解析する
+ * 1回の走査で輝度統計・前フレームとの差分・輝度勾配を求める
+ * @param luma 輝度成分の先頭
+ * @param pixel_step 横方向の隣の画素までのバイト数
+ * @param row_bytes 1行分のバイト数
+ * @param result
+ */
+/*private*/
+void V4l2AnalysisSource::analyze(
+	const uint8_t *luma, const int &pixel_step, const int &row_bytes,
+	analysis_result_t &result) {
+
+	ENTER();
+
+	const int w = (int)result.width;
+	const int h = (int)result.height;
+	const auto pixels = (size_t)w * h;
+	const bool has_prev = prev_luma.size() == pixels;
+	if (!has_prev) {
+		prev_luma.resize(pixels);
+	}
+	int threshold;
+	analysis_lock.lock();
+	{
+		threshold = motion_threshold;
+	}
+	analysis_lock.unlock();
+
+	uint64_t sum = 0, sum_sq = 0, diff_sum = 0, grad_sum = 0;
+	uint32_t moved = 0;
+	uint8_t *prev = prev_luma.data();
+	for (int y = 0; y < h; y++) {
+		const uint8_t *row = luma + (size_t)row_bytes * y;
+		// 最終行は垂直方向の勾配を計算しない
+		const uint8_t *next_row = y < h - 1 ? row + row_bytes : nullptr;
+		for (int x = 0; x < w; x++, prev++) {
+			const int v = row[x * pixel_step];
+			sum += v;
+			sum_sq += v * v;
+			result.histogram[(v * ANALYSIS_HISTOGRAM_BINS) >> 8]++;
+			if (has_prev) {
+				const int diff = std::abs(v - (int)*prev);
+				diff_sum += diff;
+				if (diff > threshold) {
+					moved++;
+				}
+			}
+			*prev = (uint8_t)v;
+			if (x < w - 1) {
+				const int dx = (int)row[(x + 1) * pixel_step] - v;
+				grad_sum += dx * dx;
+			}
+			if (next_row) {
+				const int dy = (int)next_row[x * pixel_step] - v;
+				grad_sum += dy * dy;
+			}
+		}
+	}
+	const auto n = (double)pixels;
+	const double mean = (double)sum / n;
+	result.brightness = (float)mean;
+	result.contrast = (float)std::sqrt(std::max(0.0, (double)sum_sq / n - mean * mean));
+	if (has_prev) {
+		result.motion = (float)((double)diff_sum / n);
+		result.motion_ratio = (float)((double)moved / n);
+	}
+	result.focus = (float)((double)grad_sum / n);
+
+	EXIT();
+}
+
+}	// namespace serenegiant::v4l2
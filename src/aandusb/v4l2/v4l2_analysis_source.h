@@ -0,0 +1,247 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_ANALYSIS_SOURCE_H
+#define AANDUSB_V4L2_ANALYSIS_SOURCE_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// common
+#include "mutex.h"
+#include "times.h"
+// v4l2
+#include "v4l2/v4l2_source.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * 解析用映像のデフォルトの幅と高さ
+ */
+#define DEFAULT_ANALYSIS_WIDTH (320)
+#define DEFAULT_ANALYSIS_HEIGHT (240)
+/**
+ * 解析結果の輝度ヒストグラムのビン数
+ */
+#define ANALYSIS_HISTOGRAM_BINS (16)
+/**
+ * タイムスタンプで検索できるように保持する解析結果の数
+ */
+#define ANALYSIS_HISTORY_NUMS (16)
+/**
+ * 動き検出で動いたとみなす前フレームとの輝度差のデフォルト値
+ */
+#define DEFAULT_MOTION_THRESHOLD (24)
+/**
+ * 表示用映像と解析結果を対応付けるときのタイムスタンプの差の最大値のデフォルト値[ナノ秒]
+ */
+#define DEFAULT_ANALYSIS_TOLERANCE_NS (20000000LL)
+
+/**
+ * 解析用映像1フレーム分の解析結果
+ */
+typedef struct _analysis_result {
+	/**
+	 * v4l2_buffer.timestamp[ナノ秒]
+	 * 表示用映像側がUVCメタデータを使っていても同じ基準で突き合わせられるように
+	 * 露光開始時刻(buffer_t::exposure_ts)は使わない
+	 */
+	nsecs_t timestamp;
+	/**
+	 * v4l2_buffer.sequence
+	 */
+	uint32_t sequence;
+	uint32_t width;
+	uint32_t height;
+	/**
+	 * 平均輝度[0,255]
+	 */
+	float brightness;
+	/**
+	 * 輝度の標準偏差
+	 */
+	float contrast;
+	/**
+	 * 輝度ヒストグラム(画素数)
+	 */
+	uint32_t histogram[ANALYSIS_HISTOGRAM_BINS];
+	/**
+	 * 前フレームとの輝度差の絶対値の平均, 前フレームが無ければ0
+	 */
+	float motion;
+	/**
+	 * 前フレームとの輝度差が動き検出の閾値を超えた画素の割合[0,1]
+	 */
+	float motion_ratio;
+	/**
+	 * 合焦度(水平・垂直方向の輝度勾配の2乗和の平均), 大きいほどピントが合っている
+	 */
+	float focus;
+} analysis_result_t;
+
+/**
+ * 解析結果を受け取るコールバック
+ * 解析用V4l2Sourceのワーカースレッド上で呼ばれる
+ */
+typedef std::function<void(const analysis_result_t &result)> OnAnalysisFunc;
+
+/**
+ * 表示用映像とは別のv4l2機器から低解像度の映像を受け取って
+ * 輝度統計・動き検出・合焦度をCPUで計算するためのヘルパークラス
+ * 解析処理は表示用の高解像度映像に触れないので表示用映像の受け取り・描画を邪魔しない
+ * 解析結果はタイムスタンプ付きで保持するのでfindで表示用映像のフレームに対応する結果を取得できる
+ * 輝度成分を直接読めるピクセルフォーマット(YUYV/UYVY/GREY/NV12/NV21/YUV420/YVU420)のみ対応
+ */
+class V4l2AnalysisSource {
+private:
+	mutable Mutex analysis_lock;
+	/**
+	 * 解析用映像を受け取るV4l2Source
+	 */
+	V4l2SourceUp source;
+	/**
+	 * 解析結果を受け取るコールバック
+	 */
+	OnAnalysisFunc on_analysis;
+	/**
+	 * 動き検出で動いたとみなす輝度差
+	 */
+	int motion_threshold;
+	/**
+	 * 映像取得中の映像サイズ
+	 */
+	uint32_t stream_width, stream_height;
+	/**
+	 * 動き検出用の前フレームの輝度
+	 */
+	std::vector<uint8_t> prev_luma;
+	/**
+	 * 最近の解析結果のリングバッファー
+	 */
+	analysis_result_t history[ANALYSIS_HISTORY_NUMS];
+	/**
+	 * 次に解析結果を書き込むhistoryの位置
+	 */
+	uint32_t history_head;
+	/**
+	 * historyに入っている解析結果の数
+	 */
+	uint32_t history_count;
+	/**
+	 * 解析したフレーム数
+	 */
+	std::atomic<uint64_t> analyzed_frames;
+
+	/**
+	 * 解析用V4l2Sourceからのフレームを受け取ったときの処理
+	 * 解析用V4l2Sourceのワーカースレッド上で呼ばれる
+	 * @param image
+	 * @param bytes
+	 * @param buffer
+	 * @return
+	 */
+	int on_frame(const uint8_t *image, const size_t &bytes, const buffer_t &buffer);
+	/**
+	 * 輝度成分を解析する
+	 * @param luma 輝度成分の先頭
+	 * @param pixel_step 横方向の隣の画素までのバイト数
+	 * @param row_bytes 1行分のバイト数
+	 * @param result
+	 */
+	void analyze(const uint8_t *luma, const int &pixel_step, const int &row_bytes,
+		analysis_result_t &result);
+public:
+	/**
+	 * コンストラクタ
+	 * @param device_name 解析用映像を受け取るv4l2機器名
+	 */
+	explicit V4l2AnalysisSource(std::string device_name);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4l2AnalysisSource() noexcept;
+
+	/**
+	 * 映像ノードと同じ機器の別の映像取得ノードを探す
+	 * @param video_device 表示用映像を受け取る映像ノードのデバイスファイル名
+	 * @return 見つからなければ空文字列
+	 */
+	static std::string find_capture_device(const std::string &video_device);
+
+	/**
+	 * 解析用v4l2機器をオープンして映像取得を開始する
+	 * 指定した映像サイズに対応していなければ対応している小さい映像サイズを探す
+	 * @param width
+	 * @param height
+	 * @return 0: 成功, 0以外: エラー
+	 */
+	int start(
+		const uint32_t &width = DEFAULT_ANALYSIS_WIDTH,
+		const uint32_t &height = DEFAULT_ANALYSIS_HEIGHT);
+	/**
+	 * 映像取得を停止して解析用v4l2機器を閉じる
+	 * @return
+	 */
+	int stop();
+	/**
+	 * 映像取得中かどうか
+	 * @return
+	 */
+	bool is_running() const;
+
+	/**
+	 * 解析用v4l2機器名を変更する
+	 * 再接続時にデバイスファイル名が変わったときに使う, 映像取得中は変更できない
+	 * @param device_name
+	 * @return
+	 */
+	int set_device_name(const std::string &device_name);
+	/**
+	 * 解析結果を受け取るコールバックをセット
+	 * @param callback
+	 * @return
+	 */
+	V4l2AnalysisSource &set_on_analysis(OnAnalysisFunc callback);
+	/**
+	 * 動き検出で動いたとみなす輝度差を設定
+	 * @param threshold [1,255]
+	 * @return
+	 */
+	V4l2AnalysisSource &set_motion_threshold(const int &threshold);
+
+	/**
+	 * 最新の解析結果を取得
+	 * @param result
+	 * @return 0: 成功, 0以外: 解析結果がない
+	 */
+	int get_latest(analysis_result_t &result) const;
+	/**
+	 * 指定したタイムスタンプに最も近い解析結果を取得
+	 * 表示用映像のフレームに対応する解析結果を探すときに使う
+	 * @param timestamp 表示用映像のv4l2_buffer.timestamp[ナノ秒]
+	 * @param result
+	 * @param tolerance_ns タイムスタンプの差の最大値[ナノ秒]
+	 * @return 0: 成功, 0以外: 許容範囲内の解析結果がない
+	 */
+	int find(const nsecs_t &timestamp, analysis_result_t &result,
+		const nsecs_t &tolerance_ns = DEFAULT_ANALYSIS_TOLERANCE_NS) const;
+	/**
+	 * 解析したフレーム数を取得
+	 * @return
+	 */
+	inline uint64_t get_analyzed_frames() const { return analyzed_frames.load(); };
+};
+
+typedef std::unique_ptr<V4l2AnalysisSource> V4l2AnalysisSourceUp;
+typedef std::shared_ptr<V4l2AnalysisSource> V4l2AnalysisSourceSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif // AANDUSB_V4L2_ANALYSIS_SOURCE_H
@@ -0,0 +1,232 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4L2BufferFrame"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <cerrno>
+#include <utility>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "utilbase.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_buffer_frame.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * コンストラクタ
+ * @param index v4l2バッファーのインデックス
+ * @param release_callback 参照が0になったときのコールバック
+ */
+V4L2BufferFrame::V4L2BufferFrame(const uint32_t &index, OnBufferReleaseFunc release_callback)
+:	core::BaseVideoFrame(),
+	_index(index),
+	on_release(std::move(release_callback)),
+	_ref_count(0), _lendable(false),
+	buffer(nullptr), buffer_bytes(0),
+	lent(false), orphaned(false),
+	orphan_start(MAP_FAILED), orphan_length(0), orphan_fd(0)
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+V4L2BufferFrame::~V4L2BufferFrame() noexcept {
+	ENTER();
+
+	if (UNLIKELY(_ref_count.load() > 0)) {
+		LOGW("buffer %d is still lent,ref_count=%d", _index, _ref_count.load());
+	}
+	release_orphan();
+
+	EXIT();
+}
+
+/**
+ * v4l2のバッファーを割り当てる
+ * 参照カウントは1になる
+ * @param buf
+ * @param capacity バッファーのサイズ
+ * @param bytes 実際の映像データのバイト数(v4l2_buffer.bytesused)
+ * @param width
+ * @param height
+ * @param frame_type
+ * @param lendable #retainで追加の参照を許可するかどうか
+ * @return
+ */
+int V4L2BufferFrame::assign(
+	uint8_t *buf, const size_t &capacity, const size_t &bytes,
+	const uint32_t &width, const uint32_t &height,
+	const core::raw_frame_t &frame_type,
+	const bool &lendable) {
+
+	ENTER();
+
+	buffer = buf;
+	buffer_bytes = capacity;
+	// size()がbuffer_bytesを返すのでここでの実際のバッファ確保は起こらない
+	int result = resize(width, height, frame_type);
+	if (LIKELY(!result)) {
+		// mjpegとかだと受信データサイズは固定では無いので
+		// 実際のデータバイト数に合うようにする
+		set_size(bytes <= capacity ? bytes : capacity);
+	}
+	_lendable = lendable;
+	_ref_count = 1;
+
+	RETURN(result, int);
+}
+
+/**
+ * 参照を追加する
+ * 下流のパイプラインが#chain_frameから戻った後もバッファーを保持したいときに呼ぶ
+ * @return true: 参照を追加した, false: 貸し出せないのでコピーすること
+ */
+bool V4L2BufferFrame::retain() {
+	if (!_lendable) {
+		return false;
+	}
+	int32_t count = _ref_count.load();
+	for ( ; count > 0 ; ) {
+		if (_ref_count.compare_exchange_weak(count, count + 1)) {
+			return true;
+		}
+	}
+	// 既に返却済み
+	return false;
+}
+
+/**
+ * 参照を開放する
+ * 最後の参照を開放したときはOnBufferReleaseFuncを呼び出す
+ */
+void V4L2BufferFrame::release() {
+	const auto prev = _ref_count.fetch_sub(1);
+	if (prev == 1) {
+		if (on_release) {
+			on_release(*this);
+		}
+	} else if (UNLIKELY(prev <= 0)) {
+		LOGW("unbalanced release,index=%d", _index);
+		_ref_count = 0;
+	}
+}
+
+/**
+ * 映像受け取りバッファーを開放するときにまだ貸し出し中のフレームの
+ * mmap領域とdma-bufを引き取って最後の参照が開放されるまで開放を遅延する
+ * @param start mmapした先頭ポインタ, munmapしないときはMAP_FAILED
+ * @param length
+ * @param fd dma-bufのファイルディスクリプタ, closeしないときは0
+ */
+void V4L2BufferFrame::orphan(void *start, const size_t &length, const int &fd) {
+	ENTER();
+
+	LOGD("buffer %d is still lent,defer release,ref_count=%d", _index, _ref_count.load());
+	orphaned = true;
+	orphan_start = start;
+	orphan_length = length;
+	orphan_fd = fd;
+
+	EXIT();
+}
+
+/**
+ * #orphanで引き取ったmmap領域とdma-bufを開放する
+ * 最後の参照が開放されたとき(OnBufferReleaseFunc内)に呼び出す
+ */
+void V4L2BufferFrame::release_orphan() {
+	ENTER();
+
+	if (orphan_start != MAP_FAILED) {
+		if (munmap(orphan_start, orphan_length) == -1) {
+			LOGE("munmap,errno=%d", errno);
+		}
+		orphan_start = MAP_FAILED;
+		orphan_length = 0;
+	}
+	if (orphan_fd > 0) {
+		::close(orphan_fd);
+		orphan_fd = 0;
+	}
+	buffer = nullptr;
+	buffer_bytes = 0;
+
+	EXIT();
+}
+
+/**
+ * 配列添え字演算子
+ * @param ix
+ * @return
+ */
+uint8_t &V4L2BufferFrame::operator[](uint32_t ix) {
+	return buffer[ix];
+}
+
+/**
+ * 配列添え字演算子
+ * @param ix
+ * @return
+ */
+const uint8_t &V4L2BufferFrame::operator[](uint32_t ix) const {
+	return buffer[ix];
+}
+
+/**
+ * バッファサイズを取得(バッファを拡張せずに保持できる最大サイズ)
+ * @return
+ */
+size_t V4L2BufferFrame::size() const {
+	return buffer_bytes;
+}
+
+/**
+ * フレームバッファーの先頭ポインタを取得
+ * @return
+ */
+uint8_t *V4L2BufferFrame::frame() {
+	return buffer;
+}
+
+/**
+ * フレームバッファーの先頭ポインタを取得
+ * @return
+ */
+const uint8_t *V4L2BufferFrame::frame() const {
+	return buffer;
+}
+
+/**
+ * 実際のバッファはv4l2の管理下なので割り当てを解除するだけ
+ */
+void V4L2BufferFrame::recycle() {
+	buffer = nullptr;
+	buffer_bytes = 0;
+	core::BaseVideoFrame::recycle();
+}
+
+}	// namespace serenegiant::v4l2
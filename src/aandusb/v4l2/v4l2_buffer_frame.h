@@ -0,0 +1,194 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_BUFFER_FRAME_H
+#define AANDUSB_V4L2_BUFFER_FRAME_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+// core
+#include "core/video_frame_base.h"
+
+namespace serenegiant::v4l2 {
+
+class V4L2BufferFrame;
+
+/**
+ * 貸し出したバッファーが返却されたときのコールバック
+ * 最後の参照が開放されたときに呼ばれる
+ */
+typedef std::function<void(V4L2BufferFrame &/*frame*/)> OnBufferReleaseFunc;
+
+/**
+ * v4l2のバッファー(mmap等)をコピーせずに下流へ貸し出すためのBaseVideoFrame実装
+ * 参照カウントが0になったときにOnBufferReleaseFuncを呼び出して
+ * v4l2機器へバッファーを返却(VIDIOC_QBUF)させる
+ * BaseFrame::operator=等のディープコピーはそのまま使えるので、
+ * 保持できない(#retainがfalseを返した)下流はコピーして使うこと
+ */
+class V4L2BufferFrame : public core::BaseVideoFrame {
+private:
+	/**
+	 * v4l2バッファーのインデックス
+	 */
+	const uint32_t _index;
+	/**
+	 * 参照が0になったときのコールバック
+	 */
+	OnBufferReleaseFunc on_release;
+	/**
+	 * 参照カウント
+	 */
+	std::atomic<int32_t> _ref_count;
+	/**
+	 * #retainで追加の参照を許可するかどうか
+	 */
+	std::atomic<bool> _lendable;
+	/**
+	 * 貸し出し中のバッファー
+	 */
+	uint8_t *buffer;
+	/**
+	 * 貸し出し中のバッファーのサイズ
+	 */
+	size_t buffer_bytes;
+	/**
+	 * 貸し出してからOnBufferReleaseFuncで返却されるまでtrue
+	 * 所有するパイプラインのロックで保護する
+	 */
+	bool lent;
+	/**
+	 * 所有するパイプラインが映像受け取りバッファーを開放したときに
+	 * まだ貸し出し中だったのでmunmap/closeを最後の参照が開放されるまで遅延しているかどうか
+	 */
+	bool orphaned;
+	/**
+	 * 開放を遅延しているmmap領域とdma-bufのファイルディスクリプタ
+	 */
+	void *orphan_start;
+	size_t orphan_length;
+	int orphan_fd;
+	/**
+	 * コピーコンストラクタ
+	 * (コピー禁止)
+	 * @param src
+	 */
+	V4L2BufferFrame(const V4L2BufferFrame &src) = delete;
+	/**
+	 * 代入演算子
+	 * (代入禁止)
+	 * @param src
+	 * @return
+	 */
+	V4L2BufferFrame &operator=(const V4L2BufferFrame &src) = delete;
+public:
+	/**
+	 * コンストラクタ
+	 * @param index v4l2バッファーのインデックス
+	 * @param release_callback 参照が0になったときのコールバック
+	 */
+	V4L2BufferFrame(const uint32_t &index, OnBufferReleaseFunc release_callback);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4L2BufferFrame() noexcept;
+
+	/**
+	 * v4l2のバッファーを割り当てる
+	 * 参照カウントは1になる
+	 * @param buf
+	 * @param capacity バッファーのサイズ
+	 * @param bytes 実際の映像データのバイト数(v4l2_buffer.bytesused)
+	 * @param width
+	 * @param height
+	 * @param frame_type
+	 * @param lendable #retainで追加の参照を許可するかどうか
+	 * @return
+	 */
+	int assign(
+		uint8_t *buf, const size_t &capacity, const size_t &bytes,
+		const uint32_t &width, const uint32_t &height,
+		const core::raw_frame_t &frame_type,
+		const bool &lendable);
+
+	/**
+	 * 参照を追加する
+	 * 下流のパイプラインが#chain_frameから戻った後もバッファーを保持したいときに呼ぶ
+	 * @return true: 参照を追加した, false: 貸し出せないのでコピーすること
+	 */
+	bool retain();
+	/**
+	 * 参照を開放する
+	 * 最後の参照を開放したときはOnBufferReleaseFuncを呼び出す
+	 */
+	void release();
+
+	/**
+	 * v4l2バッファーのインデックスを取得
+	 * @return
+	 */
+	inline uint32_t index() const { return _index; };
+	/**
+	 * 現在の参照カウントを取得
+	 * @return
+	 */
+	inline int32_t ref_count() const { return _ref_count.load(); };
+
+	/**
+	 * 貸し出し中(assignしてからOnBufferReleaseFuncで返却されるまで)かどうか
+	 * 所有するパイプラインのロックを保持した状態で呼び出すこと
+	 * @return
+	 */
+	inline bool is_lent() const { return lent; };
+	/**
+	 * 貸し出し中かどうかをセット
+	 * 所有するパイプラインのロックを保持した状態で呼び出すこと
+	 * @param is_lent
+	 */
+	inline void set_lent(const bool &is_lent) { lent = is_lent; };
+	/**
+	 * 映像受け取りバッファーを開放するときにまだ貸し出し中のフレームの
+	 * mmap領域とdma-bufを引き取って最後の参照が開放されるまで開放を遅延する
+	 * 所有するパイプラインはこのフレームを破棄せずに保持し続けること
+	 * 所有するパイプラインのロックを保持した状態で呼び出すこと
+	 * @param start mmapした先頭ポインタ, munmapしないときはMAP_FAILED
+	 * @param length
+	 * @param fd dma-bufのファイルディスクリプタ, closeしないときは0
+	 */
+	void orphan(void *start, const size_t &length, const int &fd);
+	/**
+	 * #orphanで開放を遅延しているかどうか
+	 * @return
+	 */
+	inline bool is_orphan() const { return orphaned; };
+	/**
+	 * #orphanで引き取ったmmap領域とdma-bufを開放する
+	 * 最後の参照が開放されたとき(OnBufferReleaseFunc内)に呼び出す
+	 */
+	void release_orphan();
+
+	//--------------------------------------------------------------------------------
+	// BaseFrameの関数をoverride
+	uint8_t &operator[](uint32_t ix) override;
+	const uint8_t &operator[](uint32_t ix) const override;
+	size_t size() const override;
+	uint8_t *frame() override;
+	const uint8_t *frame() const override;
+	/**
+	 * 実際のバッファはv4l2の管理下なので割り当てを解除するだけ
+	 */
+	void recycle() override;
+};
+
+typedef std::unique_ptr<V4L2BufferFrame> V4L2BufferFrameUp;
+typedef std::shared_ptr<V4L2BufferFrame> V4L2BufferFrameSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_BUFFER_FRAME_H
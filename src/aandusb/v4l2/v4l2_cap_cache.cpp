@@ -0,0 +1,573 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2CapCache"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "rapidjson/document.h"
+
+#include "utilbase.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_cap_cache.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * キャッシュファイルの形式のバージョン
+ * 形式を変更したときはインクリメントして古いキャッシュファイルを無視させる
+ */
+#define CAP_CACHE_VERSION (1)
+
+// キャッシュファイルのキー
+#define CACHE_VERSION "version"
+#define CACHE_KEY "key"
+#define CACHE_FORMATS "formats"
+#define CACHE_FRAMES "frames"
+#define CACHE_INTERVALS "intervals"
+#define CACHE_CTRLS "ctrls"
+#define CACHE_INDEX "index"
+#define CACHE_PIXEL_FORMAT "pixel_format"
+#define CACHE_TYPE "type"
+#define CACHE_WIDTH "width"
+#define CACHE_HEIGHT "height"
+#define CACHE_NUMERATOR "numerator"
+#define CACHE_DENOMINATOR "denominator"
+#define CACHE_MIN_NUMERATOR "min_numerator"
+#define CACHE_MIN_DENOMINATOR "min_denominator"
+#define CACHE_MAX_NUMERATOR "max_numerator"
+#define CACHE_MAX_DENOMINATOR "max_denominator"
+#define CACHE_STEP_NUMERATOR "step_numerator"
+#define CACHE_STEP_DENOMINATOR "step_denominator"
+#define CACHE_ID "id"
+#define CACHE_NAME "name"
+#define CACHE_MINIMUM "minimum"
+#define CACHE_MAXIMUM "maximum"
+#define CACHE_STEP "step"
+#define CACHE_DEFAULT "default"
+#define CACHE_FLAGS "flags"
+#define CACHE_PREFERRED "preferred"
+#define CACHE_TARGET_FPS "target_fps"
+
+/**
+ * jsonオブジェクトから符号無し整数を取得するためのヘルパー関数
+ * @param obj
+ * @param key
+ * @return キーが無いときは0
+ */
+static uint32_t get_uint(const rapidjson::Value &obj, const char *key) {
+	return obj.HasMember(key) && obj[key].IsUint() ? obj[key].GetUint() : 0;
+}
+
+/**
+ * jsonオブジェクトから浮動小数点数を取得するためのヘルパー関数
+ * @param obj
+ * @param key
+ * @return キーが無いときは0
+ */
+static float get_float(const rapidjson::Value &obj, const char *key) {
+	return obj.HasMember(key) && obj[key].IsNumber() ? (float)obj[key].GetDouble() : 0.0f;
+}
+
+/**
+ * 自動選択結果の要求解像度・目標フレームレートが一致するかどうか
+ * @param choice
+ * @param width
+ * @param height
+ * @param target_fps
+ * @return
+ */
+static bool match_choice(const stream_choice_t &choice,
+	const uint32_t &width, const uint32_t &height, const float &target_fps) {
+
+	return (choice.width == width) && (choice.height == height)
+		&& (std::fabs(choice.target_fps - target_fps) < 0.01f);
+}
+
+/**
+ * jsonオブジェクトから符号付き整数を取得するためのヘルパー関数
+ * @param obj
+ * @param key
+ * @return キーが無いときは0
+ */
+static int32_t get_int(const rapidjson::Value &obj, const char *key) {
+	return obj.HasMember(key) && obj[key].IsInt() ? obj[key].GetInt() : 0;
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * コンストラクタ
+ * @param cache_dir キャッシュファイルを保存するディレクトリ, 存在しなければ生成する
+ */
+/*public*/
+V4l2CapCache::V4l2CapCache(std::string cache_dir)
+:	cache_dir(std::move(cache_dir)),
+	caches()
+{
+	ENTER();
+
+	if (!this->cache_dir.empty()
+		&& (::mkdir(this->cache_dir.c_str(), 0755) != 0) && (errno != EEXIST)) {
+		LOGW("failed to create %s,errno=%d", this->cache_dir.c_str(), errno);
+	}
+
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2CapCache::~V4l2CapCache() noexcept {
+	ENTER();
+	EXIT();
+}
+
+/**
+ * VIDIOC_QUERYCAPの結果からキャッシュのキーを生成する
+ * @param fd
+ * @return VIDIOC_QUERYCAPが失敗したときは空文字列
+ */
+/*public, static*/
+std::string V4l2CapCache::make_key(int fd) {
+	ENTER();
+
+	struct v4l2_capability cap{};
+	if (UNLIKELY(xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1)) {
+		LOGW("VIDIOC_QUERYCAP,errno=%d", errno);
+		RET(std::string());
+	}
+	// ドライバーのバージョンやcapabilitiesが変わったときは別のキーになるようにする
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s_%s_%s_%08x_%08x",
+		(const char *)cap.driver, (const char *)cap.card, (const char *)cap.bus_info,
+		cap.version, cap.capabilities);
+	buf[sizeof(buf) - 1] = '\0';
+
+	RET(std::string(buf));
+}
+
+/**
+ * v4l2機器の対応ピクセルフォーマット・解像度・フレームレート・コントロール機能を取得する
+ * キャッシュがあればキャッシュを返し、なければv4l2機器から取得してキャッシュへ保存する
+ * @param fd
+ * @return VIDIOC_QUERYCAPが失敗したときはnullptr
+ */
+/*public*/
+DeviceCapsSp V4l2CapCache::get(int fd) {
+	ENTER();
+
+	const auto key = make_key(fd);
+	if (UNLIKELY(key.empty())) {
+		RET(nullptr);
+	}
+
+	AutoMutex lock(cache_lock);
+	auto found = caches.find(key);
+	if (found != caches.end()) {
+		LOGD("use loaded cache,key=%s", key.c_str());
+		RET(found->second);
+	}
+	auto caps = load(key);
+	if (!caps) {
+		// キャッシュファイルが無いか読み込めなかったときはv4l2機器から取得する
+		LOGD("cache miss,key=%s", key.c_str());
+		caps = enumerate(fd, key);
+		save(*caps);
+	}
+	caches[key] = caps;
+
+	RET(caps);
+}
+
+/**
+ * キャッシュの内容が実際のv4l2機器と一致しなかったときに
+ * v4l2機器から取得し直してキャッシュを更新する
+ * @param fd
+ * @param stale 一致しなかったキャッシュ
+ * @return
+ */
+/*public*/
+DeviceCapsSp V4l2CapCache::refresh(int fd, const DeviceCapsSp &stale) {
+	ENTER();
+
+	const auto key = stale ? stale->key : make_key(fd);
+	LOGW("cache is stale,key=%s", key.c_str());
+	auto caps = enumerate(fd, key);
+	AutoMutex lock(cache_lock);
+	save(*caps);
+	caches[key] = caps;
+
+	RET(caps);
+}
+
+/**
+ * 実際にネゴシエーションしたピクセルフォーマット・解像度が
+ * キャッシュの内容と一致するかどうかを確認する
+ * @param caps
+ * @param pixel_format
+ * @param width
+ * @param height
+ * @return
+ */
+/*public, static*/
+bool V4l2CapCache::validate(const device_caps_t &caps,
+	const uint32_t &pixel_format,
+	const uint32_t &width, const uint32_t &height) {
+
+	for (const auto &format: caps.formats) {
+		if (format->pixel_format == pixel_format) {
+			if (format->frames.empty()) {
+				// 離散値の解像度が無いときは確認できない
+				return true;
+			}
+			for (const auto &frame: format->frames) {
+				if ((frame->width == width) && (frame->height == height)) {
+					return true;
+				}
+			}
+			return false;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * 映像取得フォーマットの自動選択結果を取得する
+ * @param caps
+ * @param width 要求解像度
+ * @param height 要求解像度
+ * @param target_fps 目標フレームレート
+ * @param choice 見つかったときに自動選択結果をセットする
+ * @return 見つかったかどうか
+ */
+/*public*/
+bool V4l2CapCache::find_preferred(const device_caps_t &caps,
+	const uint32_t &width, const uint32_t &height, const float &target_fps,
+	stream_choice_t &choice) const {
+
+	ENTER();
+
+	AutoMutex lock(cache_lock);
+	for (const auto &item: caps.preferred) {
+		if (match_choice(item, width, height, target_fps)) {
+			choice = item;
+			RETURN(true, bool);
+		}
+	}
+
+	RETURN(false, bool);
+}
+
+/**
+ * 映像取得フォーマットの自動選択結果をキャッシュへ追加してキャッシュファイルへ保存する
+ * 同じ要求解像度・目標フレームレートの自動選択結果があれば置き換える
+ * @param caps
+ * @param choice
+ * @return
+ */
+/*public*/
+int V4l2CapCache::set_preferred(device_caps_t &caps, const stream_choice_t &choice) {
+	ENTER();
+
+	AutoMutex lock(cache_lock);
+	bool found = false;
+	for (auto &item: caps.preferred) {
+		if (match_choice(item, choice.width, choice.height, choice.target_fps)) {
+			item = choice;
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		caps.preferred.push_back(choice);
+	}
+	const int result = save(caps);
+
+	RETURN(result, int);
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * キーに対応するキャッシュファイル名を取得
+ * ファイル名に使えない文字は'_'へ置き換える
+ * @param key
+ * @return
+ */
+/*private*/
+std::string V4l2CapCache::get_path(const std::string &key) const {
+	std::string name(key);
+	for (auto &c: name) {
+		if (!isalnum((unsigned char)c) && (c != '-') && (c != '.')) {
+			c = '_';
+		}
+	}
+	return (cache_dir.empty() ? "" : cache_dir + "/") + name + ".json";
+}
+
+/**
+ * キャッシュファイルを読み込む
+ * @param key
+ * @return 読み込めなければnullptr
+ */
+/*private*/
+DeviceCapsSp V4l2CapCache::load(const std::string &key) const {
+	ENTER();
+
+	const auto path = get_path(key);
+	std::ifstream in(path.c_str());
+	if (!in.good()) {
+		RET(nullptr);
+	}
+	std::stringstream ss;
+	ss << in.rdbuf();
+	in.close();
+
+	rapidjson::Document doc;
+	doc.Parse(ss.str().c_str());
+	if (UNLIKELY(doc.HasParseError() || !doc.IsObject())) {
+		LOGW("failed to parse %s", path.c_str());
+		RET(nullptr);
+	}
+	// 形式のバージョンやキーが一致しないときは無視する(ファイル名の置き換えで衝突したとき等)
+	if ((get_uint(doc, CACHE_VERSION) != CAP_CACHE_VERSION)
+		|| !doc.HasMember(CACHE_KEY) || !doc[CACHE_KEY].IsString()
+		|| (key != doc[CACHE_KEY].GetString())) {
+
+		LOGD("version or key mismatch,%s", path.c_str());
+		RET(nullptr);
+	}
+
+	auto caps = std::make_shared<device_caps_t>();
+	caps->key = key;
+	caps->from_cache = true;
+	caps->validated = false;
+	if (doc.HasMember(CACHE_FORMATS) && doc[CACHE_FORMATS].IsArray()) {
+		for (const auto &f: doc[CACHE_FORMATS].GetArray()) {
+			auto format = std::make_shared<format_info_t>(
+				get_int(f, CACHE_INDEX), get_uint(f, CACHE_PIXEL_FORMAT));
+			if (f.HasMember(CACHE_FRAMES) && f[CACHE_FRAMES].IsArray()) {
+				for (const auto &fr: f[CACHE_FRAMES].GetArray()) {
+					auto frame = std::make_shared<frame_info_t>(
+						get_int(fr, CACHE_INDEX), format->pixel_format, get_uint(fr, CACHE_TYPE));
+					frame->width = get_uint(fr, CACHE_WIDTH);
+					frame->height = get_uint(fr, CACHE_HEIGHT);
+					if (fr.HasMember(CACHE_INTERVALS) && fr[CACHE_INTERVALS].IsArray()) {
+						for (const auto &iv: fr[CACHE_INTERVALS].GetArray()) {
+							auto fps = std::make_shared<struct v4l2_frmivalenum>();
+							fps->index = get_uint(iv, CACHE_INDEX);
+							fps->pixel_format = format->pixel_format;
+							fps->width = frame->width;
+							fps->height = frame->height;
+							fps->type = get_uint(iv, CACHE_TYPE);
+							if (fps->type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+								fps->discrete.numerator = get_uint(iv, CACHE_NUMERATOR);
+								fps->discrete.denominator = get_uint(iv, CACHE_DENOMINATOR);
+							} else {
+								fps->stepwise.min.numerator = get_uint(iv, CACHE_MIN_NUMERATOR);
+								fps->stepwise.min.denominator = get_uint(iv, CACHE_MIN_DENOMINATOR);
+								fps->stepwise.max.numerator = get_uint(iv, CACHE_MAX_NUMERATOR);
+								fps->stepwise.max.denominator = get_uint(iv, CACHE_MAX_DENOMINATOR);
+								fps->stepwise.step.numerator = get_uint(iv, CACHE_STEP_NUMERATOR);
+								fps->stepwise.step.denominator = get_uint(iv, CACHE_STEP_DENOMINATOR);
+							}
+							frame->frame_rates.push_back(fps);
+						}
+					}
+					format->frames.push_back(frame);
+				}
+			}
+			caps->formats.push_back(format);
+		}
+	}
+	if (doc.HasMember(CACHE_CTRLS) && doc[CACHE_CTRLS].IsArray()) {
+		for (const auto &c: doc[CACHE_CTRLS].GetArray()) {
+			auto query = std::make_shared<struct v4l2_queryctrl>();
+			query->id = get_uint(c, CACHE_ID);
+			query->type = get_uint(c, CACHE_TYPE);
+			if (c.HasMember(CACHE_NAME) && c[CACHE_NAME].IsString()) {
+				strncpy((char *)query->name, c[CACHE_NAME].GetString(), sizeof(query->name) - 1);
+			}
+			query->minimum = get_int(c, CACHE_MINIMUM);
+			query->maximum = get_int(c, CACHE_MAXIMUM);
+			query->step = get_int(c, CACHE_STEP);
+			query->default_value = get_int(c, CACHE_DEFAULT);
+			query->flags = get_uint(c, CACHE_FLAGS);
+			caps->ctrls[query->id] = query;
+		}
+	}
+	if (doc.HasMember(CACHE_PREFERRED) && doc[CACHE_PREFERRED].IsArray()) {
+		for (const auto &p: doc[CACHE_PREFERRED].GetArray()) {
+			caps->preferred.push_back({
+				.width = get_uint(p, CACHE_WIDTH),
+				.height = get_uint(p, CACHE_HEIGHT),
+				.target_fps = get_float(p, CACHE_TARGET_FPS),
+				.pixel_format = get_uint(p, CACHE_PIXEL_FORMAT),
+				.numerator = get_uint(p, CACHE_NUMERATOR),
+				.denominator = get_uint(p, CACHE_DENOMINATOR),
+			});
+		}
+	}
+	LOGD("loaded %s,formats=%" FMT_SIZE_T ",ctrls=%" FMT_SIZE_T,
+		path.c_str(), caps->formats.size(), caps->ctrls.size());
+
+	RET(caps);
+}
+
+/**
+ * キャッシュファイルへ書き込む
+ * 書き込み途中のファイルを読み込まないように一時ファイルへ書き込んでからリネームする
+ * @param caps
+ * @return
+ */
+/*private*/
+int V4l2CapCache::save(const device_caps_t &caps) const {
+	ENTER();
+
+	StringBuffer buffer;
+	Writer<StringBuffer> writer(buffer);
+	writer.StartObject();
+	{
+		write(writer, CACHE_VERSION, (uint32_t)CAP_CACHE_VERSION);
+		write(writer, CACHE_KEY, caps.key.c_str());
+		writer.String(CACHE_FORMATS);
+		writer.StartArray();
+		for (const auto &format: caps.formats) {
+			writer.StartObject();
+			write(writer, CACHE_INDEX, (int32_t)format->index);
+			write(writer, CACHE_PIXEL_FORMAT, format->pixel_format);
+			writer.String(CACHE_FRAMES);
+			writer.StartArray();
+			for (const auto &frame: format->frames) {
+				writer.StartObject();
+				write(writer, CACHE_INDEX, (int32_t)frame->index);
+				write(writer, CACHE_TYPE, frame->type);
+				write(writer, CACHE_WIDTH, frame->width);
+				write(writer, CACHE_HEIGHT, frame->height);
+				writer.String(CACHE_INTERVALS);
+				writer.StartArray();
+				for (const auto &fps: frame->frame_rates) {
+					writer.StartObject();
+					write(writer, CACHE_INDEX, fps->index);
+					write(writer, CACHE_TYPE, fps->type);
+					if (fps->type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+						write(writer, CACHE_NUMERATOR, fps->discrete.numerator);
+						write(writer, CACHE_DENOMINATOR, fps->discrete.denominator);
+					} else {
+						write(writer, CACHE_MIN_NUMERATOR, fps->stepwise.min.numerator);
+						write(writer, CACHE_MIN_DENOMINATOR, fps->stepwise.min.denominator);
+						write(writer, CACHE_MAX_NUMERATOR, fps->stepwise.max.numerator);
+						write(writer, CACHE_MAX_DENOMINATOR, fps->stepwise.max.denominator);
+						write(writer, CACHE_STEP_NUMERATOR, fps->stepwise.step.numerator);
+						write(writer, CACHE_STEP_DENOMINATOR, fps->stepwise.step.denominator);
+					}
+					writer.EndObject();
+				}
+				writer.EndArray();
+				writer.EndObject();
+			}
+			writer.EndArray();
+			writer.EndObject();
+		}
+		writer.EndArray();
+		writer.String(CACHE_CTRLS);
+		writer.StartArray();
+		for (const auto &itr: caps.ctrls) {
+			const auto &query = itr.second;
+			writer.StartObject();
+			write(writer, CACHE_ID, query->id);
+			write(writer, CACHE_TYPE, query->type);
+			write(writer, CACHE_NAME, (const char *)query->name);
+			write(writer, CACHE_MINIMUM, query->minimum);
+			write(writer, CACHE_MAXIMUM, query->maximum);
+			write(writer, CACHE_STEP, query->step);
+			write(writer, CACHE_DEFAULT, query->default_value);
+			write(writer, CACHE_FLAGS, query->flags);
+			writer.EndObject();
+		}
+		writer.EndArray();
+		writer.String(CACHE_PREFERRED);
+		writer.StartArray();
+		for (const auto &choice: caps.preferred) {
+			writer.StartObject();
+			write(writer, CACHE_WIDTH, choice.width);
+			write(writer, CACHE_HEIGHT, choice.height);
+			write(writer, CACHE_TARGET_FPS, choice.target_fps);
+			write(writer, CACHE_PIXEL_FORMAT, choice.pixel_format);
+			write(writer, CACHE_NUMERATOR, choice.numerator);
+			write(writer, CACHE_DENOMINATOR, choice.denominator);
+			writer.EndObject();
+		}
+		writer.EndArray();
+	}
+	writer.EndObject();
+
+	const auto path = get_path(caps.key);
+	const auto tmp_path = path + ".tmp";
+	std::ofstream out(tmp_path.c_str());
+	if (UNLIKELY(!out.good())) {
+		LOGW("failed to open %s", tmp_path.c_str());
+		RETURN(core::USB_ERROR_IO, int);
+	}
+	out << buffer.GetString();
+	out.close();
+	if (UNLIKELY(::rename(tmp_path.c_str(), path.c_str()) != 0)) {
+		const int result = -errno;
+		LOGW("failed to rename to %s,errno=%d", path.c_str(), -result);
+		::remove(tmp_path.c_str());
+		RETURN(result, int);
+	}
+	LOGD("saved %s", path.c_str());
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * v4l2機器から対応ピクセルフォーマット・解像度・フレームレート・コントロール機能を取得する
+ * @param fd
+ * @param key
+ * @return
+ */
+/*private, static*/
+DeviceCapsSp V4l2CapCache::enumerate(int fd, const std::string &key) {
+	ENTER();
+
+	auto caps = std::make_shared<device_caps_t>();
+	caps->key = key;
+	caps->from_cache = false;
+	caps->validated = true;
+	get_supported_formats(fd, caps->formats);
+	update_ctrl_all_locked(fd, caps->ctrls);
+
+	RET(caps);
+}
+
+}	// namespace serenegiant::v4l2
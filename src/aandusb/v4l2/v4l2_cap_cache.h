@@ -0,0 +1,201 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_CAP_CACHE_H
+#define AANDUSB_V4L2_CAP_CACHE_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// common
+#include "mutex.h"
+// v4l2
+#include "v4l2/v4l2.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * 映像取得フォーマットの自動選択(V4l2SourceBase::set_auto_format)で選んだ
+ * ピクセルフォーマット・フレーム間隔
+ * 要求解像度と目標フレームレートの組み合わせ毎に保持する
+ */
+typedef struct _stream_choice {
+	/**
+	 * 要求解像度
+	 */
+	uint32_t width;
+	uint32_t height;
+	/**
+	 * 目標フレームレート
+	 */
+	float target_fps;
+	/**
+	 * 選んだピクセルフォーマット
+	 */
+	uint32_t pixel_format;
+	/**
+	 * 選んだフレーム間隔[秒], numerator/denominator
+	 * 0ならフレーム間隔を変更しない
+	 */
+	uint32_t numerator;
+	uint32_t denominator;
+} stream_choice_t;
+
+/**
+ * v4l2機器の対応ピクセルフォーマット・解像度・フレームレート・コントロール機能
+ */
+typedef struct _device_caps {
+	/**
+	 * VIDIOC_QUERYCAPの結果から生成したキャッシュのキー
+	 */
+	std::string key;
+	/**
+	 * 対応ピクセルフォーマット・解像度・フレームレート
+	 */
+	std::vector<FormatInfoSp> formats;
+	/**
+	 * 対応コントロール機能
+	 */
+	std::unordered_map<uint32_t, QueryCtrlSp> ctrls;
+	/**
+	 * 映像取得フォーマットの自動選択結果
+	 * V4l2CapCacheのcache_lockで保護する
+	 */
+	std::vector<stream_choice_t> preferred;
+	/**
+	 * キャッシュファイルから読み込んだかどうか
+	 * falseならv4l2機器から取得したので照合不要
+	 */
+	bool from_cache;
+	/**
+	 * キャッシュファイルから読み込んだ内容を実際のv4l2機器と照合済みかどうか
+	 */
+	bool validated;
+} device_caps_t;
+
+typedef std::shared_ptr<device_caps_t> DeviceCapsSp;
+
+/**
+ * v4l2機器の対応ピクセルフォーマット・解像度・フレームレート・コントロール機能を
+ * VIDIOC_QUERYCAPのdriver/card/bus_info/versionをキーとしてjsonファイルへキャッシュするためのヘルパークラス
+ * 2回目以降のオープン時はVIDIOC_ENUM_xxx/VIDIOC_QUERYCTRLでの列挙の代わりにキャッシュを使う
+ * キャッシュの内容は実際に使うときに照合して(遅延照合)一致しなければ取得し直す
+ * 複数のv4l2機器で共有できる
+ */
+class V4l2CapCache {
+private:
+	mutable Mutex cache_lock;
+	/**
+	 * キャッシュファイルを保存するディレクトリ
+	 */
+	const std::string cache_dir;
+	/**
+	 * 読み込み済みのキャッシュ, キーで検索する
+	 * cache_lockで保護する
+	 */
+	std::unordered_map<std::string, DeviceCapsSp> caches;
+
+	/**
+	 * キーに対応するキャッシュファイル名を取得
+	 * @param key
+	 * @return
+	 */
+	std::string get_path(const std::string &key) const;
+	/**
+	 * キャッシュファイルを読み込む
+	 * @param key
+	 * @return 読み込めなければnullptr
+	 */
+	DeviceCapsSp load(const std::string &key) const;
+	/**
+	 * キャッシュファイルへ書き込む
+	 * @param caps
+	 * @return
+	 */
+	int save(const device_caps_t &caps) const;
+	/**
+	 * v4l2機器から対応ピクセルフォーマット・解像度・フレームレート・コントロール機能を取得する
+	 * @param fd
+	 * @param key
+	 * @return
+	 */
+	static DeviceCapsSp enumerate(int fd, const std::string &key);
+public:
+	/**
+	 * コンストラクタ
+	 * @param cache_dir キャッシュファイルを保存するディレクトリ, 存在しなければ生成する
+	 */
+	explicit V4l2CapCache(std::string cache_dir);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4l2CapCache() noexcept;
+
+	/**
+	 * VIDIOC_QUERYCAPの結果からキャッシュのキーを生成する
+	 * @param fd
+	 * @return VIDIOC_QUERYCAPが失敗したときは空文字列
+	 */
+	static std::string make_key(int fd);
+	/**
+	 * v4l2機器の対応ピクセルフォーマット・解像度・フレームレート・コントロール機能を取得する
+	 * キャッシュがあればキャッシュを返し、なければv4l2機器から取得してキャッシュへ保存する
+	 * @param fd
+	 * @return VIDIOC_QUERYCAPが失敗したときはnullptr
+	 */
+	DeviceCapsSp get(int fd);
+	/**
+	 * キャッシュの内容が実際のv4l2機器と一致しなかったときに
+	 * v4l2機器から取得し直してキャッシュを更新する
+	 * @param fd
+	 * @param stale 一致しなかったキャッシュ
+	 * @return
+	 */
+	DeviceCapsSp refresh(int fd, const DeviceCapsSp &stale);
+	/**
+	 * 実際にネゴシエーションしたピクセルフォーマット・解像度が
+	 * キャッシュの内容と一致するかどうかを確認する
+	 * 離散値の解像度が無いピクセルフォーマットは解像度を確認しない
+	 * @param caps
+	 * @param pixel_format
+	 * @param width
+	 * @param height
+	 * @return
+	 */
+	static bool validate(const device_caps_t &caps,
+		const uint32_t &pixel_format,
+		const uint32_t &width, const uint32_t &height);
+	/**
+	 * 映像取得フォーマットの自動選択結果を取得する
+	 * @param caps
+	 * @param width 要求解像度
+	 * @param height 要求解像度
+	 * @param target_fps 目標フレームレート
+	 * @param choice 見つかったときに自動選択結果をセットする
+	 * @return 見つかったかどうか
+	 */
+	bool find_preferred(const device_caps_t &caps,
+		const uint32_t &width, const uint32_t &height, const float &target_fps,
+		stream_choice_t &choice) const;
+	/**
+	 * 映像取得フォーマットの自動選択結果をキャッシュへ追加してキャッシュファイルへ保存する
+	 * 同じ要求解像度・目標フレームレートの自動選択結果があれば置き換える
+	 * @param caps
+	 * @param choice
+	 * @return
+	 */
+	int set_preferred(device_caps_t &caps, const stream_choice_t &choice);
+};
+
+typedef std::unique_ptr<V4l2CapCache> V4l2CapCacheUp;
+typedef std::shared_ptr<V4l2CapCache> V4l2CapCacheSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_CAP_CACHE_H
@@ -38,6 +38,208 @@ V4L2Ctrl::~V4L2Ctrl() {
     EXIT();
 }
 
+/**
+ * VIDIOC_QUERYCTRLの結果でキャッシュを初期化する
+ * 現在値は無効にする
+ * @param supported
+ */
+/*protected*/
+void V4L2Ctrl::init_ctrl_cache(const std::unordered_map<uint32_t, QueryCtrlSp> &supported) {
+    ENTER();
+
+    AutoMutex lock(ctrl_cache_lock);
+    ctrl_cache.clear();
+    for (const auto &itr: supported) {
+        const auto &query = itr.second;
+        ctrl_cache_t cache {
+            .values = {
+                .id = query->id,
+                .type = query->type,
+                .min = query->minimum,
+                .max = query->maximum,
+                .step = query->step,
+                .def = query->default_value,
+                .current = query->default_value,
+            },
+            .flags = query->flags,
+            .valid = false,
+        };
+        ctrl_cache[itr.first] = cache;
+    }
+
+    EXIT();
+}
+
+/**
+ * キャッシュを破棄する
+ */
+/*protected*/
+void V4L2Ctrl::clear_ctrl_cache() {
+    ENTER();
+
+    AutoMutex lock(ctrl_cache_lock);
+    ctrl_cache.clear();
+
+    EXIT();
+}
+
+/**
+ * v4l2機器から取得した最小値/最大値/ステップ値/デフォルト値/現在値でキャッシュを更新する
+ * V4L2_CTRL_FLAG_VOLATILEのコントロール機能は現在値をキャッシュしない
+ * @param values
+ */
+/*protected*/
+void V4L2Ctrl::update_ctrl_cache(const uvc::control_value32_t &values) {
+    ENTER();
+
+    AutoMutex lock(ctrl_cache_lock);
+    auto itr = ctrl_cache.find(values.id);
+    if (itr != ctrl_cache.end()) {
+        auto &cache = itr->second;
+        cache.values = values;
+        cache.valid = !(cache.flags & V4L2_CTRL_FLAG_VOLATILE);
+    }
+
+    EXIT();
+}
+
+/**
+ * コントロール機能への設定に成功したときに現在値のキャッシュを更新する
+ * V4L2_CTRL_FLAG_UPDATEのコントロール機能(自動露出等)のときは
+ * 他のコントロール機能の値も変わる可能性があるので他の現在値のキャッシュを無効にする
+ * @param ctrl_id
+ * @param value
+ */
+/*protected*/
+void V4L2Ctrl::update_ctrl_cache(const uint32_t &ctrl_id, const int32_t &value) {
+    ENTER();
+
+    AutoMutex lock(ctrl_cache_lock);
+    auto itr = ctrl_cache.find(ctrl_id);
+    if (itr != ctrl_cache.end()) {
+        auto &cache = itr->second;
+        if (cache.flags & V4L2_CTRL_FLAG_UPDATE) {
+            for (auto &other: ctrl_cache) {
+                other.second.valid = false;
+            }
+        }
+        cache.values.current = value;
+        cache.valid = !(cache.flags & V4L2_CTRL_FLAG_VOLATILE);
+    }
+
+    EXIT();
+}
+
+/**
+ * 指定したコントロール機能の現在値のキャッシュを無効にする
+ * @param ctrl_id
+ */
+/*protected*/
+void V4L2Ctrl::invalidate_ctrl_cache(const uint32_t &ctrl_id) {
+    ENTER();
+
+    AutoMutex lock(ctrl_cache_lock);
+    auto itr = ctrl_cache.find(ctrl_id);
+    if (itr != ctrl_cache.end()) {
+        itr->second.valid = false;
+    }
+
+    EXIT();
+}
+
+/**
+ * 全てのコントロール機能の現在値のキャッシュを無効にする
+ */
+/*protected*/
+void V4L2Ctrl::invalidate_ctrl_cache_all() {
+    ENTER();
+
+    AutoMutex lock(ctrl_cache_lock);
+    for (auto &itr: ctrl_cache) {
+        itr.second.valid = false;
+    }
+
+    EXIT();
+}
+
+/**
+ * キャッシュから最小値/最大値/ステップ値/デフォルト値/現在値を取得する
+ * @param ctrl_id
+ * @param values
+ * @return 0: キャッシュが有効, 0以外: キャッシュが無いか無効
+ */
+/*protected*/
+int V4L2Ctrl::get_ctrl_cache(const uint32_t &ctrl_id, uvc::control_value32_t &values) const {
+    ENTER();
+
+    int result = core::USB_ERROR_NOT_FOUND;
+
+    AutoMutex lock(ctrl_cache_lock);
+    const auto itr = ctrl_cache.find(ctrl_id);
+    if ((itr != ctrl_cache.end()) && itr->second.valid) {
+        values = itr->second.values;
+        result = core::USB_SUCCESS;
+    }
+
+    RETURN(result, int);
+}
+
+/**
+ * キャッシュにコントロール機能が存在するかどうか
+ * @param ctrl_id
+ * @return
+ */
+/*protected*/
+bool V4L2Ctrl::has_ctrl_cache(const uint32_t &ctrl_id) const {
+    ENTER();
+
+    AutoMutex lock(ctrl_cache_lock);
+    const bool result = ctrl_cache.find(ctrl_id) != ctrl_cache.end();
+
+    RETURN(result, bool);
+}
+
+/**
+ * V4L2_EVENT_CTRLイベントの内容でキャッシュを更新する
+ * @param ctrl_id
+ * @param event
+ * @param values 更新後の最小値/最大値/ステップ値/デフォルト値/現在値
+ * @return 0: 更新した, 0以外: キャッシュに無いコントロール機能
+ */
+/*protected*/
+int V4L2Ctrl::update_ctrl_cache(
+    const uint32_t &ctrl_id, const struct v4l2_event_ctrl &event,
+    uvc::control_value32_t &values) {
+
+    ENTER();
+
+    int result = core::USB_ERROR_NOT_FOUND;
+
+    AutoMutex lock(ctrl_cache_lock);
+    auto itr = ctrl_cache.find(ctrl_id);
+    if (itr != ctrl_cache.end()) {
+        auto &cache = itr->second;
+        if (event.changes & V4L2_EVENT_CTRL_CH_RANGE) {
+            cache.values.min = event.minimum;
+            cache.values.max = event.maximum;
+            cache.values.step = event.step;
+            cache.values.def = event.default_value;
+        }
+        if (event.changes & V4L2_EVENT_CTRL_CH_FLAGS) {
+            cache.flags = event.flags;
+        }
+        if (event.changes & V4L2_EVENT_CTRL_CH_VALUE) {
+            cache.values.current = event.type == V4L2_CTRL_TYPE_INTEGER64
+                ? (int32_t)event.value64 : event.value;
+            cache.valid = !(cache.flags & V4L2_CTRL_FLAG_VOLATILE);
+        }
+        values = cache.values;
+        result = core::USB_SUCCESS;
+    }
+
+    RETURN(result, int);
+}
+
 /**
  * 設定値を適用する
  * @param value
@@ -8,6 +8,10 @@
 #ifndef AANDUSB_V4L2_CTRL_H
 #define AANDUSB_V4L2_CTRL_H
 
+#include <unordered_map>
+
+// common
+#include "mutex.h"
 // v4l2
 #include "v4l2/v4l2.h"
 
@@ -16,9 +20,90 @@ namespace uvc = serenegiant::usb::uvc;
 namespace serenegiant::v4l2 {
 
 class V4L2Ctrl {
+private:
+	/**
+	 * コントロール機能の最小値/最大値/ステップ値/デフォルト値/現在値のキャッシュ
+	 */
+	typedef struct _ctrl_cache {
+		uvc::control_value32_t values;
+		/**
+		 * VIDIOC_QUERYCTRLで取得したフラグ(V4L2_CTRL_FLAG_XXX)
+		 */
+		uint32_t flags;
+		/**
+		 * 現在値が有効かどうか
+		 */
+		bool valid;
+	} ctrl_cache_t;
+
+	/**
+	 * ctrl_cacheの排他制御用
+	 * USBの制御転送中も保持しないのでキャッシュの読み込みはブロックしない
+	 */
+	mutable Mutex ctrl_cache_lock;
+	/**
+	 * コントロール機能のキャッシュ, idで検索する
+	 * ctrl_cache_lockで保護する
+	 */
+	std::unordered_map<uint32_t, ctrl_cache_t> ctrl_cache;
 protected:
     V4L2Ctrl();
     virtual ~V4L2Ctrl();
+
+	/**
+	 * VIDIOC_QUERYCTRLの結果でキャッシュを初期化する
+	 * 現在値は無効にする
+	 * @param supported
+	 */
+	void init_ctrl_cache(const std::unordered_map<uint32_t, QueryCtrlSp> &supported);
+	/**
+	 * キャッシュを破棄する
+	 */
+	void clear_ctrl_cache();
+	/**
+	 * v4l2機器から取得した最小値/最大値/ステップ値/デフォルト値/現在値でキャッシュを更新する
+	 * V4L2_CTRL_FLAG_VOLATILEのコントロール機能は現在値をキャッシュしない
+	 * @param values
+	 */
+	void update_ctrl_cache(const uvc::control_value32_t &values);
+	/**
+	 * コントロール機能への設定に成功したときに現在値のキャッシュを更新する
+	 * V4L2_CTRL_FLAG_UPDATEのコントロール機能(自動露出等)のときは
+	 * 他のコントロール機能の値も変わる可能性があるので他の現在値のキャッシュを無効にする
+	 * @param ctrl_id
+	 * @param value
+	 */
+	void update_ctrl_cache(const uint32_t &ctrl_id, const int32_t &value);
+	/**
+	 * 指定したコントロール機能の現在値のキャッシュを無効にする
+	 * @param ctrl_id
+	 */
+	void invalidate_ctrl_cache(const uint32_t &ctrl_id);
+	/**
+	 * 全てのコントロール機能の現在値のキャッシュを無効にする
+	 */
+	void invalidate_ctrl_cache_all();
+	/**
+	 * キャッシュから最小値/最大値/ステップ値/デフォルト値/現在値を取得する
+	 * @param ctrl_id
+	 * @param values
+	 * @return 0: キャッシュが有効, 0以外: キャッシュが無いか無効
+	 */
+	int get_ctrl_cache(const uint32_t &ctrl_id, uvc::control_value32_t &values) const;
+	/**
+	 * キャッシュにコントロール機能が存在するかどうか
+	 * @param ctrl_id
+	 * @return
+	 */
+	bool has_ctrl_cache(const uint32_t &ctrl_id) const;
+	/**
+	 * V4L2_EVENT_CTRLイベントの内容でキャッシュを更新する
+	 * @param ctrl_id
+	 * @param event
+	 * @param values 更新後の最小値/最大値/ステップ値/デフォルト値/現在値
+	 * @return 0: 更新した, 0以外: キャッシュに無いコントロール機能
+	 */
+	int update_ctrl_cache(const uint32_t &ctrl_id, const struct v4l2_event_ctrl &event, uvc::control_value32_t &values);
 public:
 	/**
 	 * ctrl_idで指定したコントロール機能に対応しているかどうかを取得
@@ -0,0 +1,202 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2CtrlWriter"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include "utilbase.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_ctrl_writer.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * コンストラクタ
+ * @param on_write まとめた設定値を書き込むためのコールバック関数
+ */
+/*public*/
+V4l2CtrlWriter::V4l2CtrlWriter(OnWriteCtrlsFunc on_write)
+:	m_running(false), writing(false),
+	on_write(std::move(on_write)),
+	writer_thread()
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2CtrlWriter::~V4l2CtrlWriter() noexcept {
+	ENTER();
+
+	stop();
+
+	EXIT();
+}
+
+/**
+ * ワーカースレッドを開始する
+ * @return
+ */
+/*public*/
+int V4l2CtrlWriter::start() {
+	ENTER();
+
+	AutoMutex lock(writer_lock);
+	if (!m_running) {
+		m_running = true;
+		writer_thread = std::thread([this] { writer_thread_func(); });
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * ワーカースレッドを終了する
+ * 書き込み待ちの設定値は書き込んでから終了する
+ * @return
+ */
+/*public*/
+int V4l2CtrlWriter::stop() {
+	ENTER();
+
+	writer_lock.lock();
+	{
+		m_running = false;
+		writer_sync.broadcast();
+	}
+	writer_lock.unlock();
+
+	if (writer_thread.joinable()) {
+		LOGD("join:writer_thread");
+		writer_thread.join();
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * コントロール機能の設定値の書き込みを要求する
+ * 書き込み待ちの間に同じidへの要求が来たときは後の値で上書きする
+ * @param id
+ * @param value
+ * @return 0: 要求を受け付けた, 0以外: ワーカースレッドが実行中でない
+ */
+/*public*/
+int V4l2CtrlWriter::post(const uint32_t &id, const int32_t &value) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(writer_lock);
+	if (m_running) {
+		if (pending_values.find(id) == pending_values.end()) {
+			pending_ids.push_back(id);
+		} else {
+			LOGD("coalesce id=0x%08x,value=%d", id, value);
+		}
+		pending_values[id] = value;
+		writer_sync.broadcast();
+		result = core::USB_SUCCESS;
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 書き込み待ちの設定値が全て書き込まれるまで待機する
+ * @return
+ */
+/*public*/
+int V4l2CtrlWriter::flush() {
+	ENTER();
+
+	AutoMutex lock(writer_lock);
+	while (m_running && (writing || !pending_ids.empty())) {
+		writer_sync.wait(writer_lock);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * ワーカースレッドの実行関数
+ */
+/*private*/
+void V4l2CtrlWriter::writer_thread_func() {
+	ENTER();
+
+	std::vector<struct v4l2_ext_control> ctrls;
+	writer_lock.lock();
+	for ( ; ; ) {
+		if (pending_ids.empty()) {
+			if (!m_running) {
+				break;
+			}
+			writer_sync.wait(writer_lock);
+			continue;
+		}
+		take_pending_locked(ctrls);
+		writing = true;
+		writer_lock.unlock();
+		{
+			// USBの制御転送中はwriter_lockを解放して次の要求を受け付ける
+			LOGD("write %" FMT_SIZE_T " ctrls", ctrls.size());
+			const int r = on_write ? on_write(ctrls) : core::USB_ERROR_NOT_SUPPORTED;
+			if (UNLIKELY(r)) {
+				LOGW("failed to write ctrls,r=%d", r);
+			}
+		}
+		writer_lock.lock();
+		writing = false;
+		writer_sync.broadcast();
+	}
+	writer_sync.broadcast();
+	writer_lock.unlock();
+
+	EXIT();
+}
+
+/**
+ * 書き込み待ちの設定値を取り出してv4l2_ext_controlの配列にする
+ * writer_lockをロックした状態で呼び出すこと
+ * @param ctrls
+ */
+/*private*/
+void V4l2CtrlWriter::take_pending_locked(std::vector<struct v4l2_ext_control> &ctrls) {
+	ENTER();
+
+	ctrls.clear();
+	for (const auto id: pending_ids) {
+		struct v4l2_ext_control ctrl {
+			.id = id,
+		};
+		ctrl.value = pending_values[id];
+		ctrls.push_back(ctrl);
+	}
+	pending_ids.clear();
+	pending_values.clear();
+
+	EXIT();
+}
+
+}	// namespace serenegiant::v4l2
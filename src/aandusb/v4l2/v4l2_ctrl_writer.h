@@ -0,0 +1,131 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_CTRL_WRITER_H
+#define AANDUSB_V4L2_CTRL_WRITER_H
+
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+// common
+#include "mutex.h"
+#include "condition.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * まとめたコントロール機能の設定値をv4l2機器へ書き込むためのコールバック関数
+ * V4l2CtrlWriterのワーカースレッド上で呼ばれる
+ * @param ctrls 書き込むコントロール機能のidと設定値, 要求された順に並んでいる
+ * @return 0: 成功, 0以外: エラー
+ */
+typedef std::function<int(std::vector<struct v4l2_ext_control> &ctrls)> OnWriteCtrlsFunc;
+
+/**
+ * コントロール機能の設定値をワーカースレッド上でまとめてv4l2機器へ書き込むためのヘルパークラス
+ * 書き込み待ちの間に同じコントロール機能への設定要求が来たときは最後の値だけを書き込む
+ * 呼び出し元スレッドはUSBの制御転送を待たずにすぐに戻る
+ */
+class V4l2CtrlWriter {
+private:
+	mutable Mutex writer_lock;
+	/**
+	 * 書き込み要求待ち/書き込み完了待ち用
+	 */
+	Condition writer_sync;
+	/**
+	 * 実行中フラグ
+	 */
+	volatile bool m_running;
+	/**
+	 * 書き込み中フラグ
+	 * writer_lockで保護する
+	 */
+	bool writing;
+	/**
+	 * まとめた設定値を書き込むためのコールバック関数
+	 */
+	const OnWriteCtrlsFunc on_write;
+	/**
+	 * ワーカースレッド
+	 */
+	std::thread writer_thread;
+	/**
+	 * 書き込み待ちのコントロール機能のid, 最初に要求された順
+	 * writer_lockで保護する
+	 */
+	std::vector<uint32_t> pending_ids;
+	/**
+	 * 書き込み待ちの設定値, idで検索する
+	 * writer_lockで保護する
+	 */
+	std::unordered_map<uint32_t, int32_t> pending_values;
+
+	/**
+	 * ワーカースレッドの実行関数
+	 */
+	void writer_thread_func();
+	/**
+	 * 書き込み待ちの設定値を取り出してv4l2_ext_controlの配列にする
+	 * writer_lockをロックした状態で呼び出すこと
+	 * @param ctrls
+	 */
+	void take_pending_locked(std::vector<struct v4l2_ext_control> &ctrls);
+public:
+	/**
+	 * コンストラクタ
+	 * @param on_write まとめた設定値を書き込むためのコールバック関数
+	 */
+	explicit V4l2CtrlWriter(OnWriteCtrlsFunc on_write);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4l2CtrlWriter() noexcept;
+
+	/**
+	 * 実行中かどうか
+	 * @return
+	 */
+	inline bool is_running() const { return m_running; };
+
+	/**
+	 * ワーカースレッドを開始する
+	 * @return
+	 */
+	int start();
+	/**
+	 * ワーカースレッドを終了する
+	 * 書き込み待ちの設定値は書き込んでから終了する
+	 * @return
+	 */
+	int stop();
+	/**
+	 * コントロール機能の設定値の書き込みを要求する
+	 * 書き込み待ちの間に同じidへの要求が来たときは後の値で上書きする
+	 * @param id
+	 * @param value
+	 * @return 0: 要求を受け付けた, 0以外: ワーカースレッドが実行中でない
+	 */
+	int post(const uint32_t &id, const int32_t &value);
+	/**
+	 * 書き込み待ちの設定値が全て書き込まれるまで待機する
+	 * @return
+	 */
+	int flush();
+};
+
+typedef std::unique_ptr<V4l2CtrlWriter> V4l2CtrlWriterUp;
+typedef std::shared_ptr<V4l2CtrlWriter> V4l2CtrlWriterSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_CTRL_WRITER_H
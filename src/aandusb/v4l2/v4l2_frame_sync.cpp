@@ -0,0 +1,319 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2FrameSync"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <utility>
+
+#include "utilbase.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_frame_sync.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * コンストラクタ
+ * @param tolerance_ns フレームセットとして扱うタイムスタンプの差の最大値[ナノ秒]
+ */
+/*public*/
+V4l2FrameSync::V4l2FrameSync(const nsecs_t &tolerance_ns)
+:	tolerance_ns(tolerance_ns),
+	on_frame_set(),
+	sources(), pending(), has_pending(),
+	stats()
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2FrameSync::~V4l2FrameSync() noexcept {
+	ENTER();
+
+	flush();
+	for (auto source: sources) {
+		source->set_on_release_request(nullptr);
+	}
+
+	EXIT();
+}
+
+/**
+ * V4l2Sourceを登録する
+ * @param source
+ * @return チャネル番号
+ */
+/*public*/
+uint32_t V4l2FrameSync::add_source(V4l2Source &source) {
+	ENTER();
+
+	uint32_t channel;
+	sync_lock.lock();
+	{
+		channel = (uint32_t)sources.size();
+		sources.push_back(&source);
+		pending.push_back(sync_frame_t{});
+		has_pending.push_back(false);
+		stats.channel_dropped.push_back(0);
+	}
+	sync_lock.unlock();
+
+	source.set_on_frame_ready([this, channel](const uint8_t *image, const size_t &bytes, const buffer_t &buffer) {
+		return push(channel, image, bytes, buffer);
+	});
+	// 停止・解像度変更時は待機中のフレームが保持しているバッファーを返却しないと返却待ちでタイムアウトする
+	source.set_on_release_request([this, channel]() {
+		drop_pending(channel);
+	});
+
+	RETURN(channel, uint32_t);
+}
+
+/**
+ * 待機中のフレームを全て破棄してv4l2機器へ返却する
+ */
+/*public*/
+void V4l2FrameSync::flush() {
+	ENTER();
+
+	std::vector<sync_frame_t> releases;
+	sync_lock.lock();
+	{
+		for (uint32_t channel = 0; channel < pending.size(); channel++) {
+			if (has_pending[channel]) {
+				remove_pending_locked(channel, releases);
+			}
+		}
+	}
+	sync_lock.unlock();
+	release_frames(releases);
+
+	EXIT();
+}
+
+/**
+ * フレームセットとして扱うタイムスタンプの差の最大値を設定
+ * @param _tolerance_ns [ナノ秒]
+ * @return
+ */
+/*public*/
+V4l2FrameSync &V4l2FrameSync::set_tolerance(const nsecs_t &_tolerance_ns) {
+	AutoMutex lock(sync_lock);
+	tolerance_ns = _tolerance_ns;
+	return *this;
+}
+
+/**
+ * フレームセットとして扱うタイムスタンプの差の最大値を取得
+ * @return [ナノ秒]
+ */
+/*public*/
+nsecs_t V4l2FrameSync::get_tolerance() const {
+	AutoMutex lock(sync_lock);
+	return tolerance_ns;
+}
+
+/**
+ * フレームセットを受け取るコールバックをセット
+ * @param callback
+ * @return
+ */
+/*public*/
+V4l2FrameSync &V4l2FrameSync::set_on_frame_set(OnFrameSetFunc callback) {
+	AutoMutex lock(sync_lock);
+	on_frame_set = std::move(callback);
+	return *this;
+}
+
+/**
+ * 統計情報を取得
+ * @return
+ */
+/*public*/
+sync_stats_t V4l2FrameSync::get_stats() const {
+	AutoMutex lock(sync_lock);
+	return stats;
+}
+
+/**
+ * 統計情報をクリア
+ */
+/*public*/
+void V4l2FrameSync::reset_stats() {
+	AutoMutex lock(sync_lock);
+	const auto n = stats.channel_dropped.size();
+	stats = sync_stats_t{};
+	stats.channel_dropped.resize(n, 0);
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * V4l2Sourceからのフレームを受け取ったときの処理
+ * @param channel
+ * @param image
+ * @param bytes
+ * @param buffer
+ * @return
+ */
+/*private*/
+int V4l2FrameSync::push(const uint32_t &channel,
+	const uint8_t *image, const size_t &bytes, const buffer_t &buffer) {
+
+	ENTER();
+
+	V4l2Source *source;
+	sync_lock.lock();
+	{
+		source = sources[channel];
+	}
+	sync_lock.unlock();
+
+	// コピーせずに対応するフレームが揃うまでv4l2機器のバッファーを保持する
+	if (UNLIKELY(!source->retain_buffer(buffer))) {
+		AutoMutex lock(sync_lock);
+		stats.retain_failed++;
+		stats.channel_dropped[channel]++;
+		RETURN(0, int);
+	}
+
+	std::vector<sync_frame_t> releases;
+	std::vector<sync_frame_t> frame_set;
+	OnFrameSetFunc callback;
+	sync_lock.lock();
+	{
+		if (has_pending[channel]) {
+			// 前のフレームは対応するフレームが来なかったので破棄する
+			remove_pending_locked(channel, releases);
+		}
+		pending[channel] = sync_frame_t {
+			.channel = channel,
+			.source = source,
+			.image = image,
+			.bytes = bytes,
+			.buffer = &buffer,
+			// exposure_tsはメタデータノードを開けたチャネルにしかないので
+			// 全チャネル共通の時間軸で突き合わせるためにv4l2_buffer.timestampを使う
+			.timestamp = buffer.timestamp,
+		};
+		has_pending[channel] = true;
+		const auto n = (uint32_t)pending.size();
+		for ( ; ; ) {
+			uint32_t min_channel = 0;
+			nsecs_t min_ts = 0, max_ts = 0;
+			bool all = true;
+			for (uint32_t i = 0; i < n; i++) {
+				if (!has_pending[i]) {
+					all = false;
+					break;
+				}
+				const auto ts = pending[i].timestamp;
+				if (!i || (ts < min_ts)) {
+					min_ts = ts;
+					min_channel = i;
+				}
+				if (!i || (ts > max_ts)) {
+					max_ts = ts;
+				}
+			}
+			if (!all) {
+				// まだ揃っていない
+				break;
+			}
+			const nsecs_t skew = max_ts - min_ts;
+			if (skew <= tolerance_ns) {
+				// 揃った
+				frame_set = pending;
+				has_pending.assign(n, false);
+				stats.frame_sets++;
+				stats.last_skew = skew;
+				stats.total_skew += skew;
+				if (skew > stats.max_skew) {
+					stats.max_skew = skew;
+				}
+				callback = on_frame_set;
+				break;
+			}
+			// 一番古いフレームは以降に来るフレームとも対応しないので破棄する
+			remove_pending_locked(min_channel, releases);
+		}
+	}
+	sync_lock.unlock();
+
+	release_frames(releases);
+	if (!frame_set.empty()) {
+		if (callback) {
+			callback(frame_set);
+		}
+		release_frames(frame_set);
+	}
+
+	RETURN((int)bytes, int);
+}
+
+/**
+ * 待機中のフレームを取り除いてreleasesへ追加する
+ * @param channel
+ * @param releases
+ */
+/*private*/
+void V4l2FrameSync::remove_pending_locked(const uint32_t &channel, std::vector<sync_frame_t> &releases) {
+	releases.push_back(pending[channel]);
+	has_pending[channel] = false;
+	stats.dropped++;
+	stats.channel_dropped[channel]++;
+}
+
+/**
+ * 指定したチャネルの待機中のフレームを破棄してv4l2機器へ返却する
+ * @param channel
+ */
+/*private*/
+void V4l2FrameSync::drop_pending(const uint32_t &channel) {
+	ENTER();
+
+	std::vector<sync_frame_t> releases;
+	sync_lock.lock();
+	{
+		if ((channel < pending.size()) && has_pending[channel]) {
+			remove_pending_locked(channel, releases);
+		}
+	}
+	sync_lock.unlock();
+	release_frames(releases);
+
+	EXIT();
+}
+
+/**
+ * 保持していたバッファーをv4l2機器へ返却する
+ * @param frames
+ */
+/*private, static*/
+void V4l2FrameSync::release_frames(const std::vector<sync_frame_t> &frames) {
+	for (const auto &frame: frames) {
+		frame.source->release_buffer(*frame.buffer);
+	}
+}
+
+}	// namespace serenegiant::v4l2
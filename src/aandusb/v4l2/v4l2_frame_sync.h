@@ -0,0 +1,224 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_FRAME_SYNC_H
+#define AANDUSB_V4L2_FRAME_SYNC_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+// common
+#include "mutex.h"
+#include "times.h"
+// v4l2
+#include "v4l2/v4l2_source.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * フレームセットとして扱うタイムスタンプの差の最大値のデフォルト値[ナノ秒]
+ */
+#define DEFAULT_SYNC_TOLERANCE_NS (10000000LL)
+
+/**
+ * フレームセットに含まれる1台分の映像フレーム
+ * v4l2機器のバッファーをそのまま参照するのでOnFrameSetFuncから戻った後はアクセスできない
+ */
+typedef struct _sync_frame {
+	/**
+	 * V4l2FrameSync::add_sourceが返したチャネル番号
+	 */
+	uint32_t channel;
+	V4l2Source *source;
+	/**
+	 * 映像データ, CPUからアクセスできないバッファーのときはnullptr
+	 */
+	const uint8_t *image;
+	size_t bytes;
+	const buffer_t *buffer;
+	/**
+	 * v4l2_buffer.timestamp[ナノ秒]
+	 */
+	nsecs_t timestamp;
+} sync_frame_t;
+
+/**
+ * V4l2FrameSyncの統計情報
+ */
+typedef struct _sync_stats {
+	/**
+	 * 出力したフレームセット数
+	 */
+	uint64_t frame_sets;
+	/**
+	 * 対応するフレームが見つからずに破棄したフレーム数
+	 */
+	uint64_t dropped;
+	/**
+	 * v4l2機器側のバッファーが足りなくて保持できずに破棄したフレーム数
+	 */
+	uint64_t retain_failed;
+	/**
+	 * 最後に出力したフレームセットのタイムスタンプの差[ナノ秒]
+	 */
+	nsecs_t last_skew;
+	/**
+	 * 出力したフレームセットのタイムスタンプの差の最大値[ナノ秒]
+	 */
+	nsecs_t max_skew;
+	/**
+	 * 出力したフレームセットのタイムスタンプの差の合計[ナノ秒]
+	 */
+	nsecs_t total_skew;
+	/**
+	 * チャネル毎の破棄したフレーム数
+	 */
+	std::vector<uint64_t> channel_dropped;
+
+	/**
+	 * 出力したフレームセットのタイムスタンプの差の平均値[ナノ秒]
+	 * @return
+	 */
+	inline nsecs_t average_skew() const {
+		return frame_sets ? total_skew / (nsecs_t)frame_sets : 0;
+	}
+} sync_stats_t;
+
+/**
+ * フレームセットを受け取るコールバック
+ * 最後にフレームが揃ったV4l2Sourceのワーカースレッド上で呼ばれる
+ * framesはチャネル番号順
+ */
+typedef std::function<void(const std::vector<sync_frame_t> &frames)> OnFrameSetFunc;
+
+/**
+ * 複数のV4l2Sourceからの映像をv4l2_buffer.timestampで突き合わせて
+ * フレームセットとして受け取るためのヘルパークラス
+ * 各v4l2機器のバッファーはV4l2SourceBase::retain_bufferで保持するのでコピーしない
+ * 許容範囲内に対応するフレームが来なかったフレームは破棄する
+ */
+class V4l2FrameSync {
+private:
+	mutable Mutex sync_lock;
+	/**
+	 * フレームセットとして扱うタイムスタンプの差の最大値[ナノ秒]
+	 */
+	nsecs_t tolerance_ns;
+	/**
+	 * フレームセットを受け取るコールバック
+	 */
+	OnFrameSetFunc on_frame_set;
+	/**
+	 * 登録したV4l2Source, チャネル番号でアクセスする
+	 */
+	std::vector<V4l2Source *> sources;
+	/**
+	 * 対応するフレーム待ちのフレーム, チャネル番号でアクセスする
+	 */
+	std::vector<sync_frame_t> pending;
+	/**
+	 * pendingに有効なフレームが入っているかどうか
+	 */
+	std::vector<bool> has_pending;
+	/**
+	 * 統計情報
+	 */
+	sync_stats_t stats;
+
+	/**
+	 * V4l2Sourceからのフレームを受け取ったときの処理
+	 * V4l2Sourceのワーカースレッド上で呼ばれる
+	 * @param channel
+	 * @param image
+	 * @param bytes
+	 * @param buffer
+	 * @return
+	 */
+	int push(const uint32_t &channel,
+		const uint8_t *image, const size_t &bytes, const buffer_t &buffer);
+	/**
+	 * 待機中のフレームを取り除いてreleasesへ追加する
+	 * sync_lockをロックした状態で呼び出すこと
+	 * @param channel
+	 * @param releases
+	 */
+	void remove_pending_locked(const uint32_t &channel, std::vector<sync_frame_t> &releases);
+	/**
+	 * 指定したチャネルの待機中のフレームを破棄してv4l2機器へ返却する
+	 * V4l2Sourceが映像取得終了・解像度変更等で映像受け取りバッファーを停止・再確保する前に呼ばれる
+	 * @param channel
+	 */
+	void drop_pending(const uint32_t &channel);
+	/**
+	 * 保持していたバッファーをv4l2機器へ返却する
+	 * sync_lockをロックしていない状態で呼び出すこと
+	 * @param frames
+	 */
+	static void release_frames(const std::vector<sync_frame_t> &frames);
+public:
+	/**
+	 * コンストラクタ
+	 * @param tolerance_ns フレームセットとして扱うタイムスタンプの差の最大値[ナノ秒]
+	 */
+	explicit V4l2FrameSync(const nsecs_t &tolerance_ns = DEFAULT_SYNC_TOLERANCE_NS);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4l2FrameSync() noexcept;
+
+	/**
+	 * V4l2Sourceを登録する
+	 * V4l2Source::set_on_frame_ready/set_on_release_requestを上書きするので
+	 * 以降V4l2Sourceへ直接フレームコールバック・返却要求コールバックをセットしないこと
+	 * 映像取得開始前に呼び出すこと
+	 * @param source
+	 * @return チャネル番号
+	 */
+	uint32_t add_source(V4l2Source &source);
+	/**
+	 * 待機中のフレームを全て破棄してv4l2機器へ返却する
+	 * 登録したV4l2Sourceを停止・解像度変更するときはV4l2Source側からの返却要求で
+	 * そのチャネルの待機中のフレームを破棄するので呼び出さなくても良い
+	 */
+	void flush();
+
+	/**
+	 * フレームセットとして扱うタイムスタンプの差の最大値を設定
+	 * @param tolerance_ns [ナノ秒]
+	 * @return
+	 */
+	V4l2FrameSync &set_tolerance(const nsecs_t &tolerance_ns);
+	/**
+	 * フレームセットとして扱うタイムスタンプの差の最大値を取得
+	 * @return [ナノ秒]
+	 */
+	nsecs_t get_tolerance() const;
+	/**
+	 * フレームセットを受け取るコールバックをセット
+	 * @param callback
+	 * @return
+	 */
+	V4l2FrameSync &set_on_frame_set(OnFrameSetFunc callback);
+
+	/**
+	 * 統計情報を取得
+	 * @return
+	 */
+	sync_stats_t get_stats() const;
+	/**
+	 * 統計情報をクリア
+	 */
+	void reset_stats();
+};
+
+typedef std::unique_ptr<V4l2FrameSync> V4l2FrameSyncUp;
+typedef std::shared_ptr<V4l2FrameSync> V4l2FrameSyncSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_FRAME_SYNC_H
@@ -0,0 +1,351 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2Hotplug"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include <libudev.h>
+
+#include "utilbase.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_hotplug.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * udevで監視するサブシステム
+ */
+#define HOTPLUG_SUBSYSTEM "video4linux"
+#define HOTPLUG_ACTION_ADD "add"
+#define HOTPLUG_ACTION_REMOVE "remove"
+
+/**
+ * コンストラクタ
+ * @param device_name 監視するv4l2機器のデバイスファイル名
+ */
+/*public*/
+V4l2Hotplug::V4l2Hotplug(std::string device_name)
+:	m_running(false), event_fd(0),
+	udev(nullptr), monitor(nullptr),
+	hotplug_thread(),
+	device_name(std::move(device_name)),
+	attached(false)
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2Hotplug::~V4l2Hotplug() noexcept {
+	ENTER();
+
+	stop();
+
+	EXIT();
+}
+
+/**
+ * 監視しているv4l2機器が接続されているかどうか
+ * @return
+ */
+/*public*/
+bool V4l2Hotplug::is_attached() const {
+	AutoMutex lock(hotplug_lock);
+	return attached;
+}
+
+/**
+ * 監視しているv4l2機器の現在のデバイスファイル名を取得
+ * @return
+ */
+/*public*/
+std::string V4l2Hotplug::get_dev_node() const {
+	AutoMutex lock(hotplug_lock);
+	return dev_node;
+}
+
+/**
+ * 監視を開始する
+ * 開始時に接続されているv4l2機器からシリアル番号等を取得するので
+ * v4l2機器を接続した状態で呼び出すこと
+ * @return
+ */
+/*public*/
+int V4l2Hotplug::start() {
+	ENTER();
+
+	AutoMutex lock(hotplug_lock);
+	if (m_running) {
+		RETURN(core::USB_SUCCESS, int);
+	}
+
+	int result = core::USB_ERROR_OTHER;
+	udev = udev_new();
+	if (UNLIKELY(!udev)) {
+		LOGE("udev_new failed");
+		RETURN(result, int);
+	}
+	monitor = udev_monitor_new_from_netlink(udev, "udev");
+	if (UNLIKELY(!monitor
+		|| udev_monitor_filter_add_match_subsystem_devtype(monitor, HOTPLUG_SUBSYSTEM, nullptr)
+		|| udev_monitor_enable_receiving(monitor))) {
+
+		LOGE("failed to create udev monitor");
+		goto err;
+	}
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (UNLIKELY(event_fd < 0)) {
+		result = -errno;
+		LOGE("eventfd:errno=%d", -result);
+		event_fd = 0;
+		goto err;
+	}
+
+	{	// 接続されているv4l2機器のシリアル番号等を取得する
+		struct stat st{};
+		if ((::stat(device_name.c_str(), &st) != -1) && S_ISCHR(st.st_mode)) {
+			auto dev = udev_device_new_from_devnum(udev, 'c', st.st_rdev);
+			if (dev) {
+				serial = get_property(dev, "ID_SERIAL");
+				id_path = get_property(dev, "ID_PATH");
+				index = get_sysattr(dev, "index");
+				const char *node = udev_device_get_devnode(dev);
+				dev_node = node ? node : device_name;
+				udev_device_unref(dev);
+			}
+			attached = true;
+		} else {
+			LOGW("'%s' is not connected", device_name.c_str());
+			dev_node = device_name;
+			attached = false;
+		}
+		LOGI("monitor %s,serial=%s,path=%s,index=%s",
+			dev_node.c_str(), serial.c_str(), id_path.c_str(), index.c_str());
+	}
+
+	m_running = true;
+	hotplug_thread = std::thread([this] { hotplug_thread_func(); });
+
+	RETURN(core::USB_SUCCESS, int);
+
+err:
+	if (event_fd) {
+		::close(event_fd);
+		event_fd = 0;
+	}
+	if (monitor) {
+		udev_monitor_unref(monitor);
+		monitor = nullptr;
+	}
+	udev_unref(udev);
+	udev = nullptr;
+
+	RETURN(result, int);
+}
+
+/**
+ * 監視を終了する
+ * @return
+ */
+/*public*/
+int V4l2Hotplug::stop() {
+	ENTER();
+
+	bool prev;
+	hotplug_lock.lock();
+	{
+		prev = m_running;
+		m_running = false;
+	}
+	hotplug_lock.unlock();
+
+	if (prev) {
+		// ワーカースレッドを起こす
+		const uint64_t v = 1;
+		if (UNLIKELY(::write(event_fd, &v, sizeof(v)) < 0)) {
+			LOGW("failed to write eventfd,errno=%d", errno);
+		}
+		if (hotplug_thread.joinable()) {
+			LOGD("join:hotplug_thread");
+			hotplug_thread.join();
+		}
+	}
+
+	AutoMutex lock(hotplug_lock);
+	if (event_fd) {
+		::close(event_fd);
+		event_fd = 0;
+	}
+	if (monitor) {
+		udev_monitor_unref(monitor);
+		monitor = nullptr;
+	}
+	if (udev) {
+		udev_unref(udev);
+		udev = nullptr;
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * ワーカースレッドの実行関数
+ */
+/*private*/
+void V4l2Hotplug::hotplug_thread_func() {
+	ENTER();
+
+	struct pollfd fds[2] {
+		{ .fd = udev_monitor_get_fd(monitor), .events = POLLIN, },
+		{ .fd = event_fd, .events = POLLIN, },
+	};
+
+	LOGD("hotplug loop start");
+	for ( ; is_running(); ) {
+		const int n = poll(fds, 2, -1);
+		if (UNLIKELY(n < 0)) {
+			if (errno != EINTR) {
+				LOGE("poll:errno=%d", errno);
+			}
+			continue;
+		}
+		if (fds[1].revents) {
+			// 終了要求
+			break;
+		}
+		if (fds[0].revents & POLLIN) {
+			auto dev = udev_monitor_receive_device(monitor);
+			if (dev) {
+				handle_device(dev);
+				udev_device_unref(dev);
+			}
+		}
+	}
+	LOGD("hotplug loop finished");
+
+	EXIT();
+}
+
+/**
+ * udevから受け取ったv4l2機器の接続/抜去を処理する
+ * ワーカースレッド上で呼ばれる
+ * @param dev
+ */
+/*private*/
+void V4l2Hotplug::handle_device(struct udev_device *dev) {
+	ENTER();
+
+	const char *action = udev_device_get_action(dev);
+	const char *node = udev_device_get_devnode(dev);
+	if (!action || !node) {
+		EXIT();
+	}
+	LOGD("action=%s,node=%s", action, node);
+
+	OnHotplugFunc callback = nullptr;
+	hotplug_lock.lock();
+	{
+		if (!strcmp(action, HOTPLUG_ACTION_ADD)) {
+			if (!attached && match_locked(dev)) {
+				LOGI("attached %s", node);
+				attached = true;
+				dev_node = node;
+				callback = on_attach;
+			}
+		} else if (!strcmp(action, HOTPLUG_ACTION_REMOVE)) {
+			// 抜去時はsysfs属性を読めないのでデバイスファイル名でも比較する
+			if (attached && ((dev_node == node) || match_locked(dev))) {
+				LOGI("detached %s", node);
+				attached = false;
+				callback = on_detach;
+			}
+		}
+	}
+	hotplug_lock.unlock();
+
+	if (callback) {
+		callback(node);
+	}
+
+	EXIT();
+}
+
+/**
+ * 監視しているv4l2機器かどうかを確認する
+ * hotplug_lockをロックした状態で呼び出すこと
+ * @param dev
+ * @return
+ */
+/*private*/
+bool V4l2Hotplug::match_locked(struct udev_device *dev) const {
+	ENTER();
+
+	bool result;
+	const auto dev_index = get_sysattr(dev, "index");
+	const bool index_matched = index.empty() || dev_index.empty() || (index == dev_index);
+	if (!serial.empty()) {
+		result = index_matched && (serial == get_property(dev, "ID_SERIAL"));
+	} else if (!id_path.empty()) {
+		result = index_matched && (id_path == get_property(dev, "ID_PATH"));
+	} else {
+		// シリアル番号等を取得できなかったときはデバイスファイル名で比較する
+		const char *node = udev_device_get_devnode(dev);
+		result = node && (device_name == node);
+	}
+
+	RETURN(result, bool);
+}
+
+/**
+ * udev_deviceの文字列プロパティを取得する, 存在しなければ空文字列
+ * @param dev
+ * @param key
+ * @return
+ */
+/*private, static*/
+std::string V4l2Hotplug::get_property(struct udev_device *dev, const char *key) {
+	const char *value = udev_device_get_property_value(dev, key);
+	return value ? value : "";
+}
+
+/**
+ * udev_deviceの文字列sysfs属性を取得する, 存在しなければ空文字列
+ * @param dev
+ * @param key
+ * @return
+ */
+/*private, static*/
+std::string V4l2Hotplug::get_sysattr(struct udev_device *dev, const char *key) {
+	const char *value = udev_device_get_sysattr_value(dev, key);
+	return value ? value : "";
+}
+
+}	// namespace serenegiant::v4l2
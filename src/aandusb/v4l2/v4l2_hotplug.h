@@ -0,0 +1,185 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_HOTPLUG_H
+#define AANDUSB_V4L2_HOTPLUG_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+// common
+#include "mutex.h"
+
+struct udev;
+struct udev_monitor;
+struct udev_device;
+
+namespace serenegiant::v4l2 {
+
+/**
+ * v4l2機器が接続/抜去されたときのコールバック関数
+ * V4l2Hotplugのワーカースレッド上で呼ばれる
+ * @param dev_node v4l2機器のデバイスファイル名
+ */
+typedef std::function<void(const std::string &dev_node)> OnHotplugFunc;
+
+/**
+ * libudevでv4l2機器の接続/抜去を監視するためのヘルパークラス
+ * /dev/videoNは再接続時に変わることがあるので
+ * コンストラクタで指定したv4l2機器のシリアル番号(ID_SERIAL)またはバスパス(ID_PATH)と
+ * インデックス(同じ機器の何番目のvideoノードか)で同じ機器かどうかを判断する
+ */
+class V4l2Hotplug {
+private:
+	mutable Mutex hotplug_lock;
+	/**
+	 * 実行中フラグ
+	 */
+	volatile bool m_running;
+	/**
+	 * ワーカースレッドを起こすためのeventfdのファイルディスクリプタ
+	 */
+	int event_fd;
+	struct udev *udev;
+	struct udev_monitor *monitor;
+	/**
+	 * ワーカースレッド
+	 */
+	std::thread hotplug_thread;
+	/**
+	 * 監視するv4l2機器のデバイスファイル名(/dev/v4l/by-id/...等のシンボリックリンクでも可)
+	 */
+	const std::string device_name;
+	/**
+	 * 現在のv4l2機器のデバイスファイル名
+	 * hotplug_lockで保護する
+	 */
+	std::string dev_node;
+	/**
+	 * v4l2機器のシリアル番号(ID_SERIAL)
+	 * hotplug_lockで保護する
+	 */
+	std::string serial;
+	/**
+	 * v4l2機器のバスパス(ID_PATH)
+	 * hotplug_lockで保護する
+	 */
+	std::string id_path;
+	/**
+	 * 同じ機器の何番目のvideoノードか(sysfsのindex属性)
+	 * hotplug_lockで保護する
+	 */
+	std::string index;
+	/**
+	 * v4l2機器が接続されているかどうか
+	 * hotplug_lockで保護する
+	 */
+	bool attached;
+	OnHotplugFunc on_attach;
+	OnHotplugFunc on_detach;
+
+	/**
+	 * ワーカースレッドの実行関数
+	 */
+	void hotplug_thread_func();
+	/**
+	 * udevから受け取ったv4l2機器の接続/抜去を処理する
+	 * ワーカースレッド上で呼ばれる
+	 * @param dev
+	 */
+	void handle_device(struct udev_device *dev);
+	/**
+	 * 監視しているv4l2機器かどうかを確認する
+	 * hotplug_lockをロックした状態で呼び出すこと
+	 * @param dev
+	 * @return
+	 */
+	bool match_locked(struct udev_device *dev) const;
+	/**
+	 * udev_deviceの文字列プロパティを取得する, 存在しなければ空文字列
+	 * @param dev
+	 * @param key
+	 * @return
+	 */
+	static std::string get_property(struct udev_device *dev, const char *key);
+	/**
+	 * udev_deviceの文字列sysfs属性を取得する, 存在しなければ空文字列
+	 * @param dev
+	 * @param key
+	 * @return
+	 */
+	static std::string get_sysattr(struct udev_device *dev, const char *key);
+public:
+	/**
+	 * コンストラクタ
+	 * @param device_name 監視するv4l2機器のデバイスファイル名
+	 */
+	explicit V4l2Hotplug(std::string device_name);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4l2Hotplug() noexcept;
+
+	/**
+	 * 実行中かどうか
+	 * @return
+	 */
+	inline bool is_running() const { return m_running; };
+	/**
+	 * 監視しているv4l2機器が接続されているかどうか
+	 * @return
+	 */
+	bool is_attached() const;
+	/**
+	 * 監視しているv4l2機器の現在のデバイスファイル名を取得
+	 * @return
+	 */
+	std::string get_dev_node() const;
+
+	/**
+	 * 監視を開始する
+	 * 開始時に接続されているv4l2機器からシリアル番号等を取得するので
+	 * v4l2機器を接続した状態で呼び出すこと
+	 * @return
+	 */
+	int start();
+	/**
+	 * 監視を終了する
+	 * @return
+	 */
+	int stop();
+
+	/**
+	 * 監視しているv4l2機器が接続されたときのコールバック関数をセット
+	 * @param callback
+	 * @return
+	 */
+	inline V4l2Hotplug &set_on_attach(OnHotplugFunc callback) {
+		AutoMutex lock(hotplug_lock);
+		on_attach = std::move(callback);
+		return *this;
+	}
+	/**
+	 * 監視しているv4l2機器が抜去されたときのコールバック関数をセット
+	 * @param callback
+	 * @return
+	 */
+	inline V4l2Hotplug &set_on_detach(OnHotplugFunc callback) {
+		AutoMutex lock(hotplug_lock);
+		on_detach = std::move(callback);
+		return *this;
+	}
+};
+
+typedef std::unique_ptr<V4l2Hotplug> V4l2HotplugUp;
+typedef std::shared_ptr<V4l2Hotplug> V4l2HotplugSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_HOTPLUG_H
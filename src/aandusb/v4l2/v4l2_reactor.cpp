@@ -0,0 +1,425 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2Reactor"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "utilbase.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_reactor.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * 1回のepoll_waitで受け取る最大イベント数
+ */
+#define MAX_REACTOR_EVENTS (16)
+
+/**
+ * コンストラクタ
+ */
+/*public*/
+V4l2Reactor::V4l2Reactor()
+:	m_running(false),
+	epoll_fd(0), event_fd(0),
+	reactor_thread()
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2Reactor::~V4l2Reactor() noexcept {
+	ENTER();
+
+	stop();
+
+	EXIT();
+}
+
+/**
+ * ワーカースレッドを開始する
+ * @return
+ */
+/*public*/
+int V4l2Reactor::start() {
+	ENTER();
+
+	AutoMutex lock(reactor_lock);
+	if (m_running) {
+		RETURN(core::USB_SUCCESS, int);
+	}
+
+	int result = core::USB_SUCCESS;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (UNLIKELY(epoll_fd < 0)) {
+		result = -errno;
+		LOGE("epoll_create1:errno=%d", -result);
+		epoll_fd = 0;
+		RETURN(result, int);
+	}
+	event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (UNLIKELY(event_fd < 0)) {
+		result = -errno;
+		LOGE("eventfd:errno=%d", -result);
+		::close(epoll_fd);
+		epoll_fd = event_fd = 0;
+		RETURN(result, int);
+	}
+	// eventfdはレベルトリガーで監視する, data.ptrがnullptrならeventfd
+	struct epoll_event ev {
+		.events = EPOLLIN,
+	};
+	ev.data.ptr = nullptr;
+	if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) < 0)) {
+		result = -errno;
+		LOGE("epoll_ctl:errno=%d", -result);
+		::close(event_fd);
+		::close(epoll_fd);
+		epoll_fd = event_fd = 0;
+		RETURN(result, int);
+	}
+
+	m_running = true;
+	reactor_thread = std::thread([this] { reactor_thread_func(); });
+
+	RETURN(result, int);
+}
+
+/**
+ * ワーカースレッドを終了する
+ * 登録中のクライアントは全て登録解除される
+ * @return
+ */
+/*public*/
+int V4l2Reactor::stop() {
+	ENTER();
+
+	bool prev;
+	reactor_lock.lock();
+	{
+		prev = m_running;
+		m_running = false;
+	}
+	reactor_lock.unlock();
+
+	if (prev) {
+		wakeup();
+		if (reactor_thread.joinable()) {
+			LOGD("join:reactor_thread");
+			reactor_thread.join();
+		}
+	}
+
+	AutoMutex lock(reactor_lock);
+	if (event_fd) {
+		::close(event_fd);
+		event_fd = 0;
+	}
+	if (epoll_fd) {
+		::close(epoll_fd);
+		epoll_fd = 0;
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * クライアントを登録して映像取得を開始する
+ * IV4l2ReactorClient::on_reactor_attachの処理が終わるまでブロックする
+ * @param client
+ * @return
+ */
+/*public*/
+int V4l2Reactor::attach(IV4l2ReactorClient *client) {
+	ENTER();
+
+	int result = request(true, client);
+
+	RETURN(result, int);
+}
+
+/**
+ * クライアントを登録解除して映像取得を終了する
+ * IV4l2ReactorClient::on_reactor_detachの処理が終わるまでブロックする
+ * 既に登録解除されているときは何もしない
+ * @param client
+ * @return
+ */
+/*public*/
+int V4l2Reactor::detach(IV4l2ReactorClient *client) {
+	ENTER();
+
+	int result = request(false, client);
+
+	RETURN(result, int);
+}
+
+/**
+ * ワーカースレッドを起こして登録中の全てのクライアントの
+ * IV4l2ReactorClient::on_reactor_wakeupを呼び出す
+ */
+/*public*/
+void V4l2Reactor::wakeup() {
+	ENTER();
+
+	const int fd = event_fd;
+	if (LIKELY(fd)) {
+		const uint64_t v = 1;
+		if (UNLIKELY(::write(fd, &v, sizeof(v)) < 0)) {
+			// EAGAINのときは既に起床要求済みなので無視する
+			if (errno != EAGAIN) {
+				LOGW("failed to write eventfd,errno=%d", errno);
+			}
+		}
+	}
+
+	EXIT();
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * 要求をワーカースレッドへ送って処理が終わるまで待機する
+ * ワーカースレッド上から呼ばれたときはその場で処理する
+ * @param attach
+ * @param client
+ * @return
+ */
+/*private*/
+int V4l2Reactor::request(const bool &attach, IV4l2ReactorClient *client) {
+	ENTER();
+
+	if (UNLIKELY(!client)) {
+		RETURN(core::USB_ERROR_INVALID_PARAM, int);
+	}
+	if (std::this_thread::get_id() == reactor_thread.get_id()) {
+		// ワーカースレッド上(コールバック内)から呼ばれたとき
+		const int result = attach ? handle_attach(client) : handle_detach(client, false);
+		RETURN(result, int);
+	}
+
+	reactor_command_t command {
+		.attach = attach,
+		.client = client,
+		.result = core::USB_ERROR_INVALID_STATE,
+		.done = false,
+	};
+	AutoMutex lock(reactor_lock);
+	if (!m_running) {
+		// ワーカースレッドが動いていなければ登録中のクライアントは無い
+		RETURN(attach ? core::USB_ERROR_INVALID_STATE : core::USB_SUCCESS, int);
+	}
+	commands.push_back(&command);
+	wakeup();
+	for ( ; !command.done ; ) {
+		reactor_sync.wait(reactor_lock);
+	}
+
+	RETURN(command.result, int);
+}
+
+/**
+ * ワーカースレッドの実行関数
+ */
+/*private*/
+void V4l2Reactor::reactor_thread_func() {
+	ENTER();
+
+	struct epoll_event events[MAX_REACTOR_EVENTS];
+
+	LOGD("reactor loop start");
+	for ( ; is_running() ; ) {
+		const int n = epoll_wait(epoll_fd, events, MAX_REACTOR_EVENTS, -1);
+		if (UNLIKELY(n < 0)) {
+			if (errno != EINTR) {
+				LOGE("epoll_wait:errno=%d", errno);
+			}
+			continue;
+		}
+		bool woken = false;
+		for (int i = 0; i < n; i++) {
+			auto client = static_cast<IV4l2ReactorClient *>(events[i].data.ptr);
+			if (!client) {
+				// eventfdによる起床要求
+				uint64_t v;
+				if (::read(event_fd, &v, sizeof(v)) < 0) {
+					if (errno != EAGAIN) {
+						LOGW("failed to read eventfd,errno=%d", errno);
+					}
+				}
+				woken = true;
+				continue;
+			}
+			// 同じepoll_waitの結果の中で先にエラーで登録解除されていることがある
+			if (UNLIKELY(std::find(clients.begin(), clients.end(), client) == clients.end())) {
+				continue;
+			}
+			int result = core::USB_SUCCESS;
+			if (events[i].events & EPOLLPRI) {
+				// v4l2のイベントが届いた
+				result = client->on_reactor_event();
+				if (UNLIKELY(result)) {
+					LOGW("on_reactor_event failed,fd=%d,err=%d", client->get_reactor_fd(), result);
+				}
+			}
+			// EPOLLERR/EPOLLHUPのときもVIDIOC_DQBUFの結果でエラーかどうかを判断する
+			if (!result && (events[i].events & ~EPOLLPRI)) {
+				result = client->on_reactor_ready();
+				if (UNLIKELY(result)) {
+					LOGW("on_reactor_ready failed,fd=%d,err=%d", client->get_reactor_fd(), result);
+				}
+			}
+			if (UNLIKELY(result)) {
+				handle_detach(client, true);
+			}
+		}
+		if (woken) {
+			handle_commands();
+			// on_reactor_wakeup内で登録解除されることがあるのでコピーに対して処理する
+			const auto targets = clients;
+			for (auto client: targets) {
+				const int result = client->on_reactor_wakeup();
+				if (UNLIKELY(result)) {
+					LOGW("on_reactor_wakeup failed,fd=%d,err=%d", client->get_reactor_fd(), result);
+					handle_detach(client, true);
+				}
+			}
+		}
+	}
+	LOGD("reactor loop finished");
+
+	// 終了処理
+	handle_commands();
+	const auto targets = clients;
+	for (auto client: targets) {
+		handle_detach(client, false);
+	}
+
+	EXIT();
+}
+
+/**
+ * 未処理の要求を処理する
+ * ワーカースレッド上で呼ばれる
+ */
+/*private*/
+void V4l2Reactor::handle_commands() {
+	ENTER();
+
+	std::list<reactor_command_t *> pending;
+	reactor_lock.lock();
+	{
+		pending.swap(commands);
+	}
+	reactor_lock.unlock();
+
+	for (auto command: pending) {
+		if (command->attach) {
+			command->result = is_running()
+				? handle_attach(command->client) : core::USB_ERROR_INVALID_STATE;
+		} else {
+			command->result = handle_detach(command->client, false);
+		}
+	}
+
+	if (!pending.empty()) {
+		AutoMutex lock(reactor_lock);
+		for (auto command: pending) {
+			command->done = true;
+		}
+		reactor_sync.broadcast();
+	}
+
+	EXIT();
+}
+
+/**
+ * 登録要求を処理する
+ * ワーカースレッド上で呼ばれる
+ * @param client
+ * @return
+ */
+/*private*/
+int V4l2Reactor::handle_attach(IV4l2ReactorClient *client) {
+	ENTER();
+
+	if (UNLIKELY(std::find(clients.begin(), clients.end(), client) != clients.end())) {
+		LOGD("already attached");
+		RETURN(core::USB_SUCCESS, int);
+	}
+
+	int result = client->on_reactor_attach();
+	if (LIKELY(!result)) {
+		// v4l2機器はエッジトリガーで監視する, EPOLLPRIはv4l2のイベント
+		struct epoll_event ev {
+			.events = EPOLLIN | EPOLLPRI | EPOLLET,
+		};
+		ev.data.ptr = client;
+		if (LIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->get_reactor_fd(), &ev) == 0)) {
+			clients.push_back(client);
+		} else {
+			result = -errno;
+			LOGE("epoll_ctl:errno=%d", -result);
+		}
+	}
+	if (UNLIKELY(result)) {
+		client->on_reactor_detach(true);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 登録解除要求を処理する
+ * ワーカースレッド上で呼ばれる
+ * @param client
+ * @param error
+ * @return
+ */
+/*private*/
+int V4l2Reactor::handle_detach(IV4l2ReactorClient *client, const bool &error) {
+	ENTER();
+
+	auto itr = std::find(clients.begin(), clients.end(), client);
+	if (itr == clients.end()) {
+		// 既に登録解除されている
+		RETURN(core::USB_SUCCESS, int);
+	}
+	clients.erase(itr);
+	// on_reactor_detachでv4l2機器が閉じられるので先にepollから取り除く
+	if (UNLIKELY(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->get_reactor_fd(), nullptr) < 0)) {
+		LOGW("epoll_ctl:errno=%d", errno);
+	}
+	client->on_reactor_detach(error);
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+}	// namespace serenegiant::v4l2
@@ -0,0 +1,214 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_REACTOR_H
+#define AANDUSB_V4L2_REACTOR_H
+
+#include <list>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// common
+#include "mutex.h"
+#include "condition.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * V4l2Reactorへ登録して映像取得処理を任せるためのインターフェース
+ * インターフェースの関数は全てV4l2Reactorのワーカースレッド上で呼ばれる
+ */
+class IV4l2ReactorClient {
+public:
+	virtual ~IV4l2ReactorClient() noexcept = default;
+	/**
+	 * V4l2Reactorへ登録されたときの処理
+	 * 映像取得の準備をして映像ストリームを開始する
+	 * @return 0: 成功, 0以外: エラー
+	 */
+	virtual int on_reactor_attach() = 0;
+	/**
+	 * epollで監視するv4l2機器のファイルディスクリプタを取得
+	 * @return
+	 */
+	virtual int get_reactor_fd() const = 0;
+	/**
+	 * v4l2機器が読み込み可能になったときの処理
+	 * エッジトリガーで監視するのでVIDIOC_DQBUFがEAGAINを返すまで映像データを取り出すこと
+	 * @return 0: 成功, 0以外: エラー(V4l2Reactorから登録解除される)
+	 */
+	virtual int on_reactor_ready() = 0;
+	/**
+	 * V4l2Reactor::wakeupが呼ばれたときの処理
+	 * 解像度変更要求等を処理する
+	 * @return 0: 成功, 0以外: エラー(V4l2Reactorから登録解除される)
+	 */
+	virtual int on_reactor_wakeup() = 0;
+	/**
+	 * v4l2機器にイベント(VIDIOC_DQEVENT)が届いたとき(EPOLLPRI)の処理
+	 * エッジトリガーで監視するのでVIDIOC_DQEVENTが失敗するまでイベントを取り出すこと
+	 * イベントを購読しないクライアントは実装しなくても良い
+	 * @return 0: 成功, 0以外: エラー(V4l2Reactorから登録解除される)
+	 */
+	virtual int on_reactor_event() { return 0; };
+	/**
+	 * V4l2Reactorから登録解除されたときの処理
+	 * 映像ストリームを終了して映像取得の後始末をする
+	 * @param error エラーによって登録解除されたときtrue
+	 */
+	virtual void on_reactor_detach(const bool &error) = 0;
+};
+
+/**
+ * 複数のv4l2機器からの映像取得を1つのワーカースレッドで行うためのヘルパークラス
+ * v4l2機器毎にワーカースレッドを起こしてselectで待機する代わりに
+ * 全てのv4l2機器のファイルディスクリプタをepollへエッジトリガーで登録して
+ * 読み込み可能になったv4l2機器だけVIDIOC_DQBUFする
+ * 登録/登録解除/解像度変更等の要求はeventfdでワーカースレッドを起こして処理する
+ */
+class V4l2Reactor {
+private:
+	/**
+	 * ワーカースレッドへの要求
+	 */
+	typedef struct reactor_command {
+		/**
+		 * true: 登録要求, false: 登録解除要求
+		 */
+		bool attach;
+		IV4l2ReactorClient *client;
+		/**
+		 * 処理結果
+		 */
+		int result;
+		/**
+		 * 処理済みかどうか
+		 */
+		bool done;
+	} reactor_command_t;
+
+	mutable Mutex reactor_lock;
+	/**
+	 * 要求の処理完了待ち用
+	 */
+	Condition reactor_sync;
+	/**
+	 * 実行中フラグ
+	 */
+	volatile bool m_running;
+	/**
+	 * epollのファイルディスクリプタ
+	 */
+	int epoll_fd;
+	/**
+	 * ワーカースレッドを起こすためのeventfdのファイルディスクリプタ
+	 */
+	int event_fd;
+	/**
+	 * ワーカースレッド
+	 */
+	std::thread reactor_thread;
+	/**
+	 * 未処理の要求
+	 * reactor_lockで保護する
+	 */
+	std::list<reactor_command_t *> commands;
+	/**
+	 * 登録中のクライアント
+	 * ワーカースレッドからのみアクセスする
+	 */
+	std::vector<IV4l2ReactorClient *> clients;
+
+	/**
+	 * ワーカースレッドの実行関数
+	 */
+	void reactor_thread_func();
+	/**
+	 * 未処理の要求を処理する
+	 * ワーカースレッド上で呼ばれる
+	 */
+	void handle_commands();
+	/**
+	 * 登録要求を処理する
+	 * ワーカースレッド上で呼ばれる
+	 * @param client
+	 * @return
+	 */
+	int handle_attach(IV4l2ReactorClient *client);
+	/**
+	 * 登録解除要求を処理する
+	 * ワーカースレッド上で呼ばれる
+	 * @param client
+	 * @param error
+	 * @return
+	 */
+	int handle_detach(IV4l2ReactorClient *client, const bool &error);
+	/**
+	 * 要求をワーカースレッドへ送って処理が終わるまで待機する
+	 * ワーカースレッド上から呼ばれたときはその場で処理する
+	 * @param attach
+	 * @param client
+	 * @return
+	 */
+	int request(const bool &attach, IV4l2ReactorClient *client);
+public:
+	/**
+	 * コンストラクタ
+	 */
+	V4l2Reactor();
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4l2Reactor() noexcept;
+
+	/**
+	 * 実行中かどうか
+	 * @return
+	 */
+	inline bool is_running() const { return m_running; };
+
+	/**
+	 * ワーカースレッドを開始する
+	 * @return
+	 */
+	int start();
+	/**
+	 * ワーカースレッドを終了する
+	 * 登録中のクライアントは全て登録解除される
+	 * @return
+	 */
+	int stop();
+
+	/**
+	 * クライアントを登録して映像取得を開始する
+	 * IV4l2ReactorClient::on_reactor_attachの処理が終わるまでブロックする
+	 * @param client
+	 * @return
+	 */
+	int attach(IV4l2ReactorClient *client);
+	/**
+	 * クライアントを登録解除して映像取得を終了する
+	 * IV4l2ReactorClient::on_reactor_detachの処理が終わるまでブロックする
+	 * 既に登録解除されているときは何もしない
+	 * @param client
+	 * @return
+	 */
+	int detach(IV4l2ReactorClient *client);
+	/**
+	 * ワーカースレッドを起こして登録中の全てのクライアントの
+	 * IV4l2ReactorClient::on_reactor_wakeupを呼び出す
+	 */
+	void wakeup();
+};
+
+typedef std::unique_ptr<V4l2Reactor> V4l2ReactorUp;
+typedef std::shared_ptr<V4l2Reactor> V4l2ReactorSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_REACTOR_H
@@ -0,0 +1,227 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2Recorder"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "utilbase.h"
+// usb
+#include "usb/aandusb.h"
+// v4l2
+#include "v4l2/v4l2_recorder.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * 各フレームの映像データの後ろを埋めるためのデータ
+ */
+static const uint8_t PADDING[REPLAY_FRAME_ALIGN] = { 0 };
+
+/**
+ * コンストラクタ
+ */
+/*public*/
+V4l2Recorder::V4l2Recorder()
+:	m_fd(0),
+	width(0), height(0), pixel_format(0),
+	frames(0)
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2Recorder::~V4l2Recorder() noexcept {
+	ENTER();
+
+	close();
+
+	EXIT();
+}
+
+/**
+ * 書き込み中かどうか
+ * @return
+ */
+/*public*/
+bool V4l2Recorder::is_recording() const {
+	AutoMutex lock(recorder_lock);
+	return m_fd != 0;
+}
+
+/**
+ * 書き込んだフレーム数を取得
+ * @return
+ */
+/*public*/
+uint64_t V4l2Recorder::get_frames() const {
+	AutoMutex lock(recorder_lock);
+	return frames;
+}
+
+/**
+ * 映像記録ファイルを生成してヘッダーを書き込む
+ * 同名のファイルがあれば上書きする
+ * @param path
+ * @param width
+ * @param height
+ * @param pixel_format V4L2_PIX_FMT_XXX
+ * @return
+ */
+/*public*/
+int V4l2Recorder::open(
+	const std::string &path,
+	const uint32_t &_width, const uint32_t &_height,
+	const uint32_t &_pixel_format) {
+
+	ENTER();
+
+	AutoMutex lock(recorder_lock);
+	if (m_fd) {
+		LOGD("already opened");
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+
+	const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (UNLIKELY(fd < 0)) {
+		const int result = -errno;
+		LOGE("failed to open %s,errno=%d", path.c_str(), -result);
+		RETURN(result, int);
+	}
+
+	replay_file_header_t header {
+		.version = REPLAY_FILE_VERSION,
+		.width = _width,
+		.height = _height,
+		.pixel_format = _pixel_format,
+	};
+	memcpy(header.magic, REPLAY_FILE_MAGIC, sizeof(header.magic));
+	if (UNLIKELY(::write(fd, &header, sizeof(header)) != sizeof(header))) {
+		const int result = errno ? -errno : core::USB_ERROR_IO;
+		LOGE("failed to write header,errno=%d", errno);
+		::close(fd);
+		RETURN(result, int);
+	}
+
+	m_fd = fd;
+	width = _width;
+	height = _height;
+	pixel_format = _pixel_format;
+	frames = 0;
+	LOGI("record to %s,%ux%u,pixel_format=0x%08x", path.c_str(), width, height, pixel_format);
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 映像を1フレーム書き込む
+ * on_frame_readyの引数をそのまま渡す
+ * @param image 映像データ, CPUからアクセスできないバッファーのときはnullptr
+ * @param bytes 映像データのサイズ
+ * @param buffer 共有メモリー情報
+ * @return
+ */
+/*public*/
+int V4l2Recorder::write(const uint8_t *image, const size_t &bytes, const buffer_t &buffer) {
+	ENTER();
+
+	AutoMutex lock(recorder_lock);
+	if (UNLIKELY(!m_fd)) {
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+
+	replay_frame_header_t header {
+		.timestamp = (uint64_t)buffer.timestamp,
+		.sequence = buffer.sequence,
+		.flags = buffer.flags,
+	};
+	struct iovec iov[MAX_BUFFER_PLANES + 2];
+	int n = 0;
+	size_t data_bytes = 0;
+	iov[n++] = { .iov_base = &header, .iov_len = sizeof(header) };
+	if (buffer.num_planes > 1) {
+		// マルチプレーンのときは先頭プレーンが輝度(width*height),
+		// 残りを色差プレーンで等分したものとして連続して書き込む
+		const size_t y_bytes = width * height;
+		const size_t uv_bytes = bytes > y_bytes ? (bytes - y_bytes) / (buffer.num_planes - 1) : 0;
+		for (uint32_t i = 0; i < buffer.num_planes; i++) {
+			if (UNLIKELY(buffer.planes[i].start == MAP_FAILED)) {
+				LOGW("plane %u is not accessible from cpu", i);
+				RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+			}
+			iov[n++] = {
+				.iov_base = buffer.planes[i].start,
+				.iov_len = i ? uv_bytes : y_bytes,
+			};
+			data_bytes += iov[n - 1].iov_len;
+		}
+	} else if (LIKELY(image)) {
+		iov[n++] = { .iov_base = const_cast<uint8_t *>(image), .iov_len = bytes };
+		data_bytes = bytes;
+	} else {
+		LOGW("buffer is not accessible from cpu");
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	header.bytes = (uint32_t)data_bytes;
+	const size_t padding = (REPLAY_FRAME_ALIGN - (data_bytes % REPLAY_FRAME_ALIGN)) % REPLAY_FRAME_ALIGN;
+	if (padding) {
+		iov[n++] = { .iov_base = const_cast<uint8_t *>(PADDING), .iov_len = padding };
+	}
+	const size_t total = sizeof(header) + data_bytes + padding;
+	const ssize_t written = ::writev(m_fd, iov, n);
+	if (UNLIKELY(written != (ssize_t)total)) {
+		const int result = written < 0 ? -errno : core::USB_ERROR_IO;
+		LOGE("failed to write frame,written=%d,errno=%d", (int)written, errno);
+		RETURN(result, int);
+	}
+	frames++;
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 映像記録ファイルを閉じる
+ * @return
+ */
+/*public*/
+int V4l2Recorder::close() {
+	ENTER();
+
+	AutoMutex lock(recorder_lock);
+	if (m_fd) {
+		LOGI("%" PRIu64 " frames recorded", frames);
+		::close(m_fd);
+		m_fd = 0;
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+}	// namespace serenegiant::v4l2
@@ -0,0 +1,149 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_RECORDER_H
+#define AANDUSB_V4L2_RECORDER_H
+
+#include <memory>
+#include <string>
+
+// common
+#include "mutex.h"
+// v4l2
+#include "v4l2/v4l2.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * 映像記録ファイルの先頭に書き込むマジック
+ */
+#define REPLAY_FILE_MAGIC "V4LR"
+/**
+ * 映像記録ファイルの形式のバージョン
+ * 形式を変更したときはインクリメントする
+ */
+#define REPLAY_FILE_VERSION (1)
+/**
+ * 各フレームの映像データの境界, mmapしたまま描画できるように揃える
+ */
+#define REPLAY_FRAME_ALIGN (8)
+
+/**
+ * 映像記録ファイルのヘッダー
+ * ファイル先頭に1つだけ書き込む
+ */
+typedef struct _replay_file_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	/**
+	 * V4L2_PIX_FMT_XXX
+	 */
+	uint32_t pixel_format;
+	uint32_t reserved;
+} replay_file_header_t;
+
+/**
+ * 映像記録ファイルの各フレームのヘッダー
+ * 直後にbytesバイトの映像データが続き, REPLAY_FRAME_ALIGNの倍数になるように0で埋める
+ */
+typedef struct _replay_frame_header {
+	/**
+	 * v4l2_buffer.timestamp[ナノ秒]
+	 */
+	uint64_t timestamp;
+	/**
+	 * v4l2_buffer.sequence
+	 */
+	uint32_t sequence;
+	/**
+	 * v4l2_buffer.flags
+	 */
+	uint32_t flags;
+	/**
+	 * 映像データのサイズ
+	 */
+	uint32_t bytes;
+	uint32_t reserved;
+} replay_frame_header_t;
+
+/**
+ * v4l2機器から受け取った映像をタイムスタンプ等と一緒に
+ * V4l2ReplaySourceで再生できる形式のファイルへ書き込むためのヘルパークラス
+ * 映像データは受け取ったまま(YUYV等の非圧縮映像ならそのまま, MJPEGならjpegのまま)書き込む
+ * マルチプレーンのときは各プレーンを連続して書き込む
+ * writeは呼び出したスレッド上でファイルへ書き込むので映像取得スレッドから呼ぶときはストレージの速度に注意すること
+ */
+class V4l2Recorder {
+private:
+	mutable Mutex recorder_lock;
+	/**
+	 * 書き込み中のファイルのファイルディスクリプタ
+	 */
+	int m_fd;
+	uint32_t width, height;
+	uint32_t pixel_format;
+	/**
+	 * 書き込んだフレーム数
+	 */
+	uint64_t frames;
+public:
+	/**
+	 * コンストラクタ
+	 */
+	V4l2Recorder();
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4l2Recorder() noexcept;
+
+	/**
+	 * 書き込み中かどうか
+	 * @return
+	 */
+	bool is_recording() const;
+	/**
+	 * 書き込んだフレーム数を取得
+	 * @return
+	 */
+	uint64_t get_frames() const;
+
+	/**
+	 * 映像記録ファイルを生成してヘッダーを書き込む
+	 * 同名のファイルがあれば上書きする
+	 * @param path
+	 * @param width
+	 * @param height
+	 * @param pixel_format V4L2_PIX_FMT_XXX
+	 * @return
+	 */
+	int open(const std::string &path,
+		const uint32_t &width, const uint32_t &height,
+		const uint32_t &pixel_format);
+	/**
+	 * 映像を1フレーム書き込む
+	 * on_frame_readyの引数をそのまま渡す
+	 * @param image 映像データ, CPUからアクセスできないバッファーのときはnullptr
+	 * @param bytes 映像データのサイズ
+	 * @param buffer 共有メモリー情報
+	 * @return
+	 */
+	int write(const uint8_t *image, const size_t &bytes, const buffer_t &buffer);
+	/**
+	 * 映像記録ファイルを閉じる
+	 * @return
+	 */
+	int close();
+};
+
+typedef std::unique_ptr<V4l2Recorder> V4l2RecorderUp;
+typedef std::shared_ptr<V4l2Recorder> V4l2RecorderSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_RECORDER_H
@@ -0,0 +1,540 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2ReplaySource"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utilbase.h"
+
+#include "times.h"
+
+// usb
+#include "usb/aandusb.h"
+#include "usb/descriptor_defs.h"
+// v4l2
+#include "v4l2/v4l2_replay_source.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * 映像記録ファイルにタイムスタンプが無いときのフレーム間隔
+ */
+#define DEFAULT_REPLAY_FRAME_INTERVAL_NS (33333333LL)
+
+/**
+ * @brief コンストラクタ
+ *
+ * @param path 映像記録ファイル名
+ */
+/*public*/
+V4l2ReplaySource::V4l2ReplaySource(std::string _path)
+:	V4l2SourceBase(_path, true),
+	V4l2Source(_path, true),
+	path(std::move(_path)),
+	m_fd(0), m_map((uint8_t *)MAP_FAILED), m_map_size(0),
+	width(0), height(0), pixel_format(0),
+	realtime(true), loop(false),
+	replay_thread()
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * @brief デストラクタ
+ *
+ */
+/*public*/
+V4l2ReplaySource::~V4l2ReplaySource() {
+	ENTER();
+
+	close();
+
+	EXIT();
+}
+
+/**
+ * 記録時のタイムスタンプに合わせて再生するかどうかを設定する
+ * falseならできるだけ速く再生する
+ * 再生中でも変更可能
+ * @param enable
+ * @return
+ */
+/*public*/
+V4l2ReplaySource &V4l2ReplaySource::set_realtime(const bool &enable) {
+	AutoMutex lock(replay_lock);
+	realtime = enable;
+	replay_sync.broadcast();
+	return *this;
+}
+
+/**
+ * 最後まで再生したら先頭から繰り返すかどうかを設定する
+ * 再生中でも変更可能
+ * @param enable
+ * @return
+ */
+/*public*/
+V4l2ReplaySource &V4l2ReplaySource::set_loop(const bool &enable) {
+	AutoMutex lock(replay_lock);
+	loop = enable;
+	return *this;
+}
+
+/**
+ * 映像記録ファイルのフレーム数を取得
+ * @return
+ */
+/*public*/
+size_t V4l2ReplaySource::get_num_frames() const {
+	AutoMutex lock(replay_lock);
+	return frames.size();
+}
+
+/**
+ * コンストラクタで指定した映像記録ファイルをオープン
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::open() {
+	ENTER();
+
+	AutoMutex lock(replay_lock);
+	if (m_fd) {
+		LOGD("already opened");
+		RETURN(core::USB_SUCCESS, int);
+	}
+
+	int result;
+	struct stat st{};
+	m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (UNLIKELY(m_fd < 0)) {
+		result = -errno;
+		LOGE("failed to open %s,errno=%d", path.c_str(), -result);
+		m_fd = 0;
+		RETURN(result, int);
+	}
+	if (UNLIKELY(fstat(m_fd, &st) < 0)) {
+		result = -errno;
+		LOGE("fstat:errno=%d", -result);
+		goto err;
+	}
+	m_map_size = st.st_size;
+	// MAP_PRIVATEなのでon_frame_readyの先で書き換えられてもファイルへは反映されない
+	m_map = (uint8_t *)mmap(nullptr, m_map_size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE, m_fd, 0);
+	if (UNLIKELY(m_map == MAP_FAILED)) {
+		result = -errno;
+		LOGE("mmap:errno=%d", -result);
+		goto err;
+	}
+	// 先頭から順に読むので先読みさせる
+	madvise(m_map, m_map_size, MADV_SEQUENTIAL);
+
+	result = parse_locked();
+	if (UNLIKELY(result)) {
+		goto err;
+	}
+	LOGI("%s,%ux%u,pixel_format=0x%08x,%" FMT_SIZE_T " frames",
+		path.c_str(), width, height, pixel_format, frames.size());
+	set_stream_format(width, height, pixel_format);
+
+	RETURN(core::USB_SUCCESS, int);
+
+err:
+	internal_close_locked();
+
+	RETURN(result, int);
+}
+
+/**
+ * 再生中であれば再生を終了して映像記録ファイルを閉じる
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::close() {
+	ENTER();
+
+	const int result = stop();
+	AutoMutex lock(replay_lock);
+	internal_close_locked();
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像記録ファイルの再生を開始する
+ * @param buf_nums 未使用
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::start(const int &buf_nums) {
+	ENTER();
+
+	AutoMutex lock(replay_lock);
+	if (UNLIKELY(frames.empty())) {
+		LOGD("Illegal state: not opened");
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+	if (!set_running(true)) {
+		if (replay_thread.joinable()) {
+			// 最後まで再生して終了したワーカースレッドが残っている
+			replay_thread.join();
+		}
+		LOGD("再生用のワーカースレッドを開始");
+		replay_thread = std::thread([this] { replay_thread_func(); });
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 再生を終了する
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::stop() {
+	ENTER();
+
+	replay_lock.lock();
+	{
+		set_running(false);
+		replay_sync.broadcast();
+	}
+	replay_lock.unlock();
+
+	if (replay_thread.joinable()) {
+		LOGD("join:replay_thread");
+		replay_thread.join();
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 映像記録ファイルのピクセルフォーマット・解像度をjson文字列として取得する
+ * @return
+ */
+/*public*/
+std::string V4l2ReplaySource::get_supported_size() const {
+	ENTER();
+
+	AutoMutex lock(replay_lock);
+	char buf[128];
+	StringBuffer buffer;
+	Writer<StringBuffer> writer(buffer);
+	writer.StartObject();
+	{
+		writer.String(FORMATS);
+		writer.StartArray();
+		if (!frames.empty()) {
+			writer.StartObject();
+			{
+				write(writer, FORMAT_INDEX, 1);
+				write(writer, FRAME_TYPE, V4L2_PIX_FMT_to_raw_frame(pixel_format));
+				write(writer, FRAME_DEFAULT, 1);
+				writer.String(FRAME_SIZE);
+				writer.StartArray();
+				{
+					snprintf(buf, sizeof(buf), "%ux%u", width, height);
+					buf[sizeof(buf)-1] = '\0';
+					writer.String(buf);
+				}
+				writer.EndArray();
+			}
+			writer.EndObject();
+		}
+		writer.EndArray();
+	}
+	writer.EndObject();
+
+	RET(std::string(buffer.GetString()));
+}
+
+/**
+ * 映像記録ファイルの解像度・ピクセルフォーマットと一致するかどうかを取得
+ * フレームレートは確認しない
+ * @param width
+ * @param height
+ * @param pixel_format V4L2_PIX_FMT_XXX, 0なら確認しない
+ * @param min_fps 未使用
+ * @param max_fps 未使用
+ * @return 0: 一致する, 0以外: 一致しない
+ */
+/*public*/
+int V4l2ReplaySource::find_stream(
+	const uint32_t &_width, const uint32_t &_height,
+	uint32_t _pixel_format,
+	const float &min_fps, const float &max_fps) {
+
+	ENTER();
+
+	AutoMutex lock(replay_lock);
+	if (UNLIKELY(frames.empty())) {
+		LOGD("Illegal state: not opened");
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+	if ((_width != width) || (_height != height)
+		|| (_pixel_format && (_pixel_format != pixel_format))) {
+
+		LOGE("unexpected stream,requested=%ux%u,file=%ux%u", _width, _height, width, height);
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 映像サイズを変更
+ * 映像記録ファイルの解像度・ピクセルフォーマットから変更することはできない
+ * @param width
+ * @param height
+ * @param pixel_format V4L2_PIX_FMT_XXX, 0なら確認しない
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::resize(
+	const uint32_t &_width, const uint32_t &_height,
+	const uint32_t &_pixel_format) {
+
+	ENTER();
+
+	const int result = find_stream(_width, _height, _pixel_format);
+
+	RETURN(result, int);
+}
+
+/**
+ * コントロール機能には対応しないので常にfalseを返す
+ * @param ctrl_id
+ * @return
+ */
+/*public*/
+bool V4l2ReplaySource::is_ctrl_supported(const uint32_t &ctrl_id) {
+	return false;
+}
+
+/**
+ * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+ * @param ctrl_id
+ * @param value
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::get_ctrl_value(const uint32_t &ctrl_id, int32_t &value) {
+	return core::USB_ERROR_NOT_SUPPORTED;
+}
+
+/**
+ * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+ * @param ctrl_id
+ * @param value
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::set_ctrl_value(const uint32_t &ctrl_id, const int32_t &value) {
+	return core::USB_ERROR_NOT_SUPPORTED;
+}
+
+/**
+ * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+ * @param ctrl_id
+ * @param values
+ * @return
+ */
+/*public*/
+int V4l2ReplaySource::get_ctrl(const uint32_t &ctrl_id, uvc::control_value32_t &values) {
+	return core::USB_ERROR_NOT_SUPPORTED;
+}
+
+/**
+ * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+ * @param ctrl_id
+ * @param items
+ */
+/*public*/
+int V4l2ReplaySource::get_menu_items(const uint32_t &ctrl_id, std::vector<std::string> &items) {
+	return core::USB_ERROR_NOT_SUPPORTED;
+}
+
+/**
+ * 再生用ワーカースレッドの実行関数
+ */
+/*private*/
+void V4l2ReplaySource::replay_thread_func() {
+	ENTER();
+
+	apply_thread_sched(get_thread_sched(), "replay_thread");
+	on_start();
+
+	// framesはオープン中は変更されないのでロックせずに参照する
+	const auto &first = frames.front();
+	const auto &last = frames.back();
+	// タイムスタンプが無いファイルは一定間隔で再生する
+	const bool has_timestamp = last.timestamp > first.timestamp;
+	const nsecs_t interval = has_timestamp && (frames.size() > 1)
+		? (last.timestamp - first.timestamp) / (nsecs_t)(frames.size() - 1)
+		: DEFAULT_REPLAY_FRAME_INTERVAL_NS;
+	// 繰り返し再生するときにタイムスタンプとシーケンス番号が単調増加するようにずらす量
+	const nsecs_t pts_span = has_timestamp
+		? last.timestamp - first.timestamp + interval
+		: interval * (nsecs_t)frames.size();
+	const uint32_t sequence_span = last.sequence - first.sequence + 1;
+
+	buffer_t buffer {};
+	buffer.num_planes = 1;
+	nsecs_t pts_offset = 0;
+	uint32_t sequence_offset = 0;
+	nsecs_t start_time = systemTime();
+	size_t ix = 0;
+	LOGD("replay loop start");
+	for ( ; is_running(); ) {
+		replay_lock.lock();
+		if (ix >= frames.size()) {
+			if (!loop) {
+				replay_lock.unlock();
+				LOGI("end of file");
+				break;
+			}
+			ix = 0;
+			pts_offset += pts_span;
+			sequence_offset += sequence_span;
+		}
+		const auto &frame = frames[ix];
+		// 再生開始からの相対時間
+		const nsecs_t pts = (has_timestamp ? frame.timestamp - first.timestamp : interval * (nsecs_t)ix)
+			+ pts_offset;
+		if (realtime) {
+			for ( ; is_running() && realtime; ) {
+				const nsecs_t wait = start_time + pts - systemTime();
+				if (wait <= 0) {
+					break;
+				}
+				replay_sync.waitRelative(replay_lock, wait);
+			}
+		}
+		if (!realtime) {
+			// できるだけ速く再生するときも途中でリアルタイム再生へ戻せるように基準時刻を更新する
+			start_time = systemTime() - pts;
+		}
+		replay_lock.unlock();
+		if (UNLIKELY(!is_running())) {
+			break;
+		}
+
+		auto ptr = m_map + frame.offset;
+		buffer.start = buffer.planes[0].start = ptr;
+		buffer.offset = buffer.planes[0].offset = frame.offset;
+		buffer.length = buffer.planes[0].length = frame.bytes;
+		buffer.timestamp = has_timestamp ? frame.timestamp + pts_offset : 0;
+		buffer.sequence = frame.sequence + sequence_offset;
+		buffer.flags = frame.flags;
+		on_frame_ready(buffer, frame.bytes);
+		ix++;
+	}
+	LOGD("replay loop finished");
+
+	on_stop();
+	set_running(false);
+
+	EXIT();
+}
+
+/**
+ * 映像記録ファイルのヘッダーを確認して各フレームの情報を読み込む
+ * replay_lockをロックした状態で呼び出すこと
+ * @return
+ */
+/*private*/
+int V4l2ReplaySource::parse_locked() {
+	ENTER();
+
+	frames.clear();
+	if (UNLIKELY(m_map_size < sizeof(replay_file_header_t))) {
+		LOGE("too short file,size=%" FMT_SIZE_T, m_map_size);
+		RETURN(core::USB_ERROR_INVALID_PARAM, int);
+	}
+	const auto header = (const replay_file_header_t *)m_map;
+	if (UNLIKELY(memcmp(header->magic, REPLAY_FILE_MAGIC, sizeof(header->magic))
+		|| (header->version != REPLAY_FILE_VERSION))) {
+
+		LOGE("unexpected file header,version=%u", header->version);
+		RETURN(core::USB_ERROR_INVALID_PARAM, int);
+	}
+	width = header->width;
+	height = header->height;
+	pixel_format = header->pixel_format;
+
+	size_t offset = sizeof(replay_file_header_t);
+	while (offset + sizeof(replay_frame_header_t) <= m_map_size) {
+		const auto frame = (const replay_frame_header_t *)(m_map + offset);
+		const size_t data_offset = offset + sizeof(replay_frame_header_t);
+		if (UNLIKELY(data_offset + frame->bytes > m_map_size)) {
+			// 記録中に終了したときは最後のフレームが途中で切れている
+			LOGW("truncated frame at %" FMT_SIZE_T, offset);
+			break;
+		}
+		frames.push_back({
+			.offset = data_offset,
+			.bytes = frame->bytes,
+			.timestamp = (nsecs_t)frame->timestamp,
+			.sequence = frame->sequence,
+			.flags = frame->flags,
+		});
+		offset = data_offset
+			+ (frame->bytes + REPLAY_FRAME_ALIGN - 1) / REPLAY_FRAME_ALIGN * REPLAY_FRAME_ALIGN;
+	}
+	if (UNLIKELY(frames.empty())) {
+		LOGE("no frame found");
+		RETURN(core::USB_ERROR_NOT_FOUND, int);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 映像記録ファイルを閉じる
+ * replay_lockをロックした状態で呼び出すこと
+ */
+/*private*/
+void V4l2ReplaySource::internal_close_locked() {
+	ENTER();
+
+	frames.clear();
+	if (m_map != MAP_FAILED) {
+		munmap(m_map, m_map_size);
+		m_map = (uint8_t *)MAP_FAILED;
+	}
+	m_map_size = 0;
+	if (m_fd) {
+		::close(m_fd);
+		m_fd = 0;
+	}
+
+	EXIT();
+}
+
+}	// namespace serenegiant::v4l2
@@ -0,0 +1,229 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_REPLAY_SOURCE_H
+#define AANDUSB_V4L2_REPLAY_SOURCE_H
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// common
+#include "mutex.h"
+#include "condition.h"
+// v4l2
+#include "v4l2/v4l2_source.h"
+#include "v4l2/v4l2_recorder.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * V4l2Recorderで書き込んだ映像記録ファイルを再生するV4l2Source実装
+ * v4l2機器から映像取得するときと同じbuffer_tでon_frame_readyを呼び出すので
+ * V4l2Sourceの代わりにそのまま使うことができる
+ * 映像記録ファイルはmmapしてon_frame_readyへはファイル内の映像データを直接渡す
+ * コントロール機能には対応しない
+ * 映像の受け取りは常に専用ワーカースレッド上で行うのでhandle_frameを呼び出す必要はない
+ */
+class V4l2ReplaySource : public V4l2Source {
+private:
+	/**
+	 * 映像記録ファイル内の1フレーム分の情報
+	 */
+	typedef struct _replay_frame {
+		/**
+		 * ファイル先頭から映像データまでのオフセット
+		 */
+		size_t offset;
+		uint32_t bytes;
+		nsecs_t timestamp;
+		uint32_t sequence;
+		uint32_t flags;
+	} replay_frame_t;
+
+	mutable Mutex replay_lock;
+	/**
+	 * 再生ペース調整/終了要求待ち用
+	 */
+	Condition replay_sync;
+	/**
+	 * 映像記録ファイル名
+	 */
+	const std::string path;
+	/**
+	 * 映像記録ファイルのファイルディスクリプタ
+	 */
+	int m_fd;
+	/**
+	 * mmapした映像記録ファイルの先頭
+	 */
+	uint8_t *m_map;
+	size_t m_map_size;
+	/**
+	 * 映像記録ファイルの映像サイズ・ピクセルフォーマット
+	 */
+	uint32_t width, height;
+	uint32_t pixel_format;
+	/**
+	 * 各フレームの情報
+	 */
+	std::vector<replay_frame_t> frames;
+	/**
+	 * 記録時のタイムスタンプに合わせて再生するかどうか
+	 * falseならできるだけ速く再生する
+	 */
+	bool realtime;
+	/**
+	 * 最後まで再生したら先頭から繰り返すかどうか
+	 */
+	bool loop;
+	/**
+	 * 再生用のワーカースレッド
+	 */
+	std::thread replay_thread;
+
+	/**
+	 * 再生用ワーカースレッドの実行関数
+	 */
+	void replay_thread_func();
+	/**
+	 * 映像記録ファイルのヘッダーを確認して各フレームの情報を読み込む
+	 * replay_lockをロックした状態で呼び出すこと
+	 * @return
+	 */
+	int parse_locked();
+	/**
+	 * 映像記録ファイルを閉じる
+	 * replay_lockをロックした状態で呼び出すこと
+	 */
+	void internal_close_locked();
+public:
+	/**
+	 * @brief コンストラクタ
+	 *
+	 * @param path 映像記録ファイル名
+	 */
+	explicit V4l2ReplaySource(std::string path);
+	/**
+	 * @brief デストラクタ
+	 *
+	 */
+	virtual ~V4l2ReplaySource();
+
+	/**
+	 * 記録時のタイムスタンプに合わせて再生するかどうかを設定する
+	 * falseならできるだけ速く再生する
+	 * 再生中でも変更可能
+	 * @param enable
+	 * @return
+	 */
+	V4l2ReplaySource &set_realtime(const bool &enable);
+	/**
+	 * 最後まで再生したら先頭から繰り返すかどうかを設定する
+	 * 再生中でも変更可能
+	 * @param enable
+	 * @return
+	 */
+	V4l2ReplaySource &set_loop(const bool &enable);
+	/**
+	 * 映像記録ファイルのフレーム数を取得
+	 * @return
+	 */
+	size_t get_num_frames() const;
+
+	/**
+	 * コンストラクタで指定した映像記録ファイルをオープン
+	 * @return
+	 */
+	int open() override;
+	/**
+	 * 再生中であれば再生を終了して映像記録ファイルを閉じる
+	 * @return
+	 */
+	int close() override;
+	/**
+	 * 映像記録ファイルの再生を開始する
+	 * @param buf_nums 未使用
+	 * @return
+	 */
+	int start(const int &buf_nums = DEFAULT_BUFFER_NUMS) override;
+	/**
+	 * 再生を終了する
+	 * @return
+	 */
+	int stop() override;
+	/**
+	 * 映像記録ファイルのピクセルフォーマット・解像度をjson文字列として取得する
+	 * @return
+	 */
+	std::string get_supported_size() const override;
+	/**
+	 * 映像記録ファイルの解像度・ピクセルフォーマットと一致するかどうかを取得
+	 * フレームレートは確認しない
+	 * @param width
+	 * @param height
+	 * @param pixel_format V4L2_PIX_FMT_XXX, 0なら確認しない
+	 * @param min_fps 未使用
+	 * @param max_fps 未使用
+	 * @return 0: 一致する, 0以外: 一致しない
+	 */
+	int find_stream(
+		const uint32_t &width, const uint32_t &height,
+		uint32_t pixel_format = 0,
+		const float &min_fps = DEFAULT_PREVIEW_FPS_MIN, const float &max_fps = DEFAULT_PREVIEW_FPS_MAX) override;
+	/**
+	 * 映像サイズを変更
+	 * 映像記録ファイルの解像度・ピクセルフォーマットから変更することはできない
+	 * @param width
+	 * @param height
+	 * @param pixel_format V4L2_PIX_FMT_XXX, 0なら確認しない
+	 * @return
+	 */
+	int resize(const uint32_t &width, const uint32_t &height, const uint32_t &pixel_format = 0) override;
+
+	/**
+	 * コントロール機能には対応しないので常にfalseを返す
+	 * @param ctrl_id
+	 * @return
+	 */
+	bool is_ctrl_supported(const uint32_t &ctrl_id) override;
+	/**
+	 * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+	 * @param ctrl_id
+	 * @param value
+	 * @return
+	 */
+	int get_ctrl_value(const uint32_t &ctrl_id, int32_t &value) override;
+	/**
+	 * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+	 * @param ctrl_id
+	 * @param value
+	 * @return
+	 */
+	int set_ctrl_value(const uint32_t &ctrl_id, const int32_t &value) override;
+	/**
+	 * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+	 * @param ctrl_id
+	 * @param values
+	 * @return
+	 */
+	int get_ctrl(const uint32_t &ctrl_id, uvc::control_value32_t &values) override;
+	/**
+	 * コントロール機能には対応しないので常にUSB_ERROR_NOT_SUPPORTEDを返す
+	 * @param ctrl_id
+	 * @param items
+	 */
+	int get_menu_items(const uint32_t &ctrl_id, std::vector<std::string> &items) override;
+};
+
+typedef std::unique_ptr<V4l2ReplaySource> V4l2ReplaySourceUp;
+typedef std::shared_ptr<V4l2ReplaySource> V4l2ReplaySourceSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_REPLAY_SOURCE_H
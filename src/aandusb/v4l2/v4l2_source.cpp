@@ -31,10 +31,12 @@
 #include <cassert>
 #include <ctime>
 #include <cerrno>
+#include <cinttypes>
 #include <cmath>
 #include <utility>
 
 #include <fcntl.h>              /* low-level i/o */
+#include <poll.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -60,6 +62,39 @@ namespace serenegiant::v4l2 {
  * 実機だとV4L2_PIX_FMT_NV16が一番速そう(1フレームのサイズが小さいから？)
  */
 #define DEFAULT_PIX_FMT (0) // (V4L2_PIX_FMT_NV16)	// (V4L2_PIX_FMT_MJPEG)
+/**
+ * retain_bufferでバッファーを保持するときに最低限v4l2機器側へ残しておくバッファー数
+ */
+#define MIN_QUEUED_BUFFERS (2)
+/**
+ * retain_bufferで保持されたバッファーの返却を待つ最大時間
+ */
+#define MAX_WAIT_RETAINED_BUFFERS_NS (1000000000LL)
+/**
+ * バッファー数を自動調整するときの評価期間のフレーム数
+ */
+#define TUNE_WINDOW_FRAMES (120)
+/**
+ * キューイング遅延がフレーム間隔の何倍を超えると遅延が大きいと判断するか
+ */
+#define TUNE_SLOW_LATENCY_FRAMES (2)
+/**
+ * 遅延が大きい評価期間が何回連続したときにバッファー数を減らすか
+ */
+#define TUNE_SLOW_WINDOWS (3)
+/**
+ * 映像取得フォーマットの自動選択で候補へ切り替えた直後に計測せずに読み飛ばすフレーム数
+ * 切り替え直後はフレーム間隔やデコード時間が安定しないため
+ */
+#define PROBE_SKIP_FRAMES (10)
+/**
+ * 映像取得フォーマットの自動選択で各候補を計測するフレーム数
+ */
+#define PROBE_WINDOW_FRAMES (60)
+/**
+ * 実測フレームレートが目標フレームレートのこの割合以上なら目標フレームレートを維持できたとみなす
+ */
+#define PROBE_SUSTAIN_RATIO (0.9f)
 
 #if MEAS_TIME
 #define MEAS_TIME_INIT static nsecs_t _meas_time_ = 0;\
@@ -85,6 +120,42 @@ namespace serenegiant::v4l2 {
 #define MEAS_RESET
 #endif
 
+/**
+ * 映像受け取りバッファー1つ分のmmap領域とVIDIOC_EXPBUFでエクスポートしたdma-bufを開放する
+ * @param buffer
+ * @param mplane マルチプレーンかどうか
+ * @param memory V4L2_MEMORY_XXX
+ */
+static void release_buffer_memory(buffer_t &buffer, const bool &mplane, const uint32_t &memory) {
+	if (mplane) {
+		// マルチプレーンのときはプレーン毎にmmap/VIDIOC_EXPBUFしている
+		for (uint32_t j = 0; j < buffer.num_planes; j++) {
+			auto &plane = buffer.planes[j];
+			if ((plane.start != MAP_FAILED) && (munmap(plane.start, plane.length) == -1)) {
+				LOGE("munmap");
+			}
+			if (plane.fd) {
+				::close(plane.fd);
+			}
+			plane.start = MAP_FAILED;
+			plane.fd = 0;
+		}
+		return;
+	}
+	if (buffer.start != MAP_FAILED) {
+		if (munmap(buffer.start, buffer.length) == -1) {
+			LOGE("munmap");
+		}
+		buffer.start = MAP_FAILED;
+	}
+	// VIDIOC_EXPBUFでエクスポートしたdma-bufだけを閉じる
+	// (udmabufはrelease_mmap_lockedで閉じる, 呼び出し元が確保したdma-bufは閉じない)
+	if (buffer.fd && (memory == V4L2_MEMORY_MMAP)) {
+		::close(buffer.fd);
+	}
+	buffer.fd = 0;
+}
+
 //--------------------------------------------------------------------------------
 /**
  * コンストラクタ
@@ -101,15 +172,41 @@ V4l2SourceBase::V4l2SourceBase(
 	udmabuf_name(std::move(udmabuf_name)),
 	m_running(false),
 	m_fd(0), m_state(STATE_CLOSE), m_udmabuf_fd(0),
+	m_udmabuf_sync_for_cpu(0), m_udmabuf_sync_for_device(0),
+	export_dmabuf(false), dmabuf_fds(), dmabuf_length(0), m_memory(0),
+	m_buf_type(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+	latest_only(false), skipped_frames(0),
+	last_sequence(-1), dropped_frames(0),
+	auto_buf_nums(false),
+	min_buf_nums(DEFAULT_AUTO_BUFFER_NUMS_MIN), max_buf_nums(DEFAULT_AUTO_BUFFER_NUMS_MAX),
+	request_buf_nums(0),
+	tune_frames(0), tune_queue_latency(0), tune_render_latency(0),
+	tune_first_ts(0), tune_last_ts(0), tune_dropped(0),
+	tune_slow_windows(0), tune_floor(0),
+	auto_format(false), target_fps(DEFAULT_AUTO_FORMAT_TARGET_FPS),
+	probe_pending(false), probe_index(-1), probe_candidates(),
+	probe_frames(0), probe_last_dequeued(0), probe_interval(0), probe_render(0), probe_dropped(0),
+	last_dequeued(0), switch_start(0), switch_gap(0),
+	stall_detect(false), stall_base(0), stall_first_frame(false), stall_interval(0),
+	stall_start(0), stall_level(0),
+	stall_count(0), recovery_time(0), max_recovery_time(0),
+	device_zoom_request(1.0f), device_zoom(1.0f), device_zoom_method(DEVICE_ZOOM_UNKNOWN),
+	uvc_meta_enabled(false), uvc_meta_name(), uvc_meta(),
 	request_resize(false),
 	request_pixel_format(DEFAULT_PIX_FMT),
 	request_width(DEFAULT_PREVIEW_WIDTH), request_height(DEFAULT_PREVIEW_HEIGHT),
 	request_min_fps(DEFAULT_PREVIEW_FPS_MIN), request_max_fps(DEFAULT_PREVIEW_FPS_MAX),
+	request_interval{},
 	stream_pixel_format(DEFAULT_PIX_FMT),
 	stream_width(DEFAULT_PREVIEW_WIDTH), stream_height(DEFAULT_PREVIEW_HEIGHT), image_bytes(0),
 	stream_frame_type(core::RAW_FRAME_UNKNOWN), stream_fps(0.0f),
 	m_buffers(nullptr), m_buffersNums(0),
-	v4l2_thread()
+	v4l2_thread(), thread_sched(), prefault(false),
+	reactor(), reactor_buf_nums(DEFAULT_BUFFER_NUMS),
+	retained(), retained_nums(0), delivering_index(-1),
+	on_release_request(), orphan_buffers(),
+	cap_cache(), caps(),
+	ctrl_writer([this](std::vector<struct v4l2_ext_control> &ctrls) { return write_ctrls(ctrls); })
 {
 	ENTER();
 	EXIT();
@@ -123,6 +220,17 @@ V4l2SourceBase::~V4l2SourceBase() {
 	ENTER();
 
 	close();
+	// 保持したまま返却されなかったバッファーもここで開放する
+	for (auto &orphan: orphan_buffers) {
+		LOGW("orphan buffers are not released,retained_nums=%d", orphan.retained_nums);
+		for (uint32_t i = 0; i < orphan.nums; i++) {
+			if (orphan.retained[i]) {
+				release_buffer_memory(orphan.buffers[i], orphan.mplane, orphan.memory);
+			}
+		}
+		delete [] orphan.buffers;
+	}
+	orphan_buffers.clear();
 
 	EXIT();
 }
@@ -147,7 +255,23 @@ int V4l2SourceBase::open() {
 				result = core::USB_SUCCESS;
 				m_fd = fd;
 				m_state = STATE_OPEN;
-				update_ctrl_all_locked(fd, supported, DUMP_SUPPRTED_CTRLS);
+				// マルチプレーンのみに対応している機器(SoCのキャプチャドライバー等)は
+				// V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANEで映像を受け取る
+				const uint32_t buf_type = get_capture_buf_type(fd);
+				m_buf_type = buf_type ? buf_type : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+				LOGD("buf_type=%u", m_buf_type);
+				caps = cap_cache ? cap_cache->get(fd) : nullptr;
+				if (caps) {
+					// キャッシュがあればVIDIOC_QUERYCTRLで列挙しない
+					supported = caps->ctrls;
+				} else {
+					update_ctrl_all_locked(fd, supported, DUMP_SUPPRTED_CTRLS);
+				}
+				init_ctrl_cache(supported);
+				ctrl_writer.start();
+				// 再接続時は別のv4l2機器かもしれないので拡大方法を決め直す
+				device_zoom_method = DEVICE_ZOOM_UNKNOWN;
+				device_zoom = 1.0f;
 			} else {
 				// ::openの返り値が負(-1)の時はオープンできていない
 				result = -errno;
@@ -174,10 +298,16 @@ int V4l2SourceBase::open() {
 int V4l2SourceBase::close() {
 	ENTER();
 
+	// 書き込み待ちのコントロール機能の設定値を書き込んでから終了する
+	ctrl_writer.stop();
 	int result = internal_stop();
 	v4l2_lock.lock();
 	{
 		supported.clear();
+		clear_ctrl_cache();
+		caps.reset();
+		// 映像取得せずにクローズするときはv4l2機器が開いたままなので閉じる
+		internal_close_locked();
 		m_state = STATE_CLOSE;
 	}
 	v4l2_lock.unlock();
@@ -207,9 +337,18 @@ int V4l2SourceBase::start(const int &buf_nums) {
 		result = core::USB_SUCCESS;
 		bool b = set_running(true);
 		if (!b) {
-			LOGD("映像取得用のワーカースレッドを開始");
-			// 実際のイベントハンドラで初期化したthread型一時オブジェクトをムーブ代入
-			v4l2_thread = std::thread([this, buf_nums] { v4l2_thread_func(buf_nums); });
+			if (reactor) {
+				LOGD("V4l2Reactorへ登録");
+				reactor_buf_nums = buf_nums;
+				result = reactor->attach(this);
+				if (UNLIKELY(result)) {
+					set_running(false);
+				}
+			} else {
+				LOGD("映像取得用のワーカースレッドを開始");
+				// 実際のイベントハンドラで初期化したthread型一時オブジェクトをムーブ代入
+				v4l2_thread = std::thread([this, buf_nums] { v4l2_thread_func(buf_nums); });
+			}
 		}
 	} else {
 		LOGD("Illegal state: not opened");
@@ -228,833 +367,2804 @@ int V4l2SourceBase::stop() {
 }
 
 /**
- * 対応するピクセルフォーマット・解像度・フレームレートをjson文字列として取得する
+ * V4L2_MEMORY_MMAPで映像を受け取るときに各バッファーを
+ * VIDIOC_EXPBUFでdma-bufとしてエクスポートしてbuffer_t::fdへセットするかどうかを設定する
+ * 映像取得開始前のみ変更可能
+ * @param enable
  * @return
  */
 /*public*/
-std::string V4l2SourceBase::get_supported_size() const {
+int V4l2SourceBase::set_export_dmabuf(const bool &enable) {
 	ENTER();
 
-	std::vector<FormatInfoSp> formats;
+	int result = core::USB_ERROR_INVALID_STATE;
 
 	AutoMutex lock(v4l2_lock);
-	if (m_state > STATE_CLOSE) {
-		int r = 0;
-		for (int i = 0 ; r != -1; i++) {
-			struct v4l2_fmtdesc fmt {
-				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			};
-			fmt.index = i;
-			r = xioctl(m_fd, VIDIOC_ENUM_FMT, &fmt);
-			if (r != -1) {
-				LOGV("%i)%s(%s)", fmt.index,
-					V4L2_PIX_FMT_to_string(fmt.pixelformat).c_str(),
-					fmt.description);
-				auto format = std::make_shared<format_info_t>(i, fmt.pixelformat);
-				get_supported_frame_size(m_fd, format);
-				formats.push_back(format);
-			}
-		}
-	}
-	// jsonへの出力
-	char buf[128];
-	StringBuffer buffer;
-	Writer<StringBuffer> writer(buffer);
-	writer.StartObject();
-	{
-		writer.String(FORMATS);
-		writer.StartArray();
-		for (const auto &format: formats) {
-			writer.StartObject();
-			{
-				write(writer, FORMAT_INDEX, format->index);
-				write(writer, FRAME_TYPE, V4L2_PIX_FMT_to_raw_frame(format->pixel_format));
-				write(writer, FRAME_DEFAULT, 1/*format->getDefaultFrameIndex()*/);	// 変な値が返ってくる時がある
-				if (!format->frames.empty()) {
-					writer.String(FRAME_SIZE);
-					writer.StartArray();
-					for (const auto& frame: format->frames) {
-						snprintf(buf, sizeof(buf), "%dx%d", frame->width, frame->height);
-						buf[sizeof(buf)-1] = '\0';
-						writer.String(buf);
-					}
-					writer.EndArray();
-					write_fps(writer, format->frames);	// detailキーにFPS配列を各解像度毎の配列として追加
-				}
-			}
-			writer.EndObject();
-		}
-
-		writer.EndArray();
+	if (!is_running() && (m_state <= STATE_OPEN)) {
+		export_dmabuf = enable;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
 	}
-	writer.EndObject();
 
-	RET(std::string(buffer.GetString()));
+	RETURN(result, int);
 }
 
 /**
- * 指定したピクセルフォーマット・解像度・フレームレートに対応しているかどうかを確認
- * @param width
- * @param height
- * @param pixel_format V4L2_PIX_FMT_XXX, 省略時は前回に設定した値を使う
- * @param min_fps 最小フレームレート, 省略時はDEFAULT_PREVIEW_FPS_MINを使う
- * @param max_fps 最大フレームレート, 省略時はDEFAULT_PREVIEW_FPS_MAXを使う
- * @return 0: 対応している, 0以外: 対応していない
+ * 呼び出し元が確保したdma-bufを使ってV4L2_MEMORY_DMABUFで映像を受け取るように設定する
+ * 映像取得開始前のみ変更可能
+ * @param fds dma-bufのファイルディスクリプタ配列, 空ならV4L2_MEMORY_DMABUFを使わない
+ * @param length dma-bufのサイズ, 0ならlseekで取得する
+ * @return
  */
 /*public*/
-int V4l2SourceBase::find_stream(
-	const uint32_t &width, const uint32_t &height,
-	uint32_t pixel_format,
-	const float &min_fps, const float &max_fps) {
-
+int V4l2SourceBase::set_dmabuf_fds(const std::vector<int> &fds, const size_t &length) {
 	ENTER();
 
-	AutoMutex lock(v4l2_lock);
-	int result = core::USB_ERROR_NOT_SUPPORTED;
-
-	if (m_state > STATE_CLOSE) {
-		const uint32_t _pixel_format = pixel_format
-			? pixel_format
-			: (stream_pixel_format ? stream_pixel_format
-				: (request_pixel_format ? request_pixel_format : DEFAULT_PIX_FMT));
-
-		LOGD("target pixel format=0x%08x,sz(%dx%d)", _pixel_format, width, height);
-
-		// デフォルトまたは前回のネゴシエーションでセットされている
-		// ビデオキャプチャフォーマットを取得する
-		struct v4l2_format capture_format{
-			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE
-		};
-
-		result = xioctl(m_fd, VIDIOC_G_FMT, &capture_format);
-		if (UNLIKELY(result == -1)) {
-			LOGW("VIDIOC_G_FMT,errno=%d", errno);
-			capture_format.fmt.pix.pixelformat = 0;
-		}
-		LOGD("default type=%d,sz(%dx%d),0x%08x=%s,field=%d",
-			capture_format.type, capture_format.fmt.pix.width, capture_format.fmt.pix.height,
-			capture_format.fmt.pix.pixelformat, V4L2_PIX_FMT_to_string(capture_format.fmt.pix.pixelformat).c_str(),
-			capture_format.fmt.pix.field);
-
-		result = core::USB_ERROR_NOT_SUPPORTED;
-		int r = 0;
-		for (int i = 0 ; result && (r != -1); i++) {
-			struct v4l2_fmtdesc fmt {
-				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			};
-			fmt.index = i;
-			r = xioctl(m_fd, VIDIOC_ENUM_FMT, &fmt);
-			if (r != -1) {
-				const auto pxl_fmt = fmt.pixelformat;
-				LOGD("%i)0x%08x=%s(%s)", fmt.index,
-					pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str(),
-					fmt.description);
-				if (!_pixel_format || (_pixel_format == pxl_fmt)) {
-					// ピクセルフォーマット未指定かピクセルフォーマットが一致したとき
-					pixel_format = pxl_fmt;	// 最後に一致したピクセルフォーマットをセット
-					LOGD("found pixel format, try find video size");
-					result = find_frame_size(m_fd, pxl_fmt, width, height, min_fps, max_fps);
-					// XXX VIDIOC_ENUM_FRAMESIZESが常にエラーを返してfind_frame_sizeで判断できないV4L2機器があるので
-					//     デフォルトのキャプチャーフォーマットと一致すればOKとする
-					if (result
-						&& (capture_format.fmt.pix.width == width) && (capture_format.fmt.pix.height == height)
-						&& ((capture_format.fmt.pix.pixelformat == pxl_fmt) || !get_frame_size_nums(m_fd, pxl_fmt))) {
-						result = 0;
-					}
-				}
-				if (!result) {
-					if (!request_pixel_format) {
-						LOGD("use 0x%08x/%s as request_pixel_format", pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str());
-						request_pixel_format = pxl_fmt;
-					}
-					if (!stream_pixel_format) {
-						LOGD("use 0x%08x/%s as stream_pixel_format", pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str());
-						stream_pixel_format = pxl_fmt;
-					}
-					LOGD("%i)0x%08x=%s(%s),sz(%dx%d)", fmt.index,
-						pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str(),
-						fmt.description, width, height);
-				}
-			}
-		}
+	int result = core::USB_ERROR_INVALID_STATE;
 
+	AutoMutex lock(v4l2_lock);
+	if (!is_running() && (m_state <= STATE_OPEN)) {
+		dmabuf_fds = fds;
+		dmabuf_length = length;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
 	}
 
 	RETURN(result, int);
 }
 
 /**
- * 映像サイズを変更
- * @param width
- * @param height
- * @param pixel_format V4L2_PIX_FMT_XXX
+ * 専用ワーカースレッドの代わりにV4l2Reactorのワーカースレッド上で映像取得するように設定する
+ * 映像取得開始前のみ変更可能
+ * @param reactor nullptrなら専用ワーカースレッドを使う
  * @return
  */
 /*public*/
-int V4l2SourceBase::resize(
-	const uint32_t &width, const uint32_t &height,
-	const uint32_t &pixel_format) {
-
+int V4l2SourceBase::set_reactor(V4l2ReactorSp _reactor) {
 	ENTER();
 
-	uint32_t format = pixel_format ? pixel_format : request_pixel_format;
-	if ((request_width != width) || (request_height != height)
-		|| (request_pixel_format != format)) {
+	int result = core::USB_ERROR_INVALID_STATE;
 
-		Mutex::Autolock lock(v4l2_lock);
-		request_width = width;
-		request_height = height;
-		if (format) {
-			request_pixel_format = format;
-		}
-		LOGD("request resize(%dx%d),format=0x%08x", width, height, request_pixel_format);
-		request_resize = true;
+	AutoMutex lock(v4l2_lock);
+	if (!is_running() && (m_state <= STATE_OPEN)) {
+		reactor = std::move(_reactor);
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
 	}
 
-	RETURN(core::USB_SUCCESS, int);
+	RETURN(result, int);
 }
 
-//--------------------------------------------------------------------------------
 /**
- * 映像処理スレッドの実行関数
- * @param buf_nums
+ * 対応ピクセルフォーマット・解像度・フレームレート・コントロール機能のキャッシュを設定する
+ * オープン前のみ変更可能
+ * @param cache nullptrならキャッシュを使わない
+ * @return
  */
-/*private*/
-void V4l2SourceBase::v4l2_thread_func(const int &buf_nums) {
+/*public*/
+int V4l2SourceBase::set_cap_cache(V4l2CapCacheSp cache) {
 	ENTER();
 
-	int result;
-
-	if (!is_running()) return;
+	int result = core::USB_ERROR_INVALID_STATE;
 
-	LOGD("映像処理スレッド開始");
-	on_start();
-	v4l2_lock.lock();
-	{
-		LOGD("初期解像度・ピクセルフォーマットをセット");
-		result = init_v4l2_locked(buf_nums, request_width, request_height, request_pixel_format);
-		if (LIKELY(!result)) {
-			LOGD("映像ストリーム開始");
-			result = start_stream_locked();
-		}
+	AutoMutex lock(v4l2_lock);
+	if (m_state == STATE_CLOSE) {
+		cap_cache = std::move(cache);
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already opened,state=%d", m_state);
 	}
-	v4l2_lock.unlock();
 
-	if (LIKELY(!result)) {
-		LOGD("映像取得ループ,is_running=%d,result=%d", is_running(), result);
-		for ( ; is_running() && !result; ) {
-			v4l2_lock.lock();
-			{
-				if (request_resize) {
-					request_resize = false;
-					// 解像度変更処理
-					result = handle_resize(request_width, request_height, request_pixel_format);
-				}
-			}
-			v4l2_lock.unlock();
+	RETURN(result, int);
+}
 
-			if (UNLIKELY(result)) {
-				release_mmap_locked();
-				on_error();
-				break;
-			}
+/**
+ * オープンするv4l2機器名を変更する
+ * オープン前のみ変更可能
+ * @param name
+ * @return
+ */
+/*public*/
+int V4l2SourceBase::set_device_name(std::string name) {
+	ENTER();
 
-			// 映像取得ループへ
-			if (!result && async) {
-				v4l2_loop();
-			}
-		}	// for ( ; is_running() && !result; )
+	int result = core::USB_ERROR_INVALID_STATE;
 
-		MARK("映像取得ループ終了");
+	AutoMutex lock(v4l2_lock);
+	if (m_state == STATE_CLOSE) {
+		device_name = std::move(name);
+		result = core::USB_SUCCESS;
 	} else {
-		on_error();
-	}
-
-	// 終了処理
-	v4l2_lock.lock();
-	{
-		stop_stream_locked();
-		release_mmap_locked();
-		// start_stream_lockedが失敗するとVIDIOC_QUERYBUFが呼ばれたまま
-		// dequeueされないままになってしまうのでv4l2機器も含めてすべてcloseする
-		internal_close_locked();
+		LOGD("Illegal state: already opened,state=%d", m_state);
 	}
-	v4l2_lock.unlock();
-
-	on_stop();
 
-	EXIT();
+	RETURN(result, int);
 }
 
 /**
- * 映像取得ループ
+ * 映像取得スレッドのスケジューリングポリシー・優先度・CPUアフィニティを設定する
+ * 映像取得開始前のみ変更可能
+ * @param sched
  * @return
  */
-/*private*/
-int V4l2SourceBase::v4l2_loop() {
+/*public*/
+int V4l2SourceBase::set_thread_sched(const thread_sched_t &sched) {
 	ENTER();
 
-	// 実行中＆解像度・ピクセルフォーマット変更要求が無ければ映像取得する
-	for ( ; is_running() && !request_resize; ) {
-		// 映像フレームを待機
-		handle_frame();
-	} // for ( ; is_running(); )
+	int result = core::USB_ERROR_INVALID_STATE;
 
-	RETURN(core::USB_SUCCESS, int);
+	AutoMutex lock(v4l2_lock);
+	if (!is_running()) {
+		thread_sched = sched;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
+	}
+
+	RETURN(result, int);
 }
 
 /**
- * ::stopの実体
+ * 映像受け取りバッファーを確保したときに予めページフォルトさせておくかどうかを設定する
+ * 映像取得開始前のみ変更可能
+ * @param enable
  * @return
  */
-/*private*/
-int V4l2SourceBase::internal_stop() {
+/*public*/
+int V4l2SourceBase::set_prefault(const bool &enable) {
 	ENTER();
 
-	bool b = set_running(false);
-	if (LIKELY(b)) {
-		if (v4l2_thread.joinable()) {
-			LOGD("join:v4l2_thread");
-			v4l2_thread.join();
-		}
-		LOGD("v4l2_thread finished");
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(v4l2_lock);
+	if (!is_running()) {
+		prefault = enable;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("Illegal state: already started,state=%d", m_state);
 	}
 
-	RETURN(core::USB_SUCCESS, int);
+	RETURN(result, int);
 }
 
 /**
- * オープンしているudmabufやv4l2機器を閉じる
-*/
-/*private*/
-int V4l2SourceBase::internal_close_locked() {
+ * 準備できている映像を全てVIDIOC_DQBUFして最新の映像だけをon_frame_readyへ渡すかどうかを設定する
+ * 映像取得中でも変更可能
+ * @param enable
+ * @return
+ */
+/*public*/
+int V4l2SourceBase::set_latest_only(const bool &enable) {
 	ENTER();
 
-	if (m_udmabuf_fd) {
-		// udmabufを開いていれば閉じる
-		const auto result = ::close(m_udmabuf_fd);
-		if (UNLIKELY(result)) {
-			LOGE("failed to close m_udmabuf_fd, result=%d,errno=%d", result, errno);
-		}
-		m_udmabuf_fd = 0;
-	}
-	if (m_fd) {
-		// v4l2機器を開いていれば閉じる
-		const auto result = ::close(m_fd);
-		if (UNLIKELY(result)) {
-			LOGE("failed to close fd, result=%d,errno=%d", result, errno);
-		}
-		m_fd = 0;
-	}
+	latest_only = enable;
 
 	RETURN(core::USB_SUCCESS, int);
 }
 
 /**
- * 映像ストリーム開始
+ * UVC機器のメタデータノードからペイロードヘッダーを取得するかどうかを設定する
+ * 映像取得開始前のみ変更可能
+ * @param enable
+ * @param meta_device メタデータノードのデバイスファイル名, 空なら映像ノードと同じUVC機器のものを探す
+ * @return
  */
-/*private*/
-int V4l2SourceBase::start_stream_locked() {
+/*public*/
+int V4l2SourceBase::set_uvc_meta(const bool &enable, const std::string &meta_device) {
 	ENTER();
 
-	LOGD("state=%d", m_state);
-
 	int result = core::USB_ERROR_INVALID_STATE;
 
-	if ((m_state == STATE_OPEN) || (m_state == STATE_INIT)) {
-		// 予めすべてのバッファをキューに入れておく
-		enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		const uint32_t memory = (m_udmabuf_fd ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP);
-		for (uint32_t i = 0; i < m_buffersNums; ++i) {
-			struct v4l2_buffer buf {
-				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-				.memory = memory,
-			};
-			if (memory == V4L2_MEMORY_USERPTR) {
-				// buffer must be casted to unsigned long type in order to assign it to V4L2 buffer
-				buf.m.userptr = reinterpret_cast<unsigned long>(m_buffers[i].start);
-				buf.length = m_buffers[i].length;
-			}
-			buf.index = i;
-			if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
-				// キューに入れれなかったとき
-				result = -errno;
-				LOGE("VIDIOC_QBUF: errno=%d", -errno);
-				release_mmap_locked();
-				goto ret;
-			}
-		}
-		// ストリーム開始
-		if (xioctl(m_fd, VIDIOC_STREAMON, &type) == -1) {
-			result = -errno;
-			LOGE("VIDIOC_STREAMON: errno=%d", -result);
-			release_mmap_locked();
-			goto ret;
-		}
-		// success
+	AutoMutex lock(v4l2_lock);
+	if (!is_running()) {
+		uvc_meta_enabled = enable;
+		uvc_meta_name = meta_device;
 		result = core::USB_SUCCESS;
 	} else {
-		LOGD("invalid state: state=%d", m_state);
+		LOGD("Illegal state: already started,state=%d", m_state);
 	}
 
-ret:
 	RETURN(result, int);
 }
 
 /**
- * 映像ストリーム終了
+ * 映像が途切れたときに自動で復帰処理するかどうかを設定する
+ * 映像取得開始前のみ変更可能
+ * @param enable
+ * @return
  */
-/*private*/
-int V4l2SourceBase::stop_stream_locked() {
+/*public*/
+int V4l2SourceBase::set_stall_detect(const bool &enable) {
 	ENTER();
 
-	if (m_state == STATE_STREAM) {
-		enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if (xioctl(m_fd, VIDIOC_STREAMOFF, &type) == -1) {
-			LOGE("VIDIOC_STREAMOFF: errno=%d", errno);
-		}
-		m_state = STATE_INIT;
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	AutoMutex lock(v4l2_lock);
+	if (!is_running()) {
+		stall_detect = enable;
+		result = core::USB_SUCCESS;
 	} else {
-		LOGD("Not streaming, state=%d", m_state);
+		LOGD("Illegal state: already started,state=%d", m_state);
 	}
 
-	RETURN(core::USB_SUCCESS, int);
+	RETURN(result, int);
 }
 
 /**
- * 解像度とピクセルフォーマットをセットして映像データ受け取り用バッファーを初期化する
- * @param buf_nums
- * @param width
- * @param height
- * @param pixel_format 
+ * 映像受け取りバッファー数を自動調整するかどうかを設定する
+ * @param enable
+ * @param min_nums バッファー数の最小値
+ * @param max_nums バッファー数の最大値
  * @return
  */
-/*private*/
-int V4l2SourceBase::init_v4l2_locked(
-	const int &buf_nums,
-  	const uint32_t &width, const uint32_t &height,
-  	const uint32_t &pixel_format) {
+/*public*/
+int V4l2SourceBase::set_auto_buffer_nums(const bool &enable,
+	const int &min_nums, const int &max_nums) {
 
 	ENTER();
 
-	LOGD("sz(%dx%d)@%s/0x%08x", width, height, V4L2_PIX_FMT_to_string(pixel_format).c_str(), pixel_format);
-
-	struct v4l2_capability cap{};
-
-	int result = xioctl(m_fd, VIDIOC_QUERYCAP, &cap);
-	if (UNLIKELY(result == -1)) {
-		if (EINVAL == -errno) {
-			LOGE("%s is not a V4L2 device", device_name.c_str());
-		} else {
-			LOGE("VIDIOC_QUERYCAP,errno=%d", errno);
-		}
-		RETURN(-errno, int);
-	}
-	if (UNLIKELY(!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))) {
-		LOGE("%s is not a video capture device", device_name.c_str());
-		RETURN(core::USB_ERROR_NO_DEVICE, int);
-	}
-	if (UNLIKELY(!(cap.capabilities & V4L2_CAP_STREAMING))) {
-		LOGE("%s does not support streaming i/o", device_name.c_str());
-		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	if (UNLIKELY(enable && ((min_nums < 1) || (max_nums < min_nums)))) {
+		RETURN(core::USB_ERROR_INVALID_PARAM, int);
 	}
 
-	// Select video input, video standard and tune here.
-	struct v4l2_cropcap cropcap {
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-	};
-
-	LOGD("VIDIOC_CROPCAP");
-	result = xioctl(m_fd, VIDIOC_CROPCAP, &cropcap);
-	if (!result) {
-		struct v4l2_crop crop{};
-		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		crop.c = cropcap.defrect; /* reset to default */
+	AutoMutex lock(v4l2_lock);
+	min_buf_nums = min_nums;
+	max_buf_nums = max_nums;
+	auto_buf_nums = enable;
+	tune_floor = 0;
 
-		LOGD("VIDIOC_S_CROP");
-		if (xioctl(m_fd, VIDIOC_S_CROP, &crop) == -1) {
-			if (errno == EINVAL) {
-				LOGW("Cropping not supported.");
-			} else {
-				LOGD("VIDIOC_S_CROP:Errors ignored.,errno=%d", errno);
-			}
-		}
-	} else {
-		LOGD("VIDIOC_CROPCAP:Errors ignored.,errno=%d", errno);
-	}
+	RETURN(core::USB_SUCCESS, int);
+}
 
-	struct v4l2_format fmt{};
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = width;
-	fmt.fmt.pix.height = height;
-	fmt.fmt.pix.pixelformat = pixel_format;
-	fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+/**
+ * 映像取得フォーマットを自動選択するかどうかを設定する
+ * 映像取得開始前のみ変更可能
+ * @param enable
+ * @param target_fps 目標フレームレート
+ * @return
+ */
+/*public*/
+int V4l2SourceBase::set_auto_format(const bool &enable, const float &_target_fps) {
+	ENTER();
 
-	LOGD("VIDIOC_S_FMT");
-	result = xioctl(m_fd, VIDIOC_S_FMT, &fmt);
-	if (UNLIKELY(result == -1)) {
-		LOGE("VIDIOC_S_FMT,errno=%d", errno);
-		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	if (UNLIKELY(enable && (_target_fps <= 0.0f))) {
+		RETURN(core::USB_ERROR_INVALID_PARAM, int);
 	}
 
-	// Buggy driver paranoia.
-	uint32_t min = fmt.fmt.pix.width * 2;
-	if (fmt.fmt.pix.bytesperline < min) {
-		fmt.fmt.pix.bytesperline = min;
-	}
-	min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-	if (fmt.fmt.pix.sizeimage < min) {
-		fmt.fmt.pix.sizeimage = min;
-	}
+	int result = core::USB_ERROR_INVALID_STATE;
 
-	// 画像データ読み込み用のメモリマップを初期化
-	LOGD("call init_mmap_locked");
-	result = init_mmap_locked(buf_nums);
-	if (!result) {
-		stream_width = fmt.fmt.pix.width;
-		stream_height = fmt.fmt.pix.height;
-		stream_pixel_format = fmt.fmt.pix.pixelformat;
-		stream_frame_type = V4L2_PIX_FMT_to_raw_frame(stream_pixel_format);
-		image_bytes = fmt.fmt.pix.sizeimage;
-		request_resize = false;
+	AutoMutex lock(v4l2_lock);
+	if (!is_running()) {
+		auto_format = enable;
+		target_fps = _target_fps;
+		result = core::USB_SUCCESS;
 	} else {
-		release_mmap_locked();
+		LOGD("Illegal state: already started,state=%d", m_state);
 	}
 
 	RETURN(result, int);
 }
 
 /**
- * 映像データ受け取り用のメモリマップを開放
+ * 拡大(デジタルズーム)をv4l2機器側で行うように要求する
+ * v4l2機器側で拡大できなかった分(factor / get_device_zoom())は呼び出し元で拡大すること
+ * @param factor 拡大率
+ * @return 0: v4l2機器側で拡大した, 0以外: v4l2機器側では拡大しなかった
  */
-/*private*/
-int V4l2SourceBase::release_mmap_locked() {
-
+/*public*/
+int V4l2SourceBase::set_device_zoom(const float &factor) {
 	ENTER();
 
-	internal_release_mmap_buffers();
-	stream_width = stream_height = 0;
-	if (m_state > STATE_OPEN) {
-		m_state = STATE_OPEN;
+	if (UNLIKELY(factor <= 0.0f)) {
+		RETURN(core::USB_ERROR_INVALID_PARAM, int);
 	}
 
-	if (m_udmabuf_fd) {
-		::close(m_udmabuf_fd);
-		m_udmabuf_fd = 0;
+	// 先に要求された書き込みで上書きされないように書き込み待ちの設定値を書き込んでおく
+	ctrl_writer.flush();
+	AutoMutex lock(v4l2_lock);
+	device_zoom_request = factor;
+	int result = core::USB_ERROR_INVALID_STATE;
+	if ((m_state == STATE_INIT) || (m_state == STATE_STREAM)) {
+		result = apply_device_zoom_locked();
+	} else {
+		// 映像ストリームを初期化したときに適用する
+		LOGD("not initialized yet,state=%d", m_state);
 	}
 
-	RETURN(core::USB_SUCCESS, int);
+	RETURN(result, int);
 }
 
 /**
- * m_buffersの破棄処理
-*/
-void V4l2SourceBase::internal_release_mmap_buffers() {
-	ENTER();
-
-	if (m_buffersNums && m_buffers) {
-		for (uint32_t i = 0; i < m_buffersNums; ++i) {
-			if (m_buffers[i].start != MAP_FAILED) {
-				if (munmap(m_buffers[i].start, m_buffers[i].length) == -1) {
-					LOGE("munmap");
-				}
-			}
-			if (m_buffers[i].fd) {
-				::close(m_buffers[i].fd);
-			}
-		}
-		SAFE_DELETE_ARRAY(m_buffers);
-		m_buffersNums = 0;
-	}
-
-	EXIT();
+ * set_device_zoomでの拡大にV4L2_CID_ZOOM_ABSOLUTEを使っているかどうか
+ * @return
+ */
+/*public*/
+bool V4l2SourceBase::is_zoom_ctrl_in_use() const {
+	AutoMutex lock(v4l2_lock);
+	return (device_zoom_method == DEVICE_ZOOM_CTRL) && (device_zoom.load() > 1.0f);
 }
 
 /**
- * @brief ceil3
- * @details ceil num specifiy digit
- * @param num number
- * @param base ceil digit
- * @return int32_t result
+ * 現在の映像受け取りバッファー数を取得
+ * @return
  */
-static int32_t ceil3(int32_t num, int32_t base) {
-    double x = (double)(num) / (double)(base);
-    double y = ceil(x) * (double)(base);
-    return (int32_t)(y);
+/*public*/
+uint32_t V4l2SourceBase::get_buffer_nums() const {
+	AutoMutex lock(v4l2_lock);
+	return m_buffersNums;
 }
 
 /**
- * 画像データ読み込み用のメモリマップを初期化
- * init_device_lockedの下請け
- * @param buff_nums
+ * 対応するピクセルフォーマット・解像度・フレームレートをjson文字列として取得する
+ * @return
  */
-/*private*/
-int V4l2SourceBase::init_mmap_locked(const int &buf_nums) {
+/*public*/
+std::string V4l2SourceBase::get_supported_size() const {
 	ENTER();
 
-	int result = core::USB_SUCCESS;
-	int _buf_nums = buf_nums;
-	if (_buf_nums < 1) {
-		_buf_nums = 1;
-	}
+	std::vector<FormatInfoSp> formats;
 
-	uint32_t memory = V4L2_MEMORY_MMAP;
-	if (!udmabuf_name.empty()) {
-		LOGD("try to open %s", udmabuf_name.c_str());
-		m_udmabuf_fd = ::open(udmabuf_name.c_str(), O_RDWR);
-		if (m_udmabuf_fd > 0) {
-			LOGD("use udmabuf");
-			memory = V4L2_MEMORY_USERPTR;
-		} else {
-			LOGD("Failed to open %s", udmabuf_name.c_str());
-			m_udmabuf_fd = 0;
-		}
+	AutoMutex lock(v4l2_lock);
+	if (caps) {
+		formats = caps->formats;
+	} else if (m_state > STATE_CLOSE) {
+		get_supported_formats(m_fd, formats);
 	}
-
-	// 映像データ受取用のバッファを要求する
-	struct v4l2_requestbuffers req {
-		.count = DEFAULT_BUFFER_NUMS,
-		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-		.memory = memory,
-	};
-	for (int i = _buf_nums; i >= 1; i--) {
-		LOGD("VIDIOC_REQBUFS %d", i);
-		req.count = i;
-		if (xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) {
-			result = -errno;
-			req.count = 0;
-			if (EINVAL == errno) {
-				LOGE("%s does not support memory mapping", device_name.c_str());
-				goto err;
-			} else {
-				LOGD("VIDIOC_REQBUFS,err=%d", result);
-			}
-		} else {
+	// jsonへの出力
+	char buf[128];
+	StringBuffer buffer;
+	Writer<StringBuffer> writer(buffer);
+	writer.StartObject();
+	{
+		writer.String(FORMATS);
+		writer.StartArray();
+		for (const auto &format: formats) {
+			writer.StartObject();
+			{
+				write(writer, FORMAT_INDEX, format->index);
+				write(writer, FRAME_TYPE, V4L2_PIX_FMT_to_raw_frame(format->pixel_format));
+				write(writer, FRAME_DEFAULT, 1/*format->getDefaultFrameIndex()*/);	// 変な値が返ってくる時がある
+				if (!format->frames.empty()) {
+					writer.String(FRAME_SIZE);
+					writer.StartArray();
+					for (const auto& frame: format->frames) {
+						snprintf(buf, sizeof(buf), "%dx%d", frame->width, frame->height);
+						buf[sizeof(buf)-1] = '\0';
+						writer.String(buf);
+					}
+					writer.EndArray();
+					write_fps(writer, format->frames);	// detailキーにFPS配列を各解像度毎の配列として追加
+				}
+			}
+			writer.EndObject();
+		}
+
+		writer.EndArray();
+	}
+	writer.EndObject();
+
+	RET(std::string(buffer.GetString()));
+}
+
+/**
+ * 指定したピクセルフォーマット・解像度・フレームレートに対応しているかどうかを確認
+ * @param width
+ * @param height
+ * @param pixel_format V4L2_PIX_FMT_XXX, 省略時は前回に設定した値を使う
+ * @param min_fps 最小フレームレート, 省略時はDEFAULT_PREVIEW_FPS_MINを使う
+ * @param max_fps 最大フレームレート, 省略時はDEFAULT_PREVIEW_FPS_MAXを使う
+ * @return 0: 対応している, 0以外: 対応していない
+ */
+/*public*/
+int V4l2SourceBase::find_stream(
+	const uint32_t &width, const uint32_t &height,
+	uint32_t pixel_format,
+	const float &min_fps, const float &max_fps) {
+
+	ENTER();
+
+	AutoMutex lock(v4l2_lock);
+	int result = core::USB_ERROR_NOT_SUPPORTED;
+
+	if (m_state > STATE_CLOSE) {
+		const uint32_t _pixel_format = pixel_format
+			? pixel_format
+			: (stream_pixel_format ? stream_pixel_format
+				: (request_pixel_format ? request_pixel_format : DEFAULT_PIX_FMT));
+
+		LOGD("target pixel format=0x%08x,sz(%dx%d)", _pixel_format, width, height);
+
+		// デフォルトまたは前回のネゴシエーションでセットされている
+		// ビデオキャプチャフォーマットを取得する
+		struct v4l2_format capture_format{
+			.type = m_buf_type
+		};
+
+		result = xioctl(m_fd, VIDIOC_G_FMT, &capture_format);
+		uint32_t cur_width, cur_height, cur_pixel_format;
+		if (UNLIKELY(result == -1)) {
+			LOGW("VIDIOC_G_FMT,errno=%d", errno);
+			cur_width = cur_height = cur_pixel_format = 0;
+		} else if (is_mplane()) {
+			cur_width = capture_format.fmt.pix_mp.width;
+			cur_height = capture_format.fmt.pix_mp.height;
+			cur_pixel_format = capture_format.fmt.pix_mp.pixelformat;
+		} else {
+			cur_width = capture_format.fmt.pix.width;
+			cur_height = capture_format.fmt.pix.height;
+			cur_pixel_format = capture_format.fmt.pix.pixelformat;
+		}
+		LOGD("default type=%d,sz(%dx%d),0x%08x=%s",
+			capture_format.type, cur_width, cur_height,
+			cur_pixel_format, V4L2_PIX_FMT_to_string(cur_pixel_format).c_str());
+
+		result = core::USB_ERROR_NOT_SUPPORTED;
+		std::vector<FormatInfoSp> formats;
+		if (caps) {
+			formats = caps->formats;
+		} else {
+			// 解像度・フレームレートはピクセルフォーマットが一致したときだけfind_frame_sizeで確認する
+			get_supported_formats(m_fd, formats, false);
+		}
+		for (const auto &format: formats) {
+			const auto pxl_fmt = format->pixel_format;
+			LOGD("%i)0x%08x=%s", format->index,
+				pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str());
+			if (!_pixel_format || (_pixel_format == pxl_fmt)) {
+				// ピクセルフォーマット未指定かピクセルフォーマットが一致したとき
+				pixel_format = pxl_fmt;	// 最後に一致したピクセルフォーマットをセット
+				LOGD("found pixel format, try find video size");
+				// キャッシュに離散値の解像度が無いときはv4l2機器へ問い合わせる
+				result = !format->frames.empty()
+					? find_frame_size(format->frames, width, height, min_fps, max_fps)
+					: find_frame_size(m_fd, pxl_fmt, width, height, min_fps, max_fps);
+				// XXX VIDIOC_ENUM_FRAMESIZESが常にエラーを返してfind_frame_sizeで判断できないV4L2機器があるので
+				//     デフォルトのキャプチャーフォーマットと一致すればOKとする
+				if (result
+					&& (cur_width == width) && (cur_height == height)
+					&& ((cur_pixel_format == pxl_fmt) || !get_frame_size_nums(m_fd, pxl_fmt))) {
+					result = 0;
+				}
+			}
+			if (!result) {
+				if (!request_pixel_format) {
+					LOGD("use 0x%08x/%s as request_pixel_format", pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str());
+					request_pixel_format = pxl_fmt;
+				}
+				if (!stream_pixel_format) {
+					LOGD("use 0x%08x/%s as stream_pixel_format", pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str());
+					stream_pixel_format = pxl_fmt;
+				}
+				LOGD("%i)0x%08x=%s,sz(%dx%d)", format->index,
+					pxl_fmt, V4L2_PIX_FMT_to_string(pxl_fmt).c_str(),
+					width, height);
+				break;
+			}
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像サイズを変更
+ * @param width
+ * @param height
+ * @param pixel_format V4L2_PIX_FMT_XXX
+ * @return
+ */
+/*public*/
+int V4l2SourceBase::resize(
+	const uint32_t &width, const uint32_t &height,
+	const uint32_t &pixel_format) {
+
+	ENTER();
+
+	uint32_t format = pixel_format ? pixel_format : request_pixel_format;
+	if ((request_width != width) || (request_height != height)
+		|| (request_pixel_format != format)) {
+
+		Mutex::Autolock lock(v4l2_lock);
+		request_width = width;
+		request_height = height;
+		if (format) {
+			request_pixel_format = format;
+		}
+		LOGD("request resize(%dx%d),format=0x%08x", width, height, request_pixel_format);
+		request_resize = true;
+		if (reactor) {
+			// V4l2Reactorのワーカースレッドを起こして解像度変更させる
+			reactor->wakeup();
+		}
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * 映像処理スレッドの実行関数
+ * @param buf_nums
+ */
+/*private*/
+void V4l2SourceBase::v4l2_thread_func(const int &buf_nums) {
+	ENTER();
+
+	int result;
+
+	if (!is_running()) return;
+
+	LOGD("映像処理スレッド開始");
+	apply_thread_sched(thread_sched, "v4l2_thread");
+	result = internal_start_stream(buf_nums);
+
+	if (LIKELY(!result)) {
+		LOGD("映像取得ループ,is_running=%d,result=%d", is_running(), result);
+		for ( ; is_running() && !result; ) {
+			result = handle_request();
+
+			if (UNLIKELY(result)) {
+				release_mmap_locked();
+				on_error();
+				break;
+			}
+
+			// 映像取得ループへ
+			if (!result && async) {
+				v4l2_loop();
+			}
+		}	// for ( ; is_running() && !result; )
+
+		MARK("映像取得ループ終了");
+	} else {
+		on_error();
+	}
+
+	// 終了処理
+	internal_finish_stream();
+
+	EXIT();
+}
+
+/**
+ * 映像取得開始時の処理
+ * on_startを呼び出した後に解像度・ピクセルフォーマットをセットして映像ストリームを開始する
+ * @param buf_nums
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::internal_start_stream(const int &buf_nums) {
+	ENTER();
+
+	int result;
+
+	on_start();
+	open_uvc_meta();
+	v4l2_lock.lock();
+	{
+		// 呼び出し元が確保したdma-bufを使うときはピクセルフォーマットを変更できない
+		probe_pending = auto_format && dmabuf_fds.empty();
+		probe_index = -1;
+		last_dequeued = switch_start = 0;
+		stall_base = stall_start = 0;
+		stall_interval = 0;
+		stall_level = 0;
+		LOGD("初期解像度・ピクセルフォーマットをセット");
+		result = init_v4l2_locked(buf_nums, request_width, request_height, request_pixel_format);
+		if (LIKELY(!result)) {
+			LOGD("映像ストリーム開始");
+			result = start_stream_locked();
+		}
+	}
+	v4l2_lock.unlock();
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像取得終了時の処理
+ * 映像ストリームを終了してv4l2機器を閉じた後にon_stopを呼び出す
+ */
+/*private*/
+void V4l2SourceBase::internal_finish_stream() {
+	ENTER();
+
+	v4l2_lock.lock();
+	{
+		stop_stream_locked();
+		if (wait_retained_buffers_locked()) {
+			// 保持されたままのバッファーはrelease_mmap_lockedでmunmapせずにrelease_bufferで開放する
+			LOGW("retained buffers are not returned,defer release");
+		}
+		release_mmap_locked();
+		// start_stream_lockedが失敗するとVIDIOC_QUERYBUFが呼ばれたまま
+		// dequeueされないままになってしまうのでv4l2機器も含めてすべてcloseする
+		internal_close_locked();
+	}
+	v4l2_lock.unlock();
+	uvc_meta.reset();
+
+	on_stop();
+
+	EXIT();
+}
+
+/**
+ * UVCメタデータノードをオープンする
+ * オープンできなくても映像取得はメタデータ無しで続ける
+ */
+/*private*/
+void V4l2SourceBase::open_uvc_meta() {
+	ENTER();
+
+	uvc_meta.reset();
+	if (uvc_meta_enabled) {
+		const auto name = uvc_meta_name.empty()
+			? V4l2UvcMeta::find_meta_device(device_name) : uvc_meta_name;
+		if (!name.empty()) {
+			auto meta = std::make_unique<V4l2UvcMeta>(name);
+			const int r = meta->open();
+			if (LIKELY(!r)) {
+				uvc_meta = std::move(meta);
+			} else {
+				LOGW("failed to open uvc metadata node %s,err=%d", name.c_str(), r);
+			}
+		} else {
+			LOGW("uvc metadata node not found for %s", device_name.c_str());
+		}
+	}
+
+	EXIT();
+}
+
+/**
+ * 映像のバッファーに対応するUVCメタデータを取得してbuffer_tのpts/stc/sof/exposure_tsへセットする
+ * 対応するメタデータが無ければ0にする
+ * @param buffer
+ */
+/*private*/
+void V4l2SourceBase::update_uvc_meta(buffer_t &buffer) {
+	ENTER();
+
+	uvc_meta_t meta{};
+	// uvcvideoは対応する映像のバッファーより先にメタデータのバッファーを返すので
+	// 映像をVIDIOC_DQBUFした後ならメタデータも取り出せる
+	if (uvc_meta && (uvc_meta->dequeue() >= 0)) {
+		uvc_meta->find(buffer.sequence, meta);
+	}
+	buffer.pts = meta.pts;
+	buffer.stc = meta.stc;
+	buffer.sof = meta.sof;
+	buffer.exposure_ts = meta.exposure_ts;
+
+	EXIT();
+}
+
+/**
+ * 解像度変更要求があれば処理する
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::handle_request() {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+
+	v4l2_lock.lock();
+	{
+		if (request_resize) {
+			request_resize = false;
+			// 解像度変更処理
+			result = handle_resize(request_width, request_height, request_pixel_format);
+		}
+	}
+	v4l2_lock.unlock();
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像取得ループ
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::v4l2_loop() {
+	ENTER();
+
+	// 実行中＆解像度・ピクセルフォーマット変更要求が無ければ映像取得する
+	for ( ; is_running() && !request_resize; ) {
+		// 映像フレームを待機
+		handle_frame();
+	} // for ( ; is_running(); )
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * ::stopの実体
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::internal_stop() {
+	ENTER();
+
+	bool b = set_running(false);
+	if (LIKELY(b)) {
+		if (reactor) {
+			LOGD("V4l2Reactorから登録解除");
+			reactor->detach(this);
+		} else if (v4l2_thread.joinable()) {
+			LOGD("join:v4l2_thread");
+			v4l2_thread.join();
+		}
+		LOGD("v4l2_thread finished");
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * udmabufのsysfs属性sync_for_cpu/sync_for_deviceを開く
+ * (/sys/class/u-dma-buf/<名前>/または/sys/class/udmabuf/<名前>/)
+ * 開けなければキャッシュ同期しない
+*/
+/*private*/
+void V4l2SourceBase::open_udmabuf_sync_locked() {
+	ENTER();
+
+	close_udmabuf_sync_locked();
+	const auto pos = udmabuf_name.find_last_of('/');
+	const auto name = pos == std::string::npos ? udmabuf_name : udmabuf_name.substr(pos + 1);
+	static const char *CLASS_DIRS[] = { "/sys/class/u-dma-buf", "/sys/class/udmabuf" };
+	for (const auto &dir : CLASS_DIRS) {
+		const std::string base = std::string(dir) + "/" + name;
+		const int for_cpu = ::open((base + "/sync_for_cpu").c_str(), O_WRONLY);
+		if (for_cpu > 0) {
+			const int for_device = ::open((base + "/sync_for_device").c_str(), O_WRONLY);
+			if (for_device > 0) {
+				LOGD("udmabuf sync:%s", base.c_str());
+				m_udmabuf_sync_for_cpu = for_cpu;
+				m_udmabuf_sync_for_device = for_device;
+				break;
+			}
+			::close(for_cpu);
+		}
+	}
+	if (!m_udmabuf_sync_for_cpu) {
+		LOGW("udmabuf sync_for_cpu/sync_for_device not found, CPU reads are not cache synchronized");
+	}
+
+	EXIT();
+}
+
+/**
+ * udmabufのsysfs属性sync_for_cpu/sync_for_deviceを閉じる
+*/
+/*private*/
+void V4l2SourceBase::close_udmabuf_sync_locked() {
+	ENTER();
+
+	if (m_udmabuf_sync_for_cpu) {
+		::close(m_udmabuf_sync_for_cpu);
+		m_udmabuf_sync_for_cpu = 0;
+	}
+	if (m_udmabuf_sync_for_device) {
+		::close(m_udmabuf_sync_for_device);
+		m_udmabuf_sync_for_device = 0;
+	}
+
+	EXIT();
+}
+
+/**
+ * オープンしているudmabufやv4l2機器を閉じる
+*/
+/*private*/
+int V4l2SourceBase::internal_close_locked() {
+	ENTER();
+
+	if (m_udmabuf_fd) {
+		// udmabufを開いていれば閉じる
+		const auto result = ::close(m_udmabuf_fd);
+		if (UNLIKELY(result)) {
+			LOGE("failed to close m_udmabuf_fd, result=%d,errno=%d", result, errno);
+		}
+		m_udmabuf_fd = 0;
+	}
+	close_udmabuf_sync_locked();
+	if (m_fd) {
+		// v4l2機器を開いていれば閉じる
+		const auto result = ::close(m_fd);
+		if (UNLIKELY(result)) {
+			LOGE("failed to close fd, result=%d,errno=%d", result, errno);
+		}
+		m_fd = 0;
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 映像ストリーム開始
+ */
+/*private*/
+int V4l2SourceBase::start_stream_locked() {
+	ENTER();
+
+	LOGD("state=%d", m_state);
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
+	if ((m_state == STATE_OPEN) || (m_state == STATE_INIT)) {
+		// 予めすべてのバッファをキューに入れておく
+		auto type = (enum v4l2_buf_type)m_buf_type;
+		if (retained.size() != m_buffersNums) {
+			retained.assign(m_buffersNums, false);
+			retained_nums = 0;
+		}
+		skipped_frames = 0;
+		last_sequence = -1;
+		dropped_frames = 0;
+		reset_tuning();
+		subscribe_events_locked();
+		if (uvc_meta) {
+			// 映像ストリーム開始直後のメタデータを取りこぼさないように先に開始する
+			const int r = uvc_meta->start();
+			if (UNLIKELY(r)) {
+				LOGW("failed to start uvc metadata,err=%d", r);
+			}
+		}
+		for (uint32_t i = 0; i < m_buffersNums; ++i) {
+			if (retained[i]) {
+				// 返却待ちがタイムアウトしてまだ保持されているバッファーはrelease_bufferでキューへ戻す
+				continue;
+			}
+			result = queue_buffer_locked(i);
+			if (UNLIKELY(result)) {
+				// キューに入れれなかったとき
+				release_mmap_locked();
+				goto ret;
+			}
+		}
+		// ストリーム開始
+		if (xioctl(m_fd, VIDIOC_STREAMON, &type) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_STREAMON: errno=%d", -result);
+			release_mmap_locked();
+			goto ret;
+		}
+		// success
+		m_state = STATE_STREAM;
+		// 映像が途切れたかどうかは映像ストリームを開始した時刻から判断する
+		// 最初の映像は遅れることがあるので猶予時間を長くする
+		stall_base = systemTime();
+		stall_first_frame = true;
+		result = core::USB_SUCCESS;
+	} else {
+		LOGD("invalid state: state=%d", m_state);
+	}
+
+ret:
+	RETURN(result, int);
+}
+
+/**
+ * 映像ストリーム終了
+ */
+/*private*/
+int V4l2SourceBase::stop_stream_locked() {
+	ENTER();
+
+	if (m_state == STATE_STREAM) {
+		auto type = (enum v4l2_buf_type)m_buf_type;
+		if (xioctl(m_fd, VIDIOC_STREAMOFF, &type) == -1) {
+			LOGE("VIDIOC_STREAMOFF: errno=%d", errno);
+		}
+		if (uvc_meta) {
+			uvc_meta->stop();
+		}
+		m_state = STATE_INIT;
+	} else {
+		LOGD("Not streaming, state=%d", m_state);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * キャッシュの内容が実際のv4l2機器と一致しなかったときに
+ * v4l2機器から取得し直してキャッシュを更新する
+ */
+/*private*/
+void V4l2SourceBase::refresh_caps_locked() {
+	ENTER();
+
+	if (cap_cache && m_fd) {
+		caps = cap_cache->refresh(m_fd, caps);
+		supported = caps->ctrls;
+		init_ctrl_cache(supported);
+	}
+
+	EXIT();
+}
+
+/**
+ * キャッシュから読み込んだコントロール機能の設定でエラーになったときに
+ * VIDIOC_QUERYCTRLで照合して一致しなければキャッシュを更新する
+ * @param ctrl_id
+ */
+/*private*/
+void V4l2SourceBase::validate_ctrl_locked(const uint32_t &ctrl_id) {
+	ENTER();
+
+	if (caps && caps->from_cache) {
+		const auto cached = supported.find(ctrl_id) != supported.end()
+			? supported[ctrl_id] : nullptr;
+		struct v4l2_queryctrl query {
+			.id = ctrl_id,
+		};
+		const int r = xioctl(m_fd, VIDIOC_QUERYCTRL, &query);
+		if (!cached || (r == -1) || (query.flags & V4L2_CTRL_FLAG_DISABLED)
+			|| (query.type != cached->type)
+			|| (query.minimum != cached->minimum) || (query.maximum != cached->maximum)) {
+
+			LOGW("ctrl 0x%08x does not match the cache", ctrl_id);
+			refresh_caps_locked();
+		}
+	}
+
+	EXIT();
+}
+
+/**
+ * 対応しているコントロール機能の変更(V4L2_EVENT_CTRL)と
+ * 入力ソースの変更(V4L2_EVENT_SOURCE_CHANGE)のイベントを購読する
+ * v4l2機器をクローズすると購読も解除される
+ */
+/*private*/
+void V4l2SourceBase::subscribe_events_locked() {
+	ENTER();
+
+	// 自分で設定した値はキャッシュへ反映済みなのでV4L2_EVENT_SUB_FL_ALLOW_FEEDBACKは指定しない
+	for (const auto &itr: supported) {
+		struct v4l2_event_subscription sub {
+			.type = V4L2_EVENT_CTRL,
+			.id = itr.first,
+		};
+		if (xioctl(m_fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1) {
+			LOGD("failed to subscribe ctrl event 0x%08x,errno=%d", itr.first, errno);
+		}
+	}
+	struct v4l2_event_subscription sub {
+		.type = V4L2_EVENT_SOURCE_CHANGE,
+	};
+	if (xioctl(m_fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1) {
+		// UVC機器等は対応していない
+		LOGD("failed to subscribe source change event,errno=%d", errno);
+	}
+
+	EXIT();
+}
+
+/**
+ * v4l2機器に届いたイベントをVIDIOC_DQEVENTで全て取り出して処理する
+ * ワーカースレッド上で呼ばれる
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::handle_events() {
+	ENTER();
+
+	std::vector<uvc::control_value32_t> changed_ctrls;
+	uint32_t src_changes = 0;
+
+	v4l2_lock.lock();
+	{
+		struct v4l2_event event{};
+		// 取り出すイベントが無くなるとENOENTを返す
+		for ( ; m_fd && (xioctl(m_fd, VIDIOC_DQEVENT, &event) != -1); ) {
+			switch (event.type) {
+			case V4L2_EVENT_CTRL:
+			{
+				uvc::control_value32_t values{};
+				if (!update_ctrl_cache(event.id, event.u.ctrl, values)) {
+					LOGD("ctrl changed:id=0x%08x,changes=0x%x,v=%d", event.id, event.u.ctrl.changes, values.current);
+					changed_ctrls.push_back(values);
+				}
+				break;
+			}
+			case V4L2_EVENT_SOURCE_CHANGE:
+				LOGI("source changed:changes=0x%x", event.u.src_change.changes);
+				src_changes |= event.u.src_change.changes;
+				break;
+			default:
+				LOGD("unexpected event type=%u", event.type);
+				break;
+			}
+		}
+		if (src_changes & V4L2_EVENT_SRC_CH_RESOLUTION) {
+			// 同じ要求で映像ストリームをネゴシエーションし直す
+			request_resize = true;
+		}
+	}
+	v4l2_lock.unlock();
+
+	// コールバックはv4l2_lockを解放してから呼び出す
+	for (const auto &values: changed_ctrls) {
+		on_ctrl_changed(values);
+	}
+	if (src_changes) {
+		on_source_changed(src_changes);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 解像度とピクセルフォーマットをセットして映像データ受け取り用バッファーを初期化する
+ * @param buf_nums
+ * @param width
+ * @param height
+ * @param pixel_format 
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::init_v4l2_locked(
+	const int &buf_nums,
+  	const uint32_t &width, const uint32_t &height,
+  	const uint32_t &pixel_format) {
+
+	ENTER();
+
+	LOGD("sz(%dx%d)@%s/0x%08x", width, height, V4L2_PIX_FMT_to_string(pixel_format).c_str(), pixel_format);
+
+	struct v4l2_capability cap{};
+
+	int result = xioctl(m_fd, VIDIOC_QUERYCAP, &cap);
+	if (UNLIKELY(result == -1)) {
+		if (EINVAL == -errno) {
+			LOGE("%s is not a V4L2 device", device_name.c_str());
+		} else {
+			LOGE("VIDIOC_QUERYCAP,errno=%d", errno);
+		}
+		RETURN(-errno, int);
+	}
+	if (UNLIKELY(!(cap.capabilities & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE)))) {
+		LOGE("%s is not a video capture device", device_name.c_str());
+		RETURN(core::USB_ERROR_NO_DEVICE, int);
+	}
+	if (UNLIKELY(!(cap.capabilities & V4L2_CAP_STREAMING))) {
+		LOGE("%s does not support streaming i/o", device_name.c_str());
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+
+	// Select video input, video standard and tune here.
+	struct v4l2_cropcap cropcap {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	};
+
+	LOGD("VIDIOC_CROPCAP");
+	result = xioctl(m_fd, VIDIOC_CROPCAP, &cropcap);
+	if (!result) {
+		struct v4l2_crop crop{};
+		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		crop.c = cropcap.defrect; /* reset to default */
+
+		LOGD("VIDIOC_S_CROP");
+		if (xioctl(m_fd, VIDIOC_S_CROP, &crop) == -1) {
+			if (errno == EINVAL) {
+				LOGW("Cropping not supported.");
+			} else {
+				LOGD("VIDIOC_S_CROP:Errors ignored.,errno=%d", errno);
+			}
+		}
+	} else {
+		LOGD("VIDIOC_CROPCAP:Errors ignored.,errno=%d", errno);
+	}
+
+	struct v4l2_format fmt{};
+	fmt.type = m_buf_type;
+	if (is_mplane()) {
+		fmt.fmt.pix_mp.width = width;
+		fmt.fmt.pix_mp.height = height;
+		fmt.fmt.pix_mp.pixelformat = pixel_format;
+		fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+	} else {
+		fmt.fmt.pix.width = width;
+		fmt.fmt.pix.height = height;
+		fmt.fmt.pix.pixelformat = pixel_format;
+		fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+	}
+
+	LOGD("VIDIOC_S_FMT");
+	result = xioctl(m_fd, VIDIOC_S_FMT, &fmt);
+	if (UNLIKELY(result == -1)) {
+		LOGE("VIDIOC_S_FMT,errno=%d", errno);
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	update_frame_interval_locked();
+
+	// ネゴシエーションした結果を取得する
+	uint32_t new_width, new_height, new_pixel_format;
+	size_t sizeimage = 0;
+	uint32_t num_planes = 1;
+	uint32_t bytesperline[MAX_BUFFER_PLANES] {};
+	if (is_mplane()) {
+		new_width = fmt.fmt.pix_mp.width;
+		new_height = fmt.fmt.pix_mp.height;
+		new_pixel_format = fmt.fmt.pix_mp.pixelformat;
+		num_planes = fmt.fmt.pix_mp.num_planes;
+		if (UNLIKELY(!num_planes || (num_planes > MAX_BUFFER_PLANES))) {
+			LOGE("unsupported number of planes,%u", num_planes);
+			RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+		}
+		for (uint32_t i = 0; i < num_planes; i++) {
+			bytesperline[i] = fmt.fmt.pix_mp.plane_fmt[i].bytesperline;
+			sizeimage += fmt.fmt.pix_mp.plane_fmt[i].sizeimage;
+		}
+		LOGD("num_planes=%u,sizeimage=%" FMT_SIZE_T, num_planes, sizeimage);
+	} else {
+		// Buggy driver paranoia.
+		// NV12等のプラナー形式は1行分のバイト数が横幅と同じなので横幅x2を下限にはできない
+		// bytesperlineはドライバーの値をそのまま使って(0なら隙間なく詰まっている)
+		// sizeimageだけを隙間なく詰めたときの映像サイズ以上にする
+		const uint32_t min = core::get_pixel_bytes(V4L2_PIX_FMT_to_raw_frame(fmt.fmt.pix.pixelformat))
+			.frame_bytes(fmt.fmt.pix.width, fmt.fmt.pix.height);
+		if (fmt.fmt.pix.sizeimage < min) {
+			fmt.fmt.pix.sizeimage = min;
+		}
+		new_width = fmt.fmt.pix.width;
+		new_height = fmt.fmt.pix.height;
+		new_pixel_format = fmt.fmt.pix.pixelformat;
+		bytesperline[0] = fmt.fmt.pix.bytesperline;
+		sizeimage = fmt.fmt.pix.sizeimage;
+	}
+	if (caps && !caps->validated) {
+		// キャッシュから読み込んだときは実際にネゴシエーションした結果と照合する
+		if (V4l2CapCache::validate(*caps, new_pixel_format, new_width, new_height)) {
+			caps->validated = true;
+		} else {
+			refresh_caps_locked();
+		}
+	}
+
+	// 画像データ読み込み用のメモリマップを初期化
+	LOGD("call init_mmap_locked");
+	result = init_mmap_locked(buf_nums);
+	if (!result) {
+		for (uint32_t i = 0; i < m_buffersNums; i++) {
+			auto &buffer = m_buffers[i];
+			if (!is_mplane()) {
+				// シングルプレーンのときは先頭プレーンの値をplanes[0]へコピーしておく
+				buffer.num_planes = 1;
+				buffer.planes[0] = {
+					.fd = buffer.fd,
+					.start = buffer.start,
+					.offset = buffer.offset,
+					.length = buffer.length,
+				};
+			}
+			for (uint32_t j = 0; j < buffer.num_planes; j++) {
+				buffer.planes[j].bytesperline = bytesperline[j];
+				if (prefault && (buffer.planes[j].start != MAP_FAILED)) {
+					// 映像取得中に初回アクセスでページフォルトしないように予め読み込んでおく
+					prefault_memory(buffer.planes[j].start, buffer.planes[j].length);
+				}
+			}
+		}
+		stream_width = new_width;
+		stream_height = new_height;
+		stream_pixel_format = new_pixel_format;
+		stream_frame_type = V4L2_PIX_FMT_to_raw_frame(stream_pixel_format);
+		image_bytes = sizeimage;
+		request_resize = false;
+		// 切り出し範囲はVIDIOC_S_CROPでデフォルトへ戻しているので要求されている拡大率を再適用する
+		apply_device_zoom_locked();
+	} else {
+		release_mmap_locked();
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像データ受け取り用のメモリマップを開放
+ */
+/*private*/
+int V4l2SourceBase::release_mmap_locked() {
+
+	ENTER();
+
+	internal_release_mmap_buffers();
+	stream_width = stream_height = 0;
+	if (m_state > STATE_OPEN) {
+		m_state = STATE_OPEN;
+	}
+
+	if (m_udmabuf_fd) {
+		::close(m_udmabuf_fd);
+		m_udmabuf_fd = 0;
+	}
+	close_udmabuf_sync_locked();
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * m_buffersの破棄処理
+*/
+void V4l2SourceBase::internal_release_mmap_buffers() {
+	ENTER();
+
+	if (m_buffersNums && m_buffers) {
+		const bool has_retained = retained_nums && (retained.size() == m_buffersNums);
+		for (uint32_t i = 0; i < m_buffersNums; ++i) {
+			if (has_retained && retained[i]) {
+				// 保持されたままのバッファーはmunmapするとアクセスできなくなるのでrelease_bufferまで開放しない
+				continue;
+			}
+			release_buffer_memory(m_buffers[i], is_mplane(), m_memory);
+		}
+		if (has_retained) {
+			// release_bufferで開放済みのバッファーとして判別できるようにm_buffersも破棄しない
+			LOGW("defer release of %d retained buffers", retained_nums);
+			orphan_buffers.push_back(orphan_buffers_t {
+				.buffers = m_buffers,
+				.nums = m_buffersNums,
+				.memory = m_memory,
+				.mplane = is_mplane(),
+				.retained = retained,
+				.retained_nums = retained_nums,
+			});
+			m_buffers = nullptr;
+		} else {
+			SAFE_DELETE_ARRAY(m_buffers);
+		}
+		m_buffersNums = 0;
+	}
+	retained.clear();
+	retained_nums = 0;
+	m_memory = 0;
+
+	EXIT();
+}
+
+/**
+ * @brief ceil3
+ * @details ceil num specifiy digit
+ * @param num number
+ * @param base ceil digit
+ * @return int32_t result
+ */
+static int32_t ceil3(int32_t num, int32_t base) {
+    double x = (double)(num) / (double)(base);
+    double y = ceil(x) * (double)(base);
+    return (int32_t)(y);
+}
+
+/**
+ * 画像データ読み込み用のメモリマップを初期化
+ * init_device_lockedの下請け
+ * @param buff_nums
+ */
+/*private*/
+int V4l2SourceBase::init_mmap_locked(const int &buf_nums) {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+	int _buf_nums = buf_nums;
+	if (_buf_nums < 1) {
+		_buf_nums = 1;
+	}
+
+	uint32_t memory = V4L2_MEMORY_MMAP;
+	if (is_mplane()) {
+		// マルチプレーンのときはV4L2_MEMORY_MMAPのみ対応
+		if (!dmabuf_fds.empty() || !udmabuf_name.empty()) {
+			LOGW("dmabuf/udmabuf is not supported for multi-planar capture, use mmap");
+		}
+	} else if (!dmabuf_fds.empty()) {
+		// 呼び出し元が確保したdma-bufを使うとき
+		LOGD("use dmabuf,num=%" FMT_SIZE_T, dmabuf_fds.size());
+		memory = V4L2_MEMORY_DMABUF;
+		_buf_nums = (int)dmabuf_fds.size();
+	} else if (!udmabuf_name.empty()) {
+		LOGD("try to open %s", udmabuf_name.c_str());
+		m_udmabuf_fd = ::open(udmabuf_name.c_str(), O_RDWR);
+		if (m_udmabuf_fd > 0) {
+			LOGD("use udmabuf");
+			memory = V4L2_MEMORY_USERPTR;
+			open_udmabuf_sync_locked();
+		} else {
+			LOGD("Failed to open %s", udmabuf_name.c_str());
+			m_udmabuf_fd = 0;
+		}
+	}
+
+	// 映像データ受取用のバッファを要求する
+	struct v4l2_requestbuffers req {
+		.count = DEFAULT_BUFFER_NUMS,
+		.type = m_buf_type,
+		.memory = memory,
+	};
+	for (int i = _buf_nums; i >= 1; i--) {
+		LOGD("VIDIOC_REQBUFS %d", i);
+		req.count = i;
+		if (xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) {
+			result = -errno;
+			req.count = 0;
+			if (EINVAL == errno) {
+				LOGE("%s does not support memory mapping", device_name.c_str());
+				goto err;
+			} else {
+				LOGD("VIDIOC_REQBUFS,err=%d", result);
+			}
+		} else {
+			break;
+		}
+	}
+
+	if (!req.count) {
+		LOGE("Insufficient buffer memory on %s", device_name.c_str());
+		result = core::USB_ERROR_NO_MEM;
+		goto err;
+	}
+
+	// 映像データ受け取り用バッファーを初期化
+	m_buffers = new buffer_t[req.count];
+	if (UNLIKELY(!m_buffers)) {
+		result = core::USB_ERROR_NO_MEM;
+		LOGE("Out of memory");
+		goto err;
+	}
+	for (uint32_t i = 0; i < req.count; i++) {
+		m_buffers[i].fd = 0;
+		m_buffers[i].start = MAP_FAILED;
+		m_buffers[i].offset = 0;
+		m_buffers[i].length = 0;
+		m_buffers[i].num_planes = 0;
+		m_buffers[i].dmabuf_sync = false;
+		m_buffers[i].udmabuf_sync_for_cpu = m_buffers[i].udmabuf_sync_for_device = 0;
+		m_buffers[i].pts = m_buffers[i].stc = m_buffers[i].sof = 0;
+		m_buffers[i].exposure_ts = 0;
+		for (auto &plane: m_buffers[i].planes) {
+			plane = {
+				.fd = 0,
+				.start = MAP_FAILED,
+			};
+		}
+	}
+	m_buffersNums = req.count;
+	m_memory = req.memory;
+
+	if (is_mplane()) {
+		result = init_mmap_locked_mplane(req);
+	} else if (memory == V4L2_MEMORY_DMABUF) {
+		result = init_mmap_locked_dmabuf(req);
+	} else if (m_udmabuf_fd > 0) {
+		result = init_mmap_locked_udmabuf(req);
+	} else {	// if (m_udmabuf_fd > 0)
+		result = init_mmap_udmabuf_other(req);
+	}
+
+err:
+	if (result) {
+		LOGD("something error occurred, release buffers,result=%d", result);
+		internal_release_mmap_buffers();
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * udmabufを使うとき
+ * init_mmap_lockedの下請け
+ * @param req
+*/
+int V4l2SourceBase::init_mmap_locked_udmabuf(struct v4l2_requestbuffers &req) {
+	ENTER();
+
+	int result = 0;
+	// 
+	LOGD("num=%d,capabilities=0x%08x,mem=%d", req.count, req.capabilities, req.memory);
+	uint32_t image_size = 0;
+	for (uint32_t i = 0; i < req.count; i++) {
+		struct v4l2_buffer buf {
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = req.memory,
+		};
+		buf.index = i;
+
+		LOGD("VIDIOC_QUERYBUF:%d", i);
+		if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_QUERYBUF,err=%d", result);
+			break;
+		}
+
+		image_size = MAX(image_size, buf.length);
+
+		LOGD("buf:index=%d,type=%d,used=%d,flags=0x%08x,field=0x%08x,seq=%d,mem=%d,m=%lu,len=%d",
+			buf.index, buf.type, buf.bytesused, buf.flags, buf.field, buf.sequence,
+			buf.memory, buf.m.userptr, buf.length);
+	}
+	if (result || !image_size) {
+		LOGE("Failed to get image size");
+		RETURN(result, int);
+	}
+	// DMA転送できるようにページサイズの倍数になるように調整する
+	const auto offset = ceil3(image_size, sysconf(_SC_PAGE_SIZE));
+	LOGD("image_size=%d,offset=%d", image_size, offset);
+	for (int i = 0; i < req.count; i++) {
+		m_buffers[i].length = image_size;
+		m_buffers[i].offset = i * offset;
+		m_buffers[i].start = mmap(nullptr /* start anywhere */, image_size,
+			PROT_READ | PROT_WRITE /* required */,
+			MAP_SHARED /* recommended */, m_udmabuf_fd, (off_t)(i * offset));
+		if (m_buffers[i].start == MAP_FAILED) {
+			result = -errno;
+			LOGE("mmap,err=%d", result);
+			break;
+		}
+		m_buffers[i].fd = m_udmabuf_fd;
+		m_buffers[i].udmabuf_sync_for_cpu = m_udmabuf_sync_for_cpu;
+		m_buffers[i].udmabuf_sync_for_device = m_udmabuf_sync_for_device;
+		// 物理メモリーを割り当てるためにゼロクリアする
+		// memsetではだめらしい
+		{
+			auto word_ptr = (uint8_t *)m_buffers[i].start;
+			for (int j = 0; j < offset; j++) {
+				word_ptr[j] = 0;
+			}
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * V4L2_MEMORY_MMAPを使うとき
+ * export_dmabuf=trueならVIDIOC_EXPBUFでdma-bufとしてエクスポートしてbuffer_t::fdへセットする
+ * init_mmap_lockedの下請け
+ * @param req
+*/
+int V4l2SourceBase::init_mmap_udmabuf_other(struct v4l2_requestbuffers &req) {
+	ENTER();
+
+	int result = 0;
+	// カメラドライバー側でメモリーを確保するとき
+	// XXX VIDIOC_REQBUFSはV4L2_MEMORY_MMAPで要求しているのでここでreq.memoryを変更してはいけない
+	LOGD("num=%d,capabilities=0x%08x,mem=%d", req.count, req.capabilities, req.memory);
+
+	for (uint32_t i = 0; i < req.count; i++) {
+		struct v4l2_buffer buf {
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = req.memory,
+		};
+		buf.index = i;
+
+		LOGD("VIDIOC_QUERYBUF:%d", i);
+		if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_QUERYBUF,err=%d", result);
+			break;
+		}
+
+		m_buffers[i].length = buf.length;
+		m_buffers[i].offset = buf.m.offset;
+		m_buffers[i].start = mmap(nullptr /* start anywhere */, buf.length,
+			PROT_READ | PROT_WRITE /* required */,
+			MAP_SHARED /* recommended */, m_fd, (off_t)buf.m.offset);
+
+		if (m_buffers[i].start == MAP_FAILED) {
+			result = -errno;
+			LOGE("mmap,err=%d", result);
+			break;
+		}
+
+		if (export_dmabuf) {
+			// dma-bufとしてエクスポートする
+			struct v4l2_exportbuffer expbuf {
+				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+				.index = i,
+				.flags = O_RDWR | O_CLOEXEC,
+			};
+			if (xioctl(m_fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+				// エクスポートできなくてもV4L2_MEMORY_MMAPとしては使えるのでエラーにはしない
+				LOGW("VIDIOC_EXPBUF:index=%d,errno=%d", i, errno);
+			} else {
+				LOGD("VIDIOC_EXPBUF:index=%d,fd=%d", i, expbuf.fd);
+				m_buffers[i].fd = expbuf.fd;
+				// エクスポートしたdma-bufの先頭からの位置
+				m_buffers[i].offset = 0;
+				// mmapしたバッファーをCPUから読み込むときはDMA_BUF_IOCTL_SYNCで同期する
+				m_buffers[i].dmabuf_sync = true;
+			}
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 呼び出し元が確保したdma-bufをV4L2_MEMORY_DMABUFで使うとき
+ * init_mmap_lockedの下請け
+ * @param req
+*/
+int V4l2SourceBase::init_mmap_locked_dmabuf(struct v4l2_requestbuffers &req) {
+	ENTER();
+
+	int result = 0;
+	LOGD("num=%d,capabilities=0x%08x,mem=%d", req.count, req.capabilities, req.memory);
+	if (UNLIKELY(req.count > dmabuf_fds.size())) {
+		// v4l2機器が必要とする最小バッファー数が渡されたdma-bufの数より多いと
+		// VIDIOC_REQBUFSでcountを増やして返すので割り当てるdma-bufが足りない
+		LOGE("insufficient dmabuf,required=%d,supplied=%" FMT_SIZE_T, req.count, dmabuf_fds.size());
+		RETURN(core::USB_ERROR_NO_MEM, int);
+	}
+
+	for (uint32_t i = 0; i < req.count; i++) {
+		const int fd = dmabuf_fds[i];
+		size_t length = dmabuf_length;
+		if (!length) {
+			// dma-bufはlseekでサイズを取得できる
+			const off_t sz = lseek(fd, 0, SEEK_END);
+			lseek(fd, 0, SEEK_SET);
+			length = sz > 0 ? (size_t)sz : 0;
+		}
+		if (UNLIKELY(!length)) {
+			result = core::USB_ERROR_INVALID_PARAM;
+			LOGE("failed to get dmabuf size,index=%d,fd=%d", i, fd);
+			break;
+		}
+		m_buffers[i].fd = fd;
+		m_buffers[i].offset = 0;
+		m_buffers[i].length = length;
+		m_buffers[i].dmabuf_sync = true;
+		// CPUからもアクセスできるようにmmapする
+		m_buffers[i].start = mmap(nullptr /* start anywhere */, length,
+			PROT_READ | PROT_WRITE /* required */,
+			MAP_SHARED /* recommended */, fd, 0);
+		if (m_buffers[i].start == MAP_FAILED) {
+			// mmapできないdma-bufでもEGLImage等でのインポートはできるのでエラーにはしない
+			LOGW("mmap dmabuf,index=%d,errno=%d", i, errno);
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * マルチプレーン(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)でV4L2_MEMORY_MMAPを使うとき
+ * 各プレーンを個別にmmapする
+ * export_dmabuf=trueならVIDIOC_EXPBUFで各プレーンをdma-bufとしてエクスポートしてplane_t::fdへセットする
+ * init_mmap_lockedの下請け
+ * @param req
+*/
+int V4l2SourceBase::init_mmap_locked_mplane(struct v4l2_requestbuffers &req) {
+	ENTER();
+
+	int result = 0;
+	LOGD("num=%d,capabilities=0x%08x,mem=%d", req.count, req.capabilities, req.memory);
+
+	for (uint32_t i = 0; !result && (i < req.count); i++) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf{};
+		init_v4l2_buffer(buf, planes);
+		buf.index = i;
+
+		LOGD("VIDIOC_QUERYBUF:%d", i);
+		if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_QUERYBUF,err=%d", result);
+			break;
+		}
+		if (UNLIKELY(!buf.length || (buf.length > MAX_BUFFER_PLANES))) {
+			result = core::USB_ERROR_NOT_SUPPORTED;
+			LOGE("unsupported number of planes,%u", buf.length);
+			break;
+		}
+
+		auto &buffer = m_buffers[i];
+		buffer.num_planes = buf.length;
+		for (uint32_t j = 0; j < buffer.num_planes; j++) {
+			auto &plane = buffer.planes[j];
+			plane.length = planes[j].length;
+			plane.offset = planes[j].m.mem_offset;
+			plane.start = mmap(nullptr /* start anywhere */, planes[j].length,
+				PROT_READ | PROT_WRITE /* required */,
+				MAP_SHARED /* recommended */, m_fd, (off_t)planes[j].m.mem_offset);
+			if (plane.start == MAP_FAILED) {
+				result = -errno;
+				LOGE("mmap,index=%d,plane=%d,err=%d", i, j, result);
+				break;
+			}
+			if (export_dmabuf) {
+				// プレーン毎にdma-bufとしてエクスポートする
+				struct v4l2_exportbuffer expbuf {
+					.type = m_buf_type,
+					.index = i,
+					.plane = j,
+					.flags = O_RDWR | O_CLOEXEC,
+				};
+				if (xioctl(m_fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+					// エクスポートできなくてもV4L2_MEMORY_MMAPとしては使えるのでエラーにはしない
+					LOGW("VIDIOC_EXPBUF:index=%d,plane=%d,errno=%d", i, j, errno);
+				} else {
+					LOGD("VIDIOC_EXPBUF:index=%d,plane=%d,fd=%d", i, j, expbuf.fd);
+					plane.fd = expbuf.fd;
+					// エクスポートしたdma-bufの先頭からの位置
+					plane.offset = 0;
+					buffer.dmabuf_sync = true;
+				}
+			}
+		}
+		// 先頭プレーンの値はbuffer_tのfd/start/offset/lengthでもアクセスできるようにする
+		buffer.fd = buffer.planes[0].fd;
+		buffer.start = buffer.planes[0].start;
+		buffer.offset = buffer.planes[0].offset;
+		buffer.length = buffer.planes[0].length;
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * VIDIOC_QUERYBUF/VIDIOC_QBUF/VIDIOC_DQBUF用にv4l2_bufferを初期化する
+ * マルチプレーンのときはplanesをv4l2_buffer.m.planesへセットする
+ * @param buf
+ * @param planes VIDEO_MAX_PLANES個の要素を持つ配列
+ */
+/*private*/
+void V4l2SourceBase::init_v4l2_buffer(struct v4l2_buffer &buf, struct v4l2_plane *planes) const {
+	buf.type = m_buf_type;
+	buf.memory = m_memory;
+	if (is_mplane()) {
+		// マルチプレーンのときはv4l2_buffer.lengthがプレーン配列の要素数になる
+		buf.m.planes = planes;
+		buf.length = VIDEO_MAX_PLANES;
+	}
+}
+
+/**
+ * @brief 対応しているピクセルフォーマット一覧を取得する
+ *
+ * @return std::vector
+ */
+/*private*/
+std::vector<uint32_t> V4l2SourceBase::get_supported_pixel_formats_locked(const std::vector<uint32_t> preffered) const {
+	ENTER();
+
+	std::vector<uint32_t> result;
+	if (caps) {
+		for (const auto &format: caps->formats) {
+			if (preffered.empty() || (find(preffered.begin(), preffered.end(), format->pixel_format) != preffered.end())) {
+				result.push_back(format->pixel_format);
+			}
+		}
+	} else if (m_state > STATE_CLOSE) {
+		int r = 0;
+		for (int i = 0 ; (r != -1); i++) {
+			struct v4l2_fmtdesc fmt {
+				.type = m_buf_type,
+			};
+			fmt.index = i;
+			r = xioctl(m_fd, VIDIOC_ENUM_FMT, &fmt);
+			if (r != -1) {
+				const auto pixel_format = fmt.pixelformat;
+				LOGD("%i)0x%08x=%s(%s)", fmt.index,
+					pixel_format, V4L2_PIX_FMT_to_string(pixel_format).c_str(),
+					fmt.description);
+				if (preffered.empty() || (find(preffered.begin(), preffered.end(), pixel_format) != preffered.end())) {
+					result.push_back(pixel_format);
+				}
+			}
+		}
+	}
+	LOGD("num pixel formast=%" FMT_SIZE_T, result.size());
+
+	RET(result);
+}
+
+/**
+ * 実際の解像度変更処理、ワーカースレッド上で実行される
+ * @param width
+ * @param height
+ * @param pixel_format V4L2_PIX_FMT_XXX
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::handle_resize(
+	const uint32_t &width, const uint32_t &height,
+	const uint32_t &pixel_format) {
+
+	ENTER();
+	LOGD("sz(%dx%d)@0x%08x", width, height, pixel_format);
+
+	state_t prevState = m_state;
+	// release_mmap_lockedでm_buffersNumsはクリアされるので先に保持しておく
+	// バッファー数の自動調整で変更要求があればそのバッファー数を使う
+	const int buf_nums = request_buf_nums > 0 ? request_buf_nums : (int)m_buffersNums;
+	if (prevState == STATE_STREAM) {
+		// 変更後の最初の映像を受け取るまでの時間を計測する
+		switch_start = last_dequeued ? last_dequeued : systemTime();
+		if ((width == stream_width) && (height == stream_height)
+			&& (pixel_format == stream_pixel_format)
+			&& (request_buf_nums <= 0) && m_buffersNums) {
+			// フレーム間隔だけを変更するときは映像受け取りバッファーを確保し直さない
+			const int result = change_interval_locked();
+			if (LIKELY(!result)) {
+				RETURN(result, int);
+			}
+			// 失敗したときは映像受け取りバッファーを確保し直す
+		}
+	}
+	int result = stop_stream_locked();	// state == STATE_INIT/STATE_OPEN
+	if (LIKELY(!result)) {
+		const uint32_t cur_width = stream_width ? stream_width : width;
+		const uint32_t cur_height = stream_height ? stream_height : height;
+		const uint32_t cur_pixel_format = stream_pixel_format ? stream_pixel_format : pixel_format;
+		request_buf_nums = 0;
+		if (wait_retained_buffers_locked()) {
+			// 保持されたままのバッファーはrelease_mmap_lockedでmunmapせずにrelease_bufferで開放する
+			LOGW("retained buffers are not returned,defer release");
+		}
+		result = release_mmap_locked();	// state == STATE_OPEN
+		if (LIKELY(!result)) {
+			// 解像度・ピクセルフォーマットをセット
+			result = init_v4l2_locked(buf_nums, width, height, pixel_format);
+			if (result) {
+				LOGD("以前の解像度・ピクセルフォーマットへ戻す,sz(%dx%d)@0x%08x",
+					cur_width, cur_height, cur_pixel_format);
+				result = init_v4l2_locked(buf_nums, cur_width, cur_height, cur_pixel_format);
+			}
+		}
+		if (LIKELY(!result)) {
+			m_state = STATE_INIT;
+			switch (prevState) {
+			case STATE_OPEN:	// 初回
+			case STATE_INIT:	// 2回目以降
+				break;			// 何もしない
+			case STATE_STREAM:
+				start_stream_locked();
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 解像度・ピクセルフォーマット・バッファー数を変えずにフレーム間隔だけを変更する
+ * v4l2_lockをロックした状態で呼び出すこと
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::change_interval_locked() {
+	ENTER();
+
+	// UVC機器は映像ストリーム中のVIDIOC_S_PARMがEBUSYになるので一旦停止する
+	// VIDIOC_STREAMOFFではバッファーを解放しないのでVIDIOC_REQBUFS/mmapし直す必要はない
+	int result = stop_stream_locked();	// state == STATE_INIT
+	if (LIKELY(!result)) {
+		if (wait_retained_buffers_locked()) {
+			// 保持されたままのバッファーはstart_stream_lockedでキューへ戻さずにrelease_bufferで戻す
+			LOGW("retained buffers are not returned,defer requeue");
+		}
+		update_frame_interval_locked();
+		request_resize = false;
+		// start_stream_lockedが失敗したときはバッファーが解放されてstate == STATE_OPENになる
+		result = start_stream_locked();
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像データの処理
+ * 映像データがないときはmax_wait_frame_usで指定した時間待機する
+ * ワーカースレッド上で呼ばれる
+ * @param max_wait_frame_us 最大映像待ち時間[マイクロ秒]
+ * @return int 負:エラー 0以上:読み込んだデータバイト数
+ */
+/*private*/
+int V4l2SourceBase::handle_frame(const suseconds_t &max_wait_frame_us) {
+
+	ENTER();
+
+	// 映像データとv4l2のイベント(POLLPRI)を同時に待機する
+	// v4l2機器を閉じているときは負のfdにしてタイムアウトまで待つだけにする
+	struct pollfd fds {
+		.fd = m_fd ? m_fd : -1,
+		.events = POLLIN | POLLPRI,
+	};
+	nsecs_t wait_ns = (nsecs_t)max_wait_frame_us * 1000;
+	if (stall_detect && stall_base) {
+		// 映像が途切れたと判断する時刻を過ぎて待機しないようにする
+		const nsecs_t remain = stall_base + get_stall_timeout() - systemTime();
+		wait_ns = std::max((nsecs_t)0, std::min(wait_ns, remain));
+	}
+	/* Timeout. */
+	// 映像データが準備できるまで待機
+	int result = poll(&fds, 1, (int)((wait_ns + 999999) / 1000000));
+	if (result < 0) {
+		// pollがエラーを返した時
+		result = -errno;
+		if (EINTR != errno) {
+			// 中断以外のエラーの場合はログ出力
+			LOGE("poll:errno=%d", -result);
+		}
+	} else {
+		if (fds.revents & POLLPRI) {
+			// v4l2のイベントが届いた
+			handle_events();
+		}
+		// 映像データの準備ができたかタイムアウトした時
+		if (fds.revents & (POLLIN | POLLERR | POLLHUP)) {
+			// 映像データの処理
+			int frame_result = 0;
+			const int r = dequeue_frame(frame_result);
+			if (LIKELY(!r)) {
+				result = frame_result;
+			} else if (r == -EAGAIN) {
+				// 映像データが準備出来てない
+				result = 0;
+			} else {
+				result = r;
+			}
+		} else {
+			// EAGAIN(タイムアウト)
+			result = 0;
+		}
+	}
+	if (stall_detect && (result >= 0)) {
+		const int r = check_stall();
+		if (UNLIKELY(r)) {
+			result = r;
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * ネゴシエーションしたフレーム間隔と実際に映像を受け取った間隔の長い方から
+ * 映像が途切れたと判断するまでの時間を取得する
+ * @return
+ */
+/*private*/
+nsecs_t V4l2SourceBase::get_stall_timeout() const {
+	const nsecs_t interval = std::max(stall_interval,
+		stream_fps > 0.0f ? (nsecs_t)(1000000000.0 / stream_fps) : 0);
+	const nsecs_t timeout = std::max(STALL_FRAME_INTERVALS * interval, (nsecs_t)STALL_DEFAULT_TIMEOUT_NS);
+	return stall_first_frame ? std::max(timeout, (nsecs_t)STALL_FIRST_FRAME_GRACE_NS) : timeout;
+}
+
+/**
+ * 映像が途切れていないかを確認して途切れていれば段階的に復帰処理を行う
+ * ワーカースレッド上で呼ばれる
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::check_stall() {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+
+	if (stall_base && (systemTime() - stall_base >= get_stall_timeout())) {
+		v4l2_lock.lock();
+		{
+			// 解像度変更要求があるときはhandle_requestでネゴシエーションし直すので何もしない
+			if (!request_resize && ((m_state == STATE_STREAM) || stall_level)) {
+				if (!stall_level) {
+					// 最後に映像を受け取った(または映像ストリームを開始した)時刻から復帰時間を計測する
+					stall_start = stall_base;
+					stall_count++;
+					LOGW("stream stalled,fps=%5.2f,count=%u", stream_fps, stall_count.load());
+				}
+				if (stall_level < 2) {
+					stall_level++;
+				}
+				result = recover_stream_locked(stall_level);
+				// 失敗したときもタイムアウトまで待ってから次の段階の復帰処理を行う
+				stall_base = systemTime();
+				stall_first_frame = true;
+			}
+		}
+		v4l2_lock.unlock();
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * check_stallの下請け
+ * v4l2_lockをロックした状態で呼び出すこと
+ * @param level 復帰処理の段階
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::recover_stream_locked(const int &level) {
+	ENTER();
+
+	LOGW("recover stream,level=%d,state=%d", level, m_state);
+
+	int result;
+	if (level <= 1) {
+		// VIDIOC_STREAMOFF→VIDIOC_STREAMONだけでやり直す
+		stop_stream_locked();	// state == STATE_INIT
+		if (wait_retained_buffers_locked()) {
+			// 保持されたままのバッファーはstart_stream_lockedでキューへ戻さずにrelease_bufferで戻す
+			LOGW("retained buffers are not returned,defer requeue");
+		}
+		// start_stream_lockedが失敗したときはバッファーが解放されてstate == STATE_OPENになる
+		result = start_stream_locked();
+	} else {
+		// release_mmap_lockedでm_buffersNums/stream_width/stream_heightはクリアされるので先に保持しておく
+		const int buf_nums = m_buffersNums ? (int)m_buffersNums : DEFAULT_BUFFER_NUMS;
+		const uint32_t width = stream_width ? stream_width : request_width;
+		const uint32_t height = stream_height ? stream_height : request_height;
+		const uint32_t pixel_format = stream_pixel_format ? stream_pixel_format : request_pixel_format;
+		stop_stream_locked();
+		if (wait_retained_buffers_locked()) {
+			// 保持されたままのバッファーはrelease_mmap_lockedでmunmapせずにrelease_bufferで開放する
+			LOGW("retained buffers are not returned,defer release");
+		}
+		result = release_mmap_locked();	// state == STATE_OPEN
+		if (LIKELY(!result)) {
+			// VIDIOC_REQBUFSからやり直す
+			result = init_v4l2_locked(buf_nums, width, height, pixel_format);
+		}
+		if (LIKELY(!result)) {
+			m_state = STATE_INIT;
+			result = start_stream_locked();
+		}
+	}
+	if (UNLIKELY(result)) {
+		LOGE("failed to recover stream,level=%d,err=%d", level, result);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 映像の入ったバッファーを1つ取り出してon_frame_readyを呼び出した後にキューへ戻す
+ * @param result on_frame_readyの返り値またはVIDIOC_QBUFのエラー
+ * @return 0: バッファーを取り出した, 負: VIDIOC_DQBUFのエラー(-EAGAINなら映像データが準備出来てない)
+ */
+/*private*/
+int V4l2SourceBase::dequeue_frame(int &result) {
+	ENTER();
+
+	struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+	struct v4l2_buffer buf{};
+	init_v4l2_buffer(buf, planes);
+
+	// 映像の入ったバッファを取得
+	if (xioctl(m_fd, VIDIOC_DQBUF, &buf) == -1) {
+		// バッファを取得できなかったとき
+		const int err = -errno;
+		switch (-err) {
+		case EAGAIN:
+			// 映像データが準備出来てない
 			break;
+		case EIO:
+			/* Could ignore EIO, see spec. */
+			/* fall through */
+		default:
+			LOGE("VIDIOC_DQBUF: errno=%d", -err);
+		}
+		RETURN(err, int);
+	}
+	dropped_frames += count_sequence_gap(last_sequence, buf.sequence);
+	const nsecs_t dequeued = systemTime();
+	last_dequeued = dequeued;
+	if (UNLIKELY(switch_start)) {
+		// 再ネゴシエーション後の最初の映像
+		switch_gap = dequeued - switch_start;
+		LOGI("stream switched,gap=%" PRId64 "us", (int64_t)(switch_gap.load() / 1000));
+		switch_start = 0;
+	}
+	if (LIKELY(!stall_first_frame && stall_base)) {
+		// 受け取った間隔の最大値を保持しつつ徐々に減衰させる
+		stall_interval = std::max(dequeued - stall_base, stall_interval - stall_interval / 16);
+	}
+	stall_first_frame = false;
+	stall_base = dequeued;
+	if (UNLIKELY(stall_start)) {
+		// 映像が途切れてから復帰処理後の最初の映像
+		const nsecs_t t = dequeued - stall_start;
+		recovery_time = t;
+		if (t > max_recovery_time) {
+			max_recovery_time = t;
+		}
+		LOGI("stream recovered,level=%d,recovery=%" PRId64 "us", stall_level, (int64_t)(t / 1000));
+		stall_start = 0;
+		stall_level = 0;
+	}
+
+	if (latest_only) {
+		// 準備できている映像を全て取り出して最新の映像だけを渡す
+		for ( ; ; ) {
+			struct v4l2_plane next_planes[VIDEO_MAX_PLANES] {};
+			struct v4l2_buffer next{};
+			init_v4l2_buffer(next, next_planes);
+			if (xioctl(m_fd, VIDIOC_DQBUF, &next) == -1) {
+				// EAGAINなら取り出し終わった, それ以外のエラーは次回のVIDIOC_DQBUFで処理する
+				break;
+			}
+			dropped_frames += count_sequence_gap(last_sequence, next.sequence);
+			// 古い方の映像は読み飛ばしてすぐにキューへ戻す
+			if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+				LOGE("VIDIOC_QBUF: errno=%d", errno);
+			}
+			buf = next;
+			if (is_mplane()) {
+				// v4l2_buffer.m.planesはnext_planesを指しているのでplanesへコピーして付け替える
+				memcpy(planes, next_planes, sizeof(planes));
+				buf.m.planes = planes;
+			}
+			skipped_frames++;
+		}
+	}
+
+	// バッファを取得できた時
+	result = 0;
+	bool requeue = true;
+	if (buf.index < m_buffersNums) {
+		auto &buffer = m_buffers[buf.index];
+		update_buffer_info(buffer, buf);
+		update_uvc_meta(buffer);
+		v4l2_lock.lock();
+		{
+			delivering_index = (int)buf.index;
+		}
+		v4l2_lock.unlock();
+		size_t bytes = buf.bytesused;
+		if (is_mplane()) {
+			// マルチプレーンのときは全プレーンの合計をデータバイト数とする
+			bytes = 0;
+			for (uint32_t i = 0; i < buf.length; i++) {
+				bytes += planes[i].bytesused - planes[i].data_offset;
+			}
+		}
+		result = on_frame_ready(buffer, bytes);
+		v4l2_lock.lock();
+		{
+			delivering_index = -1;
+			// retain_bufferで保持されたときはrelease_bufferでキューへ戻す
+			requeue = !retained[buf.index];
+		}
+		v4l2_lock.unlock();
+		if (probe_pending || (probe_index >= 0)) {
+			// 映像取得フォーマットの自動選択中はバッファー数を自動調整しない
+			probe_format(dequeued, systemTime());
+		} else if (auto_buf_nums && dmabuf_fds.empty()) {
+			// 呼び出し元が確保したdma-bufを使うときはバッファー数を変更できない
+			tune_buffer_nums(buffer, dequeued, systemTime());
+		}
+	}
+	// 読み込み終わったバッファをキューに追加
+	if (requeue && (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1)) {
+		result = -errno;
+		LOGE("VIDIOC_QBUF: errno=%d", -result);
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * バッファー数の自動調整用に1フレーム分の遅延を記録して
+ * 評価期間が終わればバッファー数を変更するかどうかを判断する
+ * @param buffer
+ * @param dequeued VIDIOC_DQBUFした時刻[ナノ秒]
+ * @param rendered on_frame_readyから戻った時刻[ナノ秒]
+ */
+/*private*/
+void V4l2SourceBase::tune_buffer_nums(const buffer_t &buffer, const nsecs_t &dequeued, const nsecs_t &rendered) {
+	ENTER();
+
+	// systemTimeと同じCLOCK_MONOTONICのタイムスタンプのときだけキューイング遅延を計算できる
+	const bool monotonic = (buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	if (!tune_frames) {
+		tune_first_ts = buffer.timestamp;
+	}
+	tune_last_ts = buffer.timestamp;
+	if (monotonic && (dequeued > buffer.timestamp)) {
+		tune_queue_latency += dequeued - buffer.timestamp;
+	}
+	tune_render_latency += rendered - dequeued;
+	if (++tune_frames < TUNE_WINDOW_FRAMES) {
+		EXIT();
+	}
+
+	// 評価期間が終わったとき
+	const uint64_t dropped = dropped_frames.load() - tune_dropped;
+	const nsecs_t interval = (tune_last_ts - tune_first_ts) / (nsecs_t)(tune_frames - 1);
+	const nsecs_t queue_latency = tune_queue_latency / (nsecs_t)tune_frames;
+	const nsecs_t render_latency = tune_render_latency / (nsecs_t)tune_frames;
+	const int cur_nums = (int)m_buffersNums;
+	int new_nums = cur_nums;
+	if (dropped) {
+		// フレーム落ちしたときはバッファー数を増やす
+		tune_slow_windows = 0;
+		if (cur_nums < max_buf_nums) {
+			new_nums = cur_nums + 1;
+			tune_floor = new_nums;
+			LOGI("buffer nums %d->%d,%" PRIu64 " frames dropped by driver,render latency=%" PRId64 "us",
+				cur_nums, new_nums, dropped, ns2us(render_latency));
+		}
+	} else if (monotonic && (interval > 0)
+		&& (queue_latency > interval * TUNE_SLOW_LATENCY_FRAMES)) {
+		// フレーム落ちしないがキューイング遅延が大きいときはバッファー数を減らす
+		if ((++tune_slow_windows >= TUNE_SLOW_WINDOWS)
+			&& (cur_nums > min_buf_nums) && (cur_nums > tune_floor)) {
+			new_nums = cur_nums - 1;
+			LOGI("buffer nums %d->%d,queue latency=%" PRId64 "us,frame interval=%" PRId64 "us",
+				cur_nums, new_nums, ns2us(queue_latency), ns2us(interval));
+		}
+	} else {
+		tune_slow_windows = 0;
+	}
+	LOGD("dropped=%" PRIu64 ",interval=%" PRId64 ",queue=%" PRId64 ",render=%" PRId64,
+		dropped, interval, queue_latency, render_latency);
+
+	reset_tuning();
+	if (new_nums != cur_nums) {
+		tune_slow_windows = 0;
+		AutoMutex lock(v4l2_lock);
+		request_buf_nums = new_nums;
+		// 解像度変更と同じ処理でバッファーを再割り当てする
+		request_resize = true;
+		if (reactor) {
+			reactor->wakeup();
+		}
+	}
+
+	EXIT();
+}
+
+/**
+ * バッファー数の自動調整用の統計情報をクリアする
+ */
+/*private*/
+void V4l2SourceBase::reset_tuning() {
+	tune_frames = 0;
+	tune_queue_latency = tune_render_latency = 0;
+	tune_first_ts = tune_last_ts = 0;
+	tune_dropped = dropped_frames.load();
+}
+
+/**
+ * 映像取得フォーマットの自動選択用に1フレーム分の時間を記録して
+ * 評価期間が終われば次の候補へ切り替える
+ * @param dequeued VIDIOC_DQBUFした時刻[ナノ秒]
+ * @param rendered on_frame_readyから戻った時刻[ナノ秒]
+ */
+/*private*/
+void V4l2SourceBase::probe_format(const nsecs_t &dequeued, const nsecs_t &rendered) {
+	ENTER();
+
+	if (probe_pending) {
+		probe_pending = false;
+		start_probe();
+		EXIT();
+	}
+	if (request_resize) {
+		// 候補への切り替え待ちの間に受け取ったフレームは計測しない
+		EXIT();
+	}
+
+	auto &candidate = probe_candidates[probe_index];
+	if (!probe_frames) {
+		// 切り替え後最初のフレームのときはネゴシエーション結果を確認する
+		// VIDIOC_S_FMTで別のピクセルフォーマット・解像度になったときや
+		// 切り替えに失敗して元に戻ったときはその候補を使えない
+		if ((stream_pixel_format != candidate.choice.pixel_format)
+			|| (stream_width != candidate.choice.width) || (stream_height != candidate.choice.height)) {
+
+			LOGD("skip %s,sz(%dx%d)",
+				V4L2_PIX_FMT_to_string(candidate.choice.pixel_format).c_str(),
+				candidate.choice.width, candidate.choice.height);
+			next_probe();
+			EXIT();
 		}
 	}
+	if (++probe_frames <= PROBE_SKIP_FRAMES) {
+		// 切り替え直後は安定しないので読み飛ばす
+		probe_last_dequeued = dequeued;
+		probe_dropped = dropped_frames.load();
+		EXIT();
+	}
+	probe_interval += dequeued - probe_last_dequeued;
+	probe_last_dequeued = dequeued;
+	probe_render += rendered - dequeued;
+	if (probe_frames < PROBE_SKIP_FRAMES + PROBE_WINDOW_FRAMES) {
+		EXIT();
+	}
 
-	if (!req.count) {
-		LOGE("Insufficient buffer memory on %s", device_name.c_str());
-		result = core::USB_ERROR_NO_MEM;
-		goto err;
+	// 評価期間が終わったとき
+	const uint64_t dropped = dropped_frames.load() - probe_dropped;
+	const nsecs_t interval = probe_interval / PROBE_WINDOW_FRAMES;
+	const nsecs_t render = probe_render / PROBE_WINDOW_FRAMES;
+	candidate.measured = interval > 0;
+	candidate.fps = candidate.measured ? 1000000000.0f / (float)interval : 0.0f;
+	candidate.latency = interval + render;
+	candidate.sustained = candidate.measured
+		&& (candidate.fps >= target_fps * PROBE_SUSTAIN_RATIO)
+		&& (render < interval) && !dropped;
+	LOGI("probe %s,sz(%dx%d),fps=%5.2f,interval=%" PRId64 "us,render=%" PRId64 "us,dropped=%" PRIu64 ",sustained=%d",
+		V4L2_PIX_FMT_to_string(candidate.choice.pixel_format).c_str(),
+		candidate.choice.width, candidate.choice.height,
+		candidate.fps, ns2us(interval), ns2us(render), dropped, candidate.sustained);
+	next_probe();
+
+	EXIT();
+}
+
+/**
+ * 映像取得フォーマットの自動選択を開始する
+ * 自動選択結果がキャッシュされていればそれを使い
+ * キャッシュされていなければ候補を列挙して最初の候補へ切り替える
+ */
+/*private*/
+void V4l2SourceBase::start_probe() {
+	ENTER();
+
+	probe_candidates.clear();
+	probe_index = -1;
+
+	std::vector<FormatInfoSp> formats;
+	uint32_t width, height;
+	stream_choice_t choice{};
+	bool found = false;
+	{
+		AutoMutex lock(v4l2_lock);
+		width = request_width;
+		height = request_height;
+		found = cap_cache && caps && cap_cache->find_preferred(*caps, width, height, target_fps, choice);
+		if (!found) {
+			if (caps) {
+				formats = caps->formats;
+			} else {
+				get_supported_formats(m_fd, formats);
+			}
+		}
+	}
+	if (found) {
+		// 以前に自動選択した結果があればそれを使う
+		LOGI("use preferred %s,sz(%dx%d),interval=%u/%u",
+			V4L2_PIX_FMT_to_string(choice.pixel_format).c_str(),
+			choice.width, choice.height, choice.numerator, choice.denominator);
+		if ((choice.pixel_format != stream_pixel_format) || choice.numerator) {
+			request_choice(choice);
+		}
+		EXIT();
 	}
 
-	// 映像データ受け取り用バッファーを初期化
-	m_buffers = new buffer_t[req.count];
-	if (UNLIKELY(!m_buffers)) {
-		result = core::USB_ERROR_NO_MEM;
-		LOGE("Out of memory");
-		goto err;
+	for (const auto &format: formats) {
+		const auto pixel_format = format->pixel_format;
+		if (V4L2_PIX_FMT_to_raw_frame(pixel_format) == core::RAW_FRAME_UNKNOWN) {
+			// 描画できないピクセルフォーマットは試行しない
+			continue;
+		}
+		if (format->frames.empty()) {
+			// 離散値の解像度が無いときはフレーム間隔を変更せずにネゴシエーション結果で判断する
+			probe_candidates.push_back({
+				.choice = { width, height, target_fps, pixel_format, 0, 0 },
+			});
+			continue;
+		}
+		for (const auto &frame: format->frames) {
+			if ((frame->width != width) || (frame->height != height)) {
+				continue;
+			}
+			for (const auto &rate: frame->frame_rates) {
+				// v4l2_frmivalenumはフレーム間隔[秒]なので逆数がフレームレート
+				// 連続値/ステップ値のときは最小フレーム間隔(最大フレームレート)だけを試行する
+				const auto &interval = rate->type == V4L2_FRMIVAL_TYPE_DISCRETE
+					? rate->discrete : rate->stepwise.min;
+				if (!interval.numerator || !interval.denominator
+					|| ((float)interval.denominator / (float)interval.numerator < target_fps * PROBE_SUSTAIN_RATIO)) {
+					// 目標フレームレートを維持できないフレーム間隔は試行しない
+					continue;
+				}
+				probe_candidates.push_back({
+					.choice = { width, height, target_fps, pixel_format, interval.numerator, interval.denominator },
+				});
+			}
+		}
 	}
-	for (uint32_t i = 0; i < req.count; i++) {
-		m_buffers[i].fd = 0;
-		m_buffers[i].start = MAP_FAILED;
-		m_buffers[i].offset = 0;
-		m_buffers[i].length = 0;
+	LOGI("probe %" FMT_SIZE_T " candidates,sz(%dx%d),target fps=%5.2f",
+		probe_candidates.size(), width, height, target_fps);
+
+	if (probe_candidates.size() > 1) {
+		next_probe();
+	} else {
+		// 候補が1つ以下なら選ぶ必要がない
+		probe_candidates.clear();
 	}
-	m_buffersNums = req.count;
 
-	if (m_udmabuf_fd > 0) {
-		result = init_mmap_locked_udmabuf(req);
-	} else {	// if (m_udmabuf_fd > 0)
-		result = init_mmap_udmabuf_other(req);
+	EXIT();
+}
+
+/**
+ * 次の候補へ切り替える, 全ての候補を試行し終わればfinish_probeを呼ぶ
+ */
+/*private*/
+void V4l2SourceBase::next_probe() {
+	ENTER();
+
+	probe_frames = 0;
+	probe_last_dequeued = 0;
+	probe_interval = probe_render = 0;
+	probe_dropped = dropped_frames.load();
+	if (++probe_index < (int)probe_candidates.size()) {
+		request_choice(probe_candidates[probe_index].choice);
+	} else {
+		finish_probe();
 	}
 
-err:
-	if (result) {
-		LOGD("something error occurred, release buffers,result=%d", result);
-		internal_release_mmap_buffers();
+	EXIT();
+}
+
+/**
+ * 試行結果から映像取得フォーマットを選んで切り替え、キャッシュへ保存する
+ * 目標フレームレートを維持できた候補のうちVIDIOC_DQBUF間隔+描画時間が最小のものを選ぶ
+ * 目標フレームレートを維持できた候補が無ければ実測フレームレートが最大のものを選ぶ
+ */
+/*private*/
+void V4l2SourceBase::finish_probe() {
+	ENTER();
+
+	const probe_candidate_t *best = nullptr;
+	for (const auto &candidate: probe_candidates) {
+		if (!candidate.measured) {
+			continue;
+		}
+		if (!best
+			|| (candidate.sustained && !best->sustained)
+			|| (candidate.sustained && best->sustained && (candidate.latency < best->latency))
+			|| (!candidate.sustained && !best->sustained && (candidate.fps > best->fps))) {
+			best = &candidate;
+		}
+	}
+	if (best) {
+		LOGI("choose %s,sz(%dx%d),interval=%u/%u,fps=%5.2f,latency=%" PRId64 "us,sustained=%d",
+			V4L2_PIX_FMT_to_string(best->choice.pixel_format).c_str(),
+			best->choice.width, best->choice.height,
+			best->choice.numerator, best->choice.denominator,
+			best->fps, ns2us(best->latency), best->sustained);
+		if ((best->choice.pixel_format != stream_pixel_format)
+			|| (best->choice.numerator != request_interval.numerator)
+			|| (best->choice.denominator != request_interval.denominator)) {
+			// 最後に試行した候補以外を選んだときは切り替える
+			request_choice(best->choice);
+		}
+		V4l2CapCacheSp cache;
+		DeviceCapsSp _caps;
+		{
+			AutoMutex lock(v4l2_lock);
+			cache = cap_cache;
+			_caps = caps;
+		}
+		if (cache && _caps) {
+			cache->set_preferred(*_caps, best->choice);
+		}
+	} else {
+		LOGW("no format could be measured, keep current format");
 	}
+	probe_candidates.clear();
+	probe_index = -1;
+	reset_tuning();
 
-	RETURN(result, int);
+	EXIT();
 }
 
 /**
- * udmabufを使うとき
- * init_mmap_lockedの下請け
- * @param req
-*/
-int V4l2SourceBase::init_mmap_locked_udmabuf(struct v4l2_requestbuffers &req) {
+ * 指定したピクセルフォーマット・解像度・フレーム間隔への変更を要求する
+ * @param choice
+ */
+/*private*/
+void V4l2SourceBase::request_choice(const stream_choice_t &choice) {
 	ENTER();
 
-	int result = 0;
-	// 
-	LOGD("num=%d,capabilities=0x%08x,mem=%d", req.count, req.capabilities, req.memory);
-	uint32_t image_size = 0;
-	for (uint32_t i = 0; i < req.count; i++) {
-		struct v4l2_buffer buf {
-			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			.memory = req.memory,
-		};
-		buf.index = i;
+	AutoMutex lock(v4l2_lock);
+	request_width = choice.width;
+	request_height = choice.height;
+	request_pixel_format = choice.pixel_format;
+	request_interval.numerator = choice.numerator;
+	request_interval.denominator = choice.denominator;
+	LOGD("request %s,sz(%dx%d),interval=%u/%u",
+		V4L2_PIX_FMT_to_string(choice.pixel_format).c_str(),
+		choice.width, choice.height, choice.numerator, choice.denominator);
+	// 解像度変更と同じ処理で映像ストリームを再初期化する
+	request_resize = true;
+	if (reactor) {
+		reactor->wakeup();
+	}
 
-		LOGD("VIDIOC_QUERYBUF:%d", i);
-		if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
-			result = -errno;
-			LOGE("VIDIOC_QUERYBUF,err=%d", result);
-			break;
+	EXIT();
+}
+
+/**
+ * request_intervalが指定されていればフレーム間隔をセット(VIDIOC_S_PARM)して
+ * 実際のフレーム間隔からstream_fpsを更新する
+ */
+/*private*/
+void V4l2SourceBase::update_frame_interval_locked() {
+	ENTER();
+
+	struct v4l2_streamparm param {
+		.type = m_buf_type,
+	};
+	if (request_interval.numerator && request_interval.denominator) {
+		param.parm.capture.timeperframe = request_interval;
+		if (xioctl(m_fd, VIDIOC_S_PARM, &param) == -1) {
+			LOGW("VIDIOC_S_PARM,errno=%d", errno);
 		}
+	}
+	if (!xioctl(m_fd, VIDIOC_G_PARM, &param)) {
+		const auto &interval = param.parm.capture.timeperframe;
+		stream_fps = interval.numerator
+			? (float)interval.denominator / (float)interval.numerator : 0.0f;
+		LOGD("interval=%u/%u,fps=%5.2f", interval.numerator, interval.denominator, stream_fps);
+	}
 
-		image_size = MAX(image_size, buf.length);
+	EXIT();
+}
 
-		LOGD("buf:index=%d,type=%d,used=%d,flags=0x%08x,field=0x%08x,seq=%d,mem=%d,m=%lu,len=%d",
-			buf.index, buf.type, buf.bytesused, buf.flags, buf.field, buf.sequence,
-			buf.memory, buf.m.userptr, buf.length);
+/**
+ * device_zoom_requestの拡大率をv4l2機器側で適用してdevice_zoomを更新する
+ * v4l2_lockをロックした状態で呼び出すこと
+ * @return 0: v4l2機器側で拡大した, 0以外: v4l2機器側では拡大しなかった
+ */
+/*private*/
+int V4l2SourceBase::apply_device_zoom_locked() {
+	ENTER();
+
+	// 縮小はv4l2機器側では行わない
+	const float factor = std::max(device_zoom_request, 1.0f);
+	if ((factor <= 1.0f)
+		&& ((device_zoom_method <= DEVICE_ZOOM_NONE) || (device_zoom.load() <= 1.0f))) {
+		// 等倍で拡大もしていないときはv4l2機器側の設定を変更しない
+		// (V4L2_CID_ZOOM_ABSOLUTEの値を保存してある設定値から変えないようにするため)
+		device_zoom = 1.0f;
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
 	}
-	if (result || !image_size) {
-		LOGE("Failed to get image size");
+
+	int result = core::USB_ERROR_NOT_SUPPORTED;
+	float applied = 1.0f;
+	switch (device_zoom_method) {
+	case DEVICE_ZOOM_UNKNOWN:
+		// 初めて拡大するときは切り出し、V4L2_CID_ZOOM_ABSOLUTEの順に試す
+		if (!set_crop_locked(factor, applied)) {
+			device_zoom_method = DEVICE_ZOOM_CROP;
+			result = core::USB_SUCCESS;
+		} else if (!set_zoom_ctrl_locked(factor, applied)) {
+			device_zoom_method = DEVICE_ZOOM_CTRL;
+			result = core::USB_SUCCESS;
+		} else {
+			LOGI("device zoom not supported, fallback to gpu zoom");
+			device_zoom_method = DEVICE_ZOOM_NONE;
+		}
+		LOGD("device_zoom_method=%d", device_zoom_method);
+		break;
+	case DEVICE_ZOOM_CROP:
+		result = set_crop_locked(factor, applied);
+		break;
+	case DEVICE_ZOOM_CTRL:
+		result = set_zoom_ctrl_locked(factor, applied);
+		break;
+	default:
+		break;
+	}
+	device_zoom = !result ? applied : 1.0f;
+	LOGD("factor=%f,device_zoom=%f", factor, device_zoom.load());
+
+	RETURN(result, int);
+}
+
+/**
+ * VIDIOC_S_SELECTION(V4L2_SEL_TGT_CROP)で中央部分を切り出して拡大する
+ * v4l2_lockをロックした状態で呼び出すこと
+ * @param factor 拡大率
+ * @param applied 実際に適用された拡大率
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::set_crop_locked(const float &factor, float &applied) {
+	ENTER();
+
+	// マルチプレーンでもv4l2_selection.typeはV4L2_BUF_TYPE_VIDEO_CAPTUREを使う
+	struct v4l2_selection sel {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.target = V4L2_SEL_TGT_CROP_DEFAULT,
+	};
+	if (xioctl(m_fd, VIDIOC_G_SELECTION, &sel) == -1) {
+		const int result = -errno;
+		LOGD("VIDIOC_G_SELECTION,errno=%d", -result);
 		RETURN(result, int);
 	}
-	// DMA転送できるようにページサイズの倍数になるように調整する
-	const auto offset = ceil3(image_size, sysconf(_SC_PAGE_SIZE));
-	LOGD("image_size=%d,offset=%d", image_size, offset);
-	for (int i = 0; i < req.count; i++) {
-		m_buffers[i].length = image_size;
-		m_buffers[i].offset = i * offset;
-		m_buffers[i].start = mmap(nullptr /* start anywhere */, image_size,
-			PROT_READ | PROT_WRITE /* required */,
-			MAP_SHARED /* recommended */, m_udmabuf_fd, (off_t)(i * offset));
-		if (m_buffers[i].start == MAP_FAILED) {
-			result = -errno;
-			LOGE("mmap,err=%d", result);
-			break;
-		}
-		m_buffers[i].fd = m_udmabuf_fd;
-		// 物理メモリーを割り当てるためにゼロクリアする
-		// memsetではだめらしい
-		{
-			auto word_ptr = (uint8_t *)m_buffers[i].start;
-			for (int j = 0; j < offset; j++) {
-				word_ptr[j] = 0;
-			}
-		}
+	const struct v4l2_rect def = sel.r;
+	const auto width = std::max((uint32_t)(def.width / factor) & ~1u, 2u);
+	const auto height = std::max((uint32_t)(def.height / factor) & ~1u, 2u);
+	sel.target = V4L2_SEL_TGT_CROP;
+	sel.r.left = def.left + (int32_t)(def.width - width) / 2;
+	sel.r.top = def.top + (int32_t)(def.height - height) / 2;
+	sel.r.width = width;
+	sel.r.height = height;
+	if (xioctl(m_fd, VIDIOC_S_SELECTION, &sel) == -1) {
+		const int result = -errno;
+		LOGD("VIDIOC_S_SELECTION,errno=%d", -result);
+		RETURN(result, int);
+	}
+	// スケーラーが無く切り出した範囲がそのまま出力解像度になるv4l2機器は
+	// 映像ストリームを作り直さないといけないので使わない
+	// (出力解像度は変わらないので転送量は減らない, センサーの画素を使って拡大する分画質が良くなるだけ)
+	struct v4l2_format fmt{};
+	fmt.type = m_buf_type;
+	const bool fmt_ok = (xioctl(m_fd, VIDIOC_G_FMT, &fmt) != -1)
+		&& (is_mplane()
+			? (fmt.fmt.pix_mp.width == stream_width) && (fmt.fmt.pix_mp.height == stream_height)
+			: (fmt.fmt.pix.width == stream_width) && (fmt.fmt.pix.height == stream_height));
+	if (UNLIKELY(!fmt_ok)) {
+		LOGW("cropping changes output size, restore default");
+		sel.r = def;
+		xioctl(m_fd, VIDIOC_S_SELECTION, &sel);
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	// ドライバーが切り出し範囲を調整したときは実際の範囲から拡大率を求める
+	applied = sel.r.width ? (float)def.width / (float)sel.r.width : 1.0f;
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * V4L2_CID_ZOOM_ABSOLUTEで拡大する
+ * v4l2_lockをロックした状態で呼び出すこと
+ * @param factor 拡大率
+ * @param applied 実際に適用された拡大率
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::set_zoom_ctrl_locked(const float &factor, float &applied) {
+	ENTER();
+
+	auto query = supported.find(V4L2_CID_ZOOM_ABSOLUTE) != supported.end()
+		? supported[V4L2_CID_ZOOM_ABSOLUTE] : nullptr;
+	// UVC機器は最小値を等倍(100等)とするものが多いので最小値との比を拡大率とみなす
+	if (!query || (query->minimum <= 0) || (query->maximum <= query->minimum)) {
+		RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+	}
+	const int32_t value = std::min(std::max(
+		(int32_t)lroundf((float)query->minimum * factor), query->minimum), query->maximum);
+	const int result = set_ctrl_value_locked(V4L2_CID_ZOOM_ABSOLUTE, value);
+	if (!result) {
+		applied = (float)value / (float)query->minimum;
 	}
 
 	RETURN(result, int);
 }
 
 /**
- * V4L2_MEMORY_DMABUFまたはV4L2_MEMORY_MMAPを使うとき
- * init_mmap_lockedの下請け
- * @param req
-*/
-int V4l2SourceBase::init_mmap_udmabuf_other(struct v4l2_requestbuffers &req) {
+ * 指定したインデックスのバッファーをキューへ入れる(VIDIOC_QBUF)
+ * @param index
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::queue_buffer_locked(const uint32_t &index) {
 	ENTER();
 
-	int result = 0;
-	// カメラドライバー側でメモリーを確保するとき
-	req.memory = (req.capabilities & V4L2_BUF_CAP_SUPPORTS_DMABUF)
-		? V4L2_MEMORY_DMABUF : (req.capabilities & V4L2_BUF_CAP_SUPPORTS_MMAP ? V4L2_MEMORY_MMAP : 0);
-	LOGD("num=%d,capabilities=0x%08x,mem=%d", req.count, req.capabilities, req.memory);
+	const uint32_t memory = m_memory;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+	struct v4l2_buffer buf{};
+	init_v4l2_buffer(buf, planes);
+	if (memory == V4L2_MEMORY_USERPTR) {
+		// buffer must be casted to unsigned long type in order to assign it to V4L2 buffer
+		buf.m.userptr = reinterpret_cast<unsigned long>(m_buffers[index].start);
+		buf.length = m_buffers[index].length;
+	} else if (memory == V4L2_MEMORY_DMABUF) {
+		buf.m.fd = m_buffers[index].fd;
+		buf.length = m_buffers[index].length;
+	}
+	buf.index = index;
+	if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+		const int result = -errno;
+		LOGE("VIDIOC_QBUF: errno=%d", -result);
+		RETURN(result, int);
+	}
 
-	for (uint32_t i = 0; i < req.count; i++) {
-		struct v4l2_buffer buf {
-			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			.memory = req.memory,
-		};
-		buf.index = i;
+	RETURN(core::USB_SUCCESS, int);
+}
 
-		LOGD("VIDIOC_QUERYBUF:%d", i);
-		if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
-			result = -errno;
-			LOGE("VIDIOC_QUERYBUF,err=%d", result);
-			break;
+/**
+ * m_buffersの要素からインデックスを取得する
+ * @param buf
+ * @return m_buffersの要素でなければ-1
+ */
+/*private*/
+int V4l2SourceBase::buffer_index_locked(const buffer_t &buf) const {
+	if (m_buffers && (&buf >= m_buffers) && (&buf < m_buffers + m_buffersNums)) {
+		return (int)(&buf - m_buffers);
+	}
+	return -1;
+}
+
+/**
+ * on_frame_readyで受け取ったバッファーをコールバックから戻った後も保持する
+ * @param buf on_frame_readyの引数
+ * @return true: 保持した, false: 保持できなかった
+ */
+/*public*/
+bool V4l2SourceBase::retain_buffer(const buffer_t &buf) {
+	ENTER();
+
+	AutoMutex lock(v4l2_lock);
+	const int index = buffer_index_locked(buf);
+	// on_frame_readyの呼び出し中のバッファーで
+	// v4l2機器側にMIN_QUEUED_BUFFERS個以上のバッファーが残るときだけ保持を許可する
+	if ((m_state == STATE_STREAM) && (index >= 0) && (index == delivering_index)
+		&& !retained[index]
+		&& (m_buffersNums >= retained_nums + 1 + MIN_QUEUED_BUFFERS)) {
+
+		retained[index] = true;
+		retained_nums++;
+		RETURN(true, bool);
+	}
+
+	RETURN(false, bool);
+}
+
+/**
+ * retain_bufferで保持したバッファーをv4l2機器へ返却する
+ * @param buf retain_bufferの引数
+ * @return
+ */
+/*public*/
+int V4l2SourceBase::release_buffer(const buffer_t &buf) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_PARAM;
+
+	AutoMutex lock(v4l2_lock);
+	const int index = buffer_index_locked(buf);
+	if (UNLIKELY((index < 0) && release_orphan_buffer_locked(buf))) {
+		// 映像受け取りバッファーは開放済みなので遅延していたmunmapだけを行う
+		retained_sync.broadcast();
+		RETURN(core::USB_SUCCESS, int);
+	}
+	if (LIKELY((index >= 0) && (index < (int)retained.size()) && retained[index])) {
+		retained[index] = false;
+		if (LIKELY(retained_nums > 0)) {
+			retained_nums--;
+		}
+		result = core::USB_SUCCESS;
+		// on_frame_readyの呼び出し中ならdequeue_frameでキューへ戻す
+		// ストリーム停止後はVIDIOC_STREAMOFFでv4l2機器側のキューがクリアされているので返却しない
+		if ((index != delivering_index) && (m_state == STATE_STREAM)) {
+			result = queue_buffer_locked(index);
 		}
+		retained_sync.broadcast();
+	}
 
-		m_buffers[i].length = buf.length;
-		m_buffers[i].offset = buf.m.offset;
-		m_buffers[i].start = mmap(nullptr /* start anywhere */, buf.length,
-			PROT_READ | PROT_WRITE /* required */,
-			MAP_SHARED /* recommended */, m_fd, (off_t)buf.m.offset);
+	RETURN(result, int);
+}
 
-		if (m_buffers[i].start == MAP_FAILED) {
-			result = -errno;
-			LOGE("mmap,err=%d", result);
+/**
+ * retain_bufferで保持されたバッファーが全て返却されるまで待機する
+ * @return 0: 全て返却された, 0以外: タイムアウト
+ */
+/*private*/
+int V4l2SourceBase::wait_retained_buffers_locked() {
+	ENTER();
+
+	int result = core::USB_SUCCESS;
+	if ((retained_nums > 0) && on_release_request) {
+		// 保持している側(V4l2FrameSync等)がrelease_bufferを呼べるようにロックを開放してから返却を要求する
+		auto callback = on_release_request;
+		v4l2_lock.unlock();
+		callback();
+		v4l2_lock.lock();
+	}
+	const nsecs_t deadline = systemTime() + MAX_WAIT_RETAINED_BUFFERS_NS;
+	for ( ; retained_nums > 0 ; ) {
+		const nsecs_t remain = deadline - systemTime();
+		if (remain <= 0) {
+			// 保持されたままのバッファーはキューへ戻さず、munmapもしない
+			LOGW("timeout waiting retained buffers,retained_nums=%d", retained_nums);
+			result = core::USB_ERROR_TIMEOUT;
 			break;
 		}
+		retained_sync.waitRelative(v4l2_lock, remain);
 	}
 
 	RETURN(result, int);
 }
 
 /**
- * @brief 対応しているピクセルフォーマット一覧を取得する
- *
- * @return std::vector
+ * 返却待ちがタイムアウトしたまま開放した映像受け取りバッファーの返却処理
+ * @param buf retain_bufferの引数
+ * @return true: 開放済みのバッファーだった, false: 開放済みのバッファーではない
  */
 /*private*/
-std::vector<uint32_t> V4l2SourceBase::get_supported_pixel_formats_locked(const std::vector<uint32_t> preffered) const {
+bool V4l2SourceBase::release_orphan_buffer_locked(const buffer_t &buf) {
 	ENTER();
 
-	std::vector<uint32_t> result;
-	if (m_state > STATE_CLOSE) {
-		int r = 0;
-		for (int i = 0 ; (r != -1); i++) {
-			struct v4l2_fmtdesc fmt {
-				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-			};
-			fmt.index = i;
-			r = xioctl(m_fd, VIDIOC_ENUM_FMT, &fmt);
-			if (r != -1) {
-				const auto pixel_format = fmt.pixelformat;
-				LOGD("%i)0x%08x=%s(%s)", fmt.index,
-					pixel_format, V4L2_PIX_FMT_to_string(pixel_format).c_str(),
-					fmt.description);
-				if (preffered.empty() || (find(preffered.begin(), preffered.end(), pixel_format) != preffered.end())) {
-					result.push_back(pixel_format);
-				}
-			}
+	for (auto itr = orphan_buffers.begin(); itr != orphan_buffers.end(); itr++) {
+		auto &orphan = *itr;
+		if ((&buf < orphan.buffers) || (&buf >= orphan.buffers + orphan.nums)) {
+			continue;
 		}
+		const auto index = (uint32_t)(&buf - orphan.buffers);
+		if (orphan.retained[index]) {
+			release_buffer_memory(orphan.buffers[index], orphan.mplane, orphan.memory);
+			orphan.retained[index] = false;
+			orphan.retained_nums--;
+		}
+		if (!orphan.retained_nums) {
+			delete [] orphan.buffers;
+			orphan_buffers.erase(itr);
+		}
+		RETURN(true, bool);
 	}
-	LOGD("num pixel formast=%" FMT_SIZE_T, result.size());
 
-	RET(result);
+	RETURN(false, bool);
 }
 
 /**
- * 実際の解像度変更処理、ワーカースレッド上で実行される
- * @param width
- * @param height
- * @param pixel_format V4L2_PIX_FMT_XXX
+ * retain_bufferで保持したバッファーの返却を要求するコールバックをセットする
+ * @param callback
+ */
+/*public*/
+void V4l2SourceBase::set_on_release_request(OnReleaseRequestFunc callback) {
+	AutoMutex lock(v4l2_lock);
+	on_release_request = std::move(callback);
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * V4l2Reactorへ登録されたときの処理
+ * IV4l2ReactorClientの純粋仮想関数を実装
  * @return
  */
 /*private*/
-int V4l2SourceBase::handle_resize(
-	const uint32_t &width, const uint32_t &height,
-	const uint32_t &pixel_format) {
+int V4l2SourceBase::on_reactor_attach() {
+	ENTER();
+
+	LOGD("V4l2Reactor上で映像取得開始");
+	int result = internal_start_stream(reactor_buf_nums);
 
+	RETURN(result, int);
+}
+
+/**
+ * v4l2機器が読み込み可能になったときの処理
+ * エッジトリガーで監視しているのでVIDIOC_DQBUFがEAGAINを返すまで映像データを取り出す
+ * IV4l2ReactorClientの純粋仮想関数を実装
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::on_reactor_ready() {
 	ENTER();
-	LOGD("sz(%dx%d)@0x%08x", width, height, pixel_format);
 
-	state_t prevState = m_state;
-	int result = stop_stream_locked();	// state == STATE_INIT/STATE_OPEN
-	if (LIKELY(!result)) {
-		const uint32_t cur_width = stream_width ? stream_width : width;
-		const uint32_t cur_height = stream_height ? stream_height : height;
-		const uint32_t cur_pixel_format = stream_pixel_format ? stream_pixel_format : pixel_format;
-		result = release_mmap_locked();	// state == STATE_OPEN
-		if (LIKELY(!result)) {
-			// 解像度・ピクセルフォーマットをセット
-			result = init_v4l2_locked(m_buffersNums, width, height, pixel_format);
-			if (result) {
-				LOGD("以前の解像度・ピクセルフォーマットへ戻す,sz(%dx%d)@0x%08x",
-					cur_width, cur_height, cur_pixel_format);
-				result = init_v4l2_locked(m_buffersNums, cur_width, cur_height, cur_pixel_format);
-			}
-		}
-		if (LIKELY(!result)) {
-			m_state = STATE_INIT;
-			switch (prevState) {
-			case STATE_OPEN:	// 初回
-			case STATE_INIT:	// 2回目以降
-				break;			// 何もしない
-			case STATE_STREAM:
-				start_stream_locked();
-				break;
-			default:
-				break;
-			}
+	int result = core::USB_SUCCESS;
+	// EIOが続いたときに抜けられなくなるのを防ぐため取り出す回数を制限する
+	const uint32_t max_nums = m_buffersNums * 2 + 1;
+	for (uint32_t i = 0; i < max_nums; i++) {
+		int frame_result = 0;
+		const int r = dequeue_frame(frame_result);
+		if (r == -EAGAIN) {
+			break;
+		} else if (UNLIKELY(r && (r != -EIO))) {
+			result = r;
+			break;
 		}
 	}
 
@@ -1062,81 +3172,55 @@ int V4l2SourceBase::handle_resize(
 }
 
 /**
- * 映像データの処理
- * 映像データがないときはmax_wait_frame_usで指定した時間待機する
- * ワーカースレッド上で呼ばれる
- * @param max_wait_frame_us 最大映像待ち時間[マイクロ秒]
- * @return int 負:エラー 0以上:読み込んだデータバイト数
+ * V4l2Reactor::wakeupが呼ばれたときの処理
+ * IV4l2ReactorClientの純粋仮想関数を実装
+ * @return
  */
 /*private*/
-int V4l2SourceBase::handle_frame(const suseconds_t &max_wait_frame_us) {
-
+int V4l2SourceBase::on_reactor_wakeup() {
 	ENTER();
 
-	struct timeval tv {
-		.tv_sec = 0,
-	 	.tv_usec = max_wait_frame_us,
-	};
+	int result = handle_request();
 
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(m_fd, &fds);
-	/* Timeout. */
-	// 映像データが準備できるまで待機
-	int result = select(m_fd + 1, &fds, nullptr, nullptr, &tv);
-	if (result < 0) {
-		// selectがエラーを返した時
-		result = -errno;
-		if (EINTR != errno) {
-			// 中断以外のエラーの場合はログ出力
-			LOGE("select:errno=%d", -result);
-		}
-	} else {
-		// 映像データの準備ができたかタイムアウトした時
-		if (FD_ISSET(m_fd, &fds)) {
-			// 映像データの処理
-			const uint32_t memory = (m_udmabuf_fd ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP);
-			struct v4l2_buffer buf {
-				.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
-				.memory = memory,
-			};
+	RETURN(result, int);
+}
 
-			// 映像の入ったバッファを取得
-			int result = xioctl(m_fd, VIDIOC_DQBUF, &buf);
-			if (result >= 0) {
-				// バッファを取得できた時
-				if (buf.index < m_buffersNums) {
-					result = on_frame_ready(m_buffers[buf.index], buf.bytesused);
-				}
-				// 読み込み終わったバッファをキューに追加
-				if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
-					result = -errno;
-					LOGE("VIDIOC_QBUF: errno=%d", -result);
-				}
-			} else {
-				// バッファを取得できなかったとき
-				result = -errno;
-				switch (errno) {
-				case EAGAIN:
-					// 映像データが準備出来てない
-					result = 0;
-					break;
-				case EIO:
-					/* Could ignore EIO, see spec. */
-					/* fall through */
-				default:
-					LOGE("VIDIOC_DQBUF: errno=%d", -result);
-				}
-			}
-		} else {
-			// EAGAIN(タイムアウト)
-			result = 0;
-		}
+/**
+ * v4l2機器にイベントが届いたときの処理
+ * IV4l2ReactorClientの仮想関数を実装
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::on_reactor_event() {
+	ENTER();
+
+	int result = handle_events();
+	if (!result && request_resize) {
+		// 入力ソースの解像度が変わったときはV4l2Reactorのワーカースレッド上でネゴシエーションし直す
+		result = handle_request();
 	}
 
 	RETURN(result, int);
 }
 
+/**
+ * V4l2Reactorから登録解除されたときの処理
+ * IV4l2ReactorClientの純粋仮想関数を実装
+ * @param error
+ */
+/*private*/
+void V4l2SourceBase::on_reactor_detach(const bool &error) {
+	ENTER();
+
+	LOGD("V4l2Reactor上での映像取得終了,error=%d", error);
+	if (error) {
+		on_error();
+	}
+	internal_finish_stream();
+
+	EXIT();
+}
+
 //--------------------------------------------------------------------------------
 /**
  * ctrl_idで指定したコントロール機能に対応しているかどうかを取得
@@ -1146,6 +3230,10 @@ int V4l2SourceBase::handle_frame(const suseconds_t &max_wait_frame_us) {
  */
 /*public*/
 bool V4l2SourceBase::is_ctrl_supported(const uint32_t &ctrl_id) {
+	// キャッシュにあればUSBの制御転送中でもv4l2_lockを待たずに返す
+	if (has_ctrl_cache(ctrl_id)) {
+		return true;
+	}
 	AutoMutex lock(v4l2_lock);
 	return supported.find(ctrl_id) != supported.end();
 }
@@ -1163,6 +3251,30 @@ QueryCtrlSp V4l2SourceBase::get_ctrl(const uint32_t &ctrl_id) {
 		? supported[ctrl_id] : nullptr;
 }
 
+/**
+ * 映像サイズとピクセルフォーマットをセットする
+ * v4l2機器を使わずに映像を供給する派生クラスでget_frame_type/get_pixel_formatが
+ * 正しい値を返すようにするために使う
+ * @param width
+ * @param height
+ * @param pixel_format V4L2_PIX_FMT_XXX
+ */
+/*protected*/
+void V4l2SourceBase::set_stream_format(
+	const uint32_t &width, const uint32_t &height,
+	const uint32_t &pixel_format) {
+
+	ENTER();
+
+	AutoMutex lock(v4l2_lock);
+	stream_width = width;
+	stream_height = height;
+	stream_pixel_format = pixel_format;
+	stream_frame_type = V4L2_PIX_FMT_to_raw_frame(pixel_format);
+
+	EXIT();
+}
+
 /**
  * 最小値/最大値/ステップ値/デフォルト値/現在値を取得する
  * @param ctrl_id
@@ -1176,6 +3288,12 @@ int V4l2SourceBase::get_ctrl(
 
 	ENTER();
 
+	// キャッシュが有効ならv4l2機器へ問い合わせない
+	if (!get_ctrl_cache(ctrl_id, values)) {
+		RETURN(core::USB_SUCCESS, int);
+	}
+	// 書き込み待ちの設定値があれば書き込んでから読み込む
+	ctrl_writer.flush();
 	AutoMutex lock(v4l2_lock);
 	int result = core::USB_ERROR_NOT_SUPPORTED;
 
@@ -1195,6 +3313,9 @@ int V4l2SourceBase::get_ctrl(
 		result = xioctl(m_fd, VIDIOC_G_CTRL, &ctrl);
 		if (!result) {
 			values.current = ctrl.value;
+			update_ctrl_cache(values);
+		} else if (errno == EINVAL) {
+			validate_ctrl_locked(ctrl_id);
 		}
 	}
 
@@ -1212,20 +3333,10 @@ int V4l2SourceBase::get_ctrl(
 int V4l2SourceBase::get_ctrl_value(const uint32_t &ctrl_id, int32_t &value) {
 	ENTER();
 
-	AutoMutex lock(v4l2_lock);
-	int result = core::USB_ERROR_NOT_SUPPORTED;
-
-	value = 0;
-	if (supported.find(ctrl_id) != supported.end()) {
-		// 現在の設定値を取得
-		struct v4l2_control ctrl {
-			.id = ctrl_id,
-		};
-		result = xioctl(m_fd, VIDIOC_G_CTRL, &ctrl);
-		if (!result) {
-			value = ctrl.value;
-		}
-	}
+	// キャッシュが無効なときはget_ctrlでv4l2機器から取得してキャッシュを更新する
+	uvc::control_value32_t values{};
+	const int result = get_ctrl(ctrl_id, values);
+	value = !result ? values.current : 0;
 
 	RETURN(result, int);
 }
@@ -1241,7 +3352,109 @@ int V4l2SourceBase::get_ctrl_value(const uint32_t &ctrl_id, int32_t &value) {
 int V4l2SourceBase::set_ctrl_value(const uint32_t &ctrl_id, const int32_t &value) {
 	ENTER();
 
+	// 先に要求された書き込みで上書きされないように書き込み待ちの設定値を書き込んでおく
+	ctrl_writer.flush();
+	AutoMutex lock(v4l2_lock);
+	int result = set_ctrl_value_locked(ctrl_id, value);
+
+	RETURN(result, int);
+}
+
+/**
+ * ctrl_idで指定したコントロール機能へ値を設定するようにワーカースレッドへ要求する
+ * v4l2機器をオープンしているときのみ有効
+ * @param ctrl_id
+ * @param value
+ * @return 0: 要求を受け付けた, 0以外: v4l2機器をオープンしていない
+ */
+/*public*/
+int V4l2SourceBase::post_ctrl_value(const uint32_t &ctrl_id, const int32_t &value) {
+	ENTER();
+
+	// v4l2_lockはctrl_writerのワーカースレッドが書き込み中に保持するのでここではロックしない
+	const int result = ctrl_writer.post(ctrl_id, value);
+	if (!result) {
+		// 書き込み前でも要求した値を読み込めるようにキャッシュを更新しておく
+		// 書き込みに失敗したときはwrite_ctrlsでキャッシュを無効にする
+		update_ctrl_cache(ctrl_id, value);
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * post_ctrl_valueで要求した設定値が全て書き込まれるまで待機する
+ * @return
+ */
+/*public*/
+int V4l2SourceBase::flush_ctrls() {
+	ENTER();
+
+	const int result = ctrl_writer.flush();
+
+	RETURN(result, int);
+}
+
+/**
+ * ctrl_writerでまとめたコントロール機能の設定値をVIDIOC_S_EXT_CTRLSで書き込む
+ * VIDIOC_S_EXT_CTRLSがエラーになったときは1つずつVIDIOC_S_CTRLで書き込む
+ * ctrl_writerのワーカースレッド上で呼ばれる
+ * @param ctrls
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::write_ctrls(std::vector<struct v4l2_ext_control> &ctrls) {
+	ENTER();
+
+	int result = core::USB_ERROR_INVALID_STATE;
+
 	AutoMutex lock(v4l2_lock);
+	if (m_fd && (m_state > STATE_CLOSE)) {
+		// 対応していないコントロール機能は除く
+		ctrls.erase(std::remove_if(ctrls.begin(), ctrls.end(),
+			[this](const struct v4l2_ext_control &ctrl) {
+				return supported.find(ctrl.id) == supported.end();
+			}), ctrls.end());
+		result = core::USB_SUCCESS;
+		if (!ctrls.empty()) {
+			struct v4l2_ext_controls ext_ctrls{};
+			ext_ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+			ext_ctrls.count = ctrls.size();
+			ext_ctrls.controls = ctrls.data();
+			if (!xioctl(m_fd, VIDIOC_S_EXT_CTRLS, &ext_ctrls)) {
+				// ドライバーがクランプした値が書き戻されるのでキャッシュを更新する
+				for (const auto &ctrl: ctrls) {
+					update_ctrl_cache(ctrl.id, ctrl.value);
+				}
+			} else {
+				// VIDIOC_S_EXT_CTRLSに対応していないドライバーや
+				// 範囲外の値でエラーになったときは1つずつ書き込む
+				LOGD("VIDIOC_S_EXT_CTRLS failed,errno=%d,error_idx=%u", errno, ext_ctrls.error_idx);
+				for (const auto &ctrl: ctrls) {
+					const int r = set_ctrl_value_locked(ctrl.id, ctrl.value);
+					if (r) {
+						LOGW("failed to set ctrl 0x%08x,value=%d", ctrl.id, ctrl.value);
+						result = r;
+					}
+				}
+			}
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * ctrl_idで指定したコントロール機能へ値を設定する
+ * v4l2_lockをロックした状態で呼び出すこと
+ * @param ctrl_id
+ * @param value
+ * @return
+ */
+/*private*/
+int V4l2SourceBase::set_ctrl_value_locked(const uint32_t &ctrl_id, const int32_t &value) {
+	ENTER();
+
 	int result = core::USB_ERROR_NOT_SUPPORTED;
 
 	if (supported.find(ctrl_id) != supported.end()) {
@@ -1251,9 +3464,19 @@ int V4l2SourceBase::set_ctrl_value(const uint32_t &ctrl_id, const int32_t &value
 			.value = value,
 		};
 		result = xioctl(m_fd, VIDIOC_S_CTRL, &ctrl);
-		if (result && (errno == ERANGE)) {
+		if (!result) {
+			// ドライバーがクランプした値が書き戻されるのでキャッシュを更新する
+			update_ctrl_cache(ctrl_id, ctrl.value);
+		} else if (errno == ERANGE) {
 			// ドライバー側で値をクランプしたときは正常終了とする
+			// 実際に設定された値がわからないのでキャッシュを無効にする
+			invalidate_ctrl_cache(ctrl_id);
 			result = core::USB_SUCCESS;
+		} else {
+			invalidate_ctrl_cache(ctrl_id);
+			if (errno == EINVAL) {
+				validate_ctrl_locked(ctrl_id);
+			}
 		}
 	}
 
@@ -1371,7 +3594,8 @@ int V4l2Source::on_frame_ready(const buffer_t &buf, const size_t &bytes) {
 
 	int result = -1;
 	if (LIKELY(on_frame_ready_callbac)) {
-		const auto image = (const uint8_t *)buf.start;
+		// CPUからアクセスできないバッファーのときはnullptrを渡す
+		const auto image = buf.start != MAP_FAILED ? (const uint8_t *)buf.start : nullptr;
 		result = on_frame_ready_callbac(image, bytes, buf);
 	}
 
@@ -1380,4 +3604,38 @@ int V4l2Source::on_frame_ready(const buffer_t &buf, const size_t &bytes) {
 	RETURN(result, int);
 }
 
+/**
+ * @brief コントロール機能がv4l2機器側で変更されたときの処理, V4l2SourceBaseの純粋仮想関数を実装
+ *        ワーカースレッド上で呼ばれる
+ *
+ * @param values
+ */
+/*protected*/
+void V4l2Source::on_ctrl_changed(const uvc::control_value32_t &values) {
+	ENTER();
+
+	if (on_ctrl_changed_callback) {
+		on_ctrl_changed_callback(values);
+	}
+
+	EXIT();
+}
+
+/**
+ * @brief 入力ソースが変更されたときの処理, V4l2SourceBaseの純粋仮想関数を実装
+ *        ワーカースレッド上で呼ばれる
+ *
+ * @param changes
+ */
+/*protected*/
+void V4l2Source::on_source_changed(const uint32_t &changes) {
+	ENTER();
+
+	if (on_source_changed_callback) {
+		on_source_changed_callback(changes);
+	}
+
+	EXIT();
+}
+
 }	// namespace serenegiant::v4l2
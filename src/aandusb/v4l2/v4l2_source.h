@@ -8,6 +8,7 @@
 #ifndef AANDUSB_V4L2_SOURCE_H
 #define AANDUSB_V4L2_SOURCE_H
 
+#include <atomic>
 #include <functional>
 #include <stddef.h>
 #include <string>
@@ -18,9 +19,14 @@
 // common
 #include "mutex.h"
 #include "condition.h"
+#include "thread_sched.h"
 // v4l2
 #include "v4l2/v4l2.h"
+#include "v4l2/v4l2_cap_cache.h"
 #include "v4l2/v4l2_ctrl.h"
+#include "v4l2/v4l2_ctrl_writer.h"
+#include "v4l2/v4l2_reactor.h"
+#include "v4l2/v4l2_uvc_meta.h"
 
 namespace uvc = serenegiant::usb::uvc;
 
@@ -35,15 +41,107 @@ namespace serenegiant::v4l2 {
  * 映像データ受け取り用バッファーの個数
  */
 #define DEFAULT_BUFFER_NUMS (4)
+/**
+ * バッファー数を自動調整するときの最小値のデフォルト値
+ */
+#define DEFAULT_AUTO_BUFFER_NUMS_MIN (3)
+/**
+ * バッファー数を自動調整するときの最大値のデフォルト値
+ */
+#define DEFAULT_AUTO_BUFFER_NUMS_MAX (8)
+/**
+ * 映像取得フォーマットを自動選択するときの目標フレームレートのデフォルト値
+ */
+#define DEFAULT_AUTO_FORMAT_TARGET_FPS (30.0f)
+/**
+ * 映像が途切れたと判断するまでのフレーム間隔の倍数
+ * 復帰処理を行った後に映像が届かないまま同じ時間が経過すると次の段階の復帰処理を行う
+ */
+#define STALL_FRAME_INTERVALS (4)
+/**
+ * 映像が途切れたと判断するまでの最短時間[ナノ秒]
+ * フレームレートが不明なときもこの時間を使う
+ */
+#define STALL_DEFAULT_TIMEOUT_NS (500000000LL)
+/**
+ * VIDIOC_STREAMON後に最初の映像が届くまでの猶予時間[ナノ秒]
+ * 露出優先の自動露出で暗いときや起動直後の機器は最初の映像が遅れるため
+ */
+#define STALL_FIRST_FRAME_GRACE_NS (1500000000LL)
+
+/**
+ * retain_bufferで保持したバッファーの返却を要求するコールバック
+ * 映像取得終了・解像度変更・復帰処理等で映像受け取りバッファーを停止・再確保する前に
+ * v4l2_lockを開放した状態で呼ばれるので保持しているバッファーを速やかにrelease_bufferすること
+ */
+typedef std::function<void()> OnReleaseRequestFunc;
+
+/**
+ * retain_bufferで保持されたまま返却待ちがタイムアウトした映像受け取りバッファー
+ * 保持されたバッファーはmunmapせずにrelease_bufferされたときに開放する
+ */
+typedef struct _orphan_buffers {
+	/**
+	 * 開放した時のm_buffers, 保持されたバッファーが全て返却されるまで破棄しない
+	 */
+	buffer_t *buffers;
+	uint32_t nums;
+	/**
+	 * 開放した時のm_memory
+	 */
+	uint32_t memory;
+	bool mplane;
+	/**
+	 * まだrelease_bufferされていないバッファーかどうか, buffersと同じインデックスでアクセスする
+	 */
+	std::vector<bool> retained;
+	uint32_t retained_nums;
+} orphan_buffers_t;
 
 /**
  * @brief V4L2から映像を取得するためのヘルパークラス
  *
  */
-class V4l2SourceBase: public virtual V4L2Ctrl {
+class V4l2SourceBase: public virtual V4L2Ctrl, public IV4l2ReactorClient {
 private:
+	/**
+	 * v4l2機器側で拡大する方法
+	 */
+	typedef enum _device_zoom_method {
+		DEVICE_ZOOM_UNKNOWN = 0,	// まだ試していない
+		DEVICE_ZOOM_NONE,			// v4l2機器側では拡大できない
+		DEVICE_ZOOM_CROP,			// VIDIOC_S_SELECTION(V4L2_SEL_TGT_CROP)で切り出す
+		DEVICE_ZOOM_CTRL,			// V4L2_CID_ZOOM_ABSOLUTEで拡大する
+	} device_zoom_method_t;
+	/**
+	 * 映像取得フォーマットの自動選択で試行する候補
+	 */
+	typedef struct _probe_candidate {
+		stream_choice_t choice;
+		/**
+		 * 平均VIDIOC_DQBUF間隔と平均描画時間の合計[ナノ秒]
+		 */
+		nsecs_t latency;
+		/**
+		 * 実測フレームレート
+		 */
+		float fps;
+		/**
+		 * 試行して計測できたかどうか
+		 */
+		bool measured;
+		/**
+		 * フレーム落ちせずに目標フレームレートを維持できたかどうか
+		 */
+		bool sustained;
+	} probe_candidate_t;
+
 	// v4l2機器名
-	const std::string device_name;
+	/**
+	 * v4l2機器名
+	 * v4l2_lockで保護する
+	 */
+	std::string device_name;
 	// udmabufデバイスファイル名
 	const std::string udmabuf_name;
 	/**
@@ -69,6 +167,219 @@ private:
 	 * udmabufのファイルディスクリプタ
 	 */
 	int m_udmabuf_fd;
+	/**
+	 * udmabufのsysfs属性sync_for_cpu/sync_for_deviceのファイルディスクリプタ
+	 * 開けなければ0(キャッシュ同期しない)
+	 */
+	int m_udmabuf_sync_for_cpu;
+	int m_udmabuf_sync_for_device;
+	/**
+	 * V4L2_MEMORY_MMAPのときにVIDIOC_EXPBUFで各バッファーをdma-bufとしてエクスポートするかどうか
+	 */
+	bool export_dmabuf;
+	/**
+	 * V4L2_MEMORY_DMABUFで映像を受け取るときに使う呼び出し元が確保したdma-bufのファイルディスクリプタ
+	 * 空ならV4L2_MEMORY_DMABUFは使わない
+	 */
+	std::vector<int> dmabuf_fds;
+	/**
+	 * 呼び出し元が確保したdma-bufのサイズ, 0ならlseekで取得する
+	 */
+	size_t dmabuf_length;
+	/**
+	 * 実際に使っているメモリータイプ, V4L2_MEMORY_MMAP/V4L2_MEMORY_USERPTR/V4L2_MEMORY_DMABUF
+	 */
+	uint32_t m_memory;
+	/**
+	 * 映像取得に使うバッファータイプ
+	 * V4L2_BUF_TYPE_VIDEO_CAPTURE/V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+	 * v4l2機器をオープンしたときにVIDIOC_QUERYCAPで決める
+	 */
+	uint32_t m_buf_type;
+	/**
+	 * 準備できている映像を全て取り出して最新の映像だけをon_frame_readyへ渡すかどうか
+	 */
+	volatile bool latest_only;
+	/**
+	 * latest_only=trueのときに最新の映像ではないためにon_frame_readyへ渡さずに読み飛ばした映像の数
+	 */
+	std::atomic<uint64_t> skipped_frames;
+	/**
+	 * 前回VIDIOC_DQBUFしたときのv4l2_buffer.sequence, 負なら映像ストリーム開始後まだ取得していない
+	 */
+	int64_t last_sequence;
+	/**
+	 * v4l2_buffer.sequenceの欠番から求めたドライバー側で破棄されたフレーム数
+	 */
+	std::atomic<uint64_t> dropped_frames;
+	/**
+	 * 映像受け取りバッファー数を自動調整するかどうか
+	 */
+	volatile bool auto_buf_nums;
+	/**
+	 * 自動調整するときのバッファー数の範囲
+	 */
+	int min_buf_nums, max_buf_nums;
+	/**
+	 * 自動調整で要求するバッファー数, 0なら現在のバッファー数のまま
+	 * v4l2_lockで保護する
+	 */
+	int request_buf_nums;
+	/**
+	 * 自動調整の評価期間中に処理したフレーム数
+	 * 以下tune_xxxはワーカースレッドからのみアクセスする
+	 */
+	uint32_t tune_frames;
+	/**
+	 * 自動調整の評価期間中の映像取得(v4l2_buffer.timestamp)からVIDIOC_DQBUFまでの時間の合計[ナノ秒]
+	 */
+	nsecs_t tune_queue_latency;
+	/**
+	 * 自動調整の評価期間中のVIDIOC_DQBUFからon_frame_readyが戻る(描画完了)までの時間の合計[ナノ秒]
+	 */
+	nsecs_t tune_render_latency;
+	/**
+	 * 自動調整の評価期間の最初と最後のフレームのv4l2_buffer.timestamp[ナノ秒]
+	 */
+	nsecs_t tune_first_ts, tune_last_ts;
+	/**
+	 * 自動調整の評価期間開始時のdropped_frames
+	 */
+	uint64_t tune_dropped;
+	/**
+	 * 遅延が大きいがフレーム落ちしなかった評価期間が連続した数
+	 */
+	uint32_t tune_slow_windows;
+	/**
+	 * フレーム落ちしてバッファー数を増やしたときのバッファー数
+	 * 自動調整でこれより少なくすると再びフレーム落ちするので減らさない
+	 */
+	int tune_floor;
+	/**
+	 * 映像取得フォーマットを自動選択するかどうか
+	 */
+	volatile bool auto_format;
+	/**
+	 * 映像取得フォーマットを自動選択するときの目標フレームレート
+	 */
+	float target_fps;
+	/**
+	 * 映像取得フォーマットの自動選択を開始する必要があるかどうか
+	 * 映像ストリーム開始時にセットして最初のフレームを受け取ったときに候補を列挙する
+	 */
+	bool probe_pending;
+	/**
+	 * 試行中の候補のインデックス, 負なら試行中ではない
+	 * 以下probe_xxxはワーカースレッドからのみアクセスする
+	 */
+	int probe_index;
+	/**
+	 * 映像取得フォーマットの自動選択で試行する候補
+	 */
+	std::vector<probe_candidate_t> probe_candidates;
+	/**
+	 * 試行中の候補へ切り替えてから受け取ったフレーム数
+	 */
+	uint32_t probe_frames;
+	/**
+	 * 試行中の候補で前回VIDIOC_DQBUFした時刻[ナノ秒]
+	 */
+	nsecs_t probe_last_dequeued;
+	/**
+	 * 試行中の候補の評価期間中のVIDIOC_DQBUF間隔の合計[ナノ秒]
+	 */
+	nsecs_t probe_interval;
+	/**
+	 * 試行中の候補の評価期間中のVIDIOC_DQBUFからon_frame_readyが戻る(描画完了)までの時間の合計[ナノ秒]
+	 */
+	nsecs_t probe_render;
+	/**
+	 * 試行中の候補の評価期間開始時のdropped_frames
+	 */
+	uint64_t probe_dropped;
+	/**
+	 * 前回VIDIOC_DQBUFした時刻[ナノ秒]
+	 * last_dequeued/switch_startはワーカースレッドからのみアクセスする
+	 */
+	nsecs_t last_dequeued;
+	/**
+	 * 映像ストリームの再ネゴシエーションを開始する直前に映像を受け取った時刻[ナノ秒]
+	 * 0なら再ネゴシエーション後の最初の映像を待っていない
+	 */
+	nsecs_t switch_start;
+	/**
+	 * 最後に再ネゴシエーションしたときに映像が途切れた時間[ナノ秒]
+	 */
+	std::atomic<nsecs_t> switch_gap;
+	/**
+	 * 映像が途切れたときに自動で復帰処理するかどうか
+	 */
+	bool stall_detect;
+	/**
+	 * 映像が途切れたかどうかを判断する基準時刻[ナノ秒]
+	 * 最後に映像を受け取った時刻または最後に復帰処理を行った時刻
+	 * stall_base/stall_start/stall_levelはワーカースレッドからのみアクセスする
+	 */
+	nsecs_t stall_base;
+	/**
+	 * VIDIOC_STREAMON(または復帰処理)後の最初の映像を待っているかどうか
+	 * trueの間はSTALL_FIRST_FRAME_GRACE_NSまで待つ
+	 */
+	bool stall_first_frame;
+	/**
+	 * 実際に映像を受け取った間隔[ナノ秒], 最大値を保持しつつ徐々に減衰させる
+	 * 自動露出等でネゴシエーションしたフレームレートより遅くなっても途切れたと判断しないようにするため
+	 */
+	nsecs_t stall_interval;
+	/**
+	 * 映像が途切れる直前に映像を受け取った時刻[ナノ秒]
+	 * 0なら復帰処理中ではない
+	 */
+	nsecs_t stall_start;
+	/**
+	 * 最後に行った復帰処理の段階, 0なら復帰処理を行っていない
+	 */
+	int stall_level;
+	/**
+	 * 映像が途切れた回数
+	 */
+	std::atomic<uint32_t> stall_count;
+	/**
+	 * 最後に映像が途切れてから復帰するまでの時間[ナノ秒]
+	 */
+	std::atomic<nsecs_t> recovery_time;
+	/**
+	 * 映像が途切れてから復帰するまでの時間の最大値[ナノ秒]
+	 */
+	std::atomic<nsecs_t> max_recovery_time;
+	/**
+	 * set_device_zoomで要求された拡大率
+	 * v4l2_lockで保護する
+	 */
+	float device_zoom_request;
+	/**
+	 * v4l2機器側で実際に拡大している拡大率, 1.0ならv4l2機器側では拡大していない
+	 */
+	std::atomic<float> device_zoom;
+	/**
+	 * v4l2機器側で拡大する方法
+	 * v4l2機器をオープンしたときにDEVICE_ZOOM_UNKNOWNへ戻して最初に拡大するときに決める
+	 * v4l2_lockで保護する
+	 */
+	device_zoom_method_t device_zoom_method;
+	/**
+	 * UVCメタデータノードからペイロードヘッダーを取得するかどうか
+	 */
+	bool uvc_meta_enabled;
+	/**
+	 * UVCメタデータノードのデバイスファイル名, 空なら映像取得開始時に自動で探す
+	 */
+	std::string uvc_meta_name;
+	/**
+	 * UVCメタデータノード
+	 * 映像取得開始時に生成して映像取得終了時に破棄する, ワーカースレッドからのみアクセスする
+	 */
+	V4l2UvcMetaUp uvc_meta;
 	/**
 	 * リサイズ要求フラグ
 	 */
@@ -85,6 +396,11 @@ private:
 	 * フレームレート要求値
 	 */
 	float request_min_fps, request_max_fps;
+	/**
+	 * フレーム間隔要求値[秒], numerator/denominator
+	 * numeratorが0ならフレーム間隔を変更しない
+	 */
+	struct v4l2_fract request_interval;
 	/**
 	 * 映像サイズ
 	 */
@@ -118,16 +434,221 @@ private:
 	 * async=trueの場合にhandle_frameを呼び出すワーカースレッド
 	 */
 	std::thread v4l2_thread;
+	/**
+	 * 映像取得スレッドのスケジューリングポリシー・優先度・CPUアフィニティ
+	 */
+	thread_sched_t thread_sched;
+	/**
+	 * 映像受け取りバッファーを確保したときに予めページフォルトさせておくかどうか
+	 */
+	bool prefault;
+	/**
+	 * 映像取得を任せるV4l2Reactor
+	 * nullptrでなければ専用ワーカースレッドの代わりにV4l2Reactorのワーカースレッド上で映像取得する
+	 */
+	V4l2ReactorSp reactor;
+	/**
+	 * V4l2Reactorへ登録したときに使うキャプチャ用のバッファ数
+	 */
+	int reactor_buf_nums;
 	/**
 	 * 対応しているコントロール機能のv4l2_queryctrl構造体マップ
 	 */
 	std::unordered_map<uint32_t, QueryCtrlSp> supported;
+	/**
+	 * retain_bufferで保持されていてまだrelease_bufferされていないバッファーかどうか
+	 * m_buffersと同じインデックスでアクセスする
+	 * v4l2_lockで保護する
+	 */
+	std::vector<bool> retained;
+	/**
+	 * retain_bufferで保持されていてまだrelease_bufferされていないバッファー数
+	 * v4l2_lockで保護する
+	 */
+	uint32_t retained_nums;
+	/**
+	 * on_frame_readyを呼び出している最中のバッファーのインデックス, 呼び出し中でなければ-1
+	 * v4l2_lockで保護する
+	 */
+	int delivering_index;
+	/**
+	 * retain_bufferで保持されたバッファーの返却待ち用
+	 */
+	Condition retained_sync;
+	/**
+	 * retain_bufferで保持したバッファーの返却を要求するコールバック
+	 * v4l2_lockで保護する
+	 */
+	OnReleaseRequestFunc on_release_request;
+	/**
+	 * 返却待ちがタイムアウトしたまま開放した映像受け取りバッファー
+	 * v4l2_lockで保護する
+	 */
+	std::vector<orphan_buffers_t> orphan_buffers;
+	/**
+	 * 対応ピクセルフォーマット・解像度・フレームレート・コントロール機能のキャッシュ
+	 * nullptrならキャッシュを使わずに毎回v4l2機器から取得する
+	 */
+	V4l2CapCacheSp cap_cache;
+	/**
+	 * オープン中のv4l2機器の対応ピクセルフォーマット・解像度・フレームレート・コントロール機能
+	 * cap_cacheを使わないときはnullptr
+	 * v4l2_lockで保護する
+	 */
+	DeviceCapsSp caps;
+	/**
+	 * post_ctrl_valueで要求されたコントロール機能の設定値をまとめて書き込むためのヘルパー
+	 */
+	V4l2CtrlWriter ctrl_writer;
 
 	/**
 	 * 映像取得スレッドの実行関数
 	 * @param buf_nums
 	 */
 	void v4l2_thread_func(const int &buf_nums);
+	/**
+	 * 映像取得開始時の処理
+	 * on_startを呼び出した後に解像度・ピクセルフォーマットをセットして映像ストリームを開始する
+	 * ワーカースレッド上で呼ばれる
+	 * @param buf_nums
+	 * @return
+	 */
+	int internal_start_stream(const int &buf_nums);
+	/**
+	 * 映像取得終了時の処理
+	 * 映像ストリームを終了してv4l2機器を閉じた後にon_stopを呼び出す
+	 * ワーカースレッド上で呼ばれる
+	 */
+	void internal_finish_stream();
+	/**
+	 * 解像度変更要求があれば処理する
+	 * ワーカースレッド上で呼ばれる
+	 * @return
+	 */
+	int handle_request();
+	/**
+	 * 映像の入ったバッファーを1つ取り出してon_frame_readyを呼び出した後にキューへ戻す
+	 * ワーカースレッド上で呼ばれる
+	 * @param result on_frame_readyの返り値またはVIDIOC_QBUFのエラー
+	 * @return 0: バッファーを取り出した, 負: VIDIOC_DQBUFのエラー(-EAGAINなら映像データが準備出来てない)
+	 */
+	int dequeue_frame(int &result);
+	/**
+	 * バッファー数の自動調整用に1フレーム分の遅延を記録して
+	 * 評価期間が終わればバッファー数を変更するかどうかを判断する
+	 * ワーカースレッド上で呼ばれる
+	 * @param buffer
+	 * @param dequeued VIDIOC_DQBUFした時刻[ナノ秒]
+	 * @param rendered on_frame_readyから戻った時刻[ナノ秒]
+	 */
+	void tune_buffer_nums(const buffer_t &buffer, const nsecs_t &dequeued, const nsecs_t &rendered);
+	/**
+	 * バッファー数の自動調整用の統計情報をクリアする
+	 */
+	void reset_tuning();
+	/**
+	 * 映像取得フォーマットの自動選択用に1フレーム分の時間を記録して
+	 * 評価期間が終われば次の候補へ切り替える
+	 * ワーカースレッド上で呼ばれる
+	 * @param dequeued VIDIOC_DQBUFした時刻[ナノ秒]
+	 * @param rendered on_frame_readyから戻った時刻[ナノ秒]
+	 */
+	void probe_format(const nsecs_t &dequeued, const nsecs_t &rendered);
+	/**
+	 * 映像取得フォーマットの自動選択を開始する
+	 * 自動選択結果がキャッシュされていればそれを使い
+	 * キャッシュされていなければ候補を列挙して最初の候補へ切り替える
+	 * ワーカースレッド上で呼ばれる
+	 */
+	void start_probe();
+	/**
+	 * 次の候補へ切り替える, 全ての候補を試行し終わればfinish_probeを呼ぶ
+	 * ワーカースレッド上で呼ばれる
+	 */
+	void next_probe();
+	/**
+	 * 試行結果から映像取得フォーマットを選んで切り替え、キャッシュへ保存する
+	 * ワーカースレッド上で呼ばれる
+	 */
+	void finish_probe();
+	/**
+	 * 指定したピクセルフォーマット・解像度・フレーム間隔への変更を要求する
+	 * 実際の変更は解像度変更と同様にワーカースレッド上で行う
+	 * @param choice
+	 */
+	void request_choice(const stream_choice_t &choice);
+	/**
+	 * request_intervalが指定されていればフレーム間隔をセット(VIDIOC_S_PARM)して
+	 * 実際のフレーム間隔からstream_fpsを更新する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 */
+	void update_frame_interval_locked();
+	/**
+	 * device_zoom_requestの拡大率をv4l2機器側で適用してdevice_zoomを更新する
+	 * v4l2機器側で拡大できないときはdevice_zoomを1.0にする
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @return 0: v4l2機器側で拡大した, 0以外: v4l2機器側では拡大しなかった
+	 */
+	int apply_device_zoom_locked();
+	/**
+	 * UVCメタデータノードをオープンする
+	 * オープンできなくても映像取得はメタデータ無しで続ける
+	 */
+	void open_uvc_meta();
+	/**
+	 * 映像のバッファーに対応するUVCメタデータを取得してbuffer_tのpts/stc/sof/exposure_tsへセットする
+	 * 対応するメタデータが無ければ0にする
+	 * @param buffer
+	 */
+	void update_uvc_meta(buffer_t &buffer);
+	/**
+	 * VIDIOC_S_SELECTION(V4L2_SEL_TGT_CROP)で中央部分を切り出して拡大する
+	 * 切り出すと出力解像度が変わってしまうv4l2機器では使えないのでデフォルトへ戻してエラーを返す
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param factor 拡大率
+	 * @param applied 実際に適用された拡大率
+	 * @return
+	 */
+	int set_crop_locked(const float &factor, float &applied);
+	/**
+	 * V4L2_CID_ZOOM_ABSOLUTEで拡大する
+	 * 最小値を等倍とみなすので最小値が0以下のv4l2機器では使えない
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param factor 拡大率
+	 * @param applied 実際に適用された拡大率
+	 * @return
+	 */
+	int set_zoom_ctrl_locked(const float &factor, float &applied);
+	/**
+	 * 指定したインデックスのバッファーをキューへ入れる(VIDIOC_QBUF)
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param index
+	 * @return
+	 */
+	int queue_buffer_locked(const uint32_t &index);
+	/**
+	 * m_buffersの要素からインデックスを取得する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param buf
+	 * @return m_buffersの要素でなければ-1
+	 */
+	int buffer_index_locked(const buffer_t &buf) const;
+	/**
+	 * retain_bufferで保持されたバッファーが全て返却されるまで待機する
+	 * 待機する前にon_release_requestで返却を要求する
+	 * タイムアウトしたときは保持されたままのバッファーを
+	 * start_stream_lockedでキューへ入れずinternal_release_mmap_buffersでmunmapしない
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @return 0: 全て返却された, 0以外: タイムアウト
+	 */
+	int wait_retained_buffers_locked();
+	/**
+	 * 返却待ちがタイムアウトしたまま開放した映像受け取りバッファーの返却処理
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param buf retain_bufferの引数
+	 * @return true: 開放済みのバッファーだった, false: 開放済みのバッファーではない
+	 */
+	bool release_orphan_buffer_locked(const buffer_t &buf);
 	/**
 	 * 映像取得ループ
 	 * ワーカースレッド上で呼ばれる
@@ -144,6 +665,16 @@ private:
 	 * オープンしているudmabufやv4l2機器を閉じる
 	*/
 	int internal_close_locked();
+	/**
+	 * udmabufのsysfs属性sync_for_cpu/sync_for_deviceを開く
+	 * (/sys/class/u-dma-buf/<名前>/または/sys/class/udmabuf/<名前>/)
+	 * 開けなければキャッシュ同期しない
+	*/
+	void open_udmabuf_sync_locked();
+	/**
+	 * udmabufのsysfs属性sync_for_cpu/sync_for_deviceを閉じる
+	*/
+	void close_udmabuf_sync_locked();
 	/**
 	 * 映像ストリーム開始
 	 * ワーカースレッド上で呼ばれる
@@ -156,6 +687,47 @@ private:
 	 * @return
 	 */
 	int stop_stream_locked();
+	/**
+	 * キャッシュの内容が実際のv4l2機器と一致しなかったときに
+	 * v4l2機器から取得し直してキャッシュを更新する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 */
+	void refresh_caps_locked();
+	/**
+	 * キャッシュから読み込んだコントロール機能の設定でエラーになったときに
+	 * VIDIOC_QUERYCTRLで照合して一致しなければキャッシュを更新する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param ctrl_id
+	 */
+	void validate_ctrl_locked(const uint32_t &ctrl_id);
+	/**
+	 * ctrl_idで指定したコントロール機能へ値を設定する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param ctrl_id
+	 * @param value
+	 * @return
+	 */
+	int set_ctrl_value_locked(const uint32_t &ctrl_id, const int32_t &value);
+	/**
+	 * ctrl_writerでまとめたコントロール機能の設定値をVIDIOC_S_EXT_CTRLSで書き込む
+	 * VIDIOC_S_EXT_CTRLSがエラーになったときは1つずつVIDIOC_S_CTRLで書き込む
+	 * ctrl_writerのワーカースレッド上で呼ばれる
+	 * @param ctrls
+	 * @return
+	 */
+	int write_ctrls(std::vector<struct v4l2_ext_control> &ctrls);
+	/**
+	 * 対応しているコントロール機能の変更(V4L2_EVENT_CTRL)と
+	 * 入力ソースの変更(V4L2_EVENT_SOURCE_CHANGE)のイベントを購読する
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 */
+	void subscribe_events_locked();
+	/**
+	 * v4l2機器に届いたイベントをVIDIOC_DQEVENTで全て取り出して処理する
+	 * ワーカースレッド上で呼ばれる
+	 * @return
+	 */
+	int handle_events();
 	/**
 	 * v4l2からの映像取得の準備
 	 * ワーカースレッド上で呼ばれる
@@ -177,6 +749,7 @@ private:
 	int release_mmap_locked();
 	/**
 	 * m_buffersの破棄処理
+	 * retain_bufferで保持されたままのバッファーはmunmapせずにorphan_buffersへ移す
 	*/
 	void internal_release_mmap_buffers();
 	/**
@@ -193,11 +766,33 @@ private:
 	*/
 	int init_mmap_locked_udmabuf(struct v4l2_requestbuffers &req);
 	/**
-	 * V4L2_MEMORY_DMABUFまたはV4L2_MEMORY_MMAPを使うとき
+	 * V4L2_MEMORY_MMAPを使うとき
+	 * export_dmabuf=trueならVIDIOC_EXPBUFでdma-bufとしてエクスポートしてbuffer_t::fdへセットする
 	 * init_mmap_lockedの下請け
 	 * @param req
 	*/
 	int init_mmap_udmabuf_other(struct v4l2_requestbuffers &req);
+	/**
+	 * 呼び出し元が確保したdma-bufをV4L2_MEMORY_DMABUFで使うとき
+	 * init_mmap_lockedの下請け
+	 * @param req
+	*/
+	int init_mmap_locked_dmabuf(struct v4l2_requestbuffers &req);
+	/**
+	 * マルチプレーン(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)でV4L2_MEMORY_MMAPを使うとき
+	 * 各プレーンを個別にmmapする
+	 * export_dmabuf=trueならVIDIOC_EXPBUFで各プレーンをdma-bufとしてエクスポートしてplane_t::fdへセットする
+	 * init_mmap_lockedの下請け
+	 * @param req
+	*/
+	int init_mmap_locked_mplane(struct v4l2_requestbuffers &req);
+	/**
+	 * VIDIOC_QUERYBUF/VIDIOC_QBUF/VIDIOC_DQBUF用にv4l2_bufferを初期化する
+	 * マルチプレーンのときはplanesをv4l2_buffer.m.planesへセットする
+	 * @param buf
+	 * @param planes VIDEO_MAX_PLANES個の要素を持つ配列
+	 */
+	void init_v4l2_buffer(struct v4l2_buffer &buf, struct v4l2_plane *planes) const;
 	/**
 	 * @brief 対応するピクセルフォーマット一覧を取得する
 	 *        v4l2_lockをロックした状態で呼び出すこと
@@ -217,6 +812,45 @@ private:
 	int handle_resize(
 		const uint32_t &width, const uint32_t &height,
 		const uint32_t &pixel_format);
+	/**
+	 * 解像度・ピクセルフォーマット・バッファー数を変えずにフレーム間隔だけを変更する
+	 * 映像受け取りバッファーを確保し直さずにVIDIOC_STREAMOFF→VIDIOC_S_PARM→VIDIOC_STREAMONする
+	 * handle_resizeの下請け
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @return
+	 */
+	int change_interval_locked();
+	/**
+	 * ネゴシエーションしたフレーム間隔と実際に映像を受け取った間隔の長い方から
+	 * 映像が途切れたと判断するまでの時間を取得する
+	 * 最初の映像を待っている間はSTALL_FIRST_FRAME_GRACE_NS以上にする
+	 * @return nsecs_t 映像が途切れたと判断するまでの時間[ナノ秒]
+	 */
+	nsecs_t get_stall_timeout() const;
+	/**
+	 * 映像が途切れていないかを確認して途切れていれば段階的に復帰処理を行う
+	 * 1回目: VIDIOC_STREAMOFF→VIDIOC_STREAMON
+	 * 2回目以降: 映像受け取りバッファーを解放してVIDIOC_REQBUFSからやり直す
+	 * v4l2機器の切断・再接続はここでは扱わずにV4l2Hotplugで検出して開き直す
+	 * ワーカースレッド上で呼ばれる
+	 * @return 負:エラー 0:映像は途切れていないか復帰処理を行った
+	 */
+	int check_stall();
+	/**
+	 * check_stallの下請け
+	 * v4l2_lockをロックした状態で呼び出すこと
+	 * @param level 復帰処理の段階
+	 * @return
+	 */
+	int recover_stream_locked(const int &level);
+	//--------------------------------------------------------------------------------
+	// IV4l2ReactorClientの純粋仮想関数を実装
+	int on_reactor_attach() override;
+	inline int get_reactor_fd() const override { return m_fd; };
+	int on_reactor_ready() override;
+	int on_reactor_wakeup() override;
+	int on_reactor_event() override;
+	void on_reactor_detach(const bool &error) override;
 protected:
 	mutable Mutex v4l2_lock;
 
@@ -255,6 +889,23 @@ protected:
 	 * @return int 負:エラー 0以上:読み込んだデータバイト数
 	 */
 	virtual int on_frame_ready(const buffer_t &buf, const size_t &bytes) = 0;
+	/**
+	 * @brief コントロール機能の値や最小値/最大値/フラグがv4l2機器側で変更されたときの処理, 純粋仮想関数
+	 *        自動露出で露出時間が変わったとき等にV4L2_EVENT_CTRLで通知される
+	 *        ワーカースレッド上で呼ばれる
+	 *
+	 * @param values 変更後の最小値/最大値/ステップ値/デフォルト値/現在値
+	 */
+	virtual void on_ctrl_changed(const uvc::control_value32_t &values) = 0;
+	/**
+	 * @brief 入力ソースが変更されたときの処理, 純粋仮想関数
+	 *        V4L2_EVENT_SOURCE_CHANGEで通知される
+	 *        解像度が変わったときは同じ要求で映像ストリームをネゴシエーションし直す
+	 *        ワーカースレッド上で呼ばれる
+	 *
+	 * @param changes V4L2_EVENT_SRC_CH_XXX
+	 */
+	virtual void on_source_changed(const uint32_t &changes) = 0;
 
 	/**
 	 * 映像データの処理
@@ -271,6 +922,21 @@ protected:
 	 * @return
 	 */
 	QueryCtrlSp get_ctrl(const uint32_t &ctrl_id);
+	/**
+	 * 映像サイズとピクセルフォーマットをセットする
+	 * v4l2機器を使わずに映像を供給する派生クラスでget_frame_type/get_pixel_formatが
+	 * 正しい値を返すようにするために使う
+	 * @param width
+	 * @param height
+	 * @param pixel_format V4L2_PIX_FMT_XXX
+	 */
+	void set_stream_format(const uint32_t &width, const uint32_t &height, const uint32_t &pixel_format);
+	/**
+	 * set_thread_schedで設定した映像取得スレッドのスケジューリングポリシー・優先度・CPUアフィニティを取得する
+	 * 独自のワーカースレッドで映像を供給する派生クラスで使う
+	 * @return
+	 */
+	inline const thread_sched_t &get_thread_sched() const { return thread_sched; };
 public:
 	/**
 	 * @brief コンストラクタ
@@ -298,18 +964,315 @@ public:
 	 * @return core::raw_frame_t 
 	 */
 	inline core::raw_frame_t get_frame_type() const  { return stream_frame_type; };
+	/**
+	 * @brief ネゴシーエーションしたピクセルフォーマット(V4L2_PIX_FMT_XXX)を取得する
+	 *
+	 * @return uint32_t
+	 */
+	inline uint32_t get_pixel_format() const { return stream_pixel_format; };
+	/**
+	 * @brief マルチプレーン(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)で映像を受け取るかどうか
+	 *        trueならon_frame_readyで受け取るbuffer_tの各プレーンは別々のメモリーにある
+	 *
+	 * @return bool
+	 */
+	inline bool is_mplane() const { return m_buf_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE; };
+	/**
+	 * @brief 映像データの受け取りに使っているメモリータイプを取得する
+	 *
+	 * @return uint32_t V4L2_MEMORY_MMAP/V4L2_MEMORY_USERPTR/V4L2_MEMORY_DMABUF, 映像取得中でなければ0
+	 */
+	inline uint32_t get_memory() const { return m_memory; };
+
+	/**
+	 * @brief V4L2_MEMORY_MMAPで映像を受け取るときに各バッファーを
+	 *        VIDIOC_EXPBUFでdma-bufとしてエクスポートしてbuffer_t::fdへセットするかどうかを設定する
+	 *        udmabufを使えない場合でもEGLImageを使ったゼロコピー描画ができるようになる
+	 *        映像取得開始前のみ変更可能
+	 *
+	 * @param enable
+	 * @return int
+	 */
+	int set_export_dmabuf(const bool &enable);
+	/**
+	 * @brief 呼び出し元が確保したdma-bufを使ってV4L2_MEMORY_DMABUFで映像を受け取るように設定する
+	 *        fdsの所有権は呼び出し元にあるのでV4l2SourceBaseではcloseしない
+	 *        バッファー数はstartの引数ではなくfdsの要素数になる
+	 *        映像取得開始前のみ変更可能
+	 *
+	 * @param fds dma-bufのファイルディスクリプタ配列, 空ならV4L2_MEMORY_DMABUFを使わない
+	 * @param length dma-bufのサイズ, 0ならlseekで取得する
+	 * @return int
+	 */
+	int set_dmabuf_fds(const std::vector<int> &fds, const size_t &length = 0);
+	/**
+	 * @brief 専用ワーカースレッドの代わりにV4l2Reactorのワーカースレッド上で映像取得するように設定する
+	 *        複数のv4l2機器で同じV4l2Reactorを共有するとスレッド数を減らすことができる
+	 *        V4l2Reactorは呼び出し元でstartしておくこと
+	 *        asyncの値に関わらずhandle_frameを呼び出す必要はない
+	 *        映像取得開始前のみ変更可能
+	 *
+	 * @param reactor nullptrなら専用ワーカースレッドを使う
+	 * @return int
+	 */
+	int set_reactor(V4l2ReactorSp reactor);
+	/**
+	 * @brief 対応ピクセルフォーマット・解像度・フレームレート・コントロール機能のキャッシュを設定する
+	 *        2回目以降のオープン時はVIDIOC_ENUM_xxx/VIDIOC_QUERYCTRLでの列挙の代わりにキャッシュを使う
+	 *        キャッシュの内容は映像ストリーム開始時やコントロール機能の設定時に照合して
+	 *        一致しなければv4l2機器から取得し直す
+	 *        オープン前のみ変更可能
+	 *
+	 * @param cache nullptrならキャッシュを使わない
+	 * @return int
+	 */
+	int set_cap_cache(V4l2CapCacheSp cache);
+	/**
+	 * @brief オープンするv4l2機器名を変更する
+	 *        再接続時に/dev/videoNが変わったときに使う
+	 *        オープン前のみ変更可能
+	 *
+	 * @param device_name
+	 * @return int
+	 */
+	int set_device_name(std::string device_name);
+	/**
+	 * @brief 映像取得スレッドのスケジューリングポリシー・優先度・CPUアフィニティを設定する
+	 *        映像取得スレッドの開始時に適用して実際に適用された値をログへ出力する
+	 *        V4l2Reactorを使うときはV4l2Reactorのワーカースレッドなので適用しない
+	 *        映像取得開始前のみ変更可能
+	 *
+	 * @param sched
+	 * @return int
+	 */
+	int set_thread_sched(const thread_sched_t &sched);
+	/**
+	 * @brief 映像受け取りバッファーを確保したときに全ページを読み込んで予めページフォルトさせておくかどうかを設定する
+	 *        映像取得中に初回アクセスでページフォルトして遅延するのを防ぐ
+	 *        映像取得開始前のみ変更可能
+	 *
+	 * @param enable
+	 * @return int
+	 */
+	int set_prefault(const bool &enable);
+	/**
+	 * @brief 準備できている映像を全てVIDIOC_DQBUFして最新の映像だけをon_frame_readyへ渡すかどうかを設定する
+	 *        描画が間に合わないときに古い映像を表示して遅延が大きくなるのを防ぐ
+	 *        最新以外の映像は読み飛ばしてすぐにv4l2機器へ返却する
+	 *
+	 * @param enable
+	 * @return int
+	 */
+	int set_latest_only(const bool &enable);
+	/**
+	 * @brief 最新の映像だけをon_frame_readyへ渡すかどうかを取得
+	 *
+	 * @return true
+	 * @return false
+	 */
+	inline bool is_latest_only() const { return latest_only; };
+	/**
+	 * @brief 最新の映像ではないために読み飛ばした映像の数を取得
+	 *        映像ストリーム開始時にクリアされる
+	 *
+	 * @return uint64_t
+	 */
+	inline uint64_t get_skipped_frames() const { return skipped_frames.load(); };
+	/**
+	 * @brief v4l2_buffer.sequenceの欠番から求めたドライバー側で破棄されたフレーム数を取得
+	 *        (v4l2機器側のバッファーが足りなかった等)
+	 *        get_skipped_framesで数える読み飛ばしや下流のFrameQueueでの破棄は含まない
+	 *        映像ストリーム開始時にクリアされる
+	 *
+	 * @return uint64_t
+	 */
+	inline uint64_t get_dropped_frames() const { return dropped_frames.load(); };
+	/**
+	 * @brief 映像受け取りバッファー数を自動調整するかどうかを設定する
+	 *        VIDIOC_DQBUFから描画までの遅延とv4l2_buffer.sequenceの欠番を監視して
+	 *        フレーム落ちするときはバッファー数を増やし
+	 *        フレーム落ちせずにキューイング遅延が大きいときはバッファー数を減らす
+	 *        バッファー数を変更するときは解像度変更と同様に映像ストリームを再初期化する
+	 *        呼び出し元が確保したdma-bufを使うとき(set_dmabuf_fds)は無効
+	 *
+	 * @param enable
+	 * @param min_nums バッファー数の最小値
+	 * @param max_nums バッファー数の最大値
+	 * @return int
+	 */
+	int set_auto_buffer_nums(const bool &enable,
+		const int &min_nums = DEFAULT_AUTO_BUFFER_NUMS_MIN,
+		const int &max_nums = DEFAULT_AUTO_BUFFER_NUMS_MAX);
+	/**
+	 * @brief 映像受け取りバッファー数を自動調整するかどうかを取得
+	 *
+	 * @return true
+	 * @return false
+	 */
+	inline bool is_auto_buffer_nums() const { return auto_buf_nums; };
+	/**
+	 * @brief 映像取得フォーマットを自動選択するかどうかを設定する
+	 *        有効にすると映像取得開始後に要求解像度で対応している各ピクセルフォーマット・フレームレートを
+	 *        順に短時間ずつ試行してVIDIOC_DQBUF間隔と描画時間(on_frame_readyの実行時間)を計測し
+	 *        目標フレームレートを維持できるうちで最も遅延が小さいものを選ぶ
+	 *        選んだ結果はset_cap_cacheで指定したキャッシュへv4l2機器毎に保存して次回からはそのまま使う
+	 *        映像取得開始前のみ変更可能
+	 *        呼び出し元が確保したdma-bufを使うとき(set_dmabuf_fds)は無効
+	 *
+	 * @param enable
+	 * @param target_fps 目標フレームレート
+	 * @return int
+	 */
+	int set_auto_format(const bool &enable,
+		const float &target_fps = DEFAULT_AUTO_FORMAT_TARGET_FPS);
+	/**
+	 * @brief 映像取得フォーマットを自動選択するかどうかを取得
+	 *
+	 * @return true
+	 * @return false
+	 */
+	inline bool is_auto_format() const { return auto_format; };
+	/**
+	 * @brief 拡大(デジタルズーム)をv4l2機器側で行うように要求する
+	 *        VIDIOC_S_SELECTION(V4L2_SEL_TGT_CROP)で中央部分だけを切り出せるv4l2機器なら切り出し、
+	 *        切り出せなければV4L2_CID_ZOOM_ABSOLUTEで拡大する
+	 *        切り出しは出力解像度が変わらないv4l2機器(スケーラーで元の解像度へ拡大するもの)でのみ使うので
+	 *        転送・デコードする映像の大きさは変わらない, GPUで拡大するよりも画質が良くなるだけ
+	 *        v4l2機器側で拡大できなかった分(factor / get_device_zoom())は呼び出し元で拡大すること
+	 *        1.0未満(縮小)はv4l2機器側では行わない
+	 *        映像ストリームを作り直したときも要求した拡大率を再適用する
+	 *
+	 * @param factor 拡大率
+	 * @return int 0: v4l2機器側で拡大した, 0以外: v4l2機器側では拡大しなかった
+	 */
+	int set_device_zoom(const float &factor);
+	/**
+	 * @brief v4l2機器側で実際に拡大している拡大率を取得する
+	 *        1.0ならv4l2機器側では拡大していない
+	 *
+	 * @return float
+	 */
+	inline float get_device_zoom() const { return device_zoom.load(); };
+	/**
+	 * @brief set_device_zoomでの拡大にV4L2_CID_ZOOM_ABSOLUTEを使っているかどうか
+	 *        trueの間は保存してある設定値等でV4L2_CID_ZOOM_ABSOLUTEを上書きしないこと
+	 *
+	 * @return true
+	 * @return false
+	 */
+	bool is_zoom_ctrl_in_use() const;
+	/**
+	 * @brief 最後に解像度・ピクセルフォーマット・フレームレートを変更したときに
+	 *        変更前の最後の映像から変更後の最初の映像まで映像が途切れた時間を取得する
+	 *        変更中も呼び出し元では最後に受け取った映像を表示し続けること
+	 *
+	 * @return nsecs_t 映像が途切れた時間[ナノ秒], 変更していなければ0
+	 */
+	inline nsecs_t get_switch_gap() const { return switch_gap.load(); };
+	/**
+	 * @brief 映像が途切れたときに自動で復帰処理するかどうかを設定する
+	 *        有効にするとフレーム間隔(ネゴシエーションした値と実際の値の長い方)の
+	 *        STALL_FRAME_INTERVALS倍(最短STALL_DEFAULT_TIMEOUT_NS)の間映像が届かなければ
+	 *        VIDIOC_STREAMOFF/ON→VIDIOC_REQBUFSからやり直すの順に復帰処理を行う
+	 *        VIDIOC_STREAMON後の最初の映像はSTALL_FIRST_FRAME_GRACE_NSまで待つ
+	 *        v4l2機器の切断・再接続はV4l2Hotplugで扱うのでここでは開き直さない
+	 *        V4l2Reactorで映像取得するときはタイムアウトしないので映像が途切れても検出しない
+	 *        デフォルトは無効, 映像取得開始前のみ変更可能
+	 *
+	 * @param enable
+	 * @return int
+	 */
+	int set_stall_detect(const bool &enable);
+	/**
+	 * @brief 映像が途切れたときに自動で復帰処理するかどうかを取得する
+	 *
+	 * @return true
+	 * @return false
+	 */
+	inline bool is_stall_detect() const { return stall_detect; };
+	/**
+	 * @brief 映像が途切れた回数を取得する
+	 *
+	 * @return uint32_t
+	 */
+	inline uint32_t get_stall_count() const { return stall_count.load(); };
+	/**
+	 * @brief 最後に映像が途切れてから復帰処理で映像を受け取れるようになるまでの時間を取得する
+	 *
+	 * @return nsecs_t 復帰するまでの時間[ナノ秒], 復帰していなければ0
+	 */
+	inline nsecs_t get_recovery_time() const { return recovery_time.load(); };
+	/**
+	 * @brief 映像が途切れてから復帰するまでの時間の最大値を取得する
+	 *
+	 * @return nsecs_t 復帰するまでの時間の最大値[ナノ秒], 復帰していなければ0
+	 */
+	inline nsecs_t get_max_recovery_time() const { return max_recovery_time.load(); };
+	/**
+	 * @brief UVC機器のメタデータノード(V4L2_META_FMT_UVC)からペイロードヘッダーを取得するかどうかを設定する
+	 *        映像とメタデータをv4l2_buffer.sequenceで対応付けてbuffer_tのpts/stc/sofへセットし、
+	 *        SCRから求めた機器側クロックとホスト側クロックの対応付けでptsを変換した露光開始時刻を
+	 *        buffer_t::exposure_tsへセットする
+	 *        メタデータノードが無い・オープンできないときはメタデータ無しで映像取得する
+	 *        映像取得開始前のみ変更可能
+	 *
+	 * @param enable
+	 * @param meta_device メタデータノードのデバイスファイル名, 空なら映像ノードと同じUVC機器のものを探す
+	 * @return int
+	 */
+	int set_uvc_meta(const bool &enable, const std::string &meta_device = "");
+	/**
+	 * @brief UVCメタデータノードからペイロードヘッダーを取得するかどうかを取得
+	 *
+	 * @return true
+	 * @return false
+	 */
+	inline bool is_uvc_meta() const { return uvc_meta_enabled; };
+	/**
+	 * @brief 現在の映像受け取りバッファー数を取得
+	 *
+	 * @return uint32_t
+	 */
+	uint32_t get_buffer_nums() const;
+
+	/**
+	 * @brief on_frame_readyで受け取ったバッファーをコールバックから戻った後も保持する
+	 *        保持したバッファーはrelease_bufferを呼ぶまでv4l2機器へ返却(VIDIOC_QBUF)されない
+	 *        v4l2機器側に最低限のバッファーが残らない場合は保持できない
+	 *        映像取得終了・解像度変更時には保持したバッファーが返却されるまで待機するので速やかにrelease_bufferすること
+	 *        on_frame_ready内(ワーカースレッド上)からのみ呼び出すこと
+	 *
+	 * @param buf on_frame_readyの引数
+	 * @return true: 保持した, false: 保持できなかった
+	 */
+	bool retain_buffer(const buffer_t &buf);
+	/**
+	 * @brief retain_bufferで保持したバッファーをv4l2機器へ返却する
+	 *        任意のスレッドから呼び出すことができる
+	 *
+	 * @param buf retain_bufferの引数
+	 * @return int
+	 */
+	int release_buffer(const buffer_t &buf);
+	/**
+	 * @brief retain_bufferで保持したバッファーの返却を要求するコールバックをセットする
+	 *        映像受け取りバッファーを停止・再確保する前にv4l2_lockを開放した状態で呼ばれる
+	 *
+	 * @param callback
+	 */
+	void set_on_release_request(OnReleaseRequestFunc callback);
 
 	/**
 	 * コンストラクタで指定したv4l2機器をオープン
 	 * @return
 	 */
-	int open();
+	virtual int open();
 	/**
 	 * ストリーム中であればストリーム終了したnoti
 	 * v4l2機器をオープンしていればクローズする
 	 * @return
 	 */
-	int close();
+	virtual int close();
 
 	/**
 	 * コンストラクタで指定したv4l2機器をオープンして映像取得開始する
@@ -341,7 +1304,7 @@ public:
 	 * 対応するピクセルフォーマット・解像度・フレームレートをjson文字列として取得する
 	 * @return
 	 */
-	std::string get_supported_size() const;
+	virtual std::string get_supported_size() const;
 
 	/**
 	 * 指定したピクセルフォーマント・解像度・フレームレートに対応しているかどうかを取得
@@ -352,7 +1315,7 @@ public:
 	 * @param max_fps 最大フレームレート, 省略時はDEFAULT_PREVIEW_FPS_MAXを使う
 	 * @return 0: 対応している, 0以外: 対応していない
 	 */
-	int find_stream(
+	virtual int find_stream(
 		const uint32_t &width, const uint32_t &height,
 		uint32_t pixel_format = 0,
 		const float &min_fps = DEFAULT_PREVIEW_FPS_MIN, const float &max_fps = DEFAULT_PREVIEW_FPS_MAX);
@@ -364,7 +1327,7 @@ public:
 	 * @param pixel_format V4L2_PIX_FMT_XXX, 省略時は前回に設定した値を使う
 	 * @return
 	 */
-	int resize(const uint32_t &width, const uint32_t &height, const uint32_t &pixel_format = 0);
+	virtual int resize(const uint32_t &width, const uint32_t &height, const uint32_t &pixel_format = 0);
 
 	/**
 	 * ctrl_idで指定したコントロール機能に対応しているかどうかを取得
@@ -389,6 +1352,22 @@ public:
 	 * @return
 	 */
 	int set_ctrl_value(const uint32_t &ctrl_id, const int32_t &value) override;
+	/**
+	 * ctrl_idで指定したコントロール機能へ値を設定するようにワーカースレッドへ要求する
+	 * USBの制御転送を待たずにすぐに戻るのでUIスレッドから呼び出しても良い
+	 * 書き込み待ちの間に同じコントロール機能への要求が来たときは最後の値だけを書き込む
+	 * 書き込み待ちの設定値はまとめてVIDIOC_S_EXT_CTRLSで書き込む
+	 * v4l2機器をオープンしているときのみ有効
+	 * @param ctrl_id
+	 * @param value
+	 * @return 0: 要求を受け付けた, 0以外: v4l2機器をオープンしていない
+	 */
+	int post_ctrl_value(const uint32_t &ctrl_id, const int32_t &value);
+	/**
+	 * post_ctrl_valueで要求した設定値が全て書き込まれるまで待機する
+	 * @return
+	 */
+	int flush_ctrls();
 	/**
 	 * 最小値/最大値/ステップ値/デフォルト値/現在値を取得する
 	 * @param ctrl_id
@@ -407,6 +1386,8 @@ public:
 //--------------------------------------------------------------------------------
 typedef std::function<int(const uint8_t *image, const size_t &bytes, const buffer_t &buffer)> OnFrameReadyFunc;
 typedef std::function<void()> LifeCycletEventFunc;
+typedef std::function<void(const uvc::control_value32_t &values)> OnCtrlChangedFunc;
+typedef std::function<void(const uint32_t &changes)> OnSourceChangedFunc;
 
 /**
  * @brief フレームコールバック関数をセットして映像データを受け取るようにしたV4l2SourceBase実装
@@ -418,6 +1399,8 @@ private:
 	LifeCycletEventFunc on_stop_callback;
 	LifeCycletEventFunc on_error_callback;
 	OnFrameReadyFunc on_frame_ready_callbac;
+	OnCtrlChangedFunc on_ctrl_changed_callback;
+	OnSourceChangedFunc on_source_changed_callback;
 protected:
 	/**
 	 * @brief 映像取得開始時の処理, V4l2SourceBaseの純粋仮想関数を実装
@@ -443,6 +1426,20 @@ protected:
 	 * @return int 負:エラー 0以上:読み込んだデータバイト数
 	 */
 	virtual int on_frame_ready(const buffer_t &buf, const size_t &bytes) override;
+	/**
+	 * @brief コントロール機能がv4l2機器側で変更されたときの処理, V4l2SourceBaseの純粋仮想関数を実装
+	 *        ワーカースレッド上で呼ばれる
+	 *
+	 * @param values
+	 */
+	virtual void on_ctrl_changed(const uvc::control_value32_t &values) override;
+	/**
+	 * @brief 入力ソースが変更されたときの処理, V4l2SourceBaseの純粋仮想関数を実装
+	 *        ワーカースレッド上で呼ばれる
+	 *
+	 * @param changes
+	 */
+	virtual void on_source_changed(const uint32_t &changes) override;
 public:
 	/**
 	 * @brief コンストラクタ
@@ -482,8 +1479,32 @@ public:
 		on_error_callback = callback;
 		return *this;
 	}
+	/**
+	 * @brief コントロール機能がv4l2機器側で変更されたときのコールバック関数をセット
+	 *        ワーカースレッド上で呼ばれる
+	 *
+	 * @param callback
+	 * @return V4l2Source&
+	 */
+	inline V4l2Source &set_on_ctrl_changed(OnCtrlChangedFunc callback) {
+		on_ctrl_changed_callback = callback;
+		return *this;
+	}
+	/**
+	 * @brief 入力ソースが変更されたときのコールバック関数をセット
+	 *        ワーカースレッド上で呼ばれる
+	 *
+	 * @param callback
+	 * @return V4l2Source&
+	 */
+	inline V4l2Source &set_on_source_changed(OnSourceChangedFunc callback) {
+		on_source_changed_callback = callback;
+		return *this;
+	}
 	/**
 	 * @brief フレームコールバック関数をセット
+	 *        buffer_t::dmabuf_syncがtrueのときにコールバック内でCPUから映像データを読み込むときは
+	 *        begin_cpu_access/end_cpu_accessで囲むこと
 	 * 
 	 * @param callback 
 	 * @return V4l2Source& 
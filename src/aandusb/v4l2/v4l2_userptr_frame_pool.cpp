@@ -0,0 +1,107 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4L2UserptrFramePool"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <utility>
+
+#include "utilbase.h"
+// v4l2
+#include "v4l2/v4l2_userptr_frame_pool.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * コンストラクタ
+ * プールが空のときは待機せずにnullptrを返す
+ * @param max_frame_num 最大フレーム数
+ * @param recycle_callback フレームがリサイクルされたときのコールバック
+ */
+V4L2UserptrFramePool::V4L2UserptrFramePool(
+	const uint32_t &max_frame_num, OnFrameRecycleFunc recycle_callback)
+:	core::FramePool<core::BaseVideoFrame *>(max_frame_num, 0, 0, false, false),
+	on_recycle(std::move(recycle_callback))
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+V4L2UserptrFramePool::~V4L2UserptrFramePool() noexcept {
+	ENTER();
+
+	clear_pool();
+
+	EXIT();
+}
+
+/**
+ * FramePool::create_frameの実装
+ * @param data_bytes
+ * @return
+ */
+/*protected*/
+core::BaseVideoFrame *V4L2UserptrFramePool::create_frame(const size_t &data_bytes) {
+	ENTER();
+	RET(new core::BaseVideoFrame(data_bytes));
+}
+
+/**
+ * FramePool::delete_frameの実装
+ * @param frame
+ */
+/*protected*/
+void V4L2UserptrFramePool::delete_frame(core::BaseVideoFrame *frame) {
+	ENTER();
+	SAFE_DELETE(frame);
+	EXIT();
+}
+
+/**
+ * 指定したフレームを返却する
+ * OnFrameRecycleFuncがv4l2機器へ再キューしなかったときだけプールへ戻す
+ * @param frame
+ */
+/*public*/
+void V4L2UserptrFramePool::recycle_frame(core::BaseVideoFrame *frame) {
+	ENTER();
+
+	if (LIKELY(frame) && !(on_recycle && on_recycle(frame))) {
+		core::FramePool<core::BaseVideoFrame *>::recycle_frame(frame);
+	}
+
+	EXIT();
+}
+
+/**
+ * OnFrameRecycleFuncを呼ばずにプールへ戻す
+ * @param frame
+ */
+/*public*/
+void V4L2UserptrFramePool::return_frame(core::BaseVideoFrame *frame) {
+	ENTER();
+
+	core::FramePool<core::BaseVideoFrame *>::recycle_frame(frame);
+
+	EXIT();
+}
+
+}	// namespace serenegiant::v4l2
@@ -0,0 +1,83 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_USERPTR_FRAME_POOL_H
+#define AANDUSB_V4L2_USERPTR_FRAME_POOL_H
+
+#include <functional>
+#include <memory>
+
+// core
+#include "core/frame_pool.h"
+#include "core/video_frame_base.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * フレームがリサイクルされたときのコールバック
+ * v4l2機器へ映像受け取りバッファーとしてキューに入れた(VIDIOC_QBUF)ときはtrueを返す
+ * falseを返したときはフレームプールへ戻す
+ */
+typedef std::function<bool(core::BaseVideoFrame */*frame*/)> OnFrameRecycleFunc;
+
+/**
+ * V4L2_MEMORY_USERPTRでv4l2機器へ渡す映像受け取りバッファーとして
+ * BaseVideoFrameのバッファーを使うためのフレームプール
+ * #recycle_frameでフレームを返却するとOnFrameRecycleFuncを呼び出して
+ * プールへ戻す代わりにそのままv4l2機器へ再キューさせる
+ */
+class V4L2UserptrFramePool : public core::FramePool<core::BaseVideoFrame *> {
+private:
+	/**
+	 * フレームがリサイクルされたときのコールバック
+	 */
+	OnFrameRecycleFunc on_recycle;
+protected:
+	/**
+	 * FramePool::create_frameの実装
+	 * pool_mutexがロックされた状態で呼ばれる
+	 * @param data_bytes
+	 * @return
+	 */
+	core::BaseVideoFrame *create_frame(const size_t &data_bytes) override;
+	/**
+	 * FramePool::delete_frameの実装
+	 * @param frame
+	 */
+	void delete_frame(core::BaseVideoFrame *frame) override;
+public:
+	/**
+	 * コンストラクタ
+	 * @param max_frame_num 最大フレーム数
+	 * @param recycle_callback フレームがリサイクルされたときのコールバック
+	 */
+	V4L2UserptrFramePool(const uint32_t &max_frame_num, OnFrameRecycleFunc recycle_callback);
+	/**
+	 * デストラクタ
+	 */
+	virtual ~V4L2UserptrFramePool() noexcept;
+
+	/**
+	 * 指定したフレームを返却する
+	 * OnFrameRecycleFuncがv4l2機器へ再キューしなかったときだけプールへ戻す
+	 * @param frame
+	 */
+	void recycle_frame(core::BaseVideoFrame *frame) override;
+	/**
+	 * OnFrameRecycleFuncを呼ばずにプールへ戻す
+	 * v4l2機器から取り出したフレームをストリーム停止時に返却するとき用
+	 * @param frame
+	 */
+	void return_frame(core::BaseVideoFrame *frame);
+};
+
+typedef std::unique_ptr<V4L2UserptrFramePool> V4L2UserptrFramePoolUp;
+typedef std::shared_ptr<V4L2UserptrFramePool> V4L2UserptrFramePoolSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_USERPTR_FRAME_POOL_H
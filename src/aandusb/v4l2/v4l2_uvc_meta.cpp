@@ -0,0 +1,585 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#define LOG_TAG "V4l2UvcMeta"
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/usb/video.h>
+#include <linux/uvcvideo.h>
+
+#include "utilbase.h"
+#include "charutils.h"
+// v4l2
+#include "v4l2/v4l2_uvc_meta.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * クロック対応付けに使うサンプル数の最大値
+ */
+#define UVC_CLOCK_MAX_SAMPLES (64)
+/**
+ * クロック対応付けに必要なサンプル数の最小値
+ */
+#define UVC_CLOCK_MIN_SAMPLES (8)
+/**
+ * メタデータノードのバッファー数
+ * 映像ノードより少ないとメタデータを取得できないフレームが出るので多めにする
+ */
+#define UVC_META_BUFFER_NUMS (8)
+/**
+ * 映像フレームとの対応付け待ちで保持するメタデータ数の最大値
+ */
+#define UVC_META_MAX_PENDING (32)
+/**
+ * find_meta_deviceで調べる/dev/videoNの数
+ */
+#define MAX_VIDEO_DEVICES (64)
+/**
+ * uvc_meta_bufのns/sofの合計バイト数(lengthの位置)
+ */
+#define UVC_META_HEADER_OFFSET (sizeof(uint64_t) + sizeof(uint16_t))
+
+/**
+ * リトルエンディアンの32ビット値を読み込む
+ * @param p
+ * @return
+ */
+static inline uint32_t read_le32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * リトルエンディアンの16ビット値を読み込む
+ * @param p
+ * @return
+ */
+static inline uint16_t read_le16(const uint8_t *p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+//--------------------------------------------------------------------------------
+UvcClockRecovery::UvcClockRecovery()
+:	samples(),
+	last_raw(0), last_clock(0),
+	slope(0.0), clock_mean(0.0), host_mean(0.0)
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * 保持しているサンプルを破棄する
+ */
+/*public*/
+void UvcClockRecovery::reset() {
+	ENTER();
+
+	samples.clear();
+	last_raw = 0;
+	last_clock = 0;
+	slope = clock_mean = host_mean = 0.0;
+
+	EXIT();
+}
+
+/**
+ * 32ビットの機器側クロックの桁あふれを補正する
+ * @param clock
+ * @return
+ */
+/*private*/
+int64_t UvcClockRecovery::unwrap(const uint32_t &clock) const {
+	// 前回値からの差を符号付き32ビットとして扱うと前後どちらでも桁あふれを補正できる
+	return samples.empty() ? (int64_t)clock : last_clock + (int32_t)(clock - last_raw);
+}
+
+/**
+ * SCRのdwSourceClockと受信時刻の組を追加する
+ * @param stc
+ * @param host_ts
+ */
+/*public*/
+void UvcClockRecovery::add_sample(const uint32_t &stc, const nsecs_t &host_ts) {
+	ENTER();
+
+	if (!samples.empty()) {
+		const auto diff = (int32_t)(stc - last_raw);
+		if (!diff) {
+			// 同じSCRが複数のペイロードヘッダーに入っていることがあるので最初のものだけを使う
+			EXIT();
+		} else if (UNLIKELY((diff < 0) || (host_ts <= samples.back().host_ts))) {
+			// 機器側クロックが巻き戻ったとき(機器のリセット等)は最初からやり直す
+			LOGD("clock discontinuity,diff=%d", diff);
+			reset();
+		}
+	}
+	const auto clock = unwrap(stc);
+	samples.push_back({ .device_clock = clock, .host_ts = host_ts });
+	last_raw = stc;
+	last_clock = clock;
+	while (samples.size() > UVC_CLOCK_MAX_SAMPLES) {
+		samples.pop_front();
+	}
+	fit();
+
+	EXIT();
+}
+
+/**
+ * 保持しているサンプルから1次式を当てはめ直す
+ */
+/*private*/
+void UvcClockRecovery::fit() {
+	ENTER();
+
+	const size_t n = samples.size();
+	if (n < UVC_CLOCK_MIN_SAMPLES) {
+		slope = 0.0;
+		EXIT();
+	}
+	// 桁落ちしないように先頭サンプルからの差で計算する
+	const auto &base = samples.front();
+	double sum_clock = 0.0, sum_host = 0.0;
+	for (const auto &sample: samples) {
+		sum_clock += (double)(sample.device_clock - base.device_clock);
+		sum_host += (double)(sample.host_ts - base.host_ts);
+	}
+	const double mean_clock = sum_clock / (double)n;
+	const double mean_host = sum_host / (double)n;
+	double sxx = 0.0, sxy = 0.0;
+	for (const auto &sample: samples) {
+		const double dx = (double)(sample.device_clock - base.device_clock) - mean_clock;
+		const double dy = (double)(sample.host_ts - base.host_ts) - mean_host;
+		sxx += dx * dx;
+		sxy += dx * dy;
+	}
+	if (LIKELY(sxx > 0.0) && (sxy > 0.0)) {
+		slope = sxy / sxx;
+		clock_mean = (double)base.device_clock + mean_clock;
+		host_mean = (double)base.host_ts + mean_host;
+	} else {
+		slope = 0.0;
+	}
+
+	EXIT();
+}
+
+/**
+ * 機器側クロックをホスト側のCLOCK_MONOTONICへ変換する
+ * @param clock
+ * @return ホスト側の時刻[ナノ秒], サンプルが足りないときは0
+ */
+/*public*/
+nsecs_t UvcClockRecovery::to_host(const uint32_t &clock) const {
+	if (slope <= 0.0) {
+		return 0;
+	}
+	const auto c = (double)unwrap(clock);
+	return (nsecs_t)(host_mean + slope * (c - clock_mean));
+}
+
+/**
+ * 当てはめた1次式から求めた機器側クロックの周波数[Hz]
+ * @return サンプルが足りないときは0
+ */
+/*public*/
+double UvcClockRecovery::get_clock_frequency() const {
+	return slope > 0.0 ? 1000000000.0 / slope : 0.0;
+}
+
+//--------------------------------------------------------------------------------
+/**
+ * コンストラクタ
+ * @param device_name メタデータノードのデバイスファイル名
+ */
+/*public*/
+V4l2UvcMeta::V4l2UvcMeta(std::string device_name)
+:	device_name(std::move(device_name)),
+	m_fd(0), streaming(false),
+	buffers(), metas(), clock()
+{
+	ENTER();
+	EXIT();
+}
+
+/**
+ * デストラクタ
+ */
+/*public*/
+V4l2UvcMeta::~V4l2UvcMeta() {
+	ENTER();
+
+	close();
+
+	EXIT();
+}
+
+/**
+ * 映像ノードと同じUVC機器のメタデータノードを探す
+ * @param video_device 映像ノードのデバイスファイル名
+ * @return 見つからなければ空文字列
+ */
+/*public,static*/
+std::string V4l2UvcMeta::find_meta_device(const std::string &video_device) {
+	ENTER();
+
+	std::string result;
+	struct v4l2_capability video_cap{};
+	int fd = ::open(video_device.c_str(), O_RDWR | O_NONBLOCK, 0);
+	if (fd < 0) {
+		LOGW("Cannot open '%s',errno=%d", video_device.c_str(), errno);
+		RET(result);
+	}
+	const bool ok = xioctl(fd, VIDIOC_QUERYCAP, &video_cap) != -1;
+	::close(fd);
+	if (UNLIKELY(!ok)) {
+		RET(result);
+	}
+	for (int i = 0; i < MAX_VIDEO_DEVICES; i++) {
+		const auto name = format("/dev/video%d", i);
+		if (name == video_device) {
+			continue;
+		}
+		fd = ::open(name.c_str(), O_RDWR | O_NONBLOCK, 0);
+		if (fd < 0) {
+			continue;
+		}
+		struct v4l2_capability cap{};
+		if (xioctl(fd, VIDIOC_QUERYCAP, &cap) != -1) {
+			const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+				? cap.device_caps : cap.capabilities;
+			if ((caps & V4L2_CAP_META_CAPTURE)
+				&& !strncmp((const char *)cap.bus_info, (const char *)video_cap.bus_info, sizeof(cap.bus_info))) {
+				result = name;
+			}
+		}
+		::close(fd);
+		if (!result.empty()) {
+			LOGD("found %s for %s", result.c_str(), video_device.c_str());
+			break;
+		}
+	}
+
+	RET(result);
+}
+
+/**
+ * メタデータノードをオープンしてV4L2_META_FMT_UVCを選択し、バッファーを確保する
+ * @return
+ */
+/*public*/
+int V4l2UvcMeta::open() {
+	ENTER();
+
+	if (UNLIKELY(m_fd > 0)) {
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+	int fd = ::open(device_name.c_str(), O_RDWR | O_NONBLOCK, 0);
+	if (fd < 0) {
+		const int result = -errno;
+		LOGE("Cannot open '%s',errno=%d", device_name.c_str(), -result);
+		RETURN(result, int);
+	}
+	m_fd = fd;
+
+	int result = core::USB_SUCCESS;
+	struct v4l2_capability cap{};
+	struct v4l2_format fmt{};
+	struct v4l2_requestbuffers req {
+		.count = UVC_META_BUFFER_NUMS,
+		.type = V4L2_BUF_TYPE_META_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	if (xioctl(m_fd, VIDIOC_QUERYCAP, &cap) == -1) {
+		result = -errno;
+		LOGE("VIDIOC_QUERYCAP,errno=%d", -result);
+		goto err;
+	}
+	if (!(((cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities)
+		& V4L2_CAP_META_CAPTURE)) {
+
+		LOGE("%s is not a metadata capture device", device_name.c_str());
+		result = core::USB_ERROR_NOT_SUPPORTED;
+		goto err;
+	}
+	// ベンダー独自のメタデータフォーマットがデフォルトになっていることがあるので明示的に選択する
+	fmt.type = V4L2_BUF_TYPE_META_CAPTURE;
+	fmt.fmt.meta.dataformat = V4L2_META_FMT_UVC;
+	if ((xioctl(m_fd, VIDIOC_S_FMT, &fmt) == -1)
+		|| (fmt.fmt.meta.dataformat != V4L2_META_FMT_UVC)) {
+
+		LOGE("V4L2_META_FMT_UVC not supported,errno=%d", errno);
+		result = core::USB_ERROR_NOT_SUPPORTED;
+		goto err;
+	}
+	if ((xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) || !req.count) {
+		result = errno ? -errno : core::USB_ERROR_NO_MEM;
+		LOGE("VIDIOC_REQBUFS,err=%d", result);
+		goto err;
+	}
+	for (uint32_t i = 0; i < req.count; i++) {
+		struct v4l2_buffer buf {
+			.index = i,
+			.type = V4L2_BUF_TYPE_META_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_QUERYBUF,err=%d", result);
+			goto err;
+		}
+		void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, (off_t)buf.m.offset);
+		if (start == MAP_FAILED) {
+			result = -errno;
+			LOGE("mmap,err=%d", result);
+			goto err;
+		}
+		buffers.push_back({ .start = start, .length = buf.length });
+	}
+	LOGD("opened %s,buffers=%" FMT_SIZE_T ",buffersize=%u",
+		device_name.c_str(), buffers.size(), fmt.fmt.meta.buffersize);
+
+	RETURN(result, int);
+
+err:
+	close();
+	RETURN(result, int);
+}
+
+/**
+ * mmapしたバッファーを解放する
+ */
+/*private*/
+void V4l2UvcMeta::release_buffers() {
+	ENTER();
+
+	for (auto &buffer: buffers) {
+		munmap(buffer.start, buffer.length);
+	}
+	buffers.clear();
+
+	EXIT();
+}
+
+/**
+ * メタデータノードを閉じる
+ * @return
+ */
+/*public*/
+int V4l2UvcMeta::close() {
+	ENTER();
+
+	stop();
+	release_buffers();
+	if (m_fd > 0) {
+		::close(m_fd);
+		m_fd = 0;
+	}
+	metas.clear();
+	clock.reset();
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * 全てのバッファーをキューに入れてメタデータの取得を開始する
+ * @return
+ */
+/*public*/
+int V4l2UvcMeta::start() {
+	ENTER();
+
+	if (UNLIKELY(m_fd <= 0)) {
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+	if (streaming) {
+		RETURN(core::USB_SUCCESS, int);
+	}
+	metas.clear();
+	for (uint32_t i = 0; i < buffers.size(); i++) {
+		struct v4l2_buffer buf {
+			.index = i,
+			.type = V4L2_BUF_TYPE_META_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+			const int result = -errno;
+			LOGE("VIDIOC_QBUF,err=%d", result);
+			RETURN(result, int);
+		}
+	}
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+	if (xioctl(m_fd, VIDIOC_STREAMON, &type) == -1) {
+		const int result = -errno;
+		LOGE("VIDIOC_STREAMON,err=%d", result);
+		RETURN(result, int);
+	}
+	streaming = true;
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * メタデータの取得を終了する
+ * @return
+ */
+/*public*/
+int V4l2UvcMeta::stop() {
+	ENTER();
+
+	if (streaming) {
+		enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+		if (xioctl(m_fd, VIDIOC_STREAMOFF, &type) == -1) {
+			LOGE("VIDIOC_STREAMOFF,errno=%d", errno);
+		}
+		streaming = false;
+	}
+
+	RETURN(core::USB_SUCCESS, int);
+}
+
+/**
+ * メタデータバッファーに含まれるuvc_meta_bufを解析する
+ * @param data
+ * @param bytes
+ * @param meta
+ */
+/*private*/
+void V4l2UvcMeta::parse(const uint8_t *data, const size_t &bytes, uvc_meta_t &meta) {
+	ENTER();
+
+	size_t pos = 0;
+	// uvc_meta_bufはパックされていてアライメントされていないのでバイト単位で読み込む
+	while (pos + UVC_META_HEADER_OFFSET + 2 <= bytes) {
+		nsecs_t host_ts;
+		memcpy(&host_ts, data + pos, sizeof(uint64_t));
+		const uint8_t *header = data + pos + UVC_META_HEADER_OFFSET;
+		// bHeaderLengthはbHeaderLength/bmHeaderInfo自体を含む
+		const size_t length = header[0];
+		const uint8_t flags = header[1];
+		if (UNLIKELY((length < 2) || (pos + UVC_META_HEADER_OFFSET + length > bytes))) {
+			break;
+		}
+		const uint8_t *p = header + 2;
+		size_t remain = length - 2;
+		if ((flags & UVC_STREAM_PTS) && (remain >= 4)) {
+			if (!meta.has_pts) {
+				meta.pts = read_le32(p);
+				meta.has_pts = true;
+			}
+			p += 4;
+			remain -= 4;
+		}
+		if ((flags & UVC_STREAM_SCR) && (remain >= 6)) {
+			const uint32_t stc = read_le32(p);
+			if (!meta.has_scr) {
+				meta.stc = stc;
+				meta.sof = read_le16(p + 4) & 0x07ffu;
+				meta.has_scr = true;
+			}
+			clock.add_sample(stc, host_ts);
+		}
+		pos += UVC_META_HEADER_OFFSET + length;
+	}
+
+	EXIT();
+}
+
+/**
+ * 準備できているメタデータを全て取り出す
+ * @return 取り出したメタデータの数, 負ならエラー
+ */
+/*public*/
+int V4l2UvcMeta::dequeue() {
+	ENTER();
+
+	if (UNLIKELY(!streaming)) {
+		RETURN(core::USB_ERROR_INVALID_STATE, int);
+	}
+	int result = 0;
+	for ( ; ; ) {
+		struct v4l2_buffer buf {
+			.type = V4L2_BUF_TYPE_META_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (xioctl(m_fd, VIDIOC_DQBUF, &buf) == -1) {
+			if (errno != EAGAIN) {
+				result = -errno;
+				LOGE("VIDIOC_DQBUF,errno=%d", -result);
+			}
+			break;
+		}
+		if (LIKELY(buf.index < buffers.size())) {
+			uvc_meta_t meta {
+				.sequence = buf.sequence,
+			};
+			parse((const uint8_t *)buffers[buf.index].start,
+				std::min((size_t)buf.bytesused, buffers[buf.index].length), meta);
+			meta.exposure_ts = meta.has_pts ? clock.to_host(meta.pts) : 0;
+			metas.push_back(meta);
+			while (metas.size() > UVC_META_MAX_PENDING) {
+				metas.pop_front();
+			}
+			result++;
+		}
+		if (xioctl(m_fd, VIDIOC_QBUF, &buf) == -1) {
+			result = -errno;
+			LOGE("VIDIOC_QBUF,errno=%d", -result);
+			break;
+		}
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 指定したv4l2_buffer.sequenceのメタデータを取得する
+ * @param sequence
+ * @param meta
+ * @return true: 見つかった, false: 見つからなかった
+ */
+/*public*/
+bool V4l2UvcMeta::find(const uint32_t &sequence, uvc_meta_t &meta) {
+	ENTER();
+
+	while (!metas.empty()) {
+		const auto &front = metas.front();
+		if (front.sequence == sequence) {
+			meta = front;
+			metas.pop_front();
+			RETURN(true, bool);
+		} else if ((int32_t)(front.sequence - sequence) > 0) {
+			// 指定したものより新しいメタデータしかない
+			break;
+		}
+		// 対応する映像フレームが読み飛ばされたメタデータは破棄する
+		metas.pop_front();
+	}
+
+	RETURN(false, bool);
+}
+
+}	// namespace serenegiant::v4l2
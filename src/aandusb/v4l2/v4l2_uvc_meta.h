@@ -0,0 +1,233 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef AANDUSB_V4L2_UVC_META_H
+#define AANDUSB_V4L2_UVC_META_H
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// common
+#include "times.h"
+// v4l2
+#include "v4l2/v4l2.h"
+
+namespace serenegiant::v4l2 {
+
+/**
+ * UVCメタデータから取り出した1フレーム分のペイロードヘッダー情報
+ */
+typedef struct _uvc_meta {
+	/**
+	 * 対応する映像フレームのv4l2_buffer.sequence
+	 */
+	uint32_t sequence;
+	/**
+	 * dwPresentationTime, 機器側クロックでの露光開始時刻, has_pts=falseなら0
+	 */
+	uint32_t pts;
+	/**
+	 * SCRのdwSourceClock, 機器側クロックでのUSBバスへの送出開始時刻, has_scr=falseなら0
+	 */
+	uint32_t stc;
+	/**
+	 * SCRの1KHz SOFカウンター, has_scr=falseなら0
+	 */
+	uint32_t sof;
+	bool has_pts;
+	bool has_scr;
+	/**
+	 * ptsをホスト側のCLOCK_MONOTONICへ変換した露光開始時刻[ナノ秒]
+	 * クロック対応付けのサンプルが足りないときは0
+	 */
+	nsecs_t exposure_ts;
+} uvc_meta_t;
+
+/**
+ * UVC機器側のクロック(SCRのdwSourceClock/PTS)から
+ * ホスト側のCLOCK_MONOTONICへの対応付けを求めるためのヘルパークラス
+ * SCRと受信時刻(uvc_meta_buf.ns)の組を直近UVC_CLOCK_MAX_SAMPLES個だけ保持して
+ * 最小二乗法で1次式を当てはめる
+ * 傾きが機器側クロックの周期になるのでdwClockFrequencyを知らなくても良い
+ */
+class UvcClockRecovery {
+private:
+	typedef struct _sample {
+		/**
+		 * 桁あふれを補正した機器側クロック
+		 */
+		int64_t device_clock;
+		/**
+		 * ホスト側の受信時刻[ナノ秒]
+		 */
+		nsecs_t host_ts;
+	} sample_t;
+
+	std::deque<sample_t> samples;
+	/**
+	 * 最後に追加したサンプルの桁あふれ補正前/補正後の機器側クロック
+	 */
+	uint32_t last_raw;
+	int64_t last_clock;
+	/**
+	 * 当てはめた1次式, host_ts = host_mean + slope * (device_clock - clock_mean)
+	 * slopeが0なら未計算
+	 */
+	double slope;
+	double clock_mean;
+	double host_mean;
+
+	/**
+	 * 32ビットの機器側クロックの桁あふれを補正する
+	 * @param clock
+	 * @return
+	 */
+	int64_t unwrap(const uint32_t &clock) const;
+	/**
+	 * 保持しているサンプルから1次式を当てはめ直す
+	 */
+	void fit();
+public:
+	UvcClockRecovery();
+	~UvcClockRecovery() = default;
+
+	/**
+	 * 保持しているサンプルを破棄する
+	 */
+	void reset();
+	/**
+	 * SCRのdwSourceClockと受信時刻の組を追加する
+	 * @param stc
+	 * @param host_ts
+	 */
+	void add_sample(const uint32_t &stc, const nsecs_t &host_ts);
+	/**
+	 * 機器側クロックをホスト側のCLOCK_MONOTONICへ変換する
+	 * @param clock
+	 * @return ホスト側の時刻[ナノ秒], サンプルが足りないときは0
+	 */
+	nsecs_t to_host(const uint32_t &clock) const;
+	/**
+	 * 当てはめた1次式から求めた機器側クロックの周波数[Hz]
+	 * @return サンプルが足りないときは0
+	 */
+	double get_clock_frequency() const;
+};
+
+/**
+ * UVC機器のメタデータノード(V4L2_BUF_TYPE_META_CAPTURE, V4L2_META_FMT_UVC)から
+ * ペイロードヘッダーを取得して映像フレームとv4l2_buffer.sequenceで対応付ける
+ * uvcvideoはメタデータのバッファーを対応する映像のバッファーの直前に返すので
+ * 映像のバッファーをVIDIOC_DQBUFした後に#dequeueを呼ぶと対応するメタデータを取得できる
+ * 映像取得スレッドからのみ呼び出すこと
+ */
+class V4l2UvcMeta {
+private:
+	typedef struct _meta_buffer {
+		void *start;
+		size_t length;
+	} meta_buffer_t;
+
+	/**
+	 * メタデータノードのデバイスファイル名
+	 */
+	const std::string device_name;
+	int m_fd;
+	bool streaming;
+	std::vector<meta_buffer_t> buffers;
+	/**
+	 * 取得したメタデータ, 古い順
+	 */
+	std::deque<uvc_meta_t> metas;
+	UvcClockRecovery clock;
+
+	/**
+	 * メタデータバッファーに含まれるuvc_meta_bufを解析する
+	 * SCRを含むものはクロック対応付けのサンプルとして追加する
+	 * @param data
+	 * @param bytes
+	 * @param meta
+	 */
+	void parse(const uint8_t *data, const size_t &bytes, uvc_meta_t &meta);
+	/**
+	 * mmapしたバッファーを解放する
+	 */
+	void release_buffers();
+public:
+	/**
+	 * コンストラクタ
+	 * @param device_name メタデータノードのデバイスファイル名
+	 */
+	explicit V4l2UvcMeta(std::string device_name);
+	/**
+	 * デストラクタ
+	 */
+	~V4l2UvcMeta();
+
+	/**
+	 * 映像ノードと同じUVC機器のメタデータノードを探す
+	 * /dev/videoNを順に調べてV4L2_CAP_META_CAPTUREに対応していて
+	 * bus_infoが映像ノードと一致するものを返す
+	 * @param video_device 映像ノードのデバイスファイル名
+	 * @return 見つからなければ空文字列
+	 */
+	static std::string find_meta_device(const std::string &video_device);
+
+	inline const std::string &get_device_name() const { return device_name; };
+	inline bool is_opened() const { return m_fd > 0; };
+
+	/**
+	 * メタデータノードをオープンしてV4L2_META_FMT_UVCを選択し、バッファーを確保する
+	 * @return
+	 */
+	int open();
+	/**
+	 * メタデータノードを閉じる
+	 * @return
+	 */
+	int close();
+	/**
+	 * 全てのバッファーをキューに入れてメタデータの取得を開始する
+	 * 映像ストリームを開始する前に呼び出すこと
+	 * 映像のv4l2_buffer.sequenceは映像ストリーム開始毎に0から始まるので保持しているメタデータは破棄する
+	 * クロック対応付けは機器側のクロックが連続しているので破棄しない
+	 * @return
+	 */
+	int start();
+	/**
+	 * メタデータの取得を終了する
+	 * @return
+	 */
+	int stop();
+	/**
+	 * 準備できているメタデータを全て取り出す
+	 * @return 取り出したメタデータの数, 負ならエラー
+	 */
+	int dequeue();
+	/**
+	 * 指定したv4l2_buffer.sequenceのメタデータを取得する
+	 * 指定したものより古いメタデータは破棄する
+	 * @param sequence
+	 * @param meta
+	 * @return true: 見つかった, false: 見つからなかった
+	 */
+	bool find(const uint32_t &sequence, uvc_meta_t &meta);
+	/**
+	 * 機器側クロックの周波数[Hz]
+	 * @return 不明なら0
+	 */
+	inline double get_clock_frequency() const { return clock.get_clock_frequency(); };
+};
+
+typedef std::unique_ptr<V4l2UvcMeta> V4l2UvcMetaUp;
+typedef std::shared_ptr<V4l2UvcMeta> V4l2UvcMetaSp;
+
+}	// namespace serenegiant::v4l2
+
+#endif //AANDUSB_V4L2_UVC_META_H
@@ -249,7 +249,9 @@ GLTexture::GLTexture(
 #endif
 	eglImage(nullptr),
 	pbo_ix(0),
-	pbo_sync(nullptr), pbo_need_write(false) {
+	pbo_sync(nullptr), pbo_need_write(false),
+	texel_bytes((GLint)(data_type == GL_UNSIGNED_BYTE
+		? get_pixel_bytes(pixel_format) : get_data_bytes(data_type))) {
 
 	ENTER();
 
@@ -517,11 +519,16 @@ void GLTexture::init(const GLint &width, const GLint &height,
 /**
  * テキスチャへイメージを書き込む
  * @param src イメージデータ, コンストラクタで引き渡したフォーマットに合わせること
+ * @param stride 1行分のバイト数, 0またはイメージの横幅分と同じなら隙間なく詰まっている
  * @return
  */
-int GLTexture::assignTexture(const uint8_t *src) {
+int GLTexture::assignTexture(const uint8_t *src, const GLint &stride) {
 	ENTER();
 
+	const GLint row_bytes = mImageWidth * texel_bytes;
+	// 行末に詰め物があるかどうか
+	const bool padded = (stride > row_bytes);
+
 	// テクスチャをバインド
 	bind();
 #if __ANDROID__
@@ -560,7 +567,16 @@ int GLTexture::assignTexture(const uint8_t *src) {
 		auto dst = (uint8_t *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, image_size, GL_MAP_WRITE_BIT);
 		if (LIKELY(dst)) {
 			// write image data into PBO
-			memcpy(dst, src, image_size);
+			if (padded) {
+				// PBOへは隙間なく詰めて書き込む
+				for (int row = 0; row < mImageHeight; row++) {
+					memcpy(dst, src, row_bytes);
+					dst += row_bytes;
+					src += stride;
+				}
+			} else {
+				memcpy(dst, src, image_size);
+			}
 			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
 		}
 		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
@@ -569,14 +585,15 @@ int GLTexture::assignTexture(const uint8_t *src) {
 		uint8_t *dst;
 		AAHardwareBuffer_lock(graphicBuffer, AHARDWAREBUFFER_USAGE_CPU_WRITE_OFTEN, -1, nullptr, (void**) &dst);
 		{
-			if (m_use_powered2) {
-				// イメージサイズとテクスチャサイズが異なるとき
+			if (m_use_powered2 || padded) {
+				// イメージサイズとテクスチャサイズが異なるときまたは行末に詰め物があるとき
 				size_t w = mImageWidth * get_pixel_bytes(PIXEL_FORMAT_INTERNAL);
-				size_t stride = mTexWidth * get_pixel_bytes(PIXEL_FORMAT_INTERNAL);
+				size_t dst_stride = mTexWidth * get_pixel_bytes(PIXEL_FORMAT_INTERNAL);
+				size_t src_stride = padded ? stride : w;
 				for (int row = 0; row < mImageHeight; row++) {
 					memcpy(dst, src, w);
-					dst += stride;
-					src += w;
+					dst += dst_stride;
+					src += src_stride;
 				}
 			} else {
 				// イメージサイズとテクスチャサイズが同じ時は単純コピー
@@ -588,6 +605,36 @@ int GLTexture::assignTexture(const uint8_t *src) {
 	// } else if (eglImage) {
 
 #endif	// #if __ANDROID__
+	} else if (padded) {
+		// PBOを使わずに行末に詰め物があるとき
+#if defined(GL_UNPACK_ROW_LENGTH)
+		if (!(stride % texel_bytes)) {
+			// 1行分のテクセル数を指定してそのまま書き込む
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, stride / texel_bytes);
+			glTexSubImage2D(TEX_TARGET,
+				0,					// ミップマップレベル
+				0, 0,			// オフセットx,y
+				mImageWidth, mImageHeight,	// 上書きするサイズ
+				PIXEL_FORMAT,				// 引き渡すデータのフォーマット
+				DATA_TYPE,					// データの型
+				src);						// ピクセルデータ
+			GLCHECK("glTexSubImage2D");
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			RETURN(0, int);
+		}
+#endif
+		// GL_UNPACK_ROW_LENGTHを使えないときは1行ずつ書き込む
+		for (int row = 0; row < mImageHeight; row++) {
+			glTexSubImage2D(TEX_TARGET,
+				0,					// ミップマップレベル
+				0, row,				// オフセットx,y
+				mImageWidth, 1,		// 上書きするサイズ
+				PIXEL_FORMAT,		// 引き渡すデータのフォーマット
+				DATA_TYPE,			// データの型
+				src);				// ピクセルデータ
+			src += stride;
+		}
+		GLCHECK("glTexSubImage2D");
 	} else {
 		// PBOを使わない時
 		glTexSubImage2D(TEX_TARGET,
@@ -603,6 +650,35 @@ int GLTexture::assignTexture(const uint8_t *src) {
     RETURN(0, int);
 }
 
+/**
+ * テキスチャの指定した行範囲へイメージを書き込む
+ * 複数のメモリーに分かれているイメージ(マルチプレーン等)を1つのテクスチャへ書き込むとき用
+ * PBOは使わずに直接テクスチャへ書き込む
+ * @param src イメージデータ, コンストラクタで引き渡したフォーマットに合わせること
+ * @param y 書き込み開始行
+ * @param rows 書き込む行数
+ * @return
+ */
+int GLTexture::assignTexture(const uint8_t *src, const GLint &y, const GLint &rows) {
+	ENTER();
+
+	if (UNLIKELY((y < 0) || (rows <= 0) || (y + rows > mImageHeight))) {
+		RETURN(-1, int);
+	}
+	// テクスチャをバインド
+	bind();
+	glTexSubImage2D(TEX_TARGET,
+		0,					// ミップマップレベル
+		0, y,				// オフセットx,y
+		mImageWidth, rows,	// 上書きするサイズ
+		PIXEL_FORMAT,		// 引き渡すデータのフォーマット
+		DATA_TYPE,			// データの型
+		src);				// ピクセルデータ
+	GLCHECK("glTexSubImage2D");
+
+	RETURN(0, int);
+}
+
 /**
  * PBOへの書き込み処理が完了していればテクスチャへ反映させる
  * @param timeout 最大待ち時間［ナノ秒］
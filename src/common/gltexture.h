@@ -87,6 +87,10 @@ private:
 	int pbo_ix;
 	GLsync pbo_sync;
 	bool pbo_need_write;
+	/**
+	 * 1テクセルあたりのバイト数
+	 */
+	const GLint texel_bytes;
 #if __ANDROID__
 	// 自前で生成したAHardwareBufferかどうか
 	const bool own_hardware_buffer;
@@ -222,9 +226,21 @@ public:
 	/**
 	 * テキスチャへイメージを書き込む
 	 * @param src イメージデータ, コンストラクタで引き渡したフォーマットに合わせること
+	 * @param stride 1行分のバイト数, 0またはイメージの横幅分と同じなら隙間なく詰まっている
+	 *               v4l2機器等で行末に詰め物があるときはGL_UNPACK_ROW_LENGTHでCPUで詰め直さずに書き込む
+	 * @return
+	 */
+	int assignTexture(const uint8_t *src, const GLint &stride = 0);
+	/**
+	 * テキスチャの指定した行範囲へイメージを書き込む
+	 * 複数のメモリーに分かれているイメージ(マルチプレーン等)を1つのテクスチャへ書き込むとき用
+	 * PBOは使わずに直接テクスチャへ書き込む
+	 * @param src イメージデータ, コンストラクタで引き渡したフォーマットに合わせること
+	 * @param y 書き込み開始行
+	 * @param rows 書き込む行数
 	 * @return
 	 */
-	int assignTexture(const uint8_t *src);
+	int assignTexture(const uint8_t *src, const GLint &y, const GLint &rows);
 	/**
 	 * PBOへの書き込み処理が完了していればテクスチャへ反映させる
 	 * @param timeout 最大待ち時間［ナノ秒］
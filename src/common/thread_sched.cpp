@@ -0,0 +1,250 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#if 1	// set 1 if you don't need debug message
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// ignore LOGV/LOGD/MARK
+	#endif
+	#undef USE_LOGALL
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG		// depends on definition in Android.mk and Application.mk
+#endif
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "utilbase.h"
+#include "charutils.h"
+#include "thread_sched.h"
+
+namespace serenegiant {
+
+/**
+ * スケジューリングポリシーを文字列に変換
+ * @param policy
+ * @return
+ */
+static const char *policy_string(const int &policy) {
+	switch (policy) {
+	case SCHED_OTHER:	return "SCHED_OTHER";
+	case SCHED_FIFO:	return "SCHED_FIFO";
+	case SCHED_RR:		return "SCHED_RR";
+#ifdef SCHED_BATCH
+	case SCHED_BATCH:	return "SCHED_BATCH";
+#endif
+#ifdef SCHED_IDLE
+	case SCHED_IDLE:	return "SCHED_IDLE";
+#endif
+	default:			return "unknown";
+	}
+}
+
+/**
+ * "fifo:50", "rr:10", "other"のような文字列からスケジューリングポリシーと優先度を取得する
+ * 空文字列なら変更しない
+ * @param str
+ * @param sched
+ * @return 0: 成功, 0以外: 文字列が正しくない
+ */
+int parse_sched_policy(const std::string &str, thread_sched_t &sched) {
+	ENTER();
+
+	if (str.empty()) {
+		sched.policy = -1;
+		sched.priority = 0;
+		RETURN(0, int);
+	}
+	const auto pos = str.find(':');
+	const auto name = str.substr(0, pos);
+	int policy;
+	if (name == "fifo") {
+		policy = SCHED_FIFO;
+	} else if (name == "rr") {
+		policy = SCHED_RR;
+	} else if (name == "other") {
+		policy = SCHED_OTHER;
+	} else {
+		LOGW("unknown policy '%s'", str.c_str());
+		RETURN(-EINVAL, int);
+	}
+	int priority = 0;
+	if (pos != std::string::npos) {
+		priority = atoi(str.c_str() + pos + 1);
+	}
+	if ((policy != SCHED_OTHER)
+		&& ((priority < sched_get_priority_min(policy)) || (priority > sched_get_priority_max(policy)))) {
+
+		LOGW("invalid priority '%s'", str.c_str());
+		RETURN(-EINVAL, int);
+	}
+	sched.policy = policy;
+	sched.priority = policy != SCHED_OTHER ? priority : 0;
+
+	RETURN(0, int);
+}
+
+/**
+ * "2", "0,2", "2-3"のような文字列からスレッドを実行するCPU番号を取得する
+ * 空文字列なら変更しない
+ * @param str
+ * @param sched
+ * @return 0: 成功, 0以外: 文字列が正しくない
+ */
+int parse_cpu_list(const std::string &str, thread_sched_t &sched) {
+	ENTER();
+
+	std::vector<int> cpus;
+	size_t start = 0;
+	while (start < str.size()) {
+		auto end = str.find(',', start);
+		if (end == std::string::npos) {
+			end = str.size();
+		}
+		const auto item = str.substr(start, end - start);
+		const auto dash = item.find('-');
+		char *e;
+		const int first = (int)strtol(item.c_str(), &e, 10);
+		int last = first;
+		if (dash != std::string::npos) {
+			last = (int)strtol(item.c_str() + dash + 1, &e, 10);
+		}
+		if ((e == item.c_str()) || (*e != '\0') || (first < 0) || (last < first) || (last >= CPU_SETSIZE)) {
+			LOGW("invalid cpu list '%s'", str.c_str());
+			RETURN(-EINVAL, int);
+		}
+		for (int cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+		start = end + 1;
+	}
+	sched.cpus = std::move(cpus);
+
+	RETURN(0, int);
+}
+
+/**
+ * 呼び出したスレッドのスケジューリングポリシー・優先度・CPUアフィニティを変更する
+ * SCHED_FIFO/SCHED_RRにはCAP_SYS_NICE(またはRLIMIT_RTPRIO)が必要
+ * 変更できなかったときもそのまま実行できるように警告を出すだけ
+ * 変更後の実際の値をログへ出力する
+ * @param sched
+ * @param name ログ出力用のスレッド名
+ * @return 0: 成功, 0以外: 一部または全部を変更できなかった
+ */
+int apply_thread_sched(const thread_sched_t &sched, const char *name) {
+	ENTER();
+
+	int result = 0;
+	const auto self = pthread_self();
+	if (sched.policy >= 0) {
+		struct sched_param param {
+			.sched_priority = sched.priority,
+		};
+		const int r = pthread_setschedparam(self, sched.policy, &param);
+		if (UNLIKELY(r)) {
+			LOGW("%s:failed to set %s,priority=%d,err=%d",
+				name, policy_string(sched.policy), sched.priority, r);
+			result = -r;
+		}
+	}
+	if (!sched.cpus.empty()) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (const auto cpu: sched.cpus) {
+			CPU_SET(cpu, &cpus);
+		}
+		const int r = pthread_setaffinity_np(self, sizeof(cpus), &cpus);
+		if (UNLIKELY(r)) {
+			LOGW("%s:failed to set cpu affinity,err=%d", name, r);
+			result = -r;
+		}
+	}
+	LOGI("%s:%s", name, get_thread_sched_string().c_str());
+
+	RETURN(result, int);
+}
+
+/**
+ * 呼び出したスレッドの現在のスケジューリングポリシー・優先度・CPUアフィニティを文字列として取得する
+ * @return
+ */
+std::string get_thread_sched_string() {
+	ENTER();
+
+	const auto self = pthread_self();
+	int policy = SCHED_OTHER;
+	struct sched_param param {};
+	pthread_getschedparam(self, &policy, &param);
+	std::string cpu_str;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	if (!pthread_getaffinity_np(self, sizeof(cpus), &cpus)) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &cpus)) {
+				if (!cpu_str.empty()) {
+					cpu_str += ",";
+				}
+				cpu_str += std::to_string(cpu);
+			}
+		}
+	}
+
+	RET(format("policy=%s,priority=%d,cpus=%s",
+		policy_string(policy), param.sched_priority, cpu_str.c_str()));
+}
+
+/**
+ * プロセスのメモリーを全てロックしてスワップアウト・ページフォルトしないようにする
+ * 以降に確保するメモリーもロックされる
+ * 要CAP_IPC_LOCK(またはRLIMIT_MEMLOCK)
+ * @return 0: 成功, 0以外: -errno
+ */
+int lock_memory() {
+	ENTER();
+
+	int result = 0;
+	if (UNLIKELY(mlockall(MCL_CURRENT | MCL_FUTURE))) {
+		result = -errno;
+		LOGW("mlockall failed,errno=%d", -result);
+	} else {
+		LOGI("memory locked");
+	}
+
+	RETURN(result, int);
+}
+
+/**
+ * 指定したメモリーを1ページずつ読み込んで予めページフォルトさせておく
+ * mmapしたv4l2機器のバッファー等を初回アクセス時にページフォルトさせないために使う
+ * @param ptr
+ * @param bytes
+ */
+void prefault_memory(const void *ptr, const size_t &bytes) {
+	ENTER();
+
+	if (ptr && bytes) {
+		const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+		auto p = (const volatile uint8_t *)ptr;
+		for (size_t i = 0; i < bytes; i += page_size) {
+			(void)p[i];
+		}
+		(void)p[bytes - 1];
+	}
+
+	EXIT();
+}
+
+}	// namespace serenegiant
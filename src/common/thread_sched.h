@@ -0,0 +1,83 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+#ifndef THREAD_SCHED_H_
+#define THREAD_SCHED_H_
+
+#include <string>
+#include <vector>
+
+namespace serenegiant {
+
+/**
+ * スレッドのスケジューリングポリシー・優先度・CPUアフィニティ
+ */
+typedef struct _thread_sched {
+	/**
+	 * SCHED_OTHER/SCHED_FIFO/SCHED_RR, 負なら変更しない
+	 */
+	int policy = -1;
+	/**
+	 * SCHED_FIFO/SCHED_RRのときの優先度(1-99)
+	 */
+	int priority = 0;
+	/**
+	 * スレッドを実行するCPU番号, 空なら変更しない
+	 */
+	std::vector<int> cpus;
+} thread_sched_t;
+
+/**
+ * "fifo:50", "rr:10", "other"のような文字列からスケジューリングポリシーと優先度を取得する
+ * 空文字列なら変更しない
+ * @param str
+ * @param sched
+ * @return 0: 成功, 0以外: 文字列が正しくない
+ */
+int parse_sched_policy(const std::string &str, thread_sched_t &sched);
+/**
+ * "2", "0,2", "2-3"のような文字列からスレッドを実行するCPU番号を取得する
+ * 空文字列なら変更しない
+ * @param str
+ * @param sched
+ * @return 0: 成功, 0以外: 文字列が正しくない
+ */
+int parse_cpu_list(const std::string &str, thread_sched_t &sched);
+/**
+ * 呼び出したスレッドのスケジューリングポリシー・優先度・CPUアフィニティを変更する
+ * SCHED_FIFO/SCHED_RRにはCAP_SYS_NICE(またはRLIMIT_RTPRIO)が必要
+ * 変更できなかったときもそのまま実行できるように警告を出すだけ
+ * 変更後の実際の値をログへ出力する
+ * @param sched
+ * @param name ログ出力用のスレッド名
+ * @return 0: 成功, 0以外: 一部または全部を変更できなかった
+ */
+int apply_thread_sched(const thread_sched_t &sched, const char *name);
+/**
+ * 呼び出したスレッドの現在のスケジューリングポリシー・優先度・CPUアフィニティを文字列として取得する
+ * @return
+ */
+std::string get_thread_sched_string();
+
+/**
+ * プロセスのメモリーを全てロックしてスワップアウト・ページフォルトしないようにする
+ * 以降に確保するメモリーもロックされる
+ * 要CAP_IPC_LOCK(またはRLIMIT_MEMLOCK)
+ * @return 0: 成功, 0以外: -errno
+ */
+int lock_memory();
+/**
+ * 指定したメモリーを1ページずつ読み込んで予めページフォルトさせておく
+ * mmapしたv4l2機器のバッファー等を初回アクセス時にページフォルトさせないために使う
+ * @param ptr
+ * @param bytes
+ */
+void prefault_memory(const void *ptr, const size_t &bytes);
+
+}	// namespace serenegiant
+
+#endif /* THREAD_SCHED_H_ */
@@ -93,9 +93,25 @@ std::unordered_map<std::string, std::string> init_options() {
 	std::unordered_map<std::string, std::string> options;
 //	options[OPT_DEBUG_EXIT_ESC] = "";
 //	options[OPT_DEBUG_SHOW_FPS] = "";
+//	options[OPT_EXPBUF] = "";
+//	options[OPT_LATEST_FRAME] = "";
+//	options[OPT_AUTO_FORMAT] = "";
+//	options[OPT_REPLAY] = "";
+//	options[OPT_REPLAY_FAST] = "";
+//	options[OPT_REPLAY_LOOP] = "";
+//	options[OPT_RECORD] = "";
+//	options[OPT_CAPTURE_SCHED] = "";
+//	options[OPT_CAPTURE_CPUS] = "";
+//	options[OPT_RENDER_SCHED] = "";
+//	options[OPT_RENDER_CPUS] = "";
+//	options[OPT_MLOCK] = "";
+//	options[OPT_UVC_META] = "";
+//	options[OPT_ANALYSIS] = "";
+//	options[OPT_STALL_DETECT] = "";
 	options[OPT_DEVICE] = OPT_DEVICE_DEFAULT;
 	options[OPT_UDMABUF] = OPT_UDMABUF_DEFAULT;
 	options[OPT_BUF_NUMS] = OPT_BUF_NUMS_DEFAULT;
+	options[OPT_CAP_CACHE] = OPT_CAP_CACHE_DEFAULT;
 	options[OPT_WIDTH] = OPT_WIDTH_DEFAULT;
 	options[OPT_HEIGHT] = OPT_HEIGHT_DEFAULT;
 
@@ -44,21 +44,66 @@ namespace serenegiant::app {
 // V4L2機器から映像データを受け取る際に使うUDMABUFのデバイスファイル名, デフォルトはOPT_UDMABUF_DEFAULT="/dev/udmabuf0"
 #define OPT_UDMABUF "udmabuf"
 // V4L2機器から映像データを受け取る際に使うバッファの数、デフォルトはOPT_BUF_NUMS_DEFAULT="4"
+// OPT_BUF_NUMS_AUTO="auto"ならフレーム落ちや遅延に応じて自動調整する
 #define OPT_BUF_NUMS "buf_nums"
+// 描画が間に合わないときに古い映像を読み飛ばして最新の映像だけを描画するかどうか
+#define OPT_LATEST_FRAME "latest_frame"
+// UDMABUFを使えないときにV4L2機器のバッファーをdma-bufとしてエクスポート(VIDIOC_EXPBUF)してEGLImageで描画するかどうか
+#define OPT_EXPBUF "expbuf"
+// V4L2機器の対応ピクセルフォーマット・解像度・フレームレート・コントロール機能をキャッシュするディレクトリ
+// デフォルトはOPT_CAP_CACHE_DEFAULT="v4l2_cache", 空文字列ならキャッシュしない
+#define OPT_CAP_CACHE "cap_cache"
+// 映像取得開始後にV4L2機器が対応しているピクセルフォーマット・フレームレートを順に試行して
+// 30fpsを維持できるうちで最も遅延が小さいものを自動選択するかどうか
+// 選んだ結果はOPT_CAP_CACHEのキャッシュへV4L2機器毎に保存して次回からはそのまま使う
+#define OPT_AUTO_FORMAT "auto_format"
 // V4L2機器から受け取る映像データの幅, デフォルトはOPT_WIDTH_DEFAULT="1920"
 #define OPT_WIDTH "width"
 // V4L2機器から受け取る映像データの高さ, デフォルトはOPT_HEIGHT_DEFAULT="1080"
 #define OPT_HEIGHT "height"
+// V4L2機器の代わりに再生する映像記録ファイル, 指定しなければV4L2機器から映像を取得する
+#define OPT_REPLAY "replay"
+// 映像記録ファイルを記録時のタイムスタンプに合わせずにできるだけ速く再生するかどうか
+#define OPT_REPLAY_FAST "replay_fast"
+// 映像記録ファイルを最後まで再生したら先頭から繰り返すかどうか
+#define OPT_REPLAY_LOOP "replay_loop"
+// V4L2機器から受け取った映像を書き込む映像記録ファイル, 指定しなければ記録しない
+#define OPT_RECORD "record"
+// 映像取得スレッドのスケジューリングポリシーと優先度, "fifo:50", "rr:10", "other"等
+// 指定しなければ変更しない, SCHED_FIFO/SCHED_RRにはCAP_SYS_NICEが必要
+#define OPT_CAPTURE_SCHED "capture_sched"
+// 映像取得スレッドを実行するCPU番号, "2", "0,2", "2-3"等, 指定しなければ変更しない
+#define OPT_CAPTURE_CPUS "capture_cpus"
+// 描画スレッドのスケジューリングポリシーと優先度, 書式はOPT_CAPTURE_SCHEDと同じ
+#define OPT_RENDER_SCHED "render_sched"
+// 描画スレッドを実行するCPU番号, 書式はOPT_CAPTURE_CPUSと同じ
+#define OPT_RENDER_CPUS "render_cpus"
+// メモリーをロック(mlockall)して映像受け取りバッファーを予めページフォルトさせておくかどうか
+// CAP_IPC_LOCKまたは十分なRLIMIT_MEMLOCKが必要
+#define OPT_MLOCK "mlock"
+// UVC機器のメタデータノード, "auto"なら映像ノードと同じUVC機器のものを探す
+// 指定しなければメタデータを取得しない
+#define OPT_UVC_META "uvc_meta"
+// 解析用の低解像度映像を受け取るv4l2機器, "auto"なら映像ノードと同じ機器の別の映像ノードを探す
+// 指定しなければ解析用映像を取得しない
+#define OPT_ANALYSIS "analysis"
+// 映像が途切れたときにVIDIOC_STREAMOFF/ON・VIDIOC_REQBUFSからやり直して自動で復帰させるかどうか
+// 指定しなければ復帰処理を行わない(機器の切断・再接続はこの指定に関係なく扱う)
+#define OPT_STALL_DETECT "stall_detect"
 
 // コマンドラインオプションのデフォルト値
 #define OPT_DEVICE_DEFAULT "/dev/video0"
 #define OPT_UDMABUF_DEFAULT "/dev/udmabuf0"
 #define OPT_BUF_NUMS_DEFAULT "4"
+#define OPT_BUF_NUMS_AUTO "auto"
+#define OPT_UVC_META_AUTO "auto"
+#define OPT_ANALYSIS_AUTO "auto"
+#define OPT_CAP_CACHE_DEFAULT "v4l2_cache"
 #define OPT_WIDTH_DEFAULT "1920"
 #define OPT_HEIGHT_DEFAULT "1080"
 
 // 短い形式のコマンドラインオプション(-オプション、うまく動かない)
-#define SHORT_OPTS "efd:u:n:w:h"
+#define SHORT_OPTS "efd:u:n:lxc:gw:hp:aor:s:k:t:y:mv:z:j"
 // 長い形式のコマンドラインオプション定義(--オプション)
 const struct option LONG_OPTS[] = {
 	{ OPT_DEBUG_EXIT_ESC,	no_argument,		nullptr,	'e' },
@@ -66,8 +111,24 @@ const struct option LONG_OPTS[] = {
 	{ OPT_DEVICE,			required_argument,	nullptr,	'd' },
 	{ OPT_UDMABUF,			required_argument,	nullptr,	'u' },
 	{ OPT_BUF_NUMS,			required_argument,	nullptr,	'n' },
+	{ OPT_LATEST_FRAME,		no_argument,		nullptr,	'l' },
+	{ OPT_EXPBUF,			no_argument,		nullptr,	'x' },
+	{ OPT_CAP_CACHE,		required_argument,	nullptr,	'c' },
+	{ OPT_AUTO_FORMAT,		no_argument,		nullptr,	'g' },
 	{ OPT_WIDTH,			required_argument,	nullptr,	'w' },
 	{ OPT_HEIGHT,			required_argument,	nullptr,	'h' },
+	{ OPT_REPLAY,			required_argument,	nullptr,	'p' },
+	{ OPT_REPLAY_FAST,		no_argument,		nullptr,	'a' },
+	{ OPT_REPLAY_LOOP,		no_argument,		nullptr,	'o' },
+	{ OPT_RECORD,			required_argument,	nullptr,	'r' },
+	{ OPT_CAPTURE_SCHED,	required_argument,	nullptr,	's' },
+	{ OPT_CAPTURE_CPUS,		required_argument,	nullptr,	'k' },
+	{ OPT_RENDER_SCHED,		required_argument,	nullptr,	't' },
+	{ OPT_RENDER_CPUS,		required_argument,	nullptr,	'y' },
+	{ OPT_MLOCK,			no_argument,		nullptr,	'm' },
+	{ OPT_UVC_META,			required_argument,	nullptr,	'v' },
+	{ OPT_ANALYSIS,			required_argument,	nullptr,	'z' },
+	{ OPT_STALL_DETECT,		no_argument,		nullptr,	'j' },
 	{ 0,					0,					0,			0  },
 };
 
@@ -37,6 +37,7 @@
 #include <cstring>
 #include <sstream>
 #include <iterator>	// istream_iterator
+#include <vector>
 
 #include <drm/drm_fourcc.h>
 
@@ -76,6 +77,9 @@ namespace serenegiant::app {
 #define UPDATE_STATE_INTERVAL_MS (1000)
 // キーモードをリセットするまでの待機時間[ミリ秒]
 #define KEY_MODE_RESET_DELAY_MS (5000)
+// カメラ再接続時に映像取得を再開できなかったときの再試行間隔[ミリ秒]と最大再試行回数
+#define CAMERA_RETRY_INTERVAL_MS (1000)
+#define CAMERA_RETRY_NUMS (5)
 
 #if MEAS_TIME
 #define MEAS_TIME_INIT static nsecs_t _meas_time_ = 0;\
@@ -119,14 +123,15 @@ EyeApp::EyeApp(
 	height(to_int(options[OPT_HEIGHT], to_int(OPT_HEIGHT_DEFAULT, 1080))),
 	app_settings(), camera_settings(),
 	window(width, height, "VSP4L EyeApp"),
-	source(nullptr),
+	source(nullptr), analysis(nullptr),
+	hotplug(nullptr), recorder(nullptr), camera_connected(false), warm_reconnect(false),
 	m_egl(nullptr),
 	video_renderer(nullptr), image_renderer(nullptr),
 	offscreen(nullptr), screen_renderer(nullptr),
     req_change_effect(false), req_freeze(false),
 	req_effect_type(EFFECT_NON), current_effect(req_effect_type),
 	key_dispatcher(handler),
-	mvp_matrix(), zoom_ix(DEFAULT_ZOOM_IX), brightness_ix(5),
+	mvp_matrix(), zoom_ix(DEFAULT_ZOOM_IX), current_device_zoom(1.0f), exposure_latency(0), display_ts(0), brightness_ix(5),
 	reset_mode_task(nullptr),
 	default_font(nullptr), large_font(nullptr),
 	show_brightness(false), show_zoom(false),
@@ -147,6 +152,12 @@ EyeApp::EyeApp(
 	resources = format("%s/resources", current_path);
 
 	app_settings.load();
+	if (options.find(OPT_MLOCK) != options.end()) {
+		// 映像取得・描画中にスワップアウト・ページフォルトしないようにメモリーをロックする
+		lock_memory();
+	}
+	// 描画スレッドのスケジューリングポリシー・優先度・CPUアフィニティ
+	window.set_thread_sched(get_thread_sched(OPT_RENDER_SCHED, OPT_RENDER_CPUS));
 	mvp_matrix.scale(ZOOM_FACTORS[zoom_ix]);
 	key_dispatcher
 		.set_on_key_mode_changed([this](const key_mode_t &key_mode) {
@@ -215,8 +226,8 @@ EyeApp::EyeApp(
 			r = 0;
 		} else {
 			// 一時的に設定を適用する
-			int32_t val = value.current;
-			r = set_ctrl_value(value.id, val);
+			// キーを押し続けたときに要求が溜まらないようにワーカースレッド上でまとめて書き込む
+			r = source ? source->post_ctrl_value(value.id, value.current) : -1;
 		}
 
 		RETURN(r, int);
@@ -310,7 +321,56 @@ void EyeApp::on_resume() {
 	ENTER();
 
 	frame_wrapper = std::make_unique<core::WrappedVideoFrame>(nullptr, 0);
-    source = std::make_unique<v4l2::V4l2Source>(options[OPT_DEVICE].c_str(), !HANDLE_FRAME, options[OPT_UDMABUF].c_str());
+	const bool replay = !options[OPT_REPLAY].empty();
+	if (replay) {
+		// V4L2機器の代わりに映像記録ファイルを再生する
+		auto replay_source = std::make_unique<v4l2::V4l2ReplaySource>(options[OPT_REPLAY]);
+		replay_source->set_realtime(options.find(OPT_REPLAY_FAST) == options.end())
+			.set_loop(options.find(OPT_REPLAY_LOOP) != options.end());
+		source = std::move(replay_source);
+	} else {
+		source = std::make_unique<v4l2::V4l2Source>(options[OPT_DEVICE].c_str(), !HANDLE_FRAME, options[OPT_UDMABUF].c_str());
+	}
+	// UDMABUFを使えないときはVIDIOC_EXPBUFでエクスポートしたdma-bufをEGLImageとして使う
+	source->set_export_dmabuf(options.find(OPT_EXPBUF) != options.end());
+	// 描画が間に合わないときは古い映像を読み飛ばして最新の映像だけを描画する
+	source->set_latest_only(options.find(OPT_LATEST_FRAME) != options.end());
+	// 映像取得スレッドのスケジューリングポリシー・優先度・CPUアフィニティ
+	source->set_thread_sched(get_thread_sched(OPT_CAPTURE_SCHED, OPT_CAPTURE_CPUS));
+	source->set_prefault(options.find(OPT_MLOCK) != options.end());
+	// 映像が途切れたときの自動復帰は露出時間が長い機器等で誤検出しないように指定したときだけ行う
+	source->set_stall_detect(!replay && (options.find(OPT_STALL_DETECT) != options.end()));
+	if (!replay && !options[OPT_UVC_META].empty()) {
+		// UVC機器のメタデータノードからPTS/SCRを取得して露光開始時刻を求める
+		const auto &meta_device = options[OPT_UVC_META];
+		source->set_uvc_meta(true, meta_device == OPT_UVC_META_AUTO ? "" : meta_device);
+	}
+	if (!replay && !options[OPT_ANALYSIS].empty()) {
+		// 表示用映像とは別の映像ノードから低解像度の映像を受け取って解析する
+		const auto &analysis_device = options[OPT_ANALYSIS];
+		const auto dev_node = analysis_device == OPT_ANALYSIS_AUTO
+			? v4l2::V4l2AnalysisSource::find_capture_device(options[OPT_DEVICE])
+			: analysis_device;
+		if (!dev_node.empty()) {
+			analysis = std::make_unique<v4l2::V4l2AnalysisSource>(dev_node);
+		} else {
+			LOGW("analysis device not found,continue without analysis");
+		}
+	}
+	// カメラ側でコントロール機能の値が変わったとき(自動露出等)はOSDへ反映する
+	source->set_on_ctrl_changed([this](const uvc::control_value32_t &values) {
+		handler.post([this, values]() {
+			osd.on_ctrl_changed(values);
+		});
+	})
+	.set_on_source_changed([](const uint32_t &changes) {
+		// 解像度が変わったときはV4l2Source側でネゴシエーションし直す
+		LOGI("source changed,changes=0x%x", changes);
+	});
+	// 2回目以降の起動時はV4L2機器の対応ピクセルフォーマット等を列挙する代わりにキャッシュを使う
+	if (!options[OPT_CAP_CACHE].empty()) {
+		source->set_cap_cache(std::make_shared<v4l2::V4l2CapCache>(options[OPT_CAP_CACHE]));
+	}
 #if BUFFURING || HANDLE_FRAME
 	const auto versionStr = (const char*)glGetString(GL_VERSION);
 	LOGD("GL_VERSION=%s", versionStr);
@@ -319,6 +379,12 @@ void EyeApp::on_resume() {
 	video_renderer = std::make_unique<core::VideoGLRenderer>(gl_version, 0, false);
 #else
 	source->set_on_start([this]() {
+		if (m_egl) {
+			// カメラ再接続時は既存の共有EGL/GLESコンテキストと描画用オブジェクトを再利用する
+			LOGD("reuse shared context");
+			m_egl->makeDefault();
+			return;
+		}
 		// 共有EGL/GLESコンテキストを生成してこのスレッドに割り当てる
 		LOGD("create shared context");
 		auto display = glfwGetEGLDisplay();
@@ -330,26 +396,62 @@ void EyeApp::on_resume() {
 
 		// 共有EGL/GLコンテキスト上でvideo_rendererとimage_rendererを初期化
 		video_renderer = std::make_unique<core::VideoGLRenderer>(gl_version, 0, false);
-		image_renderer = create_renderer(EFFECT_NON);
+		// dma-bufからのEGLImageはGL_TEXTURE_EXTERNAL_OESとして描画する
+		if (gl_version >= 300) {
+			image_renderer = std::make_unique<gl::GLRenderer>(texture_gl3_vsh, rgba_gl3_ext_fsh, true);
+		} else {
+			image_renderer = std::make_unique<gl::GLRenderer>(texture_gl2_vsh, rgba_gl2_ext_fsh, true);
+		}
+		image_wrapper = std::make_unique<egl::EglImageWrapper>(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE0, 0);
 		// オフスクリーンを生成
 		offscreen = std::make_unique<gl::GLOffScreen>(GL_TEXTURE0, width, height, false);
 	})
 	.set_on_stop([this]() {
+		if (warm_reconnect) {
+			// カメラ抜去時は再接続時に再利用するので共有EGL/GLESコンテキストを
+			// このスレッドから切り離すだけにする
+			eglMakeCurrent(eglGetCurrentDisplay(), EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			return;
+		}
 		reset_renderers();
 		m_egl.reset();
 	});
 #endif // #if BUFFURING || HANDLE_FRAME
 
 	source->set_on_error([this]() {
-		window.terminate();
+		if (hotplug && hotplug->is_running()) {
+			// 抜去によるエラーのときはhotplug側で再接続を待つので
+			// 少し待ってからまだ接続されているのにエラーになっている場合のみ終了する
+			handler.post_delayed([this]() {
+				if (camera_connected && hotplug && hotplug->is_attached()) {
+					window.terminate();
+				}
+			}, 500);
+		} else {
+			window.terminate();
+		}
 	})
 	.set_on_frame_ready([this](const uint8_t *image, const size_t &bytes, const v4l2::buffer_t &buf) {
     	MEAS_TIME_INIT
 
 		MEAS_TIME_START
+		// dma-bufをCPUから読み込むときだけキャッシュを同期する
+		// EGLImageでGPUから読み込むときは同期しない
+		bool cpu_access = false;
+		const auto begin_cpu_access = [&buf, &cpu_access]() {
+			if (!cpu_access) {
+				cpu_access = true;
+				v4l2::begin_cpu_access(buf);
+			}
+		};
+		if (recorder) {
+			begin_cpu_access();
+			recorder->write(image, bytes, buf);
+		}
 #if BUFFURING
 		std::lock_guard<std::mutex> lock(image_lock);
 		buffer.resize(width, height, source->get_frame_type());
+		begin_cpu_access();
 		memcpy(buffer.frame(), image, bytes);
 #else
 #if !HANDLE_FRAME
@@ -362,18 +464,32 @@ void EyeApp::on_resume() {
 		if (LIKELY(offscreen)) {
 			if (!req_freeze) {
 				// フリーズ中でなければオフスクリーンテクスチャをカメラ映像で更新する
-				const auto try_egl_image = buf.fd != 0;
+				const auto try_egl_image = (buf.fd != 0) && image_wrapper && image_renderer;
 				auto display = eglGetCurrentDisplay();
 				EGLImageKHR egl_image = EGL_NO_IMAGE_KHR;
 				if (try_egl_image) {
 					// EGLImageKHRを使ったゼロコピーテクスチャでの描画を試みる場合
-					// FIXME 未実装 EGLIMageKHRを生成
-					egl_image = egl::createEGLImage(display, buf.fd, DRM_FORMAT_UYVY,
-						width, height, buf.offset, width);
+					// 今はパックドYUV422のときのみ対応
+					EGLint fourcc = 0;
+					switch (source->get_pixel_format()) {
+					case V4L2_PIX_FMT_YUYV:
+						fourcc = DRM_FORMAT_YUYV;
+						break;
+					case V4L2_PIX_FMT_UYVY:
+						fourcc = DRM_FORMAT_UYVY;
+						break;
+					default:
+						break;
+					}
+					if (fourcc) {
+						// YUV422は1ピクセル2バイト, 行末に詰め物があるときはbytesperlineをピッチにする
+						const uint32_t pitch = MAX(buf.planes[0].bytesperline, width * 2);
+						egl_image = egl::createEGLImage(display, buf.fd, fourcc,
+							width, height, buf.offset, pitch);
+					}
 				}
 				if (egl_image) {
 					// EGLImageKHRを生成できたとき
-					// FIXME 未実装 EGLIMageWrapperでラップ、image_rendererで描画する
 					image_wrapper->wrap(egl_image, width, height, width);
 					{
 						offscreen->bind();
@@ -382,14 +498,29 @@ void EyeApp::on_resume() {
 						}
 						offscreen->unbind();
 					}
+					// unwrapでEGLImageKHRも破棄される
 					image_wrapper->unwrap();
-					egl::EGL.eglDestroyImageKHR(display, egl_image);
-					EGLCHECK("eglDestroyImageKHR");
-				} else if (frame_wrapper && video_renderer) {
+				} else if (image && frame_wrapper && video_renderer) {
 					// 4K2Kのディスプレーだとglfwのウインドウが画面全体へ広がらないのに
 					// ウインドウサイズとして画面全体を返すのでビューポートの設定がおかしくなって
 					// バッファリングありよりカメラ映像の画角が狭くなってしまう
-					frame_wrapper->assign(const_cast<uint8_t *>(image), bytes, width, height, source->get_frame_type());
+					if (buf.num_planes > 1) {
+						// マルチプレーンのときは各プレーンをそのままVideoGLRendererへ渡す
+						uint8_t *planes[MAX_BUFFER_PLANES];
+						uint32_t steps[MAX_BUFFER_PLANES];
+						for (uint32_t i = 0; i < buf.num_planes; i++) {
+							planes[i] = (uint8_t *)buf.planes[i].start + buf.planes[i].data_offset;
+							steps[i] = buf.planes[i].bytesperline;
+						}
+						frame_wrapper->assign(planes, (int)buf.num_planes, width, height, source->get_frame_type(), steps);
+					} else {
+						// 行末に詰め物があるときはbytesperlineを渡してテクスチャへの転送時に読み飛ばす
+						frame_wrapper->assign(const_cast<uint8_t *>(image), bytes, width, height,
+							source->get_frame_type(), buf.planes[0].bytesperline);
+					}
+					v4l2::set_frame_header_info(*frame_wrapper, buf);
+					// テクスチャへの転送・MJPEGのデコードでCPUから読み込む
+					begin_cpu_access();
 					offscreen->bind();
 					{
 						video_renderer->draw_frame(*frame_wrapper);
@@ -400,27 +531,22 @@ void EyeApp::on_resume() {
 		}	// if (LIKELY(offscreen))
 
 #endif // #if BUFFURING
+		if (cpu_access) {
+			v4l2::end_cpu_access(buf);
+		}
+		if (buf.exposure_ts) {
+			exposure_latency = systemTime() - buf.exposure_ts;
+		}
+		// 解析用映像にはUVCメタデータが無いことがあるので
+		// 解析結果とは露光開始時刻ではなく両方にあるv4l2_buffer.timestampで突き合わせる
+		display_ts = buf.timestamp;
 
 		MEAS_TIME_STOP
 
 		return bytes;
 	});	// source->set_on_frame_ready
 
-	if (!source || source->open() || source->find_stream(width, height)) {
-		LOGE("カメラをオープンできなかった");
-		source.reset();
-		window.stop();
-		EXIT();
-	}
-
-	LOGV("supported=%s", source->get_supported_size().c_str());
-	source->resize(width, height);
-	if (source->is_ctrl_supported(V4L2_CID_FRAMERATE)) {
-		LOGD("set frame rate to 30");
-		source->set_ctrl_value(V4L2_CID_FRAMERATE, 30);
-	}
-	const auto buf_nums = to_int(options[OPT_BUF_NUMS], to_int(OPT_BUF_NUMS_DEFAULT, 4));
-	if (source->start(buf_nums)) {
+	if (!source || start_camera()) {
 		LOGE("カメラを開始できなかった");
 		source.reset();
 		window.stop();
@@ -442,6 +568,176 @@ void EyeApp::on_resume() {
 
 	req_change_matrix = true;
 
+	if (replay) {
+		// 映像記録ファイルの再生時は抜去/再接続を監視しない
+		EXIT();
+	}
+
+	// カメラの抜去/再接続を監視する
+	hotplug = std::make_unique<v4l2::V4l2Hotplug>(options[OPT_DEVICE]);
+	hotplug->set_on_detach([this](const std::string &dev_node) {
+		handler.post([this]() {
+			on_camera_detached();
+		});
+	})
+	.set_on_attach([this](const std::string &dev_node) {
+		handler.post([this, dev_node]() {
+			on_camera_attached(dev_node);
+		});
+	});
+	if (hotplug->start()) {
+		LOGW("failed to start hotplug monitor");
+		hotplug.reset();
+	}
+
+	EXIT();
+}
+
+/**
+ * @brief コマンドラインオプションからスレッドのスケジューリングポリシー・優先度・CPUアフィニティを取得する
+ *        オプションの値が正しくなければ警告を出してその項目は変更しない
+ *
+ * @param sched_key スケジューリングポリシー・優先度のオプション名
+ * @param cpus_key CPUアフィニティのオプション名
+ * @return thread_sched_t
+ */
+/*private*/
+thread_sched_t EyeApp::get_thread_sched(const char *sched_key, const char *cpus_key) {
+	ENTER();
+
+	thread_sched_t result;
+	if (parse_sched_policy(options[sched_key], result)) {
+		LOGW("ignore --%s=%s", sched_key, options[sched_key].c_str());
+	}
+	if (parse_cpu_list(options[cpus_key], result)) {
+		LOGW("ignore --%s=%s", cpus_key, options[cpus_key].c_str());
+	}
+
+	RET(result);
+}
+
+/**
+ * @brief カメラをオープンして映像取得を開始する
+ *
+ * @return int 0: 成功, 0以外: エラー
+ */
+/*private*/
+int EyeApp::start_camera() {
+	ENTER();
+
+	if (source->open() || source->find_stream(width, height)) {
+		LOGE("カメラをオープンできなかった");
+		source->close();
+		RETURN(-1, int);
+	}
+
+	LOGV("supported=%s", source->get_supported_size().c_str());
+	source->resize(width, height);
+	if (!recorder && !options[OPT_RECORD].empty()) {
+		// 受け取った映像を映像記録ファイルへ書き込む
+		// 再接続時は同じ映像記録ファイルへ続けて書き込む
+		auto r = std::make_unique<v4l2::V4l2Recorder>();
+		if (!r->open(options[OPT_RECORD], width, height, source->get_pixel_format())) {
+			recorder = std::move(r);
+		} else {
+			LOGW("failed to open record file");
+		}
+	}
+	if (source->is_ctrl_supported(V4L2_CID_FRAMERATE)) {
+		LOGD("set frame rate to 30");
+		source->set_ctrl_value(V4L2_CID_FRAMERATE, 30);
+	}
+	// 映像取得フォーマットの自動選択
+	// 映像記録ファイルは途中でピクセルフォーマットを変更できないので記録中は自動選択しない
+	const bool auto_format = (options.find(OPT_AUTO_FORMAT) != options.end());
+	if (auto_format && recorder) {
+		LOGW("--%s is ignored while recording", OPT_AUTO_FORMAT);
+	}
+	source->set_auto_format(auto_format && !recorder, 30.0f);
+	// バッファ数の自動調整時はデフォルトのバッファ数から開始する
+	const bool auto_buf_nums = options[OPT_BUF_NUMS] == OPT_BUF_NUMS_AUTO;
+	source->set_auto_buffer_nums(auto_buf_nums);
+	const auto buf_nums = auto_buf_nums
+		? to_int(OPT_BUF_NUMS_DEFAULT, 4)
+		: to_int(options[OPT_BUF_NUMS], to_int(OPT_BUF_NUMS_DEFAULT, 4));
+	if (source->start(buf_nums)) {
+		LOGE("カメラを開始できなかった");
+		source->close();
+		RETURN(-1, int);
+	}
+	// 解析用映像は表示用映像の後に開始する, 開始できなくても表示は続ける
+	if (analysis && analysis->start()) {
+		LOGW("failed to start analysis stream");
+	}
+	camera_connected = true;
+
+	RETURN(0, int);
+}
+
+/**
+ * @brief カメラが抜去されたときの処理
+ *        映像取得を停止してv4l2機器を閉じるがV4l2Sourceと描画用オブジェクトは保持する
+ *
+ */
+/*private,@WorkerThread*/
+void EyeApp::on_camera_detached() {
+	ENTER();
+
+	LOGI("camera detached");
+	if (source && camera_connected) {
+		camera_connected = false;
+		warm_reconnect = true;
+		if (analysis) {
+			analysis->stop();
+		}
+		source->stop();
+		source->close();
+	}
+
+	EXIT();
+}
+
+/**
+ * @brief カメラが再接続されたときの処理
+ *        映像取得を再開してカメラ設定を再適用する
+ *
+ * @param dev_node 再接続されたv4l2機器のデバイスファイル名
+ * @param retry 映像取得を再開できなかったときの再試行回数
+ */
+/*private,@WorkerThread*/
+void EyeApp::on_camera_attached(const std::string &dev_node, const int &retry) {
+	ENTER();
+
+	LOGI("camera attached,%s", dev_node.c_str());
+	if (source && !camera_connected) {
+		// 再接続時にデバイスファイル名が変わることがある
+		source->set_device_name(dev_node);
+		if (analysis && (options[OPT_ANALYSIS] == OPT_ANALYSIS_AUTO)) {
+			const auto analysis_device = v4l2::V4l2AnalysisSource::find_capture_device(dev_node);
+			if (!analysis_device.empty()) {
+				analysis->set_device_name(analysis_device);
+			}
+		}
+		if (!start_camera()) {
+			// 映像取得を再開できたので次の停止時は描画用オブジェクトを破棄する
+			warm_reconnect = false;
+			// カメラ側の設定は初期値に戻っているので再適用する
+			apply_settings(camera_settings);
+			req_change_matrix = true;
+		} else if (retry < CAMERA_RETRY_NUMS) {
+			// V4l2Hotplug側では接続済みになっているので次の接続通知は来ない
+			// 少し待ってからまだ接続されていれば再試行する
+			LOGW("failed to restart camera,retry=%d", retry + 1);
+			handler.post_delayed([this, retry]() {
+				if (hotplug && hotplug->is_attached()) {
+					on_camera_attached(hotplug->get_dev_node(), retry + 1);
+				}
+			}, CAMERA_RETRY_INTERVAL_MS);
+		} else {
+			LOGW("failed to restart camera,wait for next attach");
+		}
+	}
+
 	EXIT();
 }
 
@@ -449,11 +745,33 @@ void EyeApp::on_resume() {
 void EyeApp::on_pause() {
 	ENTER();
 
+	if (hotplug) {
+		hotplug->stop();
+		hotplug.reset();
+	}
+	camera_connected = false;
+	warm_reconnect = false;
+	if (analysis) {
+		analysis->stop();
+		analysis.reset();
+	}
 	if (source) {
 		source->stop();
 		source.reset();
 	}
-	reset_renderers();
+	recorder.reset();
+	if (m_egl) {
+		// 描画用オブジェクトは共有EGL/GLESコンテキスト上で生成しているので
+		// 共有コンテキストをこのスレッドへ割り当ててから破棄する
+		// (カメラ抜去中に一時停止したときはon_stopで破棄されずに残っている)
+		m_egl->makeDefault();
+		reset_renderers();
+		m_egl.reset();
+		// 描画スレッド本来のコンテキストへ戻す
+		glfwMakeContextCurrent(window.get_window());
+	} else {
+		reset_renderers();
+	}
 
 	EXIT();
 }
@@ -581,11 +899,17 @@ void EyeApp::reset_renderers() {
 void EyeApp::prepare_draw(gl::GLOffScreenUp &offscreen, gl::GLRendererUp &renderer) {
 	ENTER();
 
-	if (UNLIKELY(req_change_matrix)) {
+	// カメラ側の拡大率は映像ストリームを作り直したときにも変わる
+	const float device_zoom = source ? source->get_device_zoom() : 1.0f;
+	if (UNLIKELY(req_change_matrix || (device_zoom != current_device_zoom))) {
 		float mat[16];
 		{	// モデルビュー変換行列が変更されたとき
 			std::lock_guard<std::mutex> lock(state_lock);
 			req_change_matrix = false;
+			current_device_zoom = device_zoom;
+			// カメラ側で拡大できなかった分だけ拡大する
+			const auto factor = ZOOM_FACTORS[zoom_ix] / device_zoom;
+			mvp_matrix.setScale(factor, LENSE_FACTOR * factor, 1.0f);
 			mvp_matrix.getOpenGLSubMatrix(mat);
 		}
 		mat[5] *= -1.f;			// 上下反転
@@ -645,6 +969,46 @@ void EyeApp::handle_draw_gui() {
 		ImGui::Begin("DEBUG");
 		const auto fps = ImGui::GetIO().Framerate;
 		ImGui::Text("%.3f ms/frame(%.1f FPS)", 1000.0f / fps, fps);
+		if (source) {
+			if (source->is_latest_only()) {
+				ImGui::Text("skipped %" PRIu64 " frames", source->get_skipped_frames());
+			}
+			ImGui::Text("dropped %" PRIu64 " frames", source->get_dropped_frames());
+			if (source->is_auto_buffer_nums()) {
+				ImGui::Text("%u buffers", source->get_buffer_nums());
+			}
+			const auto switch_gap = source->get_switch_gap();
+			if (switch_gap > 0) {
+				// 最後に解像度・ピクセルフォーマット・フレームレートを変更したときに映像が途切れた時間
+				ImGui::Text("switch gap %.1f ms", (float)switch_gap / 1000000.0f);
+			}
+			const auto stall_count = source->get_stall_count();
+			if (stall_count > 0) {
+				// 映像が途切れた回数と途切れてから復帰するまでの時間
+				ImGui::Text("stalled %u times, recovery %.1f ms(max %.1f ms)", stall_count,
+					(float)source->get_recovery_time() / 1000000.0f,
+					(float)source->get_max_recovery_time() / 1000000.0f);
+			}
+			const auto latency = exposure_latency.load();
+			if (latency > 0) {
+				// UVCメタデータのPTSから求めた露光開始から描画完了までの時間
+				ImGui::Text("latency %.1f ms", (float)latency / 1000000.0f);
+			}
+		}
+		if (analysis && analysis->is_running()) {
+			// 表示中のフレームにタイムスタンプが最も近い解析結果
+			v4l2::analysis_result_t result;
+			const auto ts = display_ts.load();
+			if (!analysis->find(ts, result)) {
+				ImGui::Text("brightness %.1f(contrast %.1f)", result.brightness, result.contrast);
+				ImGui::Text("motion %.1f(%.1f %%), focus %.0f",
+					result.motion, result.motion_ratio * 100.0f, result.focus);
+				ImGui::Text("analysis %ux%u, skew %.1f ms", result.width, result.height,
+					(float)(result.timestamp - ts) / 1000000.0f);
+			} else {
+				ImGui::Text("analysis not matched");
+			}
+		}
 		ImGui::End();
 	}
 	// static bool show_demo = true;
@@ -806,9 +1170,19 @@ void EyeApp::save_settings() {
 	ENTER();
 
 	if (LIKELY(source)) {
+		// カメラ側の拡大に使っているV4L2_CID_ZOOM_ABSOLUTEの現在値は保存せずに元の設定値を残す
+		const bool zoom_ctrl_in_use = source->is_zoom_ctrl_in_use();
+		int32_t saved_zoom;
+		const bool has_saved_zoom = !camera_settings.get_value(V4L2_CID_ZOOM_ABSOLUTE, saved_zoom);
 		// camera_settingsをカメラの現在設定値に変更する
 		camera_settings.clear();
 		for (const auto id: SUPPORTED_CTRLS) {
+			if (zoom_ctrl_in_use && (id == V4L2_CID_ZOOM_ABSOLUTE)) {
+				if (has_saved_zoom) {
+					camera_settings.set_value(id, saved_zoom);
+				}
+				continue;
+			}
 			if (source->is_ctrl_supported(id)) {
 				uvc::control_value32_t val;
 				auto r = source->get_ctrl(id, val);
@@ -907,8 +1281,10 @@ void EyeApp::apply_settings(CameraSettings &settings) {
 		settings.remove(V4L2_CID_FRAMERATE);
 		if (source->is_ctrl_supported(V4L2_CID_FRAMERATE)) {
 			LOGD("set frame rate to 30");
-			source->set_ctrl_value(V4L2_CID_FRAMERATE, 30);
+			source->post_ctrl_value(V4L2_CID_FRAMERATE, 30);
 		}
+		// 設定値はワーカースレッド上でまとめてVIDIOC_S_EXT_CTRLSで書き込む
+		std::vector<uint32_t> posted;
 		for (const auto id: SUPPORTED_CTRLS) {
 			int32_t val;
 			auto r = settings.get_value(id, val);
@@ -932,15 +1308,18 @@ void EyeApp::apply_settings(CameraSettings &settings) {
 					case V4L2_CID_WHITE_BALANCE_TEMPERATURE:
 						apply = !settings.is_auto_white_blance();
 						break;
+					case V4L2_CID_ZOOM_ABSOLUTE:
+						// カメラ側の拡大に使っているときは保存してある値で等倍へ戻さない
+						apply = !source->is_zoom_ctrl_in_use();
+						break;
 					default:
 						break;
 					}
 					if (apply) {
 						LOGD("try set value,id=0x%08x,val=%d", id, val);
-						r = set_ctrl_value(id, val);
+						r = source->post_ctrl_value(id, val);
 						if (!r) {
-							LOGD("current=%d", val);
-							settings.set_value(id, val);
+							posted.push_back(id);
 						}
 					}
 				} else {
@@ -948,6 +1327,18 @@ void EyeApp::apply_settings(CameraSettings &settings) {
 				}
 			}
 		}
+		if (!posted.empty()) {
+			// ドライバーがクランプ・丸めた値を保存・OSDへ反映できるように
+			// 書き込みが終わるのを待ってから実際に設定された値をキャッシュから読み戻す
+			source->flush_ctrls();
+			for (const auto id: posted) {
+				int32_t val;
+				if (!source->get_ctrl_value(id, val)) {
+					LOGD("current=%d", val);
+					settings.set_value(id, val);
+				}
+			}
+		}
 		if (settings.is_modified()) {
 			// 変更されていれば保存する
 			settings.save();
@@ -1056,8 +1447,11 @@ void EyeApp::request_change_scale(const bool &inc_dec) {
 	if (ix != zoom_ix) {
 		LOGD("ix=%d", ix);
 		zoom_ix = ix;
-		auto factor = ZOOM_FACTORS[ix];
-		mvp_matrix.setScale(factor, LENSE_FACTOR * factor, 1.0f);
+		if (source) {
+			// カメラ側で拡大できればカメラ側で拡大してGPUで拡大するよりも画質を良くする
+			// カメラ側で拡大できなかった分はprepare_drawでモデルビュー変換行列で拡大する
+			source->set_device_zoom(ZOOM_FACTORS[ix]);
+		}
 		req_change_matrix = true;
 	}
 
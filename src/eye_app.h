@@ -22,6 +22,7 @@
 // 1: バッファリングを行う(V4L2スレッドでバッファへコピー、描画スレッドでレンダリング)
 #define BUFFURING (0)
 
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <unordered_map>
@@ -33,12 +34,17 @@
 #include "glrenderer.h"
 #include "gltexture.h"
 #include "matrix.h"
+#include "thread_sched.h"
 // core
 #include "core/video_frame_wrapped.h"
 
 #include "const.h"
 
 #include "v4l2/v4l2_source.h"
+#include "v4l2/v4l2_hotplug.h"
+#include "v4l2/v4l2_recorder.h"
+#include "v4l2/v4l2_replay_source.h"
+#include "v4l2/v4l2_analysis_source.h"
 #include "core/video_gl_renderer.h"
 
 #if BUFFURING
@@ -84,6 +90,17 @@ private:
 	GlfwWindow window;
 	// V4L2からの映像取得用
 	v4l2::V4l2SourceUp source;
+	// 解析用の低解像度映像取得用, 表示用映像と一緒に開始・停止する
+	v4l2::V4l2AnalysisSourceUp analysis;
+	// カメラの抜去/再接続監視用
+	v4l2::V4l2HotplugUp hotplug;
+	// V4L2から受け取った映像の記録用
+	v4l2::V4l2RecorderUp recorder;
+	// カメラが接続されていて映像取得中かどうか
+	volatile bool camera_connected;
+	// カメラ抜去中で再接続を待っているかどうか
+	// (再接続時に共有EGL/GLコンテキストと描画用オブジェクトを再利用するため)
+	volatile bool warm_reconnect;
 	// ワーカースレッド上での共有EGL/GLコンテキスト用
 	egl::EGLBaseUp m_egl;
 	// V4L2からの映像データを描画用にIVideoFrameとして扱えるようにする
@@ -116,6 +133,12 @@ private:
 	math::Matrix mvp_matrix;
 	// 拡大縮小インデックス[0,NUM_ZOOM_FACTORS)
 	int zoom_ix;
+	// モデルビュー変換行列へ反映済みのカメラ側の拡大率
+	float current_device_zoom;
+	// UVCメタデータから求めた露光開始から描画完了までの時間[ナノ秒], 不明なら0
+	std::atomic<nsecs_t> exposure_latency;
+	// 最後に描画した映像フレームのv4l2_buffer.timestamp(解析結果との突き合わせ用)[ナノ秒]
+	std::atomic<nsecs_t> display_ts;
 	// 輝度インデックス[1,10]
 	int brightness_ix;
 	// デフォルトのフォント(このポインターはImGuiIO側で管理しているので自前で破棄しちゃだめ)
@@ -244,6 +267,36 @@ private:
 	 */
 	void handle_draw_gui();
 	
+	/**
+	 * @brief コマンドラインオプションからスレッドのスケジューリングポリシー・優先度・CPUアフィニティを取得する
+	 *        オプションの値が正しくなければ警告を出してその項目は変更しない
+	 *
+	 * @param sched_key スケジューリングポリシー・優先度のオプション名
+	 * @param cpus_key CPUアフィニティのオプション名
+	 * @return thread_sched_t
+	 */
+	thread_sched_t get_thread_sched(const char *sched_key, const char *cpus_key);
+	/**
+	 * @brief カメラをオープンして映像取得を開始する
+	 *
+	 * @return int 0: 成功, 0以外: エラー
+	 */
+	int start_camera();
+	/**
+	 * @brief カメラが抜去されたときの処理
+	 *        映像取得を停止してv4l2機器を閉じるがV4l2Sourceと描画用オブジェクトは保持する
+	 *
+	 */
+	void on_camera_detached();
+	/**
+	 * @brief カメラが再接続されたときの処理
+	 *        映像取得を再開してカメラ設定を再適用する
+	 *
+	 * @param dev_node 再接続されたv4l2機器のデバイスファイル名
+	 * @param retry 映像取得を再開できなかったときの再試行回数
+	 */
+	void on_camera_attached(const std::string &dev_node, const int &retry = 0);
+
 	/**
 	 * @brief 描画開始時の追加処理, Windowのレンダリングスレッド上で実行される
 	 *
@@ -104,6 +104,11 @@ void OSD::prepare(v4l2::V4l2SourceUp &source) {
 	// 設定値を読み込む等
 	app_settings.load();
 	// カメラ設定を読み込む
+	{
+		// 読み込み直すので未反映の変更は破棄する
+		std::lock_guard<std::mutex> lock(pending_lock);
+		pending_changes.clear();
+	}
 	values.clear();
 	for (const auto id: SUPPORTED_CTRLS) {
 		if (id) {
@@ -132,6 +137,10 @@ void OSD::prepare(v4l2::V4l2SourceUp &source) {
 	for (const auto id: AUTO_CTRLS) {
 		update_constraints(id);
 	}
+	if (source->is_zoom_ctrl_in_use()) {
+		// カメラ側の拡大(デジタルズーム)に使っているときは変更できないようにする
+		set_enabled(V4L2_CID_ZOOM_ABSOLUTE, false);
+	}
 
 	EXIT();
 }
@@ -173,6 +182,9 @@ void OSD::draw(ImFont *large_font) {
 		| ImGuiWindowFlags_NoTitleBar
 		| ImGuiWindowFlags_NoSavedSettings;
 
+	// カメラ側で変更された値を描画前に反映する
+	apply_ctrl_changes();
+
 	float old_size;
 	if (LIKELY(large_font)) {
 		old_size = large_font->Scale;
@@ -695,6 +707,54 @@ int OSD::value_changed(const osd_value_t &value) {
 	RETURN(result, int);
 }
 
+/**
+ * @brief カメラ側でコントロール機能の値や制約が変更されたときの処理
+ *        自動露出で露出時間が変わったとき等にV4L2_EVENT_CTRLで通知される
+ *
+ * @param value
+ */
+/*public*/
+void OSD::on_ctrl_changed(const uvc::control_value32_t &value) {
+	ENTER();
+
+	std::lock_guard<std::mutex> lock(pending_lock);
+	// 同じコントロール機能が続けて変更されたときは最新の値だけを反映する
+	pending_changes[value.id] = value;
+
+	EXIT();
+}
+
+/**
+ * on_ctrl_changedで受け取ったカメラ側の変更をvaluesへ反映する
+ * 描画スレッド上で呼ばれる
+ */
+/*private*/
+void OSD::apply_ctrl_changes() {
+	ENTER();
+
+	std::unordered_map<uint32_t, uvc::control_value32_t> changes;
+	{
+		std::lock_guard<std::mutex> lock(pending_lock);
+		changes.swap(pending_changes);
+	}
+	for (const auto &change: changes) {
+		const auto &value = change.second;
+		auto itr = values.find(value.id);
+		if ((itr != values.end()) && itr->second && itr->second->supported) {
+			auto &val = itr->second;
+			LOGD("id=0x%08x,v=%d", value.id, value.current);
+			val->value = value;
+			if (!val->modified) {
+				// ユーザーが変更していない値はキャンセル時に戻す値も更新する
+				val->prev = value.current;
+			}
+			update_constraints(value.id);
+		}
+	}
+
+	EXIT();
+}
+
 /**
  * 自動露出とゲインや露出などのように相互依存する制約を更新する
  * @param value
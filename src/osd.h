@@ -18,6 +18,7 @@
 #define OSD_H_
 
 #include <functional>
+#include <mutex>
 #include <unordered_map>
 #include <string>
 #include <vector>
@@ -63,6 +64,14 @@ private:
 	OnCameraSettingsChanged on_camera_settings_changed;
 
 	std::unordered_map<uint32_t, OSDValueUp> values;
+	/**
+	 * カメラ側で変更されたコントロール機能の値
+	 * valuesは描画スレッドで参照するのでon_ctrl_changedでは直接変更せずに
+	 * drawで描画スレッド上から反映する
+	 * pending_lockで保護する
+	 */
+	std::unordered_map<uint32_t, uvc::control_value32_t> pending_changes;
+	mutable std::mutex pending_lock;
 
 	/**
 	 * @brief 保存して閉じる
@@ -155,6 +164,11 @@ private:
 	 * @param enabled
 	*/
 	void set_enabled(const uint32_t &id, const bool &enabled);
+	/**
+	 * on_ctrl_changedで受け取ったカメラ側の変更をvaluesへ反映する
+	 * 描画スレッド上で呼ばれる
+	*/
+	void apply_ctrl_changes();
 protected:
 public:
 	/**
@@ -188,6 +202,15 @@ public:
 	 */
 	void draw(ImFont *large_font);
 
+	/**
+	 * @brief カメラ側でコントロール機能の値や制約が変更されたときの処理
+	 *        自動露出で露出時間が変わったとき等にV4L2_EVENT_CTRLで通知される
+	 *        任意のスレッドから呼び出すことができる, 実際の反映は次のdrawで行う
+	 *
+	 * @param value
+	 */
+	void on_ctrl_changed(const uvc::control_value32_t &value);
+
 	inline OSD &set_on_osd_close(OnOSDCloseFunc callback) {
 		on_osd_close = callback;
 		return *this;
@@ -0,0 +1,577 @@
+/*
+ * aAndUsb
+ * Copyright (c) 2014-2023 saki t_saki@serenegiant.com
+ * Distributed under the terms of the GNU Lesser General Public License (LGPL v3.0) License.
+ * License details are in the file license.txt, distributed as part of this software.
+ */
+
+/**
+ * vicodec(仮想コーデックドライバー)のエンコーダーでFWHTへ圧縮した映像を
+ * V4L2DecoderPipelineでデコードできるかどうかを確認するためのプログラム
+ *
+ * $ sudo modprobe vicodec
+ * $ ./vicodec_fwht_check [--encoder=/dev/videoN] [--decoder=/dev/videoM] [--width=640] [--height=480] [--frames=30]
+ *
+ * エンコーダー・デコーダーを指定しなければ/dev/videoNから自動で探す
+ * デコードした映像の輝度が元の映像とほぼ一致すれば0を返す
+ */
+
+#if 1	// デバッグ情報を出さない時は1
+	#ifndef LOG_NDEBUG
+		#define	LOG_NDEBUG		// LOGV/LOGD/MARKを出力しない時
+	#endif
+	#undef USE_LOGALL			// 指定したLOGxだけを出力
+#else
+//	#define USE_LOGALL
+	#define USE_LOGD
+	#undef LOG_NDEBUG
+	#undef NDEBUG
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <linux/videodev2.h>
+
+#include "utilbase.h"
+// common
+#include "charutils.h"
+// core
+#include "core/video_frame_base.h"
+// pipeline
+#include "pipeline/pipeline_base.h"
+// v4l2
+#include "v4l2/v4l2.h"
+#include "v4l2/pipeline_v4l2_decoder.h"
+
+namespace core = serenegiant::core;
+namespace sere_pipeline = serenegiant::pipeline;
+namespace v4l2 = serenegiant::v4l2;
+
+/**
+ * /dev/videoNを探すときの最大のN
+ */
+#define MAX_VIDEO_DEVICES (64)
+/**
+ * デコードした映像の輝度と元の映像の輝度の差の絶対値の平均の許容値
+ * FWHTは非可逆圧縮なので多少の差は許容する
+ */
+#define MAX_MEAN_LUMA_DIFF (8.0)
+
+/**
+ * 確認用の映像の輝度
+ * @param x
+ * @param y
+ * @param frame_num
+ * @return
+ */
+static inline uint8_t pattern_luma(const uint32_t &x, const uint32_t &y, const uint32_t &frame_num) {
+	return (uint8_t)((x + y + frame_num * 4) & 0xff);
+}
+
+/**
+ * mem2memデバイスを指定したキューのピクセルフォーマットで探す
+ * @param out_format OUTPUTキューのピクセルフォーマット
+ * @param cap_format CAPTUREキューのピクセルフォーマット
+ * @return 見つからなければ空文字列
+ */
+static std::string find_m2m_device(const uint32_t &out_format, const uint32_t &cap_format) {
+	ENTER();
+
+	const auto has_format = [](int fd, const uint32_t &type, const uint32_t &pixel_format) {
+		for (uint32_t i = 0; ; i++) {
+			struct v4l2_fmtdesc desc {
+				.index = i,
+				.type = type,
+			};
+			if (v4l2::xioctl(fd, VIDIOC_ENUM_FMT, &desc) == -1) {
+				return false;
+			}
+			if (desc.pixelformat == pixel_format) {
+				return true;
+			}
+		}
+	};
+
+	std::string result;
+	for (int i = 0; (i < MAX_VIDEO_DEVICES) && result.empty(); i++) {
+		const auto name = serenegiant::format("/dev/video%d", i);
+		int fd = ::open(name.c_str(), O_RDWR | O_NONBLOCK, 0);
+		if (fd < 0) {
+			continue;
+		}
+		struct v4l2_capability cap{};
+		if (v4l2::xioctl(fd, VIDIOC_QUERYCAP, &cap) != -1) {
+			const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+				? cap.device_caps : cap.capabilities;
+			const bool mplane = caps & V4L2_CAP_VIDEO_M2M_MPLANE;
+			if (mplane || (caps & V4L2_CAP_VIDEO_M2M)) {
+				const uint32_t out_type = mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+				const uint32_t cap_type = mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+				if (has_format(fd, out_type, out_format) && has_format(fd, cap_type, cap_format)) {
+					result = name;
+				}
+			}
+		}
+		::close(fd);
+	}
+
+	RET(result);
+}
+
+/**
+ * vicodecのエンコーダーでNV12の映像をFWHTへ圧縮するためのヘルパークラス
+ * OUTPUT/CAPTUREキューとも1バッファーだけ使って1フレームずつ同期して圧縮する
+ */
+class FWHTEncoder {
+private:
+	int m_fd;
+	bool mplane;
+	uint32_t out_type, cap_type;
+	v4l2::buffer_t out_buffer, cap_buffer;
+	/**
+	 * OUTPUTキューのNV12の1行分のバイト数
+	 */
+	uint32_t bytesperline;
+	/**
+	 * OUTPUTキューの1フレーム分のバイト数
+	 */
+	uint32_t sizeimage;
+
+	/**
+	 * 1バッファーだけVIDIOC_REQBUFSしてmmapする
+	 * @param type
+	 * @param buffer
+	 * @return
+	 */
+	int init_buffer(const uint32_t &type, v4l2::buffer_t &buffer) {
+		ENTER();
+
+		struct v4l2_requestbuffers req {
+			.count = 1,
+			.type = type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if ((v4l2::xioctl(m_fd, VIDIOC_REQBUFS, &req) == -1) || !req.count) {
+			LOGE("VIDIOC_REQBUFS,errno=%d", errno);
+			RETURN(core::USB_ERROR_NO_MEM, int);
+		}
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf {
+			.index = 0,
+			.type = type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (mplane) {
+			buf.m.planes = planes;
+			buf.length = VIDEO_MAX_PLANES;
+		}
+		if (v4l2::xioctl(m_fd, VIDIOC_QUERYBUF, &buf) == -1) {
+			const int result = -errno;
+			LOGE("VIDIOC_QUERYBUF,errno=%d", -result);
+			RETURN(result, int);
+		}
+		buffer.length = mplane ? planes[0].length : buf.length;
+		buffer.offset = mplane ? planes[0].m.mem_offset : buf.m.offset;
+		buffer.start = mmap(nullptr, buffer.length,
+			PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, (off_t)buffer.offset);
+		if (buffer.start == MAP_FAILED) {
+			const int result = -errno;
+			LOGE("mmap,errno=%d", -result);
+			RETURN(result, int);
+		}
+
+		RETURN(core::USB_SUCCESS, int);
+	}
+
+	/**
+	 * バッファーをキューへ入れる
+	 * @param type
+	 * @param bytesused OUTPUTキューへ入れるバイト数, CAPTUREキューなら0
+	 * @return
+	 */
+	int queue_buffer(const uint32_t &type, const uint32_t &bytesused) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf {
+			.index = 0,
+			.type = type,
+			.bytesused = bytesused,
+			.field = V4L2_FIELD_NONE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (mplane) {
+			planes[0].bytesused = bytesused;
+			buf.m.planes = planes;
+			buf.length = 1;
+		}
+		return v4l2::xioctl(m_fd, VIDIOC_QBUF, &buf) == -1 ? -errno : core::USB_SUCCESS;
+	}
+
+	/**
+	 * 処理が終わったバッファーを取り出す, 処理が終わるまでブロックする
+	 * @param type
+	 * @param bytesused 取り出したバッファーのバイト数
+	 * @return
+	 */
+	int dequeue_buffer(const uint32_t &type, uint32_t &bytesused) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES] {};
+		struct v4l2_buffer buf {
+			.type = type,
+			.memory = V4L2_MEMORY_MMAP,
+		};
+		if (mplane) {
+			buf.m.planes = planes;
+			buf.length = VIDEO_MAX_PLANES;
+		}
+		if (v4l2::xioctl(m_fd, VIDIOC_DQBUF, &buf) == -1) {
+			return -errno;
+		}
+		bytesused = mplane ? planes[0].bytesused : buf.bytesused;
+		return core::USB_SUCCESS;
+	}
+public:
+	FWHTEncoder()
+	:	m_fd(-1), mplane(false),
+		out_type(V4L2_BUF_TYPE_VIDEO_OUTPUT), cap_type(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+		out_buffer(), cap_buffer(),
+		bytesperline(0), sizeimage(0)
+	{
+		out_buffer.start = cap_buffer.start = MAP_FAILED;
+	}
+
+	~FWHTEncoder() {
+		close();
+	}
+
+	/**
+	 * エンコーダーをオープンしてストリーミングを開始する
+	 * @param name
+	 * @param width
+	 * @param height
+	 * @return
+	 */
+	int open(const std::string &name, const uint32_t &width, const uint32_t &height) {
+		ENTER();
+
+		// 1フレームずつ同期して圧縮するのでブロッキングモードでオープンする
+		m_fd = ::open(name.c_str(), O_RDWR, 0);
+		if (m_fd < 0) {
+			const int result = -errno;
+			LOGE("Cannot open '%s',errno=%d", name.c_str(), -result);
+			RETURN(result, int);
+		}
+		struct v4l2_capability cap{};
+		if (v4l2::xioctl(m_fd, VIDIOC_QUERYCAP, &cap) == -1) {
+			RETURN(-errno, int);
+		}
+		const uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+			? cap.device_caps : cap.capabilities;
+		mplane = caps & V4L2_CAP_VIDEO_M2M_MPLANE;
+		out_type = mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		cap_type = mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+		struct v4l2_format fmt { .type = out_type };
+		if (mplane) {
+			fmt.fmt.pix_mp.width = width;
+			fmt.fmt.pix_mp.height = height;
+			fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12;
+			fmt.fmt.pix_mp.num_planes = 1;
+		} else {
+			fmt.fmt.pix.width = width;
+			fmt.fmt.pix.height = height;
+			fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+		}
+		if (v4l2::xioctl(m_fd, VIDIOC_S_FMT, &fmt) == -1) {
+			const int result = -errno;
+			LOGE("VIDIOC_S_FMT(OUTPUT),errno=%d", -result);
+			RETURN(result, int);
+		}
+		const uint32_t w = mplane ? fmt.fmt.pix_mp.width : fmt.fmt.pix.width;
+		const uint32_t h = mplane ? fmt.fmt.pix_mp.height : fmt.fmt.pix.height;
+		if ((w != width) || (h != height)) {
+			LOGE("encoder does not support %ux%u,actual=%ux%u", width, height, w, h);
+			RETURN(core::USB_ERROR_NOT_SUPPORTED, int);
+		}
+		bytesperline = mplane ? fmt.fmt.pix_mp.plane_fmt[0].bytesperline : fmt.fmt.pix.bytesperline;
+		sizeimage = mplane ? fmt.fmt.pix_mp.plane_fmt[0].sizeimage : fmt.fmt.pix.sizeimage;
+		if (!bytesperline) {
+			bytesperline = width;
+		}
+		fmt = { .type = cap_type };
+		if (mplane) {
+			fmt.fmt.pix_mp.width = width;
+			fmt.fmt.pix_mp.height = height;
+			fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_FWHT;
+			fmt.fmt.pix_mp.num_planes = 1;
+		} else {
+			fmt.fmt.pix.width = width;
+			fmt.fmt.pix.height = height;
+			fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_FWHT;
+		}
+		if (v4l2::xioctl(m_fd, VIDIOC_S_FMT, &fmt) == -1) {
+			const int result = -errno;
+			LOGE("VIDIOC_S_FMT(CAPTURE),errno=%d", -result);
+			RETURN(result, int);
+		}
+		int result = init_buffer(out_type, out_buffer);
+		if (!result) {
+			result = init_buffer(cap_type, cap_buffer);
+		}
+		if (!result) {
+			auto type = (enum v4l2_buf_type)out_type;
+			if (v4l2::xioctl(m_fd, VIDIOC_STREAMON, &type) == -1) {
+				result = -errno;
+			}
+			type = (enum v4l2_buf_type)cap_type;
+			if (!result && (v4l2::xioctl(m_fd, VIDIOC_STREAMON, &type) == -1)) {
+				result = -errno;
+			}
+			if (result) {
+				LOGE("VIDIOC_STREAMON,errno=%d", -result);
+			}
+		}
+
+		RETURN(result, int);
+	}
+
+	/**
+	 * ストリーミングを終了してエンコーダーを閉じる
+	 */
+	void close() {
+		if (m_fd >= 0) {
+			auto type = (enum v4l2_buf_type)out_type;
+			v4l2::xioctl(m_fd, VIDIOC_STREAMOFF, &type);
+			type = (enum v4l2_buf_type)cap_type;
+			v4l2::xioctl(m_fd, VIDIOC_STREAMOFF, &type);
+			for (auto buffer: { &out_buffer, &cap_buffer }) {
+				if (buffer->start != MAP_FAILED) {
+					munmap(buffer->start, buffer->length);
+					buffer->start = MAP_FAILED;
+				}
+			}
+			::close(m_fd);
+			m_fd = -1;
+		}
+	}
+
+	/**
+	 * 確認用の映像を生成してFWHTへ圧縮する
+	 * @param width
+	 * @param height
+	 * @param frame_num
+	 * @param coded 圧縮した映像
+	 * @return
+	 */
+	int encode(const uint32_t &width, const uint32_t &height, const uint32_t &frame_num,
+		std::vector<uint8_t> &coded) {
+
+		ENTER();
+
+		auto dst = static_cast<uint8_t *>(out_buffer.start);
+		for (uint32_t y = 0; y < height; y++) {
+			for (uint32_t x = 0; x < width; x++) {
+				dst[y * bytesperline + x] = pattern_luma(x, y, frame_num);
+			}
+		}
+		// 色差成分は無彩色にする
+		memset(dst + bytesperline * height, 128, bytesperline * ((height + 1) / 2));
+
+		int result = queue_buffer(out_type, sizeimage ? sizeimage : bytesperline * height * 3 / 2);
+		if (!result) {
+			result = queue_buffer(cap_type, 0);
+		}
+		uint32_t bytes = 0;
+		if (!result) {
+			result = dequeue_buffer(cap_type, bytes);
+		}
+		if (!result) {
+			uint32_t dummy;
+			result = dequeue_buffer(out_type, dummy);
+		}
+		if (UNLIKELY(result)) {
+			LOGE("failed to encode,err=%d", result);
+			RETURN(result, int);
+		}
+		const auto src = static_cast<const uint8_t *>(cap_buffer.start);
+		coded.assign(src, src + bytes);
+
+		RETURN(core::USB_SUCCESS, int);
+	}
+};
+
+/**
+ * V4L2DecoderPipelineでデコードした映像を受け取って元の映像と比較するパイプライン
+ */
+class CheckPipeline : virtual public sere_pipeline::IPipeline {
+private:
+	const uint32_t width, height;
+	/**
+	 * 受け取ったフレーム数
+	 */
+	std::atomic<uint32_t> received;
+	/**
+	 * 元の映像と一致しなかったフレーム数
+	 */
+	std::atomic<uint32_t> mismatched;
+public:
+	CheckPipeline(const uint32_t &width, const uint32_t &height)
+	:	sere_pipeline::IPipeline(),
+		width(width), height(height),
+		received(0), mismatched(0)
+	{
+	}
+
+	virtual ~CheckPipeline() = default;
+
+	virtual int start() override {
+		set_running(true);
+		set_state(sere_pipeline::PIPELINE_STATE_RUNNING);
+		return core::USB_SUCCESS;
+	}
+
+	virtual int stop() override {
+		set_running(false);
+		set_state(sere_pipeline::PIPELINE_STATE_INITIALIZED);
+		return core::USB_SUCCESS;
+	}
+
+	virtual int queue_frame(core::BaseVideoFrame *frame) override {
+		if (UNLIKELY(!is_running() || !frame)) {
+			return core::USB_SUCCESS;
+		}
+		// デコーダーは映像を並べ替えないので受け取った順番が元の映像の順番
+		const uint32_t frame_num = received++;
+		if ((frame->width() != width) || (frame->height() != height)
+			|| (frame->frame_type() != core::RAW_FRAME_UNCOMPRESSED_NV12)
+			|| (frame->size() < (size_t)width * height)) {
+
+			LOGE("unexpected frame,%ux%u,type=0x%08x,bytes=%" FMT_SIZE_T,
+				frame->width(), frame->height(), frame->frame_type(), frame->size());
+			mismatched++;
+			return core::USB_SUCCESS;
+		}
+		const uint8_t *luma = frame->frame();
+		uint64_t diff = 0;
+		for (uint32_t y = 0; y < height; y++) {
+			for (uint32_t x = 0; x < width; x++) {
+				diff += std::abs((int)luma[y * width + x] - (int)pattern_luma(x, y, frame_num));
+			}
+		}
+		const double mean_diff = (double)diff / ((double)width * height);
+		if (mean_diff > MAX_MEAN_LUMA_DIFF) {
+			LOGE("frame %u mismatched,mean luma diff=%f", frame_num, mean_diff);
+			mismatched++;
+		}
+		return core::USB_SUCCESS;
+	}
+
+	inline uint32_t get_received() const { return received.load(); };
+	inline uint32_t get_mismatched() const { return mismatched.load(); };
+};
+
+static const struct option LONG_OPTS[] = {
+	{ "encoder", required_argument, nullptr, 'e' },
+	{ "decoder", required_argument, nullptr, 'd' },
+	{ "width", required_argument, nullptr, 'w' },
+	{ "height", required_argument, nullptr, 'h' },
+	{ "frames", required_argument, nullptr, 'n' },
+	{ nullptr, 0, nullptr, 0 },
+};
+
+/**
+ * @brief メイン関数
+ *
+ * @param argc
+ * @param argv
+ * @return int 0: デコードした映像が元の映像と一致した, 1: 一致しなかった, 2: 確認できなかった
+ */
+int main(int argc, char *const *argv) {
+
+	ENTER();
+
+	std::string encoder_name, decoder_name;
+	uint32_t width = 640, height = 480, frames = 30;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "e:d:w:h:n:", LONG_OPTS, nullptr)) != -1) {
+		switch (opt) {
+		case 'e':	encoder_name = optarg; break;
+		case 'd':	decoder_name = optarg; break;
+		case 'w':	width = (uint32_t)strtoul(optarg, nullptr, 10); break;
+		case 'h':	height = (uint32_t)strtoul(optarg, nullptr, 10); break;
+		case 'n':	frames = (uint32_t)strtoul(optarg, nullptr, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [--encoder=DEV] [--decoder=DEV] [--width=W] [--height=H] [--frames=N]\n", argv[0]);
+			RETURN(2, int);
+		}
+	}
+	if (!width || !height || !frames) {
+		fprintf(stderr, "invalid width/height/frames\n");
+		RETURN(2, int);
+	}
+	if (encoder_name.empty()) {
+		encoder_name = find_m2m_device(V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_FWHT);
+	}
+	if (decoder_name.empty()) {
+		decoder_name = find_m2m_device(V4L2_PIX_FMT_FWHT, V4L2_PIX_FMT_NV12);
+	}
+	if (encoder_name.empty() || decoder_name.empty()) {
+		fprintf(stderr, "vicodec encoder/decoder not found, try 'modprobe vicodec'\n");
+		RETURN(2, int);
+	}
+	printf("encoder=%s,decoder=%s,%ux%u,frames=%u\n",
+		encoder_name.c_str(), decoder_name.c_str(), width, height, frames);
+
+	FWHTEncoder encoder;
+	if (encoder.open(encoder_name, width, height)) {
+		fprintf(stderr, "failed to open encoder %s\n", encoder_name.c_str());
+		RETURN(2, int);
+	}
+
+	v4l2::pipeline::V4L2DecoderPipeline decoder(decoder_name, V4L2_PIX_FMT_NV12);
+	// FWHTはraw_frame_tに無いのでフレームタイプに関係なくFWHTとしてデコーダーへ渡す
+	decoder.set_coded_format(V4L2_PIX_FMT_FWHT);
+	CheckPipeline checker(width, height);
+	decoder.set_pipeline(&checker);
+	checker.start();
+	decoder.start();
+
+	std::vector<uint8_t> coded;
+	core::BaseVideoFrame frame;
+	bool hw_decoding = false;
+	for (uint32_t i = 0; i < frames; i++) {
+		if (encoder.encode(width, height, i, coded)) {
+			break;
+		}
+		frame.set_format(width, height, core::RAW_FRAME_UNKNOWN);
+		frame.setFrame(coded.data(), coded.size());
+		frame.update_presentationtime_us(i, (nsecs_t)(i + 1) * 33333);
+		decoder.queue_frame(&frame);
+		hw_decoding |= decoder.is_hw_decoding();
+	}
+
+	decoder.stop();
+	checker.stop();
+	encoder.close();
+
+	const auto hw_frames = decoder.get_hw_frames();
+	const auto received = checker.get_received();
+	const auto mismatched = checker.get_mismatched();
+	printf("hw_decoding=%d,hw_frames=%" PRIu64 ",received=%u,mismatched=%u\n",
+		hw_decoding, hw_frames, received, mismatched);
+	// 最初の映像ヘッダーで解像度が確定するまでの分は出てこないことがあるので1フレームは許容する
+	const bool ok = hw_decoding && (received + 1 >= frames) && (hw_frames == received) && !mismatched;
+	printf("%s\n", ok ? "OK" : "NG");
+
+	RETURN(ok ? 0 : 1, int);
+}
@@ -32,7 +32,8 @@ Window::Window(const int width, const int height, const char *title)
 	renderer_thread(),
 	aspect(640 / 480.0f), fb_width(width), fb_height(height),
 	on_key_event_func(nullptr),
-	on_start(nullptr), on_stop(nullptr), on_render(nullptr)
+	on_start(nullptr), on_stop(nullptr), on_render(nullptr),
+	thread_sched()
 {
 	ENTER();
 	EXIT();
@@ -129,6 +130,7 @@ Window::operator bool() {
 void Window::renderer_thread_func() {
     ENTER();
 
+	apply_thread_sched(thread_sched, "renderer_thread");
 	init_gl();
 
 	if (on_start) {
@@ -15,6 +15,8 @@
 #include <thread>
 
 #include "internal.h"
+// common
+#include "thread_sched.h"
 
 #include "const.h"
 #include "key_event.h"
@@ -52,6 +54,10 @@ private:
 	LifeCycletEventFunc on_pause;
 	LifeCycletEventFunc on_stop;
 	OnRenderFunc on_render;
+	/**
+	 * 描画スレッドのスケジューリングポリシー・優先度・CPUアフィニティ
+	 */
+	thread_sched_t thread_sched;
 
 	/**
 	 * @brief 描画スレッドの実行関数
@@ -153,6 +159,17 @@ public:
 		on_stop = callback;
 		return *this;
 	}
+	/**
+	 * @brief 描画スレッドのスケジューリングポリシー・優先度・CPUアフィニティを設定する
+	 *        描画スレッドの開始時に適用するのでstartより前に呼び出すこと
+	 *
+	 * @param sched
+	 * @return Window&
+	 */
+	inline Window &set_thread_sched(const thread_sched_t &sched) {
+		thread_sched = sched;
+		return *this;
+	}
 };
 
 }	// end of namespace serenegiant::app